@@ -1,5 +1,6 @@
 #include "datasets/mnist.hpp"
 #include "cxxopts.hpp"
+#include "folding.hpp"
 #include "functions.hpp"
 #include "initializer.hpp"
 #include "module.hpp"
@@ -60,24 +61,30 @@ bool equal(const kuu::tensor &t) {
 }
 
 struct net : public kuu::module {
+  // 28x28 -> conv1, pool1 -> 8x14x14 -> conv2, pool2 -> 1x7x7 -> linear1
   net()
       : conv1{kuu::conv_options<2>{1, 8, 5, 1, 2}}, conv2{kuu::conv_options<2>{
                                                         8, 1, 5, 1, 2}},
-        linear1{kuu::linear_options{784, 10, false}}, bn1{8}, bn2{1} {
+        linear1{kuu::linear_options{49, 10, false}}, bn1{8}, bn2{1},
+        pool1{2}, pool2{2} {
     register_module("conv1", conv1);
     register_module("conv2", conv2);
     register_module("linear1", linear1);
     register_module("bn1", bn1);
     register_module("bn2", bn2);
+    register_module("pool1", pool1);
+    register_module("pool2", pool2);
   }
 
   kuu::tensor forward(const kuu::tensor &input) {
     auto out = conv1->forward(input);
     out = bn1->forward(out);
     out = kuu::function::relu::forward(out);
+    out = pool1->forward(out);
     out = conv2->forward(out);
     out = bn2->forward(out);
     out = kuu::function::relu::forward(out);
+    out = pool2->forward(out);
     out = linear1->forward(out);
     return out;
   }
@@ -106,6 +113,7 @@ struct net : public kuu::module {
   kuu::conv2d conv1, conv2;
   kuu::linear linear1;
   kuu::batchnorm bn1, bn2;
+  kuu::maxpool2d pool1, pool2;
 };
 
 float evaluate(net &n, kuu::data::MNIST &mnist, size_t batch_size) {
@@ -168,5 +176,13 @@ int main(int argc, char *argv[]) {
     }
   }
 
+  // for inference, bn1 and bn2 are folded into conv1 and conv2
+  n.train(false);
+  auto sample = mnist.load(kuu::mode_type::test, batch_size, 0);
+  kuu::tensor sample_data{sample.first, false};
+  kuu::fold_batchnorm(n, [&] { n.forward(sample_data); });
+  std::cout << "test acc (folded): " << evaluate(n, mnist, batch_size)
+            << std::endl;
+
   return 0;
 }
\ No newline at end of file
@@ -0,0 +1,105 @@
+#ifndef KUU_AUTOTUNER_HPP
+#define KUU_AUTOTUNER_HPP
+
+#include "mixin/non_copyable.hpp"
+#include "mixin/non_movable.hpp"
+#include <fstream>
+#include <mutex>
+#include <optional>
+#include <sstream>
+#include <string>
+#include <unordered_map>
+
+namespace kuu {
+
+// process-wide cache of the fastest algorithm per problem key. the key is
+// built by the caller from everything that affects the choice (shapes,
+// stride, padding, ...). entries can be persisted to a plain text file with
+// one "key value" pair per line, so later runs start tuned.
+template <typename Algorithm>
+class autotuner : private non_copyable<autotuner<Algorithm>>,
+                  private non_movable<autotuner<Algorithm>> {
+public:
+  using algorithm_type = Algorithm;
+
+  static autotuner &instance() {
+    static autotuner tuner;
+    return tuner;
+  }
+
+  bool enabled() const noexcept { return enabled_; }
+  void enable(const bool on = true) noexcept { enabled_ = on; }
+
+  // loads the entries of an existing file, and appends every new entry to it.
+  void set_cache_file(const std::string &path) {
+    std::lock_guard<std::mutex> lock{mutex_};
+    path_ = path;
+    load_unlocked(path);
+  }
+
+  std::optional<algorithm_type> find(const std::string &key) const {
+    std::lock_guard<std::mutex> lock{mutex_};
+    auto itr = cache_.find(key);
+    if (itr == cache_.end()) {
+      return std::nullopt;
+    }
+    return itr->second;
+  }
+
+  void insert(const std::string &key, const algorithm_type algorithm) {
+    std::lock_guard<std::mutex> lock{mutex_};
+    cache_[key] = algorithm;
+    if (!path_.empty()) {
+      std::ofstream ofs{path_, std::ios::app};
+      ofs << key << " " << static_cast<int>(algorithm) << std::endl;
+    }
+  }
+
+  void save(const std::string &path) const {
+    std::lock_guard<std::mutex> lock{mutex_};
+    std::ofstream ofs{path, std::ios::trunc};
+    for (const auto &entry : cache_) {
+      ofs << entry.first << " " << static_cast<int>(entry.second) << std::endl;
+    }
+  }
+
+  void load(const std::string &path) {
+    std::lock_guard<std::mutex> lock{mutex_};
+    load_unlocked(path);
+  }
+
+  void clear() {
+    std::lock_guard<std::mutex> lock{mutex_};
+    cache_.clear();
+  }
+
+  std::size_t size() const {
+    std::lock_guard<std::mutex> lock{mutex_};
+    return cache_.size();
+  }
+
+private:
+  autotuner() = default;
+
+  void load_unlocked(const std::string &path) {
+    std::ifstream ifs{path};
+    std::string line;
+    while (std::getline(ifs, line)) {
+      std::istringstream iss{line};
+      std::string key;
+      int value;
+      if (iss >> key >> value) {
+        cache_[key] = static_cast<algorithm_type>(value);
+      }
+    }
+  }
+
+  bool enabled_ = false;
+  std::string path_;
+  std::unordered_map<std::string, algorithm_type> cache_;
+  mutable std::mutex mutex_;
+};
+
+} // namespace kuu
+
+#endif // KUU_AUTOTUNER_HPP
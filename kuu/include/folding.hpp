@@ -0,0 +1,98 @@
+#ifndef KUU_FOLDING_HPP
+#define KUU_FOLDING_HPP
+
+#include "config.hpp"
+#include "graph.hpp"
+#include "module.hpp"
+#include "modules/batchnorm.hpp"
+#include "modules/convolution.hpp"
+#include "modules/linear.hpp"
+#include "tensor.hpp"
+#include <cstddef>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace kuu {
+
+// folds every batchnorm in evaluation mode that directly follows a linear or
+// conv2d into that layer's weight and bias, for inference. the pairs are
+// found by running forward() once, e.g. on one batch, with forward hooks
+// recording which module consumed which module's output. a pair is folded
+// only if each of the two modules ran once and the layer's output went to
+// the batchnorm alone. uses outside of modules, e.g. by a residual sum, are
+// counted on the graph: the layers' outputs are marked as requiring grad
+// during the run, so that every function taking them is traced. an output
+// kept without passing through any function cannot be seen. the folded
+// batchnorms become the identity and the layers gain a bias. returns the
+// number of folded pairs; nothing is done while root is training.
+template <class Forward>
+std::size_t fold_batchnorm(module &root, Forward &&forward) {
+  if (root.is_training()) {
+    return 0;
+  }
+
+  struct produced {
+    module *layer;
+    std::size_t consumers;
+  };
+  std::unordered_map<id_type, produced> outputs; // of linear and conv2d
+  std::unordered_map<module *, std::size_t> calls;
+  std::vector<std::pair<id_type, batchnorm_impl *>> candidates;
+
+  std::vector<std::pair<module *, std::size_t>> hooks;
+  root.apply([&](module &m) {
+    hooks.emplace_back(
+        &m, m.register_forward_hook([&](module &layer, const tensor &input,
+                                        const tensor &output) {
+          calls[&layer]++;
+          auto it = outputs.find(input.id());
+          if (it != outputs.end()) {
+            it->second.consumers++;
+            if (auto *bn = dynamic_cast<batchnorm_impl *>(&layer)) {
+              candidates.emplace_back(input.id(), bn);
+            }
+          }
+          if (dynamic_cast<linear_impl *>(&layer) ||
+              dynamic_cast<conv2d_impl *>(&layer)) {
+            outputs[output.id()] = {&layer, 0};
+            tensor traced = output; // shallow
+            traced.set_required_grad(true);
+          }
+        }));
+  });
+  forward();
+  for (auto &[m, hook] : hooks) {
+    m->remove_forward_hook(hook);
+  }
+
+  std::size_t folded = 0;
+  for (auto &[id, bn] : candidates) {
+    const auto &producer = outputs[id];
+    // the batchnorm's own node is the one use on the graph
+    if (producer.consumers != 1 || trace::consumers(id) != 1 ||
+        calls[producer.layer] != 1 || calls[bn] != 1) {
+      continue;
+    }
+    auto *l = dynamic_cast<linear_impl *>(producer.layer);
+    auto *c = dynamic_cast<conv2d_impl *>(producer.layer);
+    if ((l && l->is_quantized()) || (c && c->is_quantized())) {
+      continue;
+    }
+    tensor_type scale, shift;
+    if (!bn->fold(scale, shift)) {
+      continue;
+    }
+    if (l) {
+      l->fold_affine(scale, shift);
+    } else {
+      c->fold_affine(scale, shift);
+    }
+    folded++;
+  }
+  return folded;
+}
+
+} // namespace kuu
+
+#endif // KUU_FOLDING_HPP
@@ -5,11 +5,27 @@
 #include "tensor.hpp"
 #include "util/util.hpp"
 #include <cstddef>
+#include <functional>
 #include <memory>
 #include <string>
+#include <vector>
 
 namespace kuu {
 
+// which inputs of a node need a gradient, worked out by trace::run_backward
+// from the requires_grad of the leaves.
+using grad_mask = std::vector<bool>;
+
+// whether a backward has to produce the gradient of inputs[i]. without a
+// mask, i.e. when called outside of the graph, requires_grad decides.
+inline bool needs_grad(const grad_mask &mask, const std::vector<tensor> &inputs,
+                       const std::size_t i) {
+  if (mask.empty()) {
+    return !inputs[i].is_empty() && inputs[i].requires_grad();
+  }
+  return mask[i];
+}
+
 // for backward
 class traceable_function {
 public:
@@ -25,7 +41,8 @@ public:
 
   void set_name(const std::string name) noexcept { name_ = name; }
 
-  std::function<void(const std::vector<tensor> &, std::vector<tensor> &)>
+  std::function<void(const std::vector<tensor> &, std::vector<tensor> &,
+                     const grad_mask &)>
       backward_function;
 
 protected:
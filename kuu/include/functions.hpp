@@ -1,6 +1,11 @@
+#include "functions/activation.hpp"
 #include "functions/batchnorm.hpp"
 #include "functions/convolution.hpp"
 #include "functions/error.hpp"
 #include "functions/linear.hpp"
+#include "functions/matmul.hpp"
+#include "functions/memory_format.hpp"
+#include "functions/pointwise.hpp"
+#include "functions/pooling.hpp"
 #include "functions/relu.hpp"
 #include "functions/softmax_cross_entropy.hpp"
\ No newline at end of file
@@ -0,0 +1,211 @@
+#ifndef KUU_FUNCTIONS_ACTIVATION_HPP
+#define KUU_FUNCTIONS_ACTIVATION_HPP
+
+#include "function.hpp"
+#include "kernels/activation.hpp"
+#include "kernels/vmath.hpp"
+#include <cassert>
+#include <memory>
+#include <utility>
+#include <vector>
+
+// elementwise activations. each keeps only what its gradient needs: a bit
+// per element for leaky_relu (and relu), the output for sigmoid and tanh,
+// and the input for gelu and silu. the input is released once nothing else
+// needs it, see trace::release_saved_data.
+
+namespace kuu {
+namespace function {
+
+namespace activation_detail {
+
+// kernel(x, n, y) over input. with inplace, input's own buffer becomes the
+// output and input is released, unless input is a leaf, i.e. the caller's
+// data, or a node reads its data in backward; the output then is a new
+// buffer, as without inplace.
+template <class Kernel>
+tensor_type map(const tensor &input, const bool inplace, Kernel &&kernel) {
+  tensor x = input; // shallow, for the raw pointer
+  const bool intermediate = input.creator_id() != "";
+  if (inplace && intermediate && !trace::reads_saved_data(input)) {
+    tensor_type y = std::move(x.data());
+    x.release_data();
+    kernel(y.data(), y.size(), y.data());
+    return y;
+  }
+  auto y = tensor_type::from_shape(input.shape());
+  kernel(x.data().data(), y.size(), y.data());
+  return y;
+}
+
+// the output y of Function over input, whose backward reads y and not input
+template <class Function>
+tensor from_output(const tensor &input, tensor_type y) {
+  tensor output{std::move(y), util::requires_grad(input)};
+  output.set_format(input.format());
+  trace::register_node<Function>({input}, output);
+  trace::retain_saved_data(output);
+  trace::release_saved_data(input);
+  return output;
+}
+
+// the output y of Function over input, whose backward reads input
+template <class Function>
+tensor from_input(const tensor &input, tensor_type y) {
+  tensor output{std::move(y), util::requires_grad(input)};
+  output.set_format(input.format());
+  trace::register_node<Function>({input}, output);
+  return output;
+}
+
+// gx = grad(v, gy, n, gx) into inputs[0], from v, the output or the input
+template <class Grad>
+void backward_from(tensor v, const std::vector<tensor> &outputs,
+                   std::vector<tensor> &inputs, const grad_mask &mask,
+                   Grad &&grad) {
+  assert(outputs.size() == 1);
+  assert(inputs.size() == 1);
+  if (!needs_grad(mask, inputs, 0)) {
+    return;
+  }
+  tensor y = outputs[0]; // shallow, for the raw pointer
+  auto gx = tensor_type::from_shape(inputs[0].shape());
+  grad(v.data().data(), y.grad().data(), gx.size(), gx.data());
+  inputs[0].set_grad(std::move(gx));
+}
+
+} // namespace activation_detail
+
+class sigmoid : public traceable_function {
+public:
+  sigmoid() : traceable_function{1} { set_name("activation-sigmoid"); }
+
+  static tensor forward(const tensor &input, const bool inplace = false) {
+    auto y = activation_detail::map(input, inplace, kernel::vsigmoid);
+    return activation_detail::from_output<sigmoid>(input, std::move(y));
+  }
+
+  // gx = gy * y * (1 - y)
+  static void backward(const std::vector<tensor> &outputs,
+                       std::vector<tensor> &inputs,
+                       const grad_mask &mask = {}) {
+    activation_detail::backward_from(outputs[0], outputs, inputs, mask,
+                                     kernel::sigmoid_grad);
+  }
+};
+
+class tanh : public traceable_function {
+public:
+  tanh() : traceable_function{1} { set_name("activation-tanh"); }
+
+  static tensor forward(const tensor &input, const bool inplace = false) {
+    auto y = activation_detail::map(input, inplace, kernel::vtanh);
+    return activation_detail::from_output<tanh>(input, std::move(y));
+  }
+
+  // gx = gy * (1 - y^2)
+  static void backward(const std::vector<tensor> &outputs,
+                       std::vector<tensor> &inputs,
+                       const grad_mask &mask = {}) {
+    activation_detail::backward_from(outputs[0], outputs, inputs, mask,
+                                     kernel::tanh_grad);
+  }
+};
+
+// the tanh approximation, as in fused_linear
+class gelu : public traceable_function {
+public:
+  gelu() : traceable_function{1} { set_name("activation-gelu"); }
+
+  // backward needs the input, so inplace only applies without grad
+  static tensor forward(const tensor &input, const bool inplace = false) {
+    auto y = activation_detail::map(
+        input, inplace && !input.requires_grad(), kernel::gelu);
+    return activation_detail::from_input<gelu>(input, std::move(y));
+  }
+
+  static void backward(const std::vector<tensor> &outputs,
+                       std::vector<tensor> &inputs,
+                       const grad_mask &mask = {}) {
+    activation_detail::backward_from(inputs[0], outputs, inputs, mask,
+                                     kernel::gelu_grad);
+  }
+};
+
+// x * sigmoid(x), a.k.a. swish
+class silu : public traceable_function {
+public:
+  silu() : traceable_function{1} { set_name("activation-silu"); }
+
+  // backward needs the input, so inplace only applies without grad
+  static tensor forward(const tensor &input, const bool inplace = false) {
+    auto y = activation_detail::map(
+        input, inplace && !input.requires_grad(), kernel::silu);
+    return activation_detail::from_input<silu>(input, std::move(y));
+  }
+
+  static void backward(const std::vector<tensor> &outputs,
+                       std::vector<tensor> &inputs,
+                       const grad_mask &mask = {}) {
+    activation_detail::backward_from(inputs[0], outputs, inputs, mask,
+                                     kernel::silu_grad);
+  }
+};
+
+// x for x > 0 and x * slope otherwise
+class leaky_relu : public traceable_function {
+public:
+  leaky_relu() : traceable_function{1} { set_name("activation-leaky-relu"); }
+
+  static tensor forward(const tensor &input, const value_type slope = 0.01,
+                        const bool inplace = false) {
+    const bool requires_grad = util::requires_grad(input);
+    std::shared_ptr<std::vector<kernel::mask_word>> bits;
+    if (requires_grad) {
+      bits = std::make_shared<std::vector<kernel::mask_word>>(
+          kernel::mask_words(input.size()));
+    }
+    auto y = activation_detail::map(
+        input, inplace,
+        [&](const float *x, const std::size_t n, float *out) {
+          kernel::leaky_relu(x, n, slope, out, bits ? bits->data() : nullptr);
+        });
+
+    tensor output{std::move(y), requires_grad};
+    output.set_format(input.format());
+    trace::register_node<leaky_relu>(
+        {input}, output,
+        [bits, slope](const std::vector<tensor> &outputs,
+                      std::vector<tensor> &inputs, const grad_mask &mask) {
+          if (bits) {
+            backward(*bits, slope, outputs, inputs, mask);
+          }
+        });
+    trace::release_saved_data(input);
+    return output;
+  }
+
+  // from the mask of x > 0 that forward kept instead of x
+  static void backward(const std::vector<kernel::mask_word> &bits,
+                       const value_type slope,
+                       const std::vector<tensor> &outputs,
+                       std::vector<tensor> &inputs,
+                       const grad_mask &mask = {}) {
+    assert(outputs.size() == 1);
+    assert(inputs.size() == 1);
+    if (!needs_grad(mask, inputs, 0)) {
+      return;
+    }
+    tensor y = outputs[0]; // shallow, for the raw pointer
+    auto gx = tensor_type::from_shape(inputs[0].shape());
+    assert(bits.size() == kernel::mask_words(gx.size()));
+    kernel::masked_grad(y.grad().data(), bits.data(), gx.size(), slope,
+                        gx.data());
+    inputs[0].set_grad(std::move(gx));
+  }
+};
+
+} // namespace function
+} // namespace kuu
+
+#endif // KUU_FUNCTIONS_ACTIVATION_HPP
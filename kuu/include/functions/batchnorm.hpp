@@ -2,16 +2,153 @@
 #define KUU_FUNCTIONS_BATCH_NORM_HPP
 
 #include "function.hpp"
+#include "kernels/batchnorm.hpp"
+#include "layout.hpp"
 #include <cmath>
 #include <execution>
 #include <xtensor/xtensor.hpp>
 
-// references:
-// https://kratzert.github.io/2016/02/12/understanding-the-gradient-flow-through-the-batch-normalization-layer.html
-
 namespace kuu {
 namespace function {
 
+namespace batchnorm_detail {
+
+// data viewed as {outer, channels, inner}, see kernels/batchnorm.hpp
+struct channel_view {
+  std::size_t outer;
+  std::size_t channels;
+  std::size_t inner;
+};
+
+inline channel_view view_of(const tensor &data) {
+  const auto shape = data.shape();
+  if (data.format() == memory_format::kNHWC) {
+    return {data.size() / shape.back(), shape.back(), 1};
+  }
+  return {shape[0], shape[1], data.size() / (shape[0] * shape[1])};
+}
+
+// running statistics of one value per channel, or none at all when the
+// batch statistics are used
+inline bool valid_running_stats(const tensor &running_mean,
+                                const tensor &running_var,
+                                const std::size_t channels,
+                                const bool batch_stats) {
+  if (running_mean.is_empty() || running_var.is_empty()) {
+    return batch_stats && running_mean.is_empty() && running_var.is_empty();
+  }
+  return running_mean.dim() == 1 && running_var.dim() == 1 &&
+         running_mean.shape()[0] == channels &&
+         running_var.shape()[0] == channels;
+}
+
+// scale = gamma * inv_std and shift = beta - mean * scale, so that
+// (x - mean) * inv_std * gamma + beta = x * scale + shift. weight and bias
+// may be empty for gamma = 1 and beta = 0.
+inline void fold_affine(const tensor &weight, const tensor &bias,
+                        const tensor_type &mean, const tensor_type &inv_std,
+                        tensor_type &scale, tensor_type &shift) {
+  scale = inv_std;
+  if (!weight.is_empty()) {
+    assert(weight.dim() == 1);
+    assert(weight.shape()[0] == mean.size());
+    scale *= weight.cdata();
+  }
+  shift = -mean * scale;
+  if (!bias.is_empty()) {
+    assert(bias.dim() == 1);
+    assert(bias.shape()[0] == mean.size());
+    shift += bias.cdata();
+  }
+}
+
+// normalizes data with its batch statistics when training and with the
+// running ones otherwise, followed by the affine transform, in one pass
+// after the statistics. when training, the running statistics (if any) are
+// updated with the batch ones. mean and inv_std receive the statistics used,
+// to be saved for backward.
+inline tensor_type normalize(const tensor &data, const tensor &weight,
+                             const tensor &bias, const tensor &running_mean,
+                             const tensor &running_var, const value_type eps,
+                             const value_type momentum, const bool training,
+                             tensor_type &mean, tensor_type &inv_std) {
+  const auto v = view_of(data);
+  tensor x = data; // shallow, for the raw pointer
+  const float *x_ptr = x.data().data();
+  if (training) {
+    mean = tensor_type::from_shape({v.channels});
+    tensor_type var = tensor_type::from_shape({v.channels});
+    kernel::channel_moments(v.outer, v.channels, v.inner, x_ptr, mean.data(),
+                            var.data());
+    inv_std = 1.f / xt::sqrt(var + eps);
+    if (!running_mean.is_empty()) {
+      tensor rm = running_mean; // shallow, updated in place
+      tensor rv = running_var;
+      rm = momentum * running_mean.cdata() + (1 - momentum) * mean;
+      rv = momentum * running_var.cdata() + (1 - momentum) * var;
+    }
+  } else {
+    mean = running_mean.cdata();
+    inv_std = 1.f / xt::sqrt(running_var.cdata() + eps);
+  }
+  assert(mean.size() == v.channels);
+
+  tensor_type scale, shift;
+  fold_affine(weight, bias, mean, inv_std, scale, shift);
+  auto y = tensor_type::from_shape(data.shape());
+  kernel::channel_affine(v.outer, v.channels, v.inner, x_ptr, scale.data(),
+                         shift.data(), y.data());
+  return y;
+}
+
+// backward of batchnorm_1d and batchnorm_nd, whose inputs are
+// {data, weight, bias, running_mean, running_var, eps, momentum,
+//  track_running_stats}, from the statistics saved by forward.
+// one pass reduces gy and gy * xhat per channel, which are the gradients of
+// beta and gamma; a second one writes the input gradient in closed form.
+inline void backward(const tensor_type &saved_mean,
+                     const tensor_type &saved_inv_std,
+                     const std::vector<tensor> &outputs,
+                     std::vector<tensor> &inputs, const grad_mask &mask) {
+  assert(inputs.size() == 8);
+  assert(outputs.size() == 1);
+  assert(outputs[0].size() == inputs[0].size());
+
+  const auto v = view_of(inputs[0]);
+  assert(saved_mean.size() == v.channels);
+  assert(saved_inv_std.size() == v.channels);
+  const bool batch_stats = 0 < inputs[7].data()();
+  tensor x = inputs[0];  // shallow, for the raw pointers
+  tensor y = outputs[0];
+  const float *x_ptr = x.data().data();
+  const float *gy_ptr = y.grad().data();
+  const float *mean = saved_mean.data();
+  const float *inv_std = saved_inv_std.data();
+
+  auto sum_gy = tensor_type::from_shape({v.channels});
+  auto sum_gy_xhat = tensor_type::from_shape({v.channels});
+  kernel::channel_grad_sums(v.outer, v.channels, v.inner, x_ptr, gy_ptr, mean,
+                            inv_std, sum_gy.data(), sum_gy_xhat.data());
+
+  if (needs_grad(mask, inputs, 0)) {
+    const float *gamma =
+        inputs[1].is_empty() ? nullptr : inputs[1].data().data();
+    auto gx = tensor_type::from_shape(inputs[0].shape());
+    kernel::channel_input_grad(v.outer, v.channels, v.inner, x_ptr, gy_ptr,
+                               gamma, mean, inv_std, sum_gy.data(),
+                               sum_gy_xhat.data(), batch_stats, gx.data());
+    inputs[0].set_grad(std::move(gx));
+  }
+  if (needs_grad(mask, inputs, 1)) {
+    inputs[1].set_grad(std::move(sum_gy_xhat));
+  }
+  if (needs_grad(mask, inputs, 2)) {
+    inputs[2].set_grad(std::move(sum_gy));
+  }
+}
+
+} // namespace batchnorm_detail
+
 class batchnorm_1d : virtual public traceable_function {
 public:
   batchnorm_1d() : traceable_function{1} { set_name("batchnorm_1d"); }
@@ -20,127 +157,38 @@ public:
                         const tensor &running_var, value_type eps = 1e-5,
                         value_type momentum = 0.1,
                         bool track_running_stats = false) {
-    auto x = data.cdata();
-    auto x_shape = x.shape();
-    std::size_t batch_size = x_shape[0];
-    std::size_t channels = x_shape[1];
-
-    assert(x.dimension() == 2);
-    assert(running_mean.dim() == 1);
-    assert(running_var.dim() == 1);
-    assert(running_mean.shape()[0] == channels);
-    assert(running_var.shape()[0] == channels);
+    assert(data.dim() == 2);
+    assert(batchnorm_detail::valid_running_stats(
+        running_mean, running_var, data.shape()[1], track_running_stats));
 
-    xt::xtensor<value_type, 2> y;
-    if (track_running_stats) {
-      auto batch_mean = xt::mean(x, {0});
-      auto batch_var = xt::variance(x, {0});
-
-      y = (x - batch_mean) / xt::sqrt(batch_var + eps);
-    } else {
-      y = (x - running_mean.cdata()) / xt::sqrt(running_var.cdata() + eps);
-    }
-
-    // affine
-    if (!weight.is_empty()) {
-      auto gamma = weight.cdata();
-      assert(gamma.dimension() == 1);
-      assert(x.shape()[1] == gamma.shape()[0]);
-      y *= gamma;
-    }
-    if (!bias.is_empty()) {
-      auto beta = bias.cdata();
-      assert(beta.dimension() == 1);
-      assert(x.shape()[1] == beta.shape()[0]);
-      y += beta;
-    }
+    tensor_type mean, inv_std;
+    auto y = batchnorm_detail::normalize(data, weight, bias, running_mean,
+                                         running_var, eps, momentum,
+                                         track_running_stats, mean, inv_std);
 
     tensor output{std::move(y), util::requires_grad(data, weight, bias)};
     if (output.requires_grad()) {
+      // the statistics are not graph inputs, only backward reads them
       trace::register_node<batchnorm_1d>(
-          {data, weight, bias, running_mean, running_var, tensor{eps},
-           tensor{momentum},
-           tensor{static_cast<value_type>(track_running_stats)}},
-          output);
+          {data, weight, bias, running_mean, running_var, tensor{eps, false},
+           tensor{momentum, false},
+           tensor{static_cast<value_type>(track_running_stats), false}},
+          output,
+          [mean = std::move(mean), inv_std = std::move(inv_std)](
+              const std::vector<tensor> &outputs, std::vector<tensor> &inputs,
+              const grad_mask &mask) {
+            backward(mean, inv_std, outputs, inputs, mask);
+          });
     }
     return output;
   }
 
-  static void backward(const std::vector<tensor> &outputs,
-                       std::vector<tensor> &inputs) {
-    assert(inputs.size() == 8);
-    assert(outputs.size() == 1);
-
-    auto &&gy = outputs[0].cgrad();
-    auto &x = inputs[0].data();
-    auto &gx = inputs[0].grad();
-    auto &running_mean = inputs[3].data();
-    auto &running_var = inputs[4].data();
-    value_type eps = inputs[5].data()();
-    value_type momentum = inputs[6].data()();
-    bool track_running_stats = 0 < inputs[7].data()() ? true : false;
-
-    assert(gy.dimension() == x.dimension());
-    assert(gy.dimension() == 2);
-    assert(gy.size() == x.size());
-
-    std::size_t batch_size = x.shape()[0];
-
-    auto &&batch_mean = xt::mean(x, {0});
-    auto &&batch_var = xt::variance(x, {0});
-
-    xt::xtensor<value_type, 2> xhat;
-    if (track_running_stats) {
-      xhat = (x - batch_mean) / xt::sqrt(batch_var + eps);
-    } else {
-      xhat = (x - running_mean) / xt::sqrt(running_var + eps);
-    }
-
-    if (!inputs[2].is_empty() && inputs[2].requires_grad()) {
-      // gradient of beta
-      auto gbeta = xt::sum(gy, {0});
-      inputs[2].set_grad(gbeta);
-    }
-
-    // gradient of gamma
-    if (!inputs[1].is_empty() && inputs[1].requires_grad()) {
-      auto ggamma = xt::sum(gy * xhat, {0});
-      inputs[1].set_grad(ggamma);
-    }
-
-    // gradinent of x
-    if (inputs[0].requires_grad()) {
-      if (track_running_stats) {
-        auto gxhat = xt::xarray<value_type>::from_shape(gy.shape());
-        if (inputs[1].is_empty()) {
-          gxhat = gy;
-        } else {
-          auto &gamma = inputs[1].data();
-          gxhat = gy * gamma;
-        }
-        auto ivar = 1. / xt::sqrt(batch_var + eps);
-        auto givar = xt::sum(gxhat * batch_mean, {0});
-        auto gbatch_mean_1 = gxhat * ivar;
-        auto gsqrtvar = -1. / batch_var * givar;
-        auto gbatch_var = 0.5 * ivar * gsqrtvar;
-        auto gsq = 1. / batch_size *
-                   xt::ones<value_type>({batch_size, x.shape()[1]}) *
-                   gbatch_var;
-        auto gbatch_mean_2 = 2 * batch_mean * gsq;
-        auto gx_1 = gbatch_mean_1 + gbatch_mean_2;
-        auto gbatch_mean = -1 * xt::sum(gbatch_mean_1 + gbatch_mean_2, {0});
-        auto gx_2 = 1. / batch_size *
-                    xt::ones<value_type>({batch_size, gy.shape()[1]}) *
-                    gbatch_mean;
-        gx = gx_1 + gx_2;
-      } else {
-        gx = gy / xt::sqrt(running_var + eps);
-      }
-    }
-    if (track_running_stats) {
-      running_mean = momentum * running_mean + (1 - momentum) * batch_mean;
-      running_var = momentum * running_var + (1 - momentum) * batch_var;
-    }
+  static void backward(const tensor_type &mean, const tensor_type &inv_std,
+                       const std::vector<tensor> &outputs,
+                       std::vector<tensor> &inputs,
+                       const grad_mask &mask = {}) {
+    assert(inputs[0].dim() == 2);
+    batchnorm_detail::backward(mean, inv_std, outputs, inputs, mask);
   }
 };
 
@@ -154,158 +202,69 @@ public:
                         value_type momentum = 0.1,
                         bool track_running_stats = true) {
 
-    auto &&x = data.cdata();
-    auto x_shape = x.shape();
-    std::size_t channels = x_shape[1];
-
-    assert(2 < x.dimension());
-    assert(running_mean.dim() == 1);
-    assert(running_var.dim() == 1);
-
-    x.reshape({static_cast<int>(x_shape[0]), static_cast<int>(x_shape[1]), -1});
-    auto y = xt::xarray<value_type>::from_shape(x.shape());
-
-    assert(running_mean.shape()[0] == x.shape()[1]);
-    assert(running_var.shape()[0] == x.shape()[1]);
-
-    if (track_running_stats) {
-      xt::xarray<value_type> batch_mean = xt::mean(x, {0, 2});
-      xt::xarray<value_type> batch_var = xt::variance(x, {0, 2});
-      batch_mean.reshape({1, channels, 1});
-      batch_var.reshape({1, channels, 1});
-
-      y = (x - batch_mean) / xt::sqrt(batch_var + eps);
-    } else {
-      xt::xarray<value_type> mean = running_mean.cdata();
-      xt::xarray<value_type> var = running_var.cdata();
-      mean.reshape({1, channels, 1});
-      var.reshape({1, channels, 1});
-      y = (x - mean) / xt::sqrt(var + eps);
-    }
+    assert(2 < data.dim());
+    assert(batchnorm_detail::valid_running_stats(
+        running_mean, running_var, batchnorm_detail::view_of(data).channels,
+        track_running_stats));
 
-    // affine
-    if (!weight.is_empty()) {
-      auto &&gamma = weight.cdata();
-      assert(gamma.dimension() == 1);
-      assert(x_shape[1] == gamma.shape()[0]);
-      gamma.reshape({1, channels, 1});
-      y *= gamma;
-    }
-    if (!bias.is_empty()) {
-      auto &&beta = bias.cdata();
-      assert(beta.dimension() == 1);
-      assert(x_shape[1] == beta.shape()[0]);
-      beta.reshape({1, channels, 1});
-      y += beta;
-    }
+    // statistics are reduced over every axis but the channel axis
+    tensor_type mean, inv_std;
+    auto y = batchnorm_detail::normalize(data, weight, bias, running_mean,
+                                         running_var, eps, momentum,
+                                         track_running_stats, mean, inv_std);
 
-    y.reshape(x_shape);
     tensor output{std::move(y), util::requires_grad(data, weight, bias)};
+    output.set_format(data.format());
     if (output.requires_grad()) {
+      // the statistics are not graph inputs, only backward reads them
       trace::register_node<batchnorm_nd>(
-          {data, weight, bias, running_mean, running_var, tensor{eps},
-           tensor{momentum},
-           tensor{static_cast<value_type>(track_running_stats)}},
-          output);
+          {data, weight, bias, running_mean, running_var, tensor{eps, false},
+           tensor{momentum, false},
+           tensor{static_cast<value_type>(track_running_stats), false}},
+          output,
+          [mean = std::move(mean), inv_std = std::move(inv_std)](
+              const std::vector<tensor> &outputs, std::vector<tensor> &inputs,
+              const grad_mask &mask) {
+            backward(mean, inv_std, outputs, inputs, mask);
+          });
     }
     return output;
   }
 
-  static void backward(const std::vector<tensor> &outputs,
-                       std::vector<tensor> &inputs) {
-
-    assert(inputs.size() == 8);
-    assert(outputs.size() == 1);
-
-    auto gy = outputs[0].cgrad();
-    xt::xarray<value_type> &x = inputs[0].data();
-    auto x_shape = x.shape();
-    auto &gx = inputs[0].grad();
-    auto &running_mean = inputs[3].data();
-    auto &running_var = inputs[4].data();
-    value_type eps = inputs[5].data()();
-    value_type momentum = inputs[6].data()();
-    bool track_running_stats = 0 < inputs[7].data()() ? true : false;
-
-    assert(gy.dimension() == x.dimension());
-    assert(2 < gy.dimension());
-    assert(gy.size() == x.size());
-
-    std::size_t batch_size = x_shape[0];
-    std::size_t channels = x_shape[1];
-
-    gy.reshape(
-        {static_cast<int>(x.shape()[0]), static_cast<int>(x.shape()[1]), -1});
-    x.reshape(gy.shape());
-
-    xt::xarray<value_type> batch_mean = xt::mean(x, {0, 2});
-    xt::xarray<value_type> batch_var = xt::variance(x, {0, 2});
-    batch_mean.reshape({1, channels, 1});
-    batch_var.reshape({1, channels, 1});
-
-    auto xhat = xt::xtensor<value_type, 3>::from_shape(x.shape());
-    if (track_running_stats) {
-      xhat = (x - batch_mean) / xt::sqrt(batch_var + eps);
-    } else {
-      running_mean.reshape({1, channels, 1});
-      running_var.reshape({1, channels, 1});
-      xhat = (x - running_mean) / xt::sqrt(running_var + eps);
-    }
-
-    // gradient of beta
-    if (!inputs[2].is_empty() && inputs[2].requires_grad()) {
-      auto gbeta = xt::sum(gy, {0, 2});
-      inputs[2].set_grad(std::move(gbeta));
-    }
-
-    // gradient of gamma
-    if (!inputs[1].is_empty() && inputs[1].requires_grad()) {
-      auto ggamma = xt::sum(gy * xhat, {0, 2});
-      inputs[1].set_grad(std::move(ggamma));
-    }
-
-    // gradinent of x
-    if (inputs[0].requires_grad()) {
-      if (track_running_stats) {
-        batch_var.reshape({channels, 1});
-        xt::xtensor<value_type, 3> gxhat{xhat.shape()};
-        if (inputs[1].is_empty()) {
-          gxhat = gy;
-        } else {
-          xt::xarray<value_type> &&gamma = inputs[1].cdata();
-          gamma.reshape({1, channels, 1});
-          gxhat = gy * gamma;
-        }
-
-        auto ivar = 1. / xt::sqrt(batch_var + eps);
-        auto givar = xt::sum(gxhat * batch_mean, {0});
-        auto gbatch_mean_1 = gxhat * ivar;
-        auto gsqrtvar = -1. / batch_var * givar;
-        auto gbatch_var = 0.5 * ivar * gsqrtvar;
-        auto gsq = 1. / batch_size * xt::ones_like(gy) * gbatch_var;
-        auto gbatch_mean_2 = 2 * batch_mean * gsq;
-        xt::xarray<value_type> gx_1 = gbatch_mean_1 + gbatch_mean_2;
-        auto gbatch_mean = -1 * xt::sum(gbatch_mean_1 + gbatch_mean_2, {0});
-        xt::xarray<value_type> gx_2 =
-            1. / batch_size * xt::ones_like(gy) * gbatch_mean;
+  static void backward(const tensor_type &mean, const tensor_type &inv_std,
+                       const std::vector<tensor> &outputs,
+                       std::vector<tensor> &inputs,
+                       const grad_mask &mask = {}) {
+    assert(2 < inputs[0].dim());
+    batchnorm_detail::backward(mean, inv_std, outputs, inputs, mask);
+  }
+};
 
-        gx_1.reshape(x_shape);
-        gx_2.reshape(x_shape);
-        x.reshape(x_shape);
-        running_mean.reshape({channels});
-        running_var.reshape({channels});
+// batchnorm with fixed statistics, for inference: y = x * scale[c] +
+// shift[c] with scale and shift folded once by affine(). nothing is traced,
+// and the output does not require grad.
+struct batchnorm_inference {
+  static void affine(const tensor &weight, const tensor &bias,
+                     const tensor &running_mean, const tensor &running_var,
+                     const value_type eps, tensor_type &scale,
+                     tensor_type &shift) {
+    const tensor_type inv_std = 1.f / xt::sqrt(running_var.cdata() + eps);
+    batchnorm_detail::fold_affine(weight, bias, running_mean.cdata(), inv_std,
+                                  scale, shift);
+  }
 
-        gx = gx_1 + gx_2;
-      } else {
-        gx = gy / xt::sqrt(running_var + eps);
-      }
-    }
-    if (track_running_stats) {
-      batch_mean.reshape({channels});
-      batch_var.reshape({channels});
-      running_mean = momentum * running_mean + (1 - momentum) * batch_mean;
-      running_var = momentum * running_var + (1 - momentum) * batch_var;
-    }
+  static tensor forward(const tensor &data, const tensor_type &scale,
+                        const tensor_type &shift) {
+    assert(2 <= data.dim());
+    const auto v = batchnorm_detail::view_of(data);
+    assert(scale.size() == v.channels && shift.size() == v.channels);
+    tensor x = data; // shallow, for the raw pointer
+    auto y = tensor_type::from_shape(data.shape());
+    kernel::channel_affine(v.outer, v.channels, v.inner, x.data().data(),
+                           scale.data(), shift.data(), y.data());
+    tensor output{std::move(y), false};
+    output.set_format(data.format());
+    return output;
   }
 };
 
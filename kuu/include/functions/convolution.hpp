@@ -1,15 +1,24 @@
 #ifndef KUU_FUNCTIONS_CONVOLUTION_HPP
 #define KUU_FUNCTIONS_CONVOLUTION_HPP
 
-#include "convolution.hpp"
+#include "autotuner.hpp"
 #include "exarray.hpp"
 #include "function.hpp"
+#include "kernels/depthwise.hpp"
+#include "kernels/fft.hpp"
 #include "layout.hpp"
+#include "math.hpp"
 #include <cassert>
+#include <chrono>
+#include <cmath>
 #include <execution>
-#include <xtensor-blas/xlinalg.hpp>
+#include <limits>
+#include <numeric>
+#include <sstream>
+#include <string>
 #include <xtensor/xeval.hpp>
 #include <xtensor/xmath.hpp>
+#include <xtensor/xview.hpp>
 
 namespace kuu {
 
@@ -34,9 +43,6 @@ im2col(T0 &&x, T1 &&weight_shape, exarray<2> stride = 1, exarray<2> padding = 0,
            xt::range(padding.get<1>(), x.shape()[NCHW::W] + padding.get<1>())) =
       x;
 
-  assert(x_shape[NCHW::H] % stride.get<0>() == 0);
-  assert(x_shape[NCHW::W] % stride.get<1>() == 0);
-
   std::size_t N = x_shape[NCHW::N];
   std::size_t H_out = (x_shape[NCHW::H] - H_f) / stride.get<0>() + 1;
   std::size_t W_out = (x_shape[NCHW::W] - W_f) / stride.get<1>() + 1;
@@ -126,6 +132,309 @@ col2im(T0 &&col, T1 &&x_shape, T2 &&weight_shape, exarray<2> stride = 1,
       xt::range(padding.get<1>(), padx_shape[NCHW::W] - padding.get<1>())));
 }
 
+// channels-last counterpart of im2col. x is {N, H, W, C} and each row of the
+// result is a window flattened in {H_f, W_f, C} order, so that the C channels
+// of a pixel are copied as one contiguous run.
+template <typename T1>
+xt::xarray<tensor::value_type>
+im2col_nhwc(const xt::xarray<tensor::value_type> &x, T1 &&weight_shape,
+            exarray<2> stride = 1, exarray<2> padding = 0) {
+  const std::size_t N = x.shape()[NHWC::N];
+  const std::size_t H = x.shape()[NHWC::H];
+  const std::size_t W = x.shape()[NHWC::W];
+  const std::size_t C = x.shape()[NHWC::C];
+  const std::size_t H_f = weight_shape[2];
+  const std::size_t W_f = weight_shape[3];
+  const std::ptrdiff_t pad_h = padding.get<0>();
+  const std::ptrdiff_t pad_w = padding.get<1>();
+  const std::size_t stride_h = stride.get<0>();
+  const std::size_t stride_w = stride.get<1>();
+
+  assert(static_cast<std::size_t>(weight_shape[1]) == C);
+
+  const std::size_t H_out = (H + 2 * pad_h - H_f) / stride_h + 1;
+  const std::size_t W_out = (W + 2 * pad_w - W_f) / stride_w + 1;
+  const std::size_t Cols = H_f * W_f * C;
+
+  xt::xarray<value_type> col =
+      xt::xarray<value_type>::from_shape({N * H_out * W_out, Cols});
+
+  std::vector<std::size_t> samples(N);
+  std::iota(samples.begin(), samples.end(), 0);
+  std::for_each(
+      std::execution::par, samples.begin(), samples.end(), [&](std::size_t n) {
+        for (std::size_t i = 0; i < H_out; i++) {
+          for (std::size_t j = 0; j < W_out; j++) {
+            value_type *row = col.data() + ((n * H_out + i) * W_out + j) * Cols;
+            for (std::size_t p = 0; p < H_f; p++) {
+              const std::ptrdiff_t h =
+                  static_cast<std::ptrdiff_t>(i * stride_h + p) - pad_h;
+              for (std::size_t q = 0; q < W_f; q++) {
+                const std::ptrdiff_t w =
+                    static_cast<std::ptrdiff_t>(j * stride_w + q) - pad_w;
+                value_type *dst = row + (p * W_f + q) * C;
+                if (h < 0 || static_cast<std::size_t>(h) >= H || w < 0 ||
+                    static_cast<std::size_t>(w) >= W) {
+                  std::fill(dst, dst + C, value_type{0});
+                } else {
+                  const value_type *src = x.data() + ((n * H + h) * W + w) * C;
+                  std::copy(src, src + C, dst);
+                }
+              }
+            }
+          }
+        }
+      });
+  return col;
+}
+
+// inverse of im2col_nhwc: overlapping windows are accumulated into
+// {N, H, W, C}.
+template <typename T1, typename T2>
+xt::xarray<tensor::value_type>
+col2im_nhwc(const xt::xarray<tensor::value_type> &col, T1 &&x_shape,
+            T2 &&weight_shape, exarray<2> stride = 1, exarray<2> padding = 0) {
+  const std::size_t N = x_shape[NHWC::N];
+  const std::size_t H = x_shape[NHWC::H];
+  const std::size_t W = x_shape[NHWC::W];
+  const std::size_t C = x_shape[NHWC::C];
+  const std::size_t H_f = weight_shape[2];
+  const std::size_t W_f = weight_shape[3];
+  const std::ptrdiff_t pad_h = padding.get<0>();
+  const std::ptrdiff_t pad_w = padding.get<1>();
+  const std::size_t stride_h = stride.get<0>();
+  const std::size_t stride_w = stride.get<1>();
+
+  const std::size_t H_out = (H + 2 * pad_h - H_f) / stride_h + 1;
+  const std::size_t W_out = (W + 2 * pad_w - W_f) / stride_w + 1;
+  const std::size_t Cols = H_f * W_f * C;
+
+  assert(col.size() == N * H_out * W_out * Cols);
+
+  xt::xarray<value_type> im = xt::zeros<value_type>({N, H, W, C});
+
+  std::vector<std::size_t> samples(N);
+  std::iota(samples.begin(), samples.end(), 0);
+  std::for_each(
+      std::execution::par, samples.begin(), samples.end(), [&](std::size_t n) {
+        for (std::size_t i = 0; i < H_out; i++) {
+          for (std::size_t j = 0; j < W_out; j++) {
+            const value_type *row =
+                col.data() + ((n * H_out + i) * W_out + j) * Cols;
+            for (std::size_t p = 0; p < H_f; p++) {
+              const std::ptrdiff_t h =
+                  static_cast<std::ptrdiff_t>(i * stride_h + p) - pad_h;
+              if (h < 0 || static_cast<std::size_t>(h) >= H) {
+                continue;
+              }
+              for (std::size_t q = 0; q < W_f; q++) {
+                const std::ptrdiff_t w =
+                    static_cast<std::ptrdiff_t>(j * stride_w + q) - pad_w;
+                if (w < 0 || static_cast<std::size_t>(w) >= W) {
+                  continue;
+                }
+                const value_type *src = row + (p * W_f + q) * C;
+                value_type *dst = im.data() + ((n * H + h) * W + w) * C;
+                for (std::size_t c = 0; c < C; c++) {
+                  dst[c] += src[c];
+                }
+              }
+            }
+          }
+        }
+      });
+  return im;
+}
+
+// columns of group g out of an im2col matrix over C channels and K = H_f * W_f
+// taps. the group's channels are a contiguous block of each row for NCHW
+// ({C, H_f, W_f} order) and a strided run per tap for NHWC ({H_f, W_f, C}).
+inline xt::xarray<tensor::value_type>
+group_columns(const xt::xarray<tensor::value_type> &col, const std::size_t g,
+              const std::size_t groups, const std::size_t C, const std::size_t K,
+              const bool channels_last) {
+  const std::size_t rows = col.shape()[0];
+  const std::size_t C_g = C / groups;
+  xt::xarray<value_type> out =
+      xt::xarray<value_type>::from_shape({rows, C_g * K});
+  for (std::size_t r = 0; r < rows; r++) {
+    const value_type *src = col.data() + r * C * K;
+    value_type *dst = out.data() + r * C_g * K;
+    if (channels_last) {
+      for (std::size_t k = 0; k < K; k++) {
+        std::copy(src + k * C + g * C_g, src + k * C + (g + 1) * C_g,
+                  dst + k * C_g);
+      }
+    } else {
+      std::copy(src + g * C_g * K, src + (g + 1) * C_g * K, dst);
+    }
+  }
+  return out;
+}
+
+// writes col_g back into the columns of group g. inverse of group_columns.
+inline void scatter_group_columns(xt::xarray<tensor::value_type> &col,
+                                  const xt::xarray<tensor::value_type> &col_g,
+                                  const std::size_t g, const std::size_t groups,
+                                  const std::size_t C, const std::size_t K,
+                                  const bool channels_last) {
+  const std::size_t rows = col.shape()[0];
+  const std::size_t C_g = C / groups;
+  for (std::size_t r = 0; r < rows; r++) {
+    const value_type *src = col_g.data() + r * C_g * K;
+    value_type *dst = col.data() + r * C * K;
+    if (channels_last) {
+      for (std::size_t k = 0; k < K; k++) {
+        std::copy(src + k * C_g, src + (k + 1) * C_g, dst + k * C + g * C_g);
+      }
+    } else {
+      std::copy(src, src + C_g * K, dst + g * C_g * K);
+    }
+  }
+}
+
+// cross-correlation of zero-padded x with weight as a pointwise product of
+// spectra. x is {N, C_in, H, W} and weight is {C_out, C_in, H_f, W_f}.
+// the result has no bias, {N, C_out, H_out, W_out}.
+inline xt::xarray<tensor::value_type>
+conv2d_fft(const xt::xarray<tensor::value_type> &x,
+           const xt::xarray<tensor::value_type> &weight, exarray<2> stride = 1,
+           exarray<2> padding = 0) {
+  using kernel::complex_type;
+
+  std::size_t N = x.shape()[NCHW::N];
+  std::size_t C_in = x.shape()[NCHW::C];
+  std::size_t H = x.shape()[NCHW::H];
+  std::size_t W = x.shape()[NCHW::W];
+  std::size_t C_out = weight.shape()[0];
+  std::size_t H_f = weight.shape()[2];
+  std::size_t W_f = weight.shape()[3];
+  std::size_t pad_h = padding.get<0>();
+  std::size_t pad_w = padding.get<1>();
+  std::size_t stride_h = stride.get<0>();
+  std::size_t stride_w = stride.get<1>();
+
+  assert(weight.shape()[1] == C_in);
+
+  std::size_t H_out = (H + 2 * pad_h - H_f) / stride_h + 1;
+  std::size_t W_out = (W + 2 * pad_w - W_f) / stride_w + 1;
+
+  // no wrap-around for the valid outputs as long as the transform covers the
+  // padded input.
+  kernel::fft2d_plan plan{kernel::fft_size(H + 2 * pad_h),
+                          kernel::fft_size(W + 2 * pad_w)};
+  const std::size_t F = plan.size();
+  const std::size_t F_w = plan.width();
+
+  // filter spectra are computed once and shared by every sample in the batch.
+  std::vector<complex_type> wspec(C_out * C_in * F);
+  std::vector<std::size_t> filters(C_out * C_in);
+  std::iota(filters.begin(), filters.end(), 0);
+  std::for_each(std::execution::par, filters.begin(), filters.end(),
+                [&](std::size_t f) {
+                  complex_type *spec = wspec.data() + f * F;
+                  const value_type *w = weight.data() + f * H_f * W_f;
+                  for (std::size_t i = 0; i < H_f; i++) {
+                    for (std::size_t j = 0; j < W_f; j++) {
+                      spec[i * F_w + j] = w[i * W_f + j];
+                    }
+                  }
+                  plan.forward(spec);
+                });
+
+  xt::xarray<value_type> y =
+      xt::xarray<value_type>::from_shape({N, C_out, H_out, W_out});
+
+  std::vector<std::size_t> samples(N);
+  std::iota(samples.begin(), samples.end(), 0);
+  std::for_each(
+      std::execution::par, samples.begin(), samples.end(), [&](std::size_t n) {
+        std::vector<complex_type> xspec(C_in * F);
+        for (std::size_t c = 0; c < C_in; c++) {
+          complex_type *spec = xspec.data() + c * F;
+          const value_type *xp = x.data() + (n * C_in + c) * H * W;
+          for (std::size_t i = 0; i < H; i++) {
+            for (std::size_t j = 0; j < W; j++) {
+              spec[(i + pad_h) * F_w + j + pad_w] = xp[i * W + j];
+            }
+          }
+          plan.forward(spec);
+        }
+
+        std::vector<complex_type> acc(F);
+        for (std::size_t co = 0; co < C_out; co++) {
+          std::fill(acc.begin(), acc.end(), complex_type{});
+          for (std::size_t c = 0; c < C_in; c++) {
+            const complex_type *xs = xspec.data() + c * F;
+            const complex_type *ws = wspec.data() + (co * C_in + c) * F;
+            for (std::size_t k = 0; k < F; k++) {
+              acc[k] += xs[k] * std::conj(ws[k]);
+            }
+          }
+          plan.inverse(acc.data());
+
+          value_type *yp = y.data() + (n * C_out + co) * H_out * W_out;
+          for (std::size_t i = 0; i < H_out; i++) {
+            for (std::size_t j = 0; j < W_out; j++) {
+              yp[i * W_out + j] = acc[i * stride_h * F_w + j * stride_w].real();
+            }
+          }
+        }
+      });
+  return y;
+}
+
+// kDirect is the depthwise kernel and only applies when groups == C_in.
+enum class conv_algorithm { kAuto = 0, kIm2col = 1, kFFT = 2, kDirect = 3 };
+
+// kAuto consults the tuner when it is enabled, and the flop model below
+// otherwise.
+using conv_autotuner = autotuner<conv_algorithm>;
+
+// rough flop model. a spectral multiply-accumulate is not as cheap as a
+// GEMM flop, so the FFT path has to win by a margin. grouped convolutions
+// never take the FFT path, and depthwise ones always run the direct kernel.
+// x_shape is in the order of format.
+template <typename S0, typename S1>
+conv_algorithm
+select_conv_algorithm(const S0 &x_shape, const S1 &weight_shape,
+                      exarray<2> stride = 1, exarray<2> padding = 0,
+                      exarray<2> dilation = 1, const std::size_t groups = 1,
+                      const memory_format format = memory_format::kNCHW) {
+  constexpr double kFFTPenalty = 3.0;
+
+  if (1 < groups) {
+    return weight_shape[1] == 1 ? conv_algorithm::kDirect
+                                : conv_algorithm::kIm2col;
+  }
+  if (dilation.get<0>() != 1 || dilation.get<1>() != 1) {
+    return conv_algorithm::kIm2col;
+  }
+  const bool channels_last = format == memory_format::kNHWC;
+  double N = x_shape[NCHW::N];
+  double C_in = x_shape[channels_last ? NHWC::C : NCHW::C];
+  double C_out = weight_shape[0];
+  double H_f = weight_shape[2];
+  double W_f = weight_shape[3];
+  std::size_t H_pad =
+      x_shape[channels_last ? NHWC::H : NCHW::H] + 2 * padding.get<0>();
+  std::size_t W_pad =
+      x_shape[channels_last ? NHWC::W : NCHW::W] + 2 * padding.get<1>();
+  double H_out = (H_pad - weight_shape[2]) / stride.get<0>() + 1;
+  double W_out = (W_pad - weight_shape[3]) / stride.get<1>() + 1;
+
+  double im2col_cost = 2. * N * H_out * W_out * C_out * C_in * H_f * W_f;
+
+  double F = static_cast<double>(kernel::fft_size(H_pad)) *
+             static_cast<double>(kernel::fft_size(W_pad));
+  double n_transforms = N * C_in + C_out * C_in + N * C_out;
+  double fft_cost = 5. * n_transforms * F * std::log2(F) +
+                    8. * N * C_out * C_in * F;
+
+  return kFFTPenalty * fft_cost < im2col_cost ? conv_algorithm::kFFT
+                                               : conv_algorithm::kIm2col;
+}
+
 namespace function {
 
 class convolution_2d : virtual public traceable_function {
@@ -133,9 +442,53 @@ public:
   convolution_2d() : traceable_function{1} { set_name("convolution_2d"); }
   ~convolution_2d() = default;
 
+  // tags of the weight's packed GEMM operands
+  static constexpr int kPackedFilter = 1;
+  static constexpr int kPackedFilterNHWC = 2;
+
+  // the filter transposed, {Cols, C_out} in the window order of the input's
+  // format, in block sparse form when the weight is masked and sparse enough
+  // for the block kernels to pay off. null otherwise.
+  static const kernel::bsr_matrix *sparse_filter(const tensor &weight,
+                                                 const bool channels_last,
+                                                 const double max_density) {
+    if (!weight.mask()) {
+      return nullptr;
+    }
+    const std::size_t C_out = weight.shape()[0];
+    const std::size_t Cols = weight.size() / C_out;
+    const auto &S = weight.packed_sparse(
+        channels_last ? kPackedFilterNHWC : kPackedFilter,
+        [&](const tensor::tensor_type &w) {
+          if (channels_last) {
+            xt::xarray<tensor::value_type> f = xt::transpose(w, {0, 2, 3, 1});
+            return kernel::pack_bsr(true, Cols, C_out, f.data(), Cols);
+          }
+          return kernel::pack_bsr(true, Cols, C_out, w.data(), Cols);
+        });
+    return S.density() <= max_density ? &S : nullptr;
+  }
+
+  // {rows, C_out} = col * filter^T + bias with the block kernel.
+  static xt::xarray<tensor::value_type>
+  sparse_dot(const xt::xarray<tensor::value_type> &col,
+             const kernel::bsr_matrix &filter, const tensor &bias) {
+    const std::size_t rows = col.shape()[0];
+    auto dot = xt::xarray<tensor::value_type>::from_shape({rows, filter.n});
+    tensor b = bias; // shallow, for the raw pointer
+    kernel::bsr_gemm(rows, col.data(), filter.k, filter,
+                     0 < bias.size() ? b.data().data() : nullptr, dot.data(),
+                     filter.n);
+    return dot;
+  }
+
+  // weight is {C_out, C_in / groups, H_f, W_f}. output channels are split
+  // into groups of C_out / groups, each seeing its own C_in / groups inputs.
   static tensor forward(const tensor &data, const tensor &weight,
                         const tensor &bias, exarray<2> stride = 1,
-                        exarray<2> padding = 0, exarray<2> dilation = 1) {
+                        exarray<2> padding = 0, exarray<2> dilation = 1,
+                        const std::size_t groups = 1,
+                        conv_algorithm algorithm = conv_algorithm::kAuto) {
     // std::cout << "x\n" << xt::mean(data.cdata(), {0, 1, 2}) << std::endl;
     // std::cout << "W\n" << xt::mean(weight.cdata()) << std::endl;
     // std::cout << "b\n" << xt::mean(bias.cdata()) << std::endl;
@@ -143,52 +496,293 @@ public:
     assert(data.shape().size() == 4);
     assert(weight.shape().size() == 4);
 
+    tensor::tensor_type result;
+    if (algorithm != conv_algorithm::kAuto) {
+      result = compute(data, weight, bias, stride, padding, dilation, groups,
+                       algorithm);
+    } else if (!conv_autotuner::instance().enabled()) {
+      algorithm = select_conv_algorithm(data.shape(), weight.shape(), stride,
+                                        padding, dilation, groups,
+                                        data.format());
+      result = compute(data, weight, bias, stride, padding, dilation, groups,
+                       algorithm);
+    } else {
+      auto &tuner = conv_autotuner::instance();
+      const std::string key =
+          conv_key(data, weight, stride, padding, dilation, groups);
+      if (auto cached = tuner.find(key)) {
+        result = compute(data, weight, bias, stride, padding, dilation, groups,
+                         *cached);
+      } else {
+        // first call for this key: time every candidate and keep the output
+        // of the fastest one. each one runs once untimed before, so that
+        // one-off costs such as packing the weight count against none.
+        double best = std::numeric_limits<double>::max();
+        for (auto candidate : candidates(data, weight, dilation, groups)) {
+          compute(data, weight, bias, stride, padding, dilation, groups,
+                  candidate);
+          auto start = std::chrono::steady_clock::now();
+          auto y = compute(data, weight, bias, stride, padding, dilation,
+                           groups, candidate);
+          std::chrono::duration<double> elapsed =
+              std::chrono::steady_clock::now() - start;
+          if (elapsed.count() < best) {
+            best = elapsed.count();
+            algorithm = candidate;
+            result = std::move(y);
+          }
+        }
+        tuner.insert(key, algorithm);
+      }
+    }
+
+    tensor output{std::move(result), util::requires_grad(data, weight, bias)};
+    output.set_format(data.format());
+    trace::register_node<convolution_2d>(
+        {data, weight, bias, stride.asTensor(), padding.asTensor(),
+         dilation.asTensor(), exarray<1>{groups}.asTensor()},
+        output);
+
+    return output;
+  }
+
+  // groups == C_in, i.e. one input channel per group.
+  static bool is_depthwise(const tensor &weight, const std::size_t groups) {
+    return 1 < groups && weight.shape()[1] == 1;
+  }
+
+  // algorithms applicable to the given input.
+  static std::vector<conv_algorithm> candidates(const tensor &data,
+                                                const tensor &weight,
+                                                exarray<2> dilation,
+                                                const std::size_t groups = 1) {
+    std::vector<conv_algorithm> algorithms{conv_algorithm::kIm2col};
+    if (is_depthwise(weight, groups)) {
+      algorithms.push_back(conv_algorithm::kDirect);
+    } else if (groups == 1 && data.format() == memory_format::kNCHW &&
+               dilation.get<0>() == 1 && dilation.get<1>() == 1) {
+      algorithms.push_back(conv_algorithm::kFFT);
+    }
+    return algorithms;
+  }
+
+  static std::string conv_key(const tensor &data, const tensor &weight,
+                              exarray<2> stride, exarray<2> padding,
+                              exarray<2> dilation,
+                              const std::size_t groups = 1) {
+    std::stringstream ss;
+    ss << "conv2d:x=" << shape2string(data.shape(), "x")
+       << ":w=" << shape2string(weight.shape(), "x")
+       << ":s=" << stride.get<0>() << "x" << stride.get<1>()
+       << ":p=" << padding.get<0>() << "x" << padding.get<1>()
+       << ":d=" << dilation.get<0>() << "x" << dilation.get<1>()
+       << ":g=" << groups << ":f=" << static_cast<int>(data.format());
+    return ss.str();
+  }
+
+  // output data of one algorithm, bias included.
+  static tensor::tensor_type compute(const tensor &data, const tensor &weight,
+                                     const tensor &bias, exarray<2> stride,
+                                     exarray<2> padding, exarray<2> dilation,
+                                     const std::size_t groups,
+                                     conv_algorithm algorithm) {
+    assert(data.shape().size() == 4);
+    assert(weight.shape().size() == 4);
+
+    const bool channels_last = data.format() == memory_format::kNHWC;
+    const std::size_t H_axis = channels_last ? NHWC::H : NCHW::H;
+    const std::size_t W_axis = channels_last ? NHWC::W : NCHW::W;
+    const std::size_t C_axis = channels_last ? NHWC::C : NCHW::C;
+
     std::size_t N = data.shape()[NCHW::N];
     std::size_t W_f = weight.shape()[3];
     std::size_t H_f = weight.shape()[2];
     std::size_t C_in = weight.shape()[1];
     std::size_t C_out = weight.shape()[0];
     std::size_t H_out =
-        (data.shape()[NCHW::H] + 2 * padding.get<0>() - H_f) / stride.get<0>() +
+        (data.shape()[H_axis] + 2 * padding.get<0>() - H_f) / stride.get<0>() +
         1;
     std::size_t W_out =
-        (data.shape()[NCHW::W] + 2 * padding.get<1>() - W_f) / stride.get<1>() +
+        (data.shape()[W_axis] + 2 * padding.get<1>() - W_f) / stride.get<1>() +
         1;
 
     assert(bias.size() == 0 || bias.shape()[0] == C_out);
+    assert(0 < groups && data.shape()[C_axis] == C_in * groups);
+    assert(C_out % groups == 0);
 
-    auto col = im2col(data.cdata(), weight.shape(), stride, padding, dilation);
+    // the FFT path works on dense NCHW planes only, and the direct kernel on
+    // depthwise convolutions only.
+    if (algorithm == conv_algorithm::kFFT && (channels_last || 1 < groups)) {
+      algorithm = conv_algorithm::kIm2col;
+    }
+    if (algorithm == conv_algorithm::kDirect && !is_depthwise(weight, groups)) {
+      algorithm = conv_algorithm::kIm2col;
+    }
+    assert(algorithm != conv_algorithm::kAuto);
 
-    // filter size for im2col is {C_out, C_in * H_f * W_f}.
-    xt::xarray<tensor::value_type> filter = weight.cdata();
-    filter.reshape({C_out, C_in * H_f * W_f});
+    tensor::tensor_type result;
+    if (algorithm == conv_algorithm::kFFT) {
+      result = conv2d_fft(data.cdata(), weight.cdata(), stride, padding);
+      if (0 < bias.size()) {
+        auto b = bias.cdata();
+        b.reshape({1, static_cast<int>(C_out), 1, 1});
+        result += b;
+      }
+    } else if (algorithm == conv_algorithm::kDirect) {
+      // shallow copies, to reach the buffers without copying them.
+      tensor x = data, w = weight, b = bias;
+      const auto geometry = depthwise_geometry(data, weight, stride, padding);
+      std::vector<std::size_t> y_shape =
+          channels_last ? std::vector<std::size_t>{N, H_out, W_out, C_out}
+                        : std::vector<std::size_t>{N, C_out, H_out, W_out};
+      result = tensor::tensor_type::from_shape(y_shape);
+      const value_type *b_ptr = 0 < b.size() ? b.data().data() : nullptr;
+      if (channels_last) {
+        kernel::depthwise_forward_nhwc(x.data().data(), w.data().data(), b_ptr,
+                                       result.data(), geometry);
+      } else {
+        kernel::depthwise_forward_nchw(x.data().data(), w.data().data(), b_ptr,
+                                       result.data(), geometry);
+      }
+    } else if (1 < groups) {
+      // one GEMM per group over the columns of that group's channels.
+      const std::size_t C_out_g = C_out / groups;
+      const std::size_t K = H_f * W_f;
+      std::vector<std::size_t> x_weight_shape = {C_out, C_in * groups, H_f,
+                                                 W_f};
+      auto col = channels_last
+                     ? im2col_nhwc(data.cdata(), x_weight_shape, stride, padding)
+                     : im2col(data.cdata(), x_weight_shape, stride, padding,
+                              dilation);
 
-    // shape is {N * H_out * W_out, C_out}
-    auto dot = xt::linalg::dot(col, xt::transpose(filter));
+      xt::xarray<tensor::value_type> filter =
+          channels_last ? xt::xarray<tensor::value_type>(
+                              xt::transpose(weight.cdata(), {0, 2, 3, 1}))
+                        : weight.cdata();
+      filter.reshape({C_out, C_in * K});
 
-    if (0 < bias.size()) {
-      auto b = bias.cdata();
-      dot += b;
-    }
+      xt::xarray<value_type> dot =
+          xt::xarray<value_type>::from_shape({col.shape()[0], C_out});
+      for (std::size_t g = 0; g < groups; g++) {
+        auto col_g =
+            group_columns(col, g, groups, C_in * groups, K, channels_last);
+        xt::xarray<value_type> filter_g = xt::view(
+            filter, xt::range(g * C_out_g, (g + 1) * C_out_g), xt::all());
+        xt::view(dot, xt::all(), xt::range(g * C_out_g, (g + 1) * C_out_g)) =
+            math::gemm(col_g, filter_g, false, true);
+      }
 
-    dot.reshape({N, H_out, W_out, C_out});
-    tensor::tensor_type result =
-        xt::transpose(std::move(dot), {0, 3, 1, 2}); // {N, C_out, H_out, W_out}
+      if (0 < bias.size()) {
+        auto b = bias.cdata();
+        dot += b;
+      }
 
-    tensor output{std::move(result), util::requires_grad(data, weight, bias)};
-    trace::register_node<convolution_2d>({data, weight, bias, stride.asTensor(),
-                                          padding.asTensor(),
-                                          dilation.asTensor()},
-                                         output);
+      dot.reshape({N, H_out, W_out, C_out});
+      if (channels_last) {
+        result = std::move(dot);
+      } else {
+        result = xt::transpose(std::move(dot), {0, 3, 1, 2});
+      }
+    } else if (channels_last) {
+      auto col = im2col_nhwc(data.cdata(), weight.shape(), stride, padding);
 
-    return output;
+      xt::xarray<value_type> dot;
+      if (const auto *sparse =
+              sparse_filter(weight, true, kernel::kBsrMaxDensity)) {
+        dot = sparse_dot(col, *sparse, bias);
+      } else {
+        // {C_out, H_f * W_f * C_in} to match the window order of
+        // im2col_nhwc, packed transposed. rebuilt only when the weight
+        // changes.
+        const std::size_t Cols = H_f * W_f * C_in;
+        const auto &filter = weight.packed(
+            kPackedFilterNHWC, [&](const tensor::tensor_type &w) {
+              xt::xarray<tensor::value_type> f =
+                  xt::transpose(w, {0, 2, 3, 1});
+              return kernel::pack_matrix(true, Cols, C_out, f.data(), Cols);
+            });
+
+        // rows are already {N, H_out, W_out}, so no transpose is needed.
+        dot = math::gemm(col, filter);
+
+        if (0 < bias.size()) {
+          auto b = bias.cdata();
+          dot += b;
+        }
+      }
+
+      dot.reshape({N, H_out, W_out, C_out});
+      result = std::move(dot);
+    } else {
+      auto col =
+          im2col(data.cdata(), weight.shape(), stride, padding, dilation);
+
+      // shape is {N * H_out * W_out, C_out}
+      xt::xarray<value_type> dot;
+      if (const auto *sparse =
+              sparse_filter(weight, false, kernel::kBsrMaxDensity)) {
+        dot = sparse_dot(col, *sparse, bias);
+      } else {
+        // filter size for im2col is {C_out, C_in * H_f * W_f}, which is the
+        // weight's own storage. it is packed transposed, once per version.
+        const std::size_t Cols = C_in * H_f * W_f;
+        const auto &filter =
+            weight.packed(kPackedFilter, [&](const tensor::tensor_type &w) {
+              return kernel::pack_matrix(true, Cols, C_out, w.data(), Cols);
+            });
+
+        dot = math::gemm(col, filter);
+
+        if (0 < bias.size()) {
+          auto b = bias.cdata();
+          dot += b;
+        }
+      }
+
+      dot.reshape({N, H_out, W_out, C_out});
+      result = xt::transpose(std::move(dot),
+                             {0, 3, 1, 2}); // {N, C_out, H_out, W_out}
+    }
+
+    return result;
+  }
+
+  static kernel::conv2d_geometry depthwise_geometry(const tensor &data,
+                                                    const tensor &weight,
+                                                    exarray<2> stride,
+                                                    exarray<2> padding) {
+    const bool channels_last = data.format() == memory_format::kNHWC;
+    const auto x_shape = data.shape();
+    return {x_shape[NCHW::N],
+            x_shape[channels_last ? NHWC::C : NCHW::C],
+            x_shape[channels_last ? NHWC::H : NCHW::H],
+            x_shape[channels_last ? NHWC::W : NCHW::W],
+            weight.shape()[0],
+            weight.shape()[2],
+            weight.shape()[3],
+            stride.get<0>(),
+            stride.get<1>(),
+            padding.get<0>(),
+            padding.get<1>()};
   }
 
   static void backward(const std::vector<tensor> &outputs,
-                       std::vector<tensor> &inputs) {
+                       std::vector<tensor> &inputs,
+                       const grad_mask &mask = {}) {
     // std::cout << "conv2d backward()" << std::endl;
     assert(outputs.size() == 1);
-    assert(inputs.size() == 6);
+    assert(inputs.size() == 6 || inputs.size() == 7);
+
+    const bool grad_x = needs_grad(mask, inputs, 0);
+    const bool grad_w = needs_grad(mask, inputs, 1);
+    const bool grad_b = needs_grad(mask, inputs, 2);
+
+    const std::size_t groups =
+        inputs.size() == 7 ? exarray<1>{inputs[6]}.get<0>() : 1;
+    if (is_depthwise(inputs[1], groups)) {
+      backward_depthwise(outputs, inputs, grad_x, grad_w, grad_b);
+      return;
+    }
 
     auto gy = outputs[0].cgrad(); // {N, C_out, (H_in + pad*2 - H_f)/stride +
                                   // 1, (W_in + pad*2 - W_f)/stride + 1}
@@ -210,31 +804,42 @@ public:
     // std::cout << shape2string(outputs[0].cdata().shape()) << std::endl;
     // std::cout << shape2string(outputs[0].cgrad().shape()) << std::endl;
 
+    const bool channels_last = data.format() == memory_format::kNHWC;
+
     std::vector<std::size_t> y_shape = outputs[0].shape();
     assert(y_shape[NCHW::N] == data.shape()[NCHW::N]);
 
     std::size_t N = y_shape[NCHW::N];
-    std::size_t C_out = y_shape[NCHW::C];
-    std::size_t C_in = data.shape()[NCHW::C];
+    std::size_t C_out = weight.shape()[0];
+    std::size_t C_in = weight.shape()[1];
 
-    gy = xt::transpose(gy, {0, 2, 3, 1});
+    if (!channels_last) {
+      gy = xt::transpose(gy, {0, 2, 3, 1});
+    }
     gy.reshape({-1, (int)C_out}); // {N * H_out * W_out, C_out}
 
     // db
-    if (0 < bias.size() && bias.requires_grad()) {
-      assert(y_shape[NCHW::C] == bias.shape()[0]);
+    if (grad_b) {
+      assert(C_out == bias.shape()[0]);
       auto &db = bias.grad();
       db = xt::sum(gy, {0});
       // std::cout << "db\n" << db << std::endl << std::endl;
     }
 
-    if (data.requires_grad() || weight.requires_grad()) {
+    if (1 < groups && (grad_x || grad_w)) {
+      backward_grouped(gy, inputs, groups, grad_x, grad_w);
+      return;
+    }
+
+    if (grad_x || grad_w) {
       // {N * H_out * W_out, H_f * W_f * C_in}
-      xt::xtensor<value_type, 2> col =
-          im2col(data.data(), weight.shape(), stride, padding, dilation);
+      xt::xarray<value_type> col =
+          channels_last
+              ? im2col_nhwc(data.data(), weight.shape(), stride, padding)
+              : im2col(data.data(), weight.shape(), stride, padding, dilation);
       // std::cout << "col shape: " << shape2string(col.shape()) << std::endl;
       // std::cout << "col\n" << xt::mean(col) << std::endl;
-      if (weight.requires_grad()) {
+      if (grad_w) {
         // dW
 
         // auto tcol = xt::transpose(col);
@@ -252,39 +857,344 @@ public:
         }
         */
 
-        auto &&dW =
-            xt::linalg::dot(xt::transpose(col),
-                            gy); // {Cols, N * H_out * W_out} x {N * H_out
-                                 // * W_out, C_out} --> {Cols, C_out}
+        // {C_out, N * H_out * W_out} x {N * H_out * W_out, Cols}
+        // --> {C_out, Cols}
+        auto dW = math::gemm(gy, col, true, false);
         // std::cout << "dW shape: " << shape2string(dW.shape()) << std::endl;
         // std::cout << "dW\n" << xt::mean(dW, {0}) << std::endl << std::endl;
 
-        dW = xt::transpose(dW, {1, 0});
-
         assert(dW.shape()[0] == C_out);
         assert(dW.shape()[1] == C_in * H_f * W_f);
 
-        dW.reshape({(int)C_out, (int)C_in, -1});
-        dW.reshape({C_out, C_in, H_f, W_f});
-        inputs[1].set_grad(std::move(dW));
+        if (channels_last) {
+          dW.reshape({C_out, H_f, W_f, C_in});
+          inputs[1].set_grad(xt::transpose(dW, {0, 3, 1, 2}));
+        } else {
+          dW.reshape({(int)C_out, (int)C_in, -1});
+          dW.reshape({C_out, C_in, H_f, W_f});
+          inputs[1].set_grad(std::move(dW));
+        }
       }
-      if (data.requires_grad()) {
-        xt::xarray<tensor::value_type> filter = weight.cdata();
-        filter.reshape({(int)C_out, -1});
-
-        // std::cout << "filter: " << filter << std::endl;
-        // std::cout << "gy: " << gy << std::endl;
-        auto dcol = xt::linalg::dot(
-            gy, filter); // {N * H_out * W_out, C_out} x {C_out, Cols}
+      if (grad_x) {
+        xt::xarray<tensor::value_type> dcol;
+        if (const auto *sparse = sparse_filter(weight, channels_last,
+                                               kernel::kBsrMaxDensityNt)) {
+          dcol = xt::xarray<tensor::value_type>::from_shape(
+              {gy.shape()[0], sparse->k});
+          kernel::bsr_gemm_nt(gy.shape()[0], gy.data(), C_out, *sparse,
+                              dcol.data(), sparse->k);
+        } else {
+          xt::xarray<tensor::value_type> filter =
+              channels_last ? xt::xarray<tensor::value_type>(
+                                  xt::transpose(weight.cdata(), {0, 2, 3, 1}))
+                            : weight.cdata();
+          filter.reshape({(int)C_out, -1});
+
+          // std::cout << "filter: " << filter << std::endl;
+          // std::cout << "gy: " << gy << std::endl;
+          dcol = math::gemm(
+              gy, filter); // {N * H_out * W_out, C_out} x {C_out, Cols}
+        }
         // std::cout << "dcol: " << dcol << std::endl;
 
-        dx = col2im(dcol, data.shape(), weight.shape(), stride, padding,
-                    dilation);
+        if (channels_last) {
+          dx = col2im_nhwc(dcol, data.shape(), weight.shape(), stride,
+                           padding);
+        } else {
+          dx = col2im(dcol, data.shape(), weight.shape(), stride, padding,
+                      dilation);
+        }
         // std::cout << "dX\n" << xt::mean(dx) << std::endl << std::endl;
         // inputs[0].set_grad(dx);
       }
     }
   }
+
+private:
+  // gy is {N * H_out * W_out, C_out}. mirrors the grouped forward: one GEMM
+  // per group for dW and for the columns of dx.
+  static void backward_grouped(const xt::xarray<tensor::value_type> &gy,
+                               std::vector<tensor> &inputs,
+                               const std::size_t groups, const bool grad_x,
+                               const bool grad_w) {
+    auto &data = inputs[0];
+    auto &weight = inputs[1];
+    auto stride = exarray<2>{inputs[3]};
+    auto padding = exarray<2>{inputs[4]};
+    auto dilation = exarray<2>{inputs[5]};
+
+    const bool channels_last = data.format() == memory_format::kNHWC;
+    const std::size_t C_out = weight.shape()[0];
+    const std::size_t C_in_g = weight.shape()[1];
+    const std::size_t H_f = weight.shape()[2];
+    const std::size_t W_f = weight.shape()[3];
+    const std::size_t C_in = C_in_g * groups;
+    const std::size_t C_out_g = C_out / groups;
+    const std::size_t K = H_f * W_f;
+
+    std::vector<std::size_t> x_weight_shape = {C_out, C_in, H_f, W_f};
+    xt::xarray<value_type> col =
+        channels_last
+            ? im2col_nhwc(data.data(), x_weight_shape, stride, padding)
+            : im2col(data.data(), x_weight_shape, stride, padding, dilation);
+
+    xt::xarray<tensor::value_type> filter =
+        channels_last ? xt::xarray<tensor::value_type>(
+                            xt::transpose(weight.cdata(), {0, 2, 3, 1}))
+                      : weight.cdata();
+    filter.reshape({C_out, C_in_g * K});
+
+    xt::xarray<value_type> dW =
+        xt::xarray<value_type>::from_shape({C_out, C_in_g * K});
+    xt::xarray<value_type> dcol =
+        grad_x ? xt::xarray<value_type>(xt::zeros<value_type>(
+                                   {col.shape()[0], C_in * K}))
+                             : xt::xarray<value_type>{};
+
+    for (std::size_t g = 0; g < groups; g++) {
+      auto out_range = xt::range(g * C_out_g, (g + 1) * C_out_g);
+      xt::xarray<value_type> gy_g = xt::view(gy, xt::all(), out_range);
+      if (grad_w) {
+        auto col_g = group_columns(col, g, groups, C_in, K, channels_last);
+        // {C_out_g, rows} x {rows, C_in_g * K} --> {C_out_g, C_in_g * K}
+        xt::view(dW, out_range, xt::all()) =
+            math::gemm(gy_g, col_g, true, false);
+      }
+      if (grad_x) {
+        xt::xarray<value_type> filter_g =
+            xt::view(filter, out_range, xt::all());
+        xt::xarray<value_type> dcol_g = math::gemm(gy_g, filter_g);
+        scatter_group_columns(dcol, dcol_g, g, groups, C_in, K, channels_last);
+      }
+    }
+
+    if (grad_w) {
+      if (channels_last) {
+        dW.reshape({C_out, H_f, W_f, C_in_g});
+        weight.set_grad(xt::transpose(dW, {0, 3, 1, 2}));
+      } else {
+        dW.reshape({C_out, C_in_g, H_f, W_f});
+        weight.set_grad(std::move(dW));
+      }
+    }
+    if (grad_x) {
+      if (channels_last) {
+        data.grad() = col2im_nhwc(dcol, data.shape(), x_weight_shape, stride,
+                                  padding);
+      } else {
+        data.grad() = col2im(dcol, data.shape(), x_weight_shape, stride,
+                             padding, dilation);
+      }
+    }
+  }
+
+  // the direct kernels overwrite the gradient buffers in place.
+  static void backward_depthwise(const std::vector<tensor> &outputs,
+                                 std::vector<tensor> &inputs,
+                                 const bool grad_x, const bool grad_w,
+                                 const bool grad_b) {
+    auto &data = inputs[0];
+    auto &weight = inputs[1];
+    auto &bias = inputs[2];
+    auto stride = exarray<2>{inputs[3]};
+    auto padding = exarray<2>{inputs[4]};
+
+    const bool channels_last = data.format() == memory_format::kNHWC;
+    tensor y = outputs[0];
+    const auto &gy = y.grad();
+
+    if (grad_b) {
+      if (channels_last) {
+        bias.grad() = xt::sum(gy, {0, 1, 2});
+      } else {
+        bias.grad() = xt::sum(gy, {0, 2, 3});
+      }
+    }
+
+    value_type *gx = grad_x ? data.grad().data() : nullptr;
+    value_type *gw = grad_w ? weight.grad().data() : nullptr;
+    if (!gx && !gw) {
+      return;
+    }
+    const auto geometry = depthwise_geometry(data, weight, stride, padding);
+    if (channels_last) {
+      kernel::depthwise_backward_nhwc(data.data().data(), weight.data().data(),
+                                      gy.data(), gx, gw, geometry);
+    } else {
+      kernel::depthwise_backward_nchw(data.data().data(), weight.data().data(),
+                                      gy.data(), gx, gw, geometry);
+    }
+  }
+};
+
+// gradient of convolution_2d with respect to its input, used as a layer.
+// weight is {C_in, C_out, H_f, W_f} and the output is
+// H_out = (H - 1) * stride - 2 * padding + H_f + out_padding. every input
+// pixel is scattered into its output window with one GEMM and col2im, so the
+// input is never upsampled with inserted zeros.
+class convolution_transpose_2d : virtual public traceable_function {
+public:
+  convolution_transpose_2d() : traceable_function{1} {
+    set_name("convolution_transpose_2d");
+  }
+  ~convolution_transpose_2d() = default;
+
+  static constexpr int kPackedFilter = 1;
+  static constexpr int kPackedFilterNHWC = 2;
+
+  static tensor forward(const tensor &data, const tensor &weight,
+                        const tensor &bias, exarray<2> stride = 1,
+                        exarray<2> padding = 0, exarray<2> out_padding = 0) {
+    assert(data.shape().size() == 4);
+    assert(weight.shape().size() == 4);
+
+    const bool channels_last = data.format() == memory_format::kNHWC;
+    const auto x_shape = data.shape();
+    const std::size_t N = x_shape[NCHW::N];
+    const std::size_t C_in = weight.shape()[0];
+    const std::size_t C_out = weight.shape()[1];
+    const std::size_t H_f = weight.shape()[2];
+    const std::size_t W_f = weight.shape()[3];
+    const std::size_t H = x_shape[channels_last ? NHWC::H : NCHW::H];
+    const std::size_t W = x_shape[channels_last ? NHWC::W : NCHW::W];
+
+    assert(x_shape[channels_last ? NHWC::C : NCHW::C] == C_in);
+    assert(bias.size() == 0 || bias.shape()[0] == C_out);
+    assert(out_padding.get<0>() < stride.get<0>() &&
+           out_padding.get<1>() < stride.get<1>());
+
+    const std::size_t H_out = (H - 1) * stride.get<0>() + H_f +
+                              out_padding.get<0>() - 2 * padding.get<0>();
+    const std::size_t W_out = (W - 1) * stride.get<1>() + W_f +
+                              out_padding.get<1>() - 2 * padding.get<1>();
+
+    // {N * H * W, C_in} x {C_in, Cols} --> {N * H * W, Cols}
+    auto x = rows(data.cdata(), channels_last);
+    const auto &w = weight.packed(
+        channels_last ? kPackedFilterNHWC : kPackedFilter,
+        [&](const tensor::tensor_type &weight_data) {
+          auto f = filter(weight_data, channels_last);
+          return kernel::pack_matrix(false, f.shape()[0], f.shape()[1],
+                                     f.data(), f.shape()[1]);
+        });
+    auto col = math::gemm(x, w);
+
+    tensor::tensor_type result;
+    if (channels_last) {
+      std::vector<std::size_t> y_shape = {N, H_out, W_out, C_out};
+      result =
+          col2im_nhwc(col, y_shape, weight.shape(), stride, padding);
+      if (0 < bias.size()) {
+        result += bias.cdata();
+      }
+    } else {
+      std::vector<std::size_t> y_shape = {N, C_out, H_out, W_out};
+      result = col2im(col, y_shape, weight.shape(), stride, padding);
+      if (0 < bias.size()) {
+        auto b = bias.cdata();
+        b.reshape({1, static_cast<int>(C_out), 1, 1});
+        result += b;
+      }
+    }
+
+    tensor output{std::move(result), util::requires_grad(data, weight, bias)};
+    output.set_format(data.format());
+    trace::register_node<convolution_transpose_2d>(
+        {data, weight, bias, stride.asTensor(), padding.asTensor(),
+         out_padding.asTensor()},
+        output);
+    return output;
+  }
+
+  static void backward(const std::vector<tensor> &outputs,
+                       std::vector<tensor> &inputs,
+                       const grad_mask &mask = {}) {
+    assert(outputs.size() == 1);
+    assert(inputs.size() == 6);
+
+    const bool grad_x = needs_grad(mask, inputs, 0);
+    const bool grad_w = needs_grad(mask, inputs, 1);
+
+    auto &data = inputs[0];
+    auto &weight = inputs[1];
+    auto &bias = inputs[2];
+    auto stride = exarray<2>{inputs[3]};
+    auto padding = exarray<2>{inputs[4]};
+
+    const bool channels_last = data.format() == memory_format::kNHWC;
+    const std::size_t C_in = weight.shape()[0];
+    const std::size_t C_out = weight.shape()[1];
+    const std::size_t H_f = weight.shape()[2];
+    const std::size_t W_f = weight.shape()[3];
+    const auto gy = outputs[0].cgrad();
+
+    if (needs_grad(mask, inputs, 2)) {
+      if (channels_last) {
+        bias.grad() = xt::sum(gy, {0, 1, 2});
+      } else {
+        bias.grad() = xt::sum(gy, {0, 2, 3});
+      }
+    }
+    if (!grad_x && !grad_w) {
+      return;
+    }
+
+    // the windows of gy are exactly the columns the forward GEMM produced.
+    // {N * H * W, Cols}
+    xt::xarray<value_type> col =
+        channels_last ? im2col_nhwc(gy, weight.shape(), stride, padding)
+                      : im2col(gy, weight.shape(), stride, padding);
+
+    if (grad_x) {
+      // {N * H * W, Cols} x {Cols, C_in}
+      xt::xarray<value_type> dx =
+          math::gemm(col, filter(weight.cdata(), channels_last), false, true);
+      const auto x_shape = data.shape();
+      if (channels_last) {
+        dx.reshape(x_shape);
+        data.grad() = std::move(dx);
+      } else {
+        dx.reshape({x_shape[NCHW::N], x_shape[NCHW::H], x_shape[NCHW::W],
+                    C_in});
+        data.grad() = xt::transpose(dx, {0, 3, 1, 2});
+      }
+    }
+    if (grad_w) {
+      // {C_in, N * H * W} x {N * H * W, Cols}
+      auto x = rows(data.cdata(), channels_last);
+      xt::xarray<value_type> dW = math::gemm(x, col, true, false);
+      if (channels_last) {
+        dW.reshape({C_in, H_f, W_f, C_out});
+        weight.set_grad(xt::transpose(dW, {0, 3, 1, 2}));
+      } else {
+        dW.reshape({C_in, C_out, H_f, W_f});
+        weight.set_grad(std::move(dW));
+      }
+    }
+  }
+
+private:
+  // {N * H * W, C_in}
+  static xt::xarray<tensor::value_type>
+  rows(xt::xarray<tensor::value_type> x, const bool channels_last) {
+    const std::size_t C = x.shape()[channels_last ? NHWC::C : NCHW::C];
+    if (!channels_last) {
+      x = xt::transpose(x, {0, 2, 3, 1});
+    }
+    x.reshape({x.size() / C, C});
+    return x;
+  }
+
+  // {C_in, Cols} with columns in the window order of im2col / im2col_nhwc.
+  static xt::xarray<tensor::value_type>
+  filter(xt::xarray<tensor::value_type> w, const bool channels_last) {
+    const std::size_t C_in = w.shape()[0];
+    if (channels_last) {
+      w = xt::transpose(w, {0, 2, 3, 1});
+    }
+    w.reshape({C_in, w.size() / C_in});
+    return w;
+  }
 };
 } // namespace function
 } // namespace kuu
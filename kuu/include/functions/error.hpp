@@ -33,10 +33,17 @@ public:
   }
 
   static void backward(const std::vector<tensor> &outputs,
-                       std::vector<tensor> &inputs) {
+                       std::vector<tensor> &inputs,
+                       const grad_mask &mask = {}) {
     assert(inputs.size() == 2);
     assert(outputs.size() == 1);
 
+    const bool grad_x0 = needs_grad(mask, inputs, 0);
+    const bool grad_x1 = needs_grad(mask, inputs, 1);
+    if (!grad_x0 && !grad_x1) {
+      return;
+    }
+
     const auto &x0 = inputs[0].data();
     const auto &x1 = inputs[1].data();
     auto gy = outputs[0].cgrad();
@@ -48,10 +55,10 @@ public:
 
     std::cout << "gx\n" << xt::mean(gx, {0}) << std::endl;
 
-    if (inputs[0].requires_grad()) {
+    if (grad_x0) {
       inputs[0].set_grad(gx.reshape(inputs[0].shape()));
     }
-    if (inputs[1].requires_grad()) {
+    if (grad_x1) {
       inputs[1].set_grad(std::move(-gx.reshape(inputs[1].shape())));
     }
   }
@@ -1,18 +1,55 @@
 #ifndef KUU_FUNCTIONS_LINEAR_HPP
 #define KUU_FUNCTIONS_LINEAR_HPP
 
+#include "exarray.hpp"
 #include "function.hpp"
+#include "kernels/activation.hpp"
+#include "math.hpp"
+#include "sparse_tensor.hpp"
+#include <algorithm>
 #include <fstream>
-#include <xtensor-blas/xlinalg.hpp>
+#include <memory>
 #include <xtensor/xcsv.hpp>
 
 namespace kuu {
+using activation = kernel::activation;
+
 namespace function {
+
+// rows of a weight gradient that the last sparse backward wrote, and the
+// buffer they are in. given to linear::forward over a sparse input, it lets
+// the next backward reuse that buffer and clear only these rows instead of
+// allocating a dense zero gradient.
+struct sparse_grad_rows {
+  const value_type *grad = nullptr;
+  std::vector<std::size_t> rows;
+};
+
 struct linear : public virtual traceable_function {
   using self_type = function::linear;
 
   linear() : traceable_function{1} { set_name("function-linear"); }
 
+  // tag of the weight's packed GEMM operand
+  static constexpr int kPackedWeight = 1;
+  // tag of the weight's block sparse operand
+  static constexpr int kSparseWeight = 1;
+
+  // the weight in block sparse form when it is masked and sparse enough for
+  // the block kernels to pay off, null otherwise.
+  static const kernel::bsr_matrix *sparse_weight(const tensor &weight,
+                                                 const double max_density) {
+    if (!weight.mask()) {
+      return nullptr;
+    }
+    const auto &S =
+        weight.packed_sparse(kSparseWeight, [](const tensor_type &w) {
+          return kernel::pack_bsr(false, w.shape()[0], w.shape()[1], w.data(),
+                                  w.shape()[1]);
+        });
+    return S.density() <= max_density ? &S : nullptr;
+  }
+
   static tensor forward(const tensor &input, const tensor &weight,
                         const tensor &bias = tensor{}) {
     assert(!input.is_empty());
@@ -22,17 +59,34 @@ struct linear : public virtual traceable_function {
     assert(weight.shape()[0] == input.size() / input.shape()[0]);
     auto x = input.cdata();
     if (2 < x.dimension()) {
+      // features are flattened in storage order, i.e. {H, W, C} for a
+      // channels-last input. no layout shuffle is needed before the GEMM.
       x.reshape({(int)input.shape()[0], -1}); // n, in
     }
-    xt::xtensor<value_type, 2> W = weight.cdata(); // in, out
+    tensor_type y;
+    if (const auto *S = sparse_weight(weight, kernel::kBsrMaxDensity)) {
+      // pruned blocks of the weight are skipped
+      const std::size_t n = x.shape()[0];
+      y = tensor_type::from_shape({n, S->n});
+      tensor b = bias; // shallow, for the raw pointer
+      kernel::bsr_gemm(n, x.data(), S->k, *S,
+                       bias.is_empty() ? nullptr : b.data().data(), y.data(),
+                       S->n);
+    } else {
+      // {in, out} is already the B operand; it is packed once per version.
+      const auto &W = weight.packed(kPackedWeight, [](const tensor_type &w) {
+        return kernel::pack_matrix(false, w.shape()[0], w.shape()[1],
+                                   w.data(), w.shape()[1]);
+      });
 
-    auto y = xt::linalg::dot(x, W); // n, out
+      y = math::gemm(x, W); // n, out
 
-    if (!bias.is_empty()) {
-      assert(bias.shape()[0] == weight.shape()[1]);
-      auto b = bias.cdata();
-      b.reshape({1, bias.shape()[0]}); // {out} to {1, out}
-      y += b;
+      if (!bias.is_empty()) {
+        assert(bias.shape()[0] == weight.shape()[1]);
+        auto b = bias.cdata();
+        b.reshape({1, bias.shape()[0]}); // {out} to {1, out}
+        y += b;
+      }
     }
     tensor output{std::move(y), util::requires_grad(input, weight, bias)};
     assert(output.shape()[0] == input.shape()[0]);
@@ -43,8 +97,88 @@ struct linear : public virtual traceable_function {
     return output;
   }
 
+  // sparse input {n, in} through the CSR kernel. the input is captured by the
+  // backward closure rather than being a graph input, and only the rows of
+  // the weight gradient that some sample uses are computed. with `written`,
+  // the weight gradient is kept across backward passes, see
+  // sparse_grad_rows.
+  static tensor
+  forward(const sparse_tensor &input, const tensor &weight,
+          const tensor &bias = tensor{},
+          std::shared_ptr<sparse_grad_rows> written = nullptr) {
+    assert(!weight.is_empty());
+    assert(weight.shape().size() == 2);
+    assert(weight.shape()[0] == input.cols());
+    const std::size_t out = weight.shape()[1];
+    auto y = tensor_type::from_shape({input.rows(), out});
+    tensor w = weight; // shallow, for the raw pointer
+    kernel::spmm(input.view(), w.data().data(), out, out, y.data(), out);
+
+    if (!bias.is_empty()) {
+      assert(bias.shape()[0] == out);
+      auto b = bias.cdata();
+      b.reshape({1, out});
+      y += b;
+    }
+    tensor output{std::move(y), util::requires_grad(weight, bias)};
+
+    trace::register_node<self_type>(
+        {weight, bias}, output,
+        [input, written](const std::vector<tensor> &outputs,
+                         std::vector<tensor> &inputs, const grad_mask &mask) {
+          backward_sparse(input, written.get(), outputs, inputs, mask);
+        });
+
+    return output;
+  }
+
+  // inputs are {weight, bias}. written may be null.
+  static void backward_sparse(const sparse_tensor &input,
+                              sparse_grad_rows *written,
+                              const std::vector<tensor> &outputs,
+                              std::vector<tensor> &inputs,
+                              const grad_mask &mask = {}) {
+    assert(outputs.size() == 1);
+    assert(inputs.size() == 2);
+    tensor y = outputs[0];
+    const auto &gy = y.grad(); // n, out
+
+    // db
+    if (needs_grad(mask, inputs, 1)) {
+      auto gb = xt::sum(gy, {0}); // out
+      inputs[1].set_grad(std::move(gb));
+    }
+
+    // dW, {in, out}, zero but for the rows of the active features
+    if (needs_grad(mask, inputs, 0)) {
+      const std::size_t out = gy.shape()[1];
+      const auto shape = inputs[0].shape();
+      auto &gW = inputs[0].get()->grad;
+      // the buffer is ours from the last pass unless something else has
+      // set the gradient since
+      const bool reuse =
+          written && written->grad == gW.data() &&
+          std::vector<std::size_t>(gW.shape().begin(), gW.shape().end()) ==
+              shape;
+      if (reuse) {
+        for (const std::size_t k : written->rows) {
+          std::fill_n(gW.data() + k * out, out, value_type{0});
+        }
+      } else {
+        inputs[0].set_grad(tensor_type(xt::zeros<value_type>(shape)));
+      }
+      auto active = kernel::spmm_transposed(input.view(), gy.data(), out, out,
+                                            gW.data(), out);
+      if (written) {
+        written->grad = gW.data();
+        written->rows = std::move(active);
+      }
+    }
+  }
+
   static void backward(const std::vector<tensor> &outputs,
-                       std::vector<tensor> &inputs) {
+                       std::vector<tensor> &inputs,
+                       const grad_mask &mask = {}) {
     assert(outputs.size() == 1);
     assert(inputs.size() == 3);
 
@@ -57,29 +191,172 @@ struct linear : public virtual traceable_function {
     auto gy = outputs[0].cgrad();  // n, out
 
     // db
-    if (!inputs[2].is_empty()) {
-      tensor &bias = inputs[2];
+    if (needs_grad(mask, inputs, 2)) {
       auto gb = xt::sum(gy, {0}); // out
       inputs[2].set_grad(std::move(gb));
     }
 
     // dW
-    if (2 < x_shape.size()) {
-      x.reshape({(int)x_shape[0], -1});
+    if (needs_grad(mask, inputs, 1)) {
+      if (2 < x_shape.size()) {
+        x.reshape({(int)x_shape[0], -1});
+      }
+      auto gW = math::gemm(x, gy, true, false); // in, out
+      inputs[1].set_grad(std::move(gW));
+      if (2 < x_shape.size()) {
+        x.reshape(x_shape);
+      }
     }
 
-    auto gW = xt::linalg::dot(xt::transpose(x),
-                              gy); // in, out
-    inputs[1].set_grad(std::move(gW));
-
     // dx
-    auto gx = xt::linalg::dot(gy, xt::transpose(W)); // n, in
-    if (2 < x_shape.size()) {
+    if (needs_grad(mask, inputs, 0)) {
+      tensor_type gx;
+      if (const auto *S = sparse_weight(weight, kernel::kBsrMaxDensityNt)) {
+        gx = tensor_type::from_shape({gy.shape()[0], S->k});
+        kernel::bsr_gemm_nt(gy.shape()[0], gy.data(), S->n, *S, gx.data(),
+                            S->k);
+      } else {
+        gx = math::gemm(gy, W, false, true); // n, in
+      }
+      if (2 < x_shape.size()) {
+        gx.reshape(x_shape);
+      }
+      inputs[0].set_grad(std::move(gx));
+    }
+  }
+};
 
-      gx.reshape(x_shape);
-      x.reshape(x_shape);
+// linear followed by bias and an activation, all applied in the GEMM's
+// epilogue. backward keeps what the activation's gradient needs, as the
+// activation functions do: a bit per element of z > 0 for ReLU, and the
+// output for sigmoid. GELU's gradient needs z, which the epilogue
+// overwrites, so the epilogue writes gelu'(z) for it instead, one float per
+// element like the input that gelu keeps.
+struct fused_linear : public virtual traceable_function {
+  using self_type = function::fused_linear;
+
+  fused_linear() : traceable_function{1} { set_name("function-fused-linear"); }
+
+  // saved by forward for backward, besides the graph inputs
+  struct saved_activation {
+    kernel::activation act = kernel::activation::kNone;
+    std::vector<kernel::mask_word> bits; // ReLU
+    tensor_type derivative;              // GELU
+  };
+
+  static tensor forward(const tensor &input, const tensor &weight,
+                        const tensor &bias, const kernel::activation act) {
+    assert(!input.is_empty());
+    assert(!weight.is_empty());
+    assert(weight.shape().size() == 2);
+    assert(weight.shape()[0] == input.size() / input.shape()[0]);
+    auto x = input.cdata();
+    if (2 < x.dimension()) {
+      x.reshape({(int)input.shape()[0], -1}); // n, in
+    }
+    const auto &W =
+        weight.packed(linear::kPackedWeight, [](const tensor_type &w) {
+          return kernel::pack_matrix(false, w.shape()[0], w.shape()[1],
+                                     w.data(), w.shape()[1]);
+        });
+
+    const bool requires_grad = util::requires_grad(input, weight, bias);
+    auto saved = std::make_shared<saved_activation>();
+    saved->act = act;
+    kernel::gemm_epilogue epilogue{nullptr, act, nullptr};
+    tensor b = bias; // shallow, for the raw pointer
+    if (!bias.is_empty()) {
+      assert(bias.shape()[0] == weight.shape()[1]);
+      epilogue.bias = b.data().data();
+    }
+    if (requires_grad && act == kernel::activation::kGELU) {
+      saved->derivative =
+          tensor_type::from_shape({input.shape()[0], weight.shape()[1]});
+      epilogue.derivative = saved->derivative.data();
+    }
+
+    auto y = math::gemm(x, W, false, epilogue); // n, out
+    if (requires_grad && act == kernel::activation::kReLU) {
+      // y = max(z, 0) is positive where z is, and relu leaves it as it is
+      saved->bits.resize(kernel::mask_words(y.size()));
+      kernel::relu(y.data(), y.size(), y.data(), saved->bits.data());
+    }
+    tensor output{std::move(y), requires_grad};
+
+    trace::register_node<self_type>(
+        {input, weight, bias}, output,
+        [saved](const std::vector<tensor> &outputs,
+                std::vector<tensor> &inputs, const grad_mask &mask) {
+          backward(*saved, outputs, inputs, mask);
+        });
+    if (act == kernel::activation::kSigmoid) {
+      trace::retain_saved_data(output); // read by backward
+    }
+
+    return output;
+  }
+
+  static void backward(const saved_activation &saved,
+                       const std::vector<tensor> &outputs,
+                       std::vector<tensor> &inputs,
+                       const grad_mask &mask = {}) {
+    assert(outputs.size() == 1);
+    assert(inputs.size() == 3);
+
+    tensor &input = inputs[0];
+    tensor &weight = inputs[1];
+
+    auto &x = input.data(); // n, in
+    auto x_shape = x.shape();
+    const auto &W = weight.data(); // in, out
+    auto gz = outputs[0].cgrad();  // n, out
+
+    // through the activation
+    switch (saved.act) {
+    case kernel::activation::kNone:
+      break;
+    case kernel::activation::kReLU:
+      assert(saved.bits.size() == kernel::mask_words(gz.size()));
+      kernel::masked_grad(gz.data(), saved.bits.data(), gz.size(), 0.f,
+                          gz.data());
+      break;
+    case kernel::activation::kSigmoid: {
+      tensor output = outputs[0]; // shallow, for the raw pointer
+      kernel::sigmoid_grad(output.data().data(), gz.data(), gz.size(),
+                           gz.data());
+      break;
+    }
+    case kernel::activation::kGELU:
+      gz *= saved.derivative;
+      break;
+    }
+
+    // db
+    if (needs_grad(mask, inputs, 2)) {
+      auto gb = xt::sum(gz, {0}); // out
+      inputs[2].set_grad(std::move(gb));
+    }
+
+    // dW
+    if (needs_grad(mask, inputs, 1)) {
+      if (2 < x_shape.size()) {
+        x.reshape({(int)x_shape[0], -1});
+      }
+      auto gW = math::gemm(x, gz, true, false); // in, out
+      inputs[1].set_grad(std::move(gW));
+      if (2 < x_shape.size()) {
+        x.reshape(x_shape);
+      }
+    }
+
+    // dx
+    if (needs_grad(mask, inputs, 0)) {
+      auto gx = math::gemm(gz, W, false, true); // n, in
+      if (2 < x_shape.size()) {
+        gx.reshape(x_shape);
+      }
+      inputs[0].set_grad(std::move(gx));
     }
-    inputs[0].set_grad(std::move(gx));
   }
 };
 
@@ -0,0 +1,205 @@
+#ifndef KUU_FUNCTIONS_MATMUL_HPP
+#define KUU_FUNCTIONS_MATMUL_HPP
+
+#include "function.hpp"
+#include "kernels/gemm.hpp"
+#include <algorithm>
+#include <cassert>
+#include <vector>
+#include <xtensor/xmath.hpp>
+
+namespace kuu {
+namespace function {
+
+// batched matrix product of a {..., M, K} and b {..., K, N}. the batch
+// dimensions broadcast as in numpy, and all products of the batch go
+// through one call of the batched GEMM, forward and backward.
+class matmul : public traceable_function {
+  using self_type = matmul;
+
+public:
+  matmul() : traceable_function{1} { set_name("function-matmul"); }
+
+  static tensor forward(const tensor &a, const tensor &b) {
+    assert(2 <= a.shape().size() && 2 <= b.shape().size());
+    const auto a_shape = a.shape();
+    const auto b_shape = b.shape();
+    const std::size_t M = a_shape[a_shape.size() - 2];
+    const std::size_t K = a_shape.back();
+    const std::size_t N = b_shape.back();
+    assert(b_shape[b_shape.size() - 2] == K);
+
+    const auto batch_shape = broadcast_batch(a_shape, b_shape);
+    const auto a_offsets = offsets(a_shape, batch_shape, M * K);
+    const auto b_offsets = offsets(b_shape, batch_shape, K * N);
+    const std::size_t batch = a_offsets.size();
+
+    std::vector<std::size_t> y_shape = batch_shape;
+    y_shape.push_back(M);
+    y_shape.push_back(N);
+    auto y = tensor_type::from_shape(y_shape);
+
+    tensor a_ = a, b_ = b; // shallow, for the raw pointers
+    std::vector<const value_type *> pa(batch), pb(batch);
+    std::vector<value_type *> pc(batch);
+    for (std::size_t i = 0; i < batch; i++) {
+      pa[i] = a_.data().data() + a_offsets[i];
+      pb[i] = b_.data().data() + b_offsets[i];
+      pc[i] = y.data() + i * M * N;
+    }
+    kernel::sgemm_batched(false, false, M, N, K, 1.f, pa.data(), K, pb.data(),
+                          N, 0.f, pc.data(), N, batch);
+
+    tensor output{std::move(y), util::requires_grad(a, b)};
+    trace::register_node<self_type>({a, b}, output);
+    return output;
+  }
+
+  static void backward(const std::vector<tensor> &outputs,
+                       std::vector<tensor> &inputs,
+                       const grad_mask &mask = {}) {
+    assert(outputs.size() == 1);
+    assert(inputs.size() == 2);
+
+    tensor y = outputs[0];
+    const auto &gy = y.grad();
+    const auto a_shape = inputs[0].shape();
+    const auto b_shape = inputs[1].shape();
+    const std::size_t M = a_shape[a_shape.size() - 2];
+    const std::size_t K = a_shape.back();
+    const std::size_t N = b_shape.back();
+
+    const auto batch_shape = broadcast_batch(a_shape, b_shape);
+    const auto a_offsets = offsets(a_shape, batch_shape, M * K);
+    const auto b_offsets = offsets(b_shape, batch_shape, K * N);
+    const std::size_t batch = a_offsets.size();
+
+    std::vector<const value_type *> pa(batch), pb(batch), pgy(batch);
+    for (std::size_t i = 0; i < batch; i++) {
+      pa[i] = inputs[0].data().data() + a_offsets[i];
+      pb[i] = inputs[1].data().data() + b_offsets[i];
+      pgy[i] = gy.data() + i * M * N;
+    }
+
+    // the gradients are computed per batch entry, then summed over the
+    // dimensions the operand was broadcast along.
+    if (needs_grad(mask, inputs, 0)) {
+      auto ga = expanded(batch_shape, M, K);
+      auto pga = pointers(ga, batch, M * K);
+      // {M, N} x {N, K}
+      kernel::sgemm_batched(false, true, M, K, N, 1.f, pgy.data(), N,
+                            pb.data(), N, 0.f, pga.data(), K, batch);
+      inputs[0].set_grad(reduce(std::move(ga), a_shape));
+    }
+    if (needs_grad(mask, inputs, 1)) {
+      auto gb = expanded(batch_shape, K, N);
+      auto pgb = pointers(gb, batch, K * N);
+      // {K, M} x {M, N}
+      kernel::sgemm_batched(true, false, K, N, M, 1.f, pa.data(), K,
+                            pgy.data(), N, 0.f, pgb.data(), N, batch);
+      inputs[1].set_grad(reduce(std::move(gb), b_shape));
+    }
+  }
+
+private:
+  static std::vector<std::size_t>
+  broadcast_batch(const std::vector<std::size_t> &a_shape,
+                  const std::vector<std::size_t> &b_shape) {
+    const std::size_t a_rank = a_shape.size() - 2;
+    const std::size_t b_rank = b_shape.size() - 2;
+    const std::size_t rank = std::max(a_rank, b_rank);
+    std::vector<std::size_t> batch_shape(rank);
+    for (std::size_t d = 0; d < rank; d++) {
+      const std::size_t da =
+          d + a_rank < rank ? 1 : a_shape[d + a_rank - rank];
+      const std::size_t db =
+          d + b_rank < rank ? 1 : b_shape[d + b_rank - rank];
+      assert(da == db || da == 1 || db == 1);
+      batch_shape[d] = std::max(da, db);
+    }
+    return batch_shape;
+  }
+
+  // offset of each matrix of an operand, for every index of the broadcast
+  // batch in row-major order. broadcast dimensions have stride 0.
+  static std::vector<std::size_t>
+  offsets(const std::vector<std::size_t> &shape,
+          const std::vector<std::size_t> &batch_shape,
+          const std::size_t matrix_size) {
+    const std::size_t rank = batch_shape.size();
+    const std::size_t own_rank = shape.size() - 2;
+    std::vector<std::size_t> strides(rank, 0);
+    std::size_t stride = matrix_size;
+    for (std::size_t d = rank; 0 < d--;) {
+      if (d + own_rank < rank) {
+        break;
+      }
+      const std::size_t n = shape[d + own_rank - rank];
+      strides[d] = n == 1 ? 0 : stride;
+      stride *= n;
+    }
+
+    std::size_t batch = 1;
+    for (auto n : batch_shape) {
+      batch *= n;
+    }
+    std::vector<std::size_t> result(batch);
+    std::vector<std::size_t> index(rank, 0);
+    for (std::size_t i = 0; i < batch; i++) {
+      std::size_t offset = 0;
+      for (std::size_t d = 0; d < rank; d++) {
+        offset += index[d] * strides[d];
+      }
+      result[i] = offset;
+      for (std::size_t d = rank; 0 < d--;) {
+        if (++index[d] < batch_shape[d]) {
+          break;
+        }
+        index[d] = 0;
+      }
+    }
+    return result;
+  }
+
+  static tensor_type expanded(std::vector<std::size_t> shape,
+                              const std::size_t rows, const std::size_t cols) {
+    shape.push_back(rows);
+    shape.push_back(cols);
+    return tensor_type::from_shape(shape);
+  }
+
+  static std::vector<value_type *>
+  pointers(tensor_type &x, const std::size_t batch,
+           const std::size_t matrix_size) {
+    std::vector<value_type *> result(batch);
+    for (std::size_t i = 0; i < batch; i++) {
+      result[i] = x.data() + i * matrix_size;
+    }
+    return result;
+  }
+
+  // sums a {batch..., rows, cols} gradient down to the operand's shape.
+  static tensor_type reduce(tensor_type g,
+                            const std::vector<std::size_t> &shape) {
+    const std::size_t rank = g.dimension() - 2;
+    const std::size_t own_rank = shape.size() - 2;
+    std::vector<std::size_t> axes;
+    for (std::size_t d = 0; d < rank; d++) {
+      if (d + own_rank < rank || shape[d + own_rank - rank] == 1) {
+        axes.push_back(d);
+      }
+    }
+    if (axes.empty()) {
+      g.reshape(shape);
+      return g;
+    }
+    tensor_type reduced = xt::sum(g, axes);
+    reduced.reshape(shape);
+    return reduced;
+  }
+};
+
+} // namespace function
+} // namespace kuu
+
+#endif // KUU_FUNCTIONS_MATMUL_HPP
@@ -0,0 +1,60 @@
+#ifndef KUU_FUNCTIONS_MEMORY_FORMAT_HPP
+#define KUU_FUNCTIONS_MEMORY_FORMAT_HPP
+
+#include "function.hpp"
+#include "layout.hpp"
+#include <cassert>
+#include <xtensor/xmanipulation.hpp>
+
+namespace kuu {
+namespace function {
+
+// converts a 4-d tensor between NCHW and NHWC. a network only needs one cast
+// at its input; every kernel downstream keeps the format of its input.
+class memory_format_cast : virtual public traceable_function {
+public:
+  memory_format_cast() : traceable_function{1} {
+    set_name("memory_format_cast");
+  }
+
+  static tensor forward(const tensor &input, const memory_format format) {
+    assert(input.dim() == 4);
+    if (input.format() == format) {
+      return input;
+    }
+
+    tensor::tensor_type y;
+    if (format == memory_format::kNHWC) {
+      y = xt::transpose(input.cdata(), {0, 2, 3, 1});
+    } else {
+      y = xt::transpose(input.cdata(), {0, 3, 1, 2});
+    }
+
+    tensor output{std::move(y), util::requires_grad(input)};
+    output.set_format(format);
+    trace::register_node<memory_format_cast>({input}, output);
+    return output;
+  }
+
+  static void backward(const std::vector<tensor> &outputs,
+                       std::vector<tensor> &inputs,
+                       const grad_mask &mask = {}) {
+    assert(outputs.size() == 1);
+    assert(inputs.size() == 1);
+
+    if (!needs_grad(mask, inputs, 0)) {
+      return;
+    }
+    auto gy = outputs[0].cgrad();
+    if (outputs[0].format() == memory_format::kNHWC) {
+      inputs[0].set_grad(xt::transpose(gy, {0, 3, 1, 2}));
+    } else {
+      inputs[0].set_grad(xt::transpose(gy, {0, 2, 3, 1}));
+    }
+  }
+};
+
+} // namespace function
+} // namespace kuu
+
+#endif // KUU_FUNCTIONS_MEMORY_FORMAT_HPP
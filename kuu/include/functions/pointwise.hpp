@@ -0,0 +1,196 @@
+#ifndef KUU_FUNCTIONS_POINTWISE_HPP
+#define KUU_FUNCTIONS_POINTWISE_HPP
+
+#include "function.hpp"
+#include "functions/batchnorm.hpp"
+#include "kernels/pointwise.hpp"
+#include <cassert>
+#include <memory>
+#include <vector>
+
+namespace kuu {
+namespace function {
+
+namespace pointwise_detail {
+
+// the {outer, channels, inner} view of the kernels. the channels only matter
+// to affine ops, which need at least 2 dimensions.
+inline batchnorm_detail::channel_view view_of(const tensor &data) {
+  if (data.dim() < 2) {
+    return {1, 1, data.size()};
+  }
+  return batchnorm_detail::view_of(data);
+}
+
+struct op {
+  kernel::pointwise_kind kind;
+  // per-channel operands of kAffine, either may be empty
+  tensor scale;
+  tensor shift;
+  value_type value = 1;
+};
+
+// a chain of pointwise ops over source. as the deferred data of a tensor it
+// runs when the tensor is first read, i.e. at the next function that is not
+// pointwise.
+struct program : detail::deferred_data<tensor_type> {
+  tensor source;
+  std::vector<op> ops;
+
+  // the kernel's view of ops. the operands' data must outlive the result.
+  std::vector<kernel::pointwise_op> kernel_ops() const {
+    std::vector<kernel::pointwise_op> k(ops.size());
+    for (std::size_t i = 0; i < ops.size(); i++) {
+      k[i].kind = ops[i].kind;
+      k[i].value = ops[i].value;
+      tensor scale = ops[i].scale; // shallow, for the raw pointers
+      tensor shift = ops[i].shift;
+      k[i].scale = scale.is_empty() ? nullptr : scale.data().data();
+      k[i].shift = shift.is_empty() ? nullptr : shift.data().data();
+    }
+    return k;
+  }
+
+  void compute(tensor_type &data) const override {
+    const auto v = view_of(source);
+    const auto k = kernel_ops();
+    tensor x = source; // shallow, for the raw pointer
+    kernel::pointwise_forward(v.outer, v.channels, v.inner, k.data(),
+                              k.size(), x.data().data(), data.data());
+  }
+};
+
+} // namespace pointwise_detail
+
+// pointwise functions that can be fused. while a fuse_pointwise scope is
+// alive (fusion.hpp) they return tensors whose data is deferred: a chain of
+// them becomes one pass over memory when its result is first read, and one
+// node whose backward is one pass as well. outside of the scope they run
+// right away, through the same kernel.
+class pointwise : virtual public traceable_function {
+public:
+  pointwise() : traceable_function{1} { set_name("pointwise"); }
+
+  static tensor relu(const tensor &input) {
+    return apply(input, {kernel::pointwise_kind::kReLU, {}, {}, 1});
+  }
+
+  // input * value
+  static tensor scale(const tensor &input, const value_type value) {
+    return apply(input, {kernel::pointwise_kind::kScale, {}, {}, value});
+  }
+
+  // input * scale[c] + shift[c] over the channel axis, i.e. axis 1, or the
+  // last axis for NHWC. scale or shift may be empty, e.g. for a bias.
+  static tensor affine(const tensor &input, const tensor &scale,
+                       const tensor &shift) {
+    assert(2 <= input.dim());
+    assert(scale.is_empty() ||
+           scale.size() == batchnorm_detail::view_of(input).channels);
+    assert(shift.is_empty() ||
+           shift.size() == batchnorm_detail::view_of(input).channels);
+    return apply(input, {kernel::pointwise_kind::kAffine, scale, shift, 1});
+  }
+
+private:
+  static tensor apply(const tensor &input, pointwise_detail::op op) {
+    assert(op.kind != kernel::pointwise_kind::kAffine || 2 <= input.dim());
+    // a deferred input is extended instead of being computed
+    auto chain = std::make_shared<pointwise_detail::program>();
+    const auto *pending =
+        dynamic_cast<const pointwise_detail::program *>(input.deferred());
+    if (pending) {
+      *chain = *pending;
+    } else {
+      chain->source = input;
+    }
+    chain->ops.push_back(std::move(op));
+
+    // the source, then the scale and shift of every op
+    std::vector<tensor> inputs{chain->source};
+    bool requires_grad = chain->source.requires_grad();
+    for (const auto &o : chain->ops) {
+      inputs.push_back(o.scale);
+      inputs.push_back(o.shift);
+      requires_grad = requires_grad ||
+                      (!o.scale.is_empty() && o.scale.requires_grad()) ||
+                      (!o.shift.is_empty() && o.shift.requires_grad());
+    }
+
+    tensor output;
+    if (detail::g->lazy_pointwise()) {
+      output.set_required_grad(requires_grad);
+      output.defer(input.shape(), chain);
+    } else {
+      output = tensor{tensor_type::from_shape(input.shape()), requires_grad};
+      chain->compute(output.data());
+    }
+    output.set_format(input.format());
+
+    if (requires_grad) {
+      // a copy of the ops without the tensors, which are graph inputs
+      std::vector<pointwise_detail::op> ops;
+      for (const auto &o : chain->ops) {
+        ops.push_back({o.kind, {}, {}, o.value});
+      }
+      trace::register_node<pointwise>(
+          std::move(inputs), output,
+          [ops](const std::vector<tensor> &outputs,
+                std::vector<tensor> &inputs, const grad_mask &mask) {
+            backward(ops, outputs, inputs, mask);
+          });
+    }
+    return output;
+  }
+
+  static void backward(std::vector<pointwise_detail::op> ops,
+                       const std::vector<tensor> &outputs,
+                       std::vector<tensor> &inputs, const grad_mask &mask) {
+    assert(outputs.size() == 1);
+    assert(inputs.size() == 1 + 2 * ops.size());
+    pointwise_detail::program chain;
+    chain.source = inputs[0];
+    for (std::size_t k = 0; k < ops.size(); k++) {
+      ops[k].scale = inputs[1 + 2 * k];
+      ops[k].shift = inputs[2 + 2 * k];
+    }
+    chain.ops = std::move(ops);
+    const auto k_ops = chain.kernel_ops();
+    const auto v = pointwise_detail::view_of(chain.source);
+
+    std::vector<tensor_type> grads(inputs.size());
+    std::vector<float *> gscale(chain.ops.size(), nullptr);
+    std::vector<float *> gshift(chain.ops.size(), nullptr);
+    for (std::size_t i = 1; i < inputs.size(); i++) {
+      if (needs_grad(mask, inputs, i)) {
+        grads[i] = tensor_type::from_shape({v.channels});
+        (i % 2 == 1 ? gscale : gshift)[(i - 1) / 2] = grads[i].data();
+      }
+    }
+    if (needs_grad(mask, inputs, 0)) {
+      grads[0] = tensor_type::from_shape(chain.source.shape());
+    }
+
+    tensor x = chain.source; // shallow, for the raw pointers
+    tensor y = outputs[0];
+    kernel::pointwise_backward(
+        v.outer, v.channels, v.inner, k_ops.data(), k_ops.size(),
+        x.data().data(), y.grad().data(),
+        needs_grad(mask, inputs, 0) ? grads[0].data() : nullptr,
+        gscale.data(), gshift.data());
+
+    for (std::size_t i = 0; i < inputs.size(); i++) {
+      if (needs_grad(mask, inputs, i)) {
+        if (0 < i) {
+          grads[i].reshape(inputs[i].shape());
+        }
+        inputs[i].set_grad(std::move(grads[i]));
+      }
+    }
+  }
+};
+
+} // namespace function
+} // namespace kuu
+
+#endif // KUU_FUNCTIONS_POINTWISE_HPP
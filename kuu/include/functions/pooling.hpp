@@ -0,0 +1,180 @@
+#ifndef KUU_FUNCTIONS_POOLING_HPP
+#define KUU_FUNCTIONS_POOLING_HPP
+
+#include "exarray.hpp"
+#include "function.hpp"
+#include "kernels/pooling.hpp"
+#include "layout.hpp"
+#include <cassert>
+#include <memory>
+#include <vector>
+
+// 2d pooling over inputs in either memory format. neither backward reads the
+// input: max pooling keeps the position of each maximum in its window, and
+// average pooling only needs the shapes, so the input is released once
+// nothing else needs it.
+
+namespace kuu {
+namespace function {
+
+namespace pooling_detail {
+
+inline kernel::pool2d_geometry geometry_of(const tensor &data,
+                                           exarray<2> kernel_size,
+                                           exarray<2> stride,
+                                           exarray<2> padding) {
+  assert(data.dim() == 4);
+  const std::size_t stride_h = stride.get<0>(), stride_w = stride.get<1>();
+  const bool channels_last = data.format() == memory_format::kNHWC;
+  const auto x_shape = data.shape();
+  return {x_shape[NCHW::N],
+          x_shape[channels_last ? NHWC::C : NCHW::C],
+          x_shape[channels_last ? NHWC::H : NCHW::H],
+          x_shape[channels_last ? NHWC::W : NCHW::W],
+          kernel_size.get<0>(),
+          kernel_size.get<1>(),
+          0 < stride_h ? stride_h : kernel_size.get<0>(),
+          0 < stride_w ? stride_w : kernel_size.get<1>(),
+          padding.get<0>(),
+          padding.get<1>()};
+}
+
+inline std::vector<std::size_t> output_shape(const kernel::pool2d_geometry &g,
+                                             const memory_format format) {
+  return format == memory_format::kNHWC
+             ? std::vector<std::size_t>{g.N, g.H_out(), g.W_out(), g.C}
+             : std::vector<std::size_t>{g.N, g.C, g.H_out(), g.W_out()};
+}
+
+} // namespace pooling_detail
+
+class max_pool_2d : public traceable_function {
+public:
+  max_pool_2d() : traceable_function{1} { set_name("max-pool-2d"); }
+
+  // a stride of 0 along an axis is the kernel size along it
+  static tensor forward(const tensor &data, exarray<2> kernel_size,
+                        exarray<2> stride = 0, exarray<2> padding = 0) {
+    const auto geometry =
+        pooling_detail::geometry_of(data, kernel_size, stride, padding);
+    assert(geometry.is_valid());
+    const bool channels_last = data.format() == memory_format::kNHWC;
+    auto y = tensor_type::from_shape(
+        pooling_detail::output_shape(geometry, data.format()));
+    auto index = std::make_shared<std::vector<kernel::pool_index>>(y.size());
+
+    tensor x = data; // shallow, for the raw pointer
+    if (channels_last) {
+      kernel::maxpool_forward_nhwc(x.data().data(), y.data(), index->data(),
+                                   geometry);
+    } else {
+      kernel::maxpool_forward_nchw(x.data().data(), y.data(), index->data(),
+                                   geometry);
+    }
+
+    const bool requires_grad = util::requires_grad(data);
+    if (!requires_grad) {
+      index.reset();
+    }
+    tensor output{std::move(y), requires_grad};
+    output.set_format(data.format());
+    trace::register_node<max_pool_2d>(
+        {data}, output,
+        [index, geometry, channels_last](const std::vector<tensor> &outputs,
+                                         std::vector<tensor> &inputs,
+                                         const grad_mask &mask) {
+          if (index) {
+            backward(*index, geometry, channels_last, outputs, inputs, mask);
+          }
+        });
+    trace::release_saved_data(data);
+    return output;
+  }
+
+  // scatters gy to the maximum of each window, from the positions that
+  // forward kept instead of x
+  static void backward(const std::vector<kernel::pool_index> &index,
+                       const kernel::pool2d_geometry &geometry,
+                       const bool channels_last,
+                       const std::vector<tensor> &outputs,
+                       std::vector<tensor> &inputs,
+                       const grad_mask &mask = {}) {
+    assert(outputs.size() == 1);
+    assert(inputs.size() == 1);
+    if (!needs_grad(mask, inputs, 0)) {
+      return;
+    }
+    tensor y = outputs[0]; // shallow, for the raw pointer
+    assert(index.size() == y.size());
+    auto gx = tensor_type::from_shape(inputs[0].shape());
+    if (channels_last) {
+      kernel::maxpool_backward_nhwc(y.grad().data(), index.data(), gx.data(),
+                                    geometry);
+    } else {
+      kernel::maxpool_backward_nchw(y.grad().data(), index.data(), gx.data(),
+                                    geometry);
+    }
+    inputs[0].set_grad(std::move(gx));
+  }
+};
+
+// padding counts as zeros, i.e. every window is divided by its full size
+class avg_pool_2d : public traceable_function {
+public:
+  avg_pool_2d() : traceable_function{1} { set_name("avg-pool-2d"); }
+
+  // a stride of 0 along an axis is the kernel size along it
+  static tensor forward(const tensor &data, exarray<2> kernel_size,
+                        exarray<2> stride = 0, exarray<2> padding = 0) {
+    const auto geometry =
+        pooling_detail::geometry_of(data, kernel_size, stride, padding);
+    assert(geometry.is_valid());
+    const bool channels_last = data.format() == memory_format::kNHWC;
+    auto y = tensor_type::from_shape(
+        pooling_detail::output_shape(geometry, data.format()));
+
+    tensor x = data; // shallow, for the raw pointer
+    if (channels_last) {
+      kernel::avgpool_forward_nhwc(x.data().data(), y.data(), geometry);
+    } else {
+      kernel::avgpool_forward_nchw(x.data().data(), y.data(), geometry);
+    }
+
+    tensor output{std::move(y), util::requires_grad(data)};
+    output.set_format(data.format());
+    trace::register_node<avg_pool_2d>(
+        {data}, output,
+        [geometry, channels_last](const std::vector<tensor> &outputs,
+                                  std::vector<tensor> &inputs,
+                                  const grad_mask &mask) {
+          backward(geometry, channels_last, outputs, inputs, mask);
+        });
+    trace::release_saved_data(data);
+    return output;
+  }
+
+  static void backward(const kernel::pool2d_geometry &geometry,
+                       const bool channels_last,
+                       const std::vector<tensor> &outputs,
+                       std::vector<tensor> &inputs,
+                       const grad_mask &mask = {}) {
+    assert(outputs.size() == 1);
+    assert(inputs.size() == 1);
+    if (!needs_grad(mask, inputs, 0)) {
+      return;
+    }
+    tensor y = outputs[0]; // shallow, for the raw pointer
+    auto gx = tensor_type::from_shape(inputs[0].shape());
+    if (channels_last) {
+      kernel::avgpool_backward_nhwc(y.grad().data(), gx.data(), geometry);
+    } else {
+      kernel::avgpool_backward_nchw(y.grad().data(), gx.data(), geometry);
+    }
+    inputs[0].set_grad(std::move(gx));
+  }
+};
+
+} // namespace function
+} // namespace kuu
+
+#endif // KUU_FUNCTIONS_POOLING_HPP
@@ -0,0 +1,92 @@
+#ifndef KUU_FUNCTIONS_QUANTIZED_HPP
+#define KUU_FUNCTIONS_QUANTIZED_HPP
+
+#include "functions/convolution.hpp"
+#include "kernels/qgemm.hpp"
+#include <cassert>
+#include <vector>
+
+// int8 variants of linear and convolution_2d for inference. weights come
+// quantized and packed by kernel::quantize_matrix; activations are quantized
+// per call, with a fixed scale when one is given and from their own range
+// otherwise. nothing is traced, and outputs do not require grad.
+
+namespace kuu {
+namespace function {
+
+struct quantized_linear {
+  // weight packs the {in, out} weight of a linear. act is applied to the
+  // dequantized output, as fused_linear does.
+  static tensor forward(const tensor &input,
+                        const kernel::qpacked_matrix &weight,
+                        const tensor &bias = tensor{},
+                        const float activation_scale = 0.f,
+                        const kernel::activation act =
+                            kernel::activation::kNone) {
+    assert(weight.k == input.size() / input.shape()[0]);
+    const std::size_t n = input.shape()[0];
+    tensor x = input; // shallow, for the raw pointer
+    auto y = tensor_type::from_shape({n, weight.n});
+    tensor b = bias;
+    kernel::qgemm(n, x.data().data(), weight.k, activation_scale, weight,
+                  bias.is_empty() ? nullptr : b.data().data(), y.data(),
+                  weight.n);
+    if (act != kernel::activation::kNone) {
+      kernel::gemm_detail::finish_tile({nullptr, act, nullptr}, y.data(),
+                                       nullptr, weight.n, n, weight.n, 0,
+                                       false);
+    }
+    return tensor{std::move(y), false};
+  }
+};
+
+struct quantized_convolution_2d {
+  // weight packs the filter transposed, {Cols, C_out}, with the columns in
+  // the window order of im2col for NCHW inputs and of im2col_nhwc for NHWC.
+  static tensor forward(const tensor &data,
+                        const std::vector<std::size_t> &weight_shape,
+                        const kernel::qpacked_matrix &weight,
+                        const tensor &bias, exarray<2> stride = 1,
+                        exarray<2> padding = 0, exarray<2> dilation = 1,
+                        const float activation_scale = 0.f) {
+    assert(data.shape().size() == 4);
+    const bool channels_last = data.format() == memory_format::kNHWC;
+    const std::size_t N = data.shape()[NCHW::N];
+    const std::size_t C_out = weight_shape[0];
+    const std::size_t H_f = weight_shape[2];
+    const std::size_t W_f = weight_shape[3];
+    const std::size_t H =
+        data.shape()[channels_last ? NHWC::H : NCHW::H] + 2 * padding.get<0>();
+    const std::size_t W =
+        data.shape()[channels_last ? NHWC::W : NCHW::W] + 2 * padding.get<1>();
+    const std::size_t H_out = (H - H_f) / stride.get<0>() + 1;
+    const std::size_t W_out = (W - W_f) / stride.get<1>() + 1;
+    assert(weight.n == C_out);
+
+    // {N * H_out * W_out, Cols}
+    auto col = channels_last
+                   ? im2col_nhwc(data.cdata(), weight_shape, stride, padding)
+                   : im2col(data.cdata(), weight_shape, stride, padding,
+                            dilation);
+    assert(col.shape()[1] == weight.k);
+
+    auto dot = tensor_type::from_shape({col.shape()[0], C_out});
+    tensor b = bias;
+    kernel::qgemm(col.shape()[0], col.data(), weight.k, activation_scale,
+                  weight, bias.is_empty() ? nullptr : b.data().data(),
+                  dot.data(), C_out);
+
+    dot.reshape({N, H_out, W_out, C_out});
+    tensor output{channels_last
+                      ? std::move(dot)
+                      : tensor_type(xt::transpose(dot, {0, 3, 1, 2})),
+                  false};
+    output.set_format(data.format());
+    return output;
+  }
+};
+
+} // namespace function
+} // namespace kuu
+
+#endif // KUU_FUNCTIONS_QUANTIZED_HPP
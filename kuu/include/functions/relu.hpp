@@ -2,8 +2,13 @@
 #define KUU_FUNCTIONS_RELU_HPP
 
 #include "function.hpp"
+#include "functions/activation.hpp"
+#include "functions/pointwise.hpp"
+#include "kernels/activation.hpp"
 #include <cassert>
+#include <memory>
 #include <string>
+#include <vector>
 #include <xtensor-blas/xlinalg.hpp>
 #include <xtensor/xexpression.hpp>
 #include <xtensor/xmath.hpp>
@@ -17,25 +22,71 @@ class relu : public traceable_function {
 public:
   relu() : traceable_function{1} { set_name("activation-relu"); }
 
-  static tensor forward(const tensor &input) {
-    auto x = input.cdata();
-    auto y = xt::fmax(0, x);
+  // with inplace, the output takes input's buffer when possible, see
+  // activation_detail::map. ignored while pointwise functions are fused.
+  static tensor forward(const tensor &input, const bool inplace = false) {
+    if (detail::g->lazy_pointwise()) {
+      return pointwise::relu(input); // fused with its neighbours
+    }
+    const bool requires_grad = util::requires_grad(input);
+    // backward only needs the sign of x, one bit per element, so x itself
+    // is released once nothing else needs it
+    std::shared_ptr<std::vector<kernel::mask_word>> bits;
+    if (requires_grad) {
+      bits = std::make_shared<std::vector<kernel::mask_word>>(
+          kernel::mask_words(input.size()));
+    }
+    auto y = activation_detail::map(
+        input, inplace, [&](const float *x, const std::size_t n, float *out) {
+          kernel::relu(x, n, out, bits ? bits->data() : nullptr);
+        });
 
-    tensor output{std::move(y), util::requires_grad(input)};
-    trace::register_node<self_type>({input}, output);
+    tensor output{std::move(y), requires_grad};
+    output.set_format(input.format());
+    trace::register_node<self_type>(
+        {input}, output,
+        [bits](const std::vector<tensor> &outputs, std::vector<tensor> &inputs,
+               const grad_mask &mask) {
+          if (bits) {
+            backward(*bits, outputs, inputs, mask);
+          }
+        });
+    trace::release_saved_data(input);
     return output;
   }
 
   static void backward(const std::vector<tensor> &outputs,
-                       std::vector<tensor> &inputs) {
+                       std::vector<tensor> &inputs,
+                       const grad_mask &mask = {}) {
     assert(outputs.size() == 1);
     assert(inputs.size() == 1);
+    if (!needs_grad(mask, inputs, 0)) {
+      return;
+    }
     tensor &input = inputs[0];
     const auto &x = input.data();
     auto dy = outputs[0].cgrad();
     auto dx = dy * (x > 0);
     input.set_grad(dx);
   }
+
+  // from the mask of x > 0 that forward kept instead of x
+  static void backward(const std::vector<kernel::mask_word> &bits,
+                       const std::vector<tensor> &outputs,
+                       std::vector<tensor> &inputs,
+                       const grad_mask &mask = {}) {
+    assert(outputs.size() == 1);
+    assert(inputs.size() == 1);
+    if (!needs_grad(mask, inputs, 0)) {
+      return;
+    }
+    tensor y = outputs[0]; // shallow, for the raw pointer
+    auto gx = tensor_type::from_shape(inputs[0].shape());
+    assert(bits.size() == kernel::mask_words(gx.size()));
+    kernel::masked_grad(y.grad().data(), bits.data(), gx.size(), 0.f,
+                        gx.data());
+    inputs[0].set_grad(std::move(gx));
+  }
 };
 } // namespace function
 } // namespace kuu
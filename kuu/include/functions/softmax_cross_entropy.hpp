@@ -2,14 +2,10 @@
 #define KUU_FUNCTIONS_SOFTMAX_CROSS_ENTROPY_HPP
 
 #include "function.hpp"
-#include "math.hpp"
+#include "kernels/vmath.hpp"
 #include "util/converter.hpp"
 #include <cassert>
-#include <xtensor-blas/xlinalg.hpp>
-#include <xtensor/xbroadcast.hpp>
-#include <xtensor/xindex_view.hpp>
-#include <xtensor/xmath.hpp>
-#include <xtensor/xsort.hpp>
+#include <vector>
 #include <xtensor/xtensor.hpp>
 
 namespace kuu {
@@ -20,80 +16,74 @@ public:
   softmax_cross_entropy() : traceable_function{1} {
     set_name("softmax_cross_entropy");
   }
+  // the loss over the rows of x with class labels t of shape {N}, stored as
+  // floats, or soft targets of shape {N, n_label}. the per-row
+  // log-sum-exp is kept for backward, which then needs one pass over x.
   static tensor forward(const tensor &x, const tensor &t,
                         reduction_type reduction = reduction_type::kMean) {
     assert(2 == x.dim());                 // {N, n_label}
     assert(t.dim() == 1 || t.dim() == 2); // {N, n_label}
     assert(x.shape()[0] == t.shape()[0]);
-
-    xt::xarray<value_type> scores = math::log_softmax(x.cdata(), 1);
-
-    assert(scores.dimension() == 2);
-    assert(scores.shape()[1] == x.shape()[1]);
-
-    xt::xtensor<value_type, 0> y;
-
-    if (t.dim() == 1) {
-      using index_type = std::array<std::size_t, 2>;
-      std::vector<index_type> indices{scores.shape()[0]};
-      for (std::size_t i = 0; i < scores.shape()[0]; i++) {
-        indices[i] = {i, static_cast<std::size_t>(t.cdata()(i))};
-      }
-      auto prob = xt::index_view(scores, indices); // {N}
-
-      y = -xt::sum(prob); // sum of ce
-      if (reduction == reduction_type::kMean) {
-        y /= prob.shape()[0];
-      }
-    } else {
-      xt::xtensor<value_type, 2> target;
-      target = t.cdata();
-
-      auto aaa = scores * target;
-
-      auto ce = -xt::sum(aaa, {1}); // {N}
-      if (reduction == reduction_type::kMean) {
-        y = xt::mean(ce);
-      } else if (reduction == reduction_type::kSum) {
-        y = xt::sum(ce);
-      }
+    assert(t.dim() == 1 || t.shape()[1] == x.shape()[1]);
+
+    const std::size_t N = x.shape()[0];
+    const std::size_t n_label = x.shape()[1];
+    tensor scores = x; // shallow, for the raw pointers
+    tensor target = t;
+    const float *labels = t.dim() == 1 ? target.data().data() : nullptr;
+    const float *targets = t.dim() == 2 ? target.data().data() : nullptr;
+
+    tensor_type lse = tensor_type::from_shape({N});
+    std::vector<value_type> loss(N);
+    kernel::softmax_cross_entropy(N, n_label, scores.data().data(), labels,
+                                  targets, lse.data(), loss.data());
+
+    double sum = 0;
+    for (const auto l : loss) {
+      sum += l;
     }
+    xt::xtensor<value_type, 0> y;
+    y() = static_cast<value_type>(
+        reduction == reduction_type::kMean ? sum / N : sum);
 
     tensor output{std::move(y), util::requires_grad(x, t)};
-    trace::register_node<softmax_cross_entropy>({x, t}, output);
+    trace::register_node<softmax_cross_entropy>(
+        {x, t, tensor{std::move(lse), false},
+         tensor{static_cast<value_type>(reduction), false}},
+        output);
     return output;
   }
 
+  // gx = gy * (softmax(x) - t), divided by N for kMean.
   static void backward(const std::vector<tensor> &outputs,
-                       std::vector<tensor> &inputs) {
-    assert(inputs.size() == 2);
+                       std::vector<tensor> &inputs,
+                       const grad_mask &mask = {}) {
+    assert(inputs.size() == 4);
     assert(outputs.size() == 1);
 
-    if (!inputs[0].requires_grad()) {
+    if (!needs_grad(mask, inputs, 0)) {
       return;
     }
 
-    auto &x = inputs[0].data();
-    auto &gx = inputs[0].grad();
-    auto &t = inputs[1].data();
-
-    auto gy = outputs[0].cgrad();
-
-    auto scores = math::log_softmax(x); // {N, n_label}
-    scores = xt::exp(scores);
-
-    if (t.dimension() == 2) {
-      gx = gy * (scores - t);
-    } else if (x.dimension() == 2) {
-      gx = scores;
-      for (std::size_t i = 0; i < x.shape()[0]; i++) {
-        gx(i, t[i]) -= 1;
-      }
-      gx *= gy;
-    } else {
-      std::runtime_error("error!");
+    tensor x = inputs[0]; // shallow, for the raw pointers
+    tensor t = inputs[1];
+    tensor lse = inputs[2];
+    const std::size_t N = x.shape()[0];
+    const std::size_t n_label = x.shape()[1];
+    const auto reduction =
+        static_cast<reduction_type>(inputs[3].cdata()());
+    float scale = outputs[0].cgrad()();
+    if (reduction == reduction_type::kMean) {
+      scale /= N;
     }
-    gx /= x.shape()[0];
+
+    auto gx = tensor_type::from_shape({N, n_label});
+    const float *t_ptr = t.data().data();
+    kernel::softmax_cross_entropy_grad(
+        N, n_label, x.data().data(), lse.data().data(),
+        t.dim() == 1 ? t_ptr : nullptr, t.dim() == 2 ? t_ptr : nullptr,
+        scale, gx.data());
+    inputs[0].set_grad(std::move(gx));
   }
 };
 } // namespace function
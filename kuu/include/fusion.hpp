@@ -0,0 +1,38 @@
+#ifndef KUU_FUSION_HPP
+#define KUU_FUSION_HPP
+
+#include "functions/pointwise.hpp"
+#include "graph.hpp"
+#include "mixin/non_copyable.hpp"
+#include "mixin/non_movable.hpp"
+
+// lazy fusion of pointwise functions. inside the scope, function::pointwise,
+// function::relu and the inference path of batchnorm return tensors whose
+// data is deferred; a chain of them is computed in one pass over memory when
+// its result is first read, e.g. by a convolution, a GEMM or a loss, and
+// backward goes through the chain in one pass as well:
+//
+//   {
+//     fuse_pointwise fusion;
+//     auto y = function::relu::forward(bn->forward(x)); // nothing computed
+//     auto z = linear->forward(y);                       // y computed here
+//   }
+
+namespace kuu {
+
+// while alive, pointwise functions defer their outputs.
+class fuse_pointwise : private non_copyable<fuse_pointwise>,
+                       private non_movable<fuse_pointwise> {
+public:
+  fuse_pointwise() : previous_{detail::g->lazy_pointwise()} {
+    detail::g->set_lazy_pointwise(true);
+  }
+  ~fuse_pointwise() { detail::g->set_lazy_pointwise(previous_); }
+
+private:
+  bool previous_;
+};
+
+} // namespace kuu
+
+#endif // KUU_FUSION_HPP
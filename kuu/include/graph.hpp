@@ -2,10 +2,13 @@
 #define KUU_GRAPH_HPP
 
 #include "config.hpp"
+#include "kernels/half.hpp"
 #include "mixin/non_copyable.hpp"
 #include "mixin/non_movable.hpp"
 #include "tensor.hpp"
+#include <functional>
 #include <memory>
+#include <optional>
 #include <unordered_map>
 #include <vector>
 #include <xtensor/xarray.hpp>
@@ -23,16 +26,50 @@ extern std::shared_ptr<graph> g;
 } // namespace detail
 
 namespace trace {
+using backward_closure = std::function<void(
+    const std::vector<tensor> &, std::vector<tensor> &,
+    const std::vector<bool> &)>;
 template <typename Function>
 void register_node(std::initializer_list<tensor> inputs, tensor &output);
+template <typename Function>
+void register_node(std::initializer_list<tensor> inputs, tensor &output,
+                   backward_closure backward);
+template <typename Function>
+void register_node(std::vector<tensor> inputs, tensor &output,
+                   backward_closure backward);
 void run_backward(const tensor &root);
+// the node registered last reads only the grad of input in backward, not
+// its data, e.g. relu, which keeps a bit mask instead. once no node reads
+// the data of input and nothing outside of the graph shares it, the data is
+// released, at the registration of a later node. leaves are kept.
+void release_saved_data(const tensor &input);
+// t's data is read in backward although no node saves it, e.g. an output
+// that its own node reads, so it is never released.
+void retain_saved_data(const tensor &t);
+// whether a node reads t's data in backward, so that it must not be
+// overwritten, e.g. by an in-place function
+bool reads_saved_data(const tensor &t);
+// the number of times the tensor with this id is an input of a node, i.e. its
+// uses by traced functions
+std::size_t consumers(const id_type &tensor_id);
 } // namespace trace
 
 class graph : private non_copyable<graph>, private non_movable<graph> {
   template <typename Function>
   friend void trace::register_node(std::initializer_list<tensor> inputs,
                                    tensor &output);
+  template <typename Function>
+  friend void trace::register_node(std::initializer_list<tensor> inputs,
+                                   tensor &output,
+                                   trace::backward_closure backward);
+  template <typename Function>
+  friend void trace::register_node(std::vector<tensor> inputs, tensor &output,
+                                   trace::backward_closure backward);
   friend void trace::run_backward(const tensor &root);
+  friend void trace::release_saved_data(const tensor &input);
+  friend void trace::retain_saved_data(const tensor &t);
+  friend bool trace::reads_saved_data(const tensor &t);
+  friend std::size_t trace::consumers(const id_type &tensor_id);
   friend class optimizer;
 
 public:
@@ -43,15 +80,52 @@ public:
 
   std::string node_name(const id_type node_id);
 
+  // format in which activations saved for backward are stored, or none to
+  // keep them in fp32. see autocast.
+  std::optional<kernel::half_format> activation_format() const noexcept {
+    return activation_format_;
+  }
+  void set_activation_format(std::optional<kernel::half_format> format) {
+    activation_format_ = format;
+  }
+
+  // whether pointwise functions defer their outputs to fuse them into one
+  // pass. see fuse_pointwise.
+  bool lazy_pointwise() const noexcept { return lazy_pointwise_; }
+  void set_lazy_pointwise(const bool lazy) noexcept { lazy_pointwise_ = lazy; }
+
 private:
   std::unordered_map<id_type, std::shared_ptr<traceable_function>> nodes_;
   std::unordered_map<id_type, std::vector<tensor>> operator_inputs_;
   std::unordered_map<id_type, std::vector<tensor>> backward_stack_;
+  // whether any leaf under a node requires grad, memoized per node
+  std::unordered_map<id_type, bool> needs_grad_;
+  // per tensor, the number of its copies among the saved inputs, and of the
+  // nodes that read its data in backward
+  std::unordered_map<id_type, std::size_t> saved_copies_;
+  std::unordered_map<id_type, std::size_t> data_readers_;
+  // activations saved only for their grads, whose data is released once
+  // nothing outside of the graph shares them
+  std::unordered_map<id_type, tensor> releasable_;
+
+  std::optional<kernel::half_format> activation_format_;
+  bool lazy_pointwise_ = false;
+
+  bool needs_grad(const tensor &t);
+  std::vector<bool> input_mask(const id_type &node_id);
+  // records the inputs of a node, compressing the activations among them.
+  void save_inputs(const id_type &node_id, std::vector<tensor> inputs);
+  // releases the data of the releasable tensors that only the graph holds
+  void release_unused_data();
 
   void clear() {
     nodes_.clear();
     operator_inputs_.clear();
     backward_stack_.clear();
+    needs_grad_.clear();
+    saved_copies_.clear();
+    data_readers_.clear();
+    releasable_.clear();
   }
 };
 
@@ -59,11 +133,40 @@ namespace trace {
 template <typename Function>
 void register_node(std::initializer_list<tensor> inputs, tensor &output) {
   auto node = std::make_unique<Function>();
-  node->backward_function = Function::backward;
+  node->backward_function = [](const std::vector<tensor> &outputs,
+                                std::vector<tensor> &inputs,
+                                const std::vector<bool> &mask) {
+    Function::backward(outputs, inputs, mask);
+  };
+  id_type id = node->id();
+  detail::g->nodes_[id] = std::move(node);
+  output.set_creator_id(id);
+  detail::g->save_inputs(id, inputs);
+}
+
+// for operands that are not tensors, e.g. a sparse_tensor: the backward is a
+// closure that captures them, and only the tensors are graph inputs.
+template <typename Function>
+void register_node(std::initializer_list<tensor> inputs, tensor &output,
+                   backward_closure backward) {
+  auto node = std::make_unique<Function>();
+  node->backward_function = std::move(backward);
+  id_type id = node->id();
+  detail::g->nodes_[id] = std::move(node);
+  output.set_creator_id(id);
+  detail::g->save_inputs(id, inputs);
+}
+
+// the same with a number of inputs only known at run time
+template <typename Function>
+void register_node(std::vector<tensor> inputs, tensor &output,
+                   backward_closure backward) {
+  auto node = std::make_unique<Function>();
+  node->backward_function = std::move(backward);
   id_type id = node->id();
   detail::g->nodes_[id] = std::move(node);
   output.set_creator_id(id);
-  detail::g->operator_inputs_[id] = std::move(std::vector<tensor>{inputs});
+  detail::g->save_inputs(id, std::move(inputs));
 }
 } // namespace trace
 
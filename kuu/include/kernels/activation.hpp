@@ -0,0 +1,494 @@
+#ifndef KUU_KERNELS_ACTIVATION_HPP
+#define KUU_KERNELS_ACTIVATION_HPP
+
+#include "kernels/gemm.hpp"
+#include "kernels/vmath.hpp"
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+
+// elementwise activations and their gradients, on the exp of
+// kernels/vmath.hpp. an activation whose gradient only depends on the sign
+// of its input keeps one bit per element for backward, 1 where x > 0,
+// instead of x itself: element i is bit i % 64 of word i / 64. the
+// gradients of sigmoid and tanh are computed from their outputs, and those
+// of GELU and SiLU from their inputs. GELU is the tanh approximation, as in
+// the GEMM epilogue. every output may alias an input.
+
+namespace kuu {
+namespace kernel {
+
+using mask_word = std::uint64_t;
+constexpr std::size_t kMaskBits = 64;
+
+// the number of words of the mask of n elements
+constexpr std::size_t mask_words(const std::size_t n) {
+  return (n + kMaskBits - 1) / kMaskBits;
+}
+
+namespace activation_detail {
+
+static_assert(vmath_detail::kChunk % kMaskBits == 0,
+              "chunks must start at a word");
+
+// the GELU constants of the GEMM epilogue, see gelu_detail
+using gelu_detail::kGELU;
+using gelu_detail::kGELUCubic;
+// below this |x|, tanh is a polynomial; above, it is 1 - 2 / (exp(2x) + 1)
+constexpr float kTanhSmall = 0.625f;
+
+// Cephes' tanhf
+inline float tanh_generic(const float x) {
+  const float a = std::abs(x);
+  if (a < kTanhSmall) {
+    const float z = x * x;
+    const float p = (((-5.70498872745e-3f * z + 2.06390887954e-2f) * z -
+                      5.37397155531e-2f) *
+                         z +
+                     1.33314422036e-1f) *
+                        z -
+                    3.33332819422e-1f;
+    return p * z * x + x;
+  }
+  const float t = 1.f - 2.f / (vmath_detail::exp_generic(a + a) + 1.f);
+  return std::copysign(t, x);
+}
+
+inline float sigmoid_generic(const float x) {
+  return 1.f / (1.f + vmath_detail::exp_generic(-x));
+}
+
+// the ops of the elementwise drivers below: generic() per element, and
+// avx2() per 8 elements.
+struct tanh_op {
+  static float generic(const float x) { return tanh_generic(x); }
+#ifdef KUU_GEMM_X86
+  __attribute__((target("avx2,fma"))) static __m256 avx2(const __m256 x);
+#endif
+};
+
+struct gelu_op {
+  static float generic(const float x) {
+    return gelu_detail::value(x, tanh_generic(gelu_detail::inner(x)));
+  }
+#ifdef KUU_GEMM_X86
+  __attribute__((target("avx2,fma"))) static __m256 avx2(const __m256 x);
+#endif
+};
+
+struct silu_op {
+  static float generic(const float x) { return x * sigmoid_generic(x); }
+#ifdef KUU_GEMM_X86
+  __attribute__((target("avx2,fma"))) static __m256 avx2(const __m256 x);
+#endif
+};
+
+// the gradient ops take the saved value v, an input or an output, and gy
+struct sigmoid_grad_op {
+  static float generic(const float y, const float g) {
+    return g * y * (1.f - y);
+  }
+#ifdef KUU_GEMM_X86
+  __attribute__((target("avx2,fma"))) static __m256 avx2(const __m256 y,
+                                                          const __m256 g);
+#endif
+};
+
+struct tanh_grad_op {
+  static float generic(const float y, const float g) {
+    return g * (1.f - y * y);
+  }
+#ifdef KUU_GEMM_X86
+  __attribute__((target("avx2,fma"))) static __m256 avx2(const __m256 y,
+                                                          const __m256 g);
+#endif
+};
+
+struct gelu_grad_op {
+  static float generic(const float x, const float g) {
+    return g * gelu_detail::grad(x, tanh_generic(gelu_detail::inner(x)));
+  }
+#ifdef KUU_GEMM_X86
+  __attribute__((target("avx2,fma"))) static __m256 avx2(const __m256 x,
+                                                          const __m256 g);
+#endif
+};
+
+struct silu_grad_op {
+  static float generic(const float x, const float g) {
+    const float s = sigmoid_generic(x);
+    return g * s * (1.f + x * (1.f - s));
+  }
+#ifdef KUU_GEMM_X86
+  __attribute__((target("avx2,fma"))) static __m256 avx2(const __m256 x,
+                                                          const __m256 g);
+#endif
+};
+
+template <class Op>
+void map_generic(const float *x, const std::size_t n, float *y) {
+  for (std::size_t i = 0; i < n; i++) {
+    y[i] = Op::generic(x[i]);
+  }
+}
+
+template <class Op>
+void map_generic(const float *v, const float *gy, const std::size_t n,
+                 float *gx) {
+  for (std::size_t i = 0; i < n; i++) {
+    gx[i] = Op::generic(v[i], gy[i]);
+  }
+}
+
+inline void relu_generic(const float *x, const std::size_t n, float *y,
+                         mask_word *mask) {
+  for (std::size_t w = 0; w * kMaskBits < n; w++) {
+    const std::size_t begin = w * kMaskBits;
+    const std::size_t m = std::min(kMaskBits, n - begin);
+    mask_word bits = 0;
+    for (std::size_t j = 0; j < m; j++) {
+      const float v = x[begin + j];
+      bits |= static_cast<mask_word>(0.f < v) << j;
+      y[begin + j] = 0.f < v ? v : 0.f;
+    }
+    if (mask) {
+      mask[w] = bits;
+    }
+  }
+}
+
+inline void masked_grad_generic(const float *gy, const mask_word *mask,
+                                const std::size_t n, const float slope,
+                                float *gx) {
+  for (std::size_t w = 0; w * kMaskBits < n; w++) {
+    const std::size_t begin = w * kMaskBits;
+    const std::size_t m = std::min(kMaskBits, n - begin);
+    const mask_word bits = mask[w];
+    for (std::size_t j = 0; j < m; j++) {
+      const float g = gy[begin + j];
+      gx[begin + j] = (bits >> j) & 1 ? g : g * slope;
+    }
+  }
+}
+
+inline void leaky_relu_generic(const float *x, const std::size_t n,
+                               const float slope, float *y, mask_word *mask) {
+  for (std::size_t w = 0; w * kMaskBits < n; w++) {
+    const std::size_t begin = w * kMaskBits;
+    const std::size_t m = std::min(kMaskBits, n - begin);
+    mask_word bits = 0;
+    for (std::size_t j = 0; j < m; j++) {
+      const float v = x[begin + j];
+      bits |= static_cast<mask_word>(0.f < v) << j;
+      y[begin + j] = 0.f < v ? v : v * slope;
+    }
+    if (mask) {
+      mask[w] = bits;
+    }
+  }
+}
+
+#ifdef KUU_GEMM_X86
+__attribute__((target("avx2,fma"))) inline __m256 tanh_avx2(const __m256 x) {
+  const __m256 sign = _mm256_set1_ps(-0.f);
+  const __m256 a = _mm256_andnot_ps(sign, x);
+  // small |x|
+  const __m256 z = _mm256_mul_ps(x, x);
+  __m256 p = _mm256_set1_ps(-5.70498872745e-3f);
+  p = _mm256_fmadd_ps(p, z, _mm256_set1_ps(2.06390887954e-2f));
+  p = _mm256_fmadd_ps(p, z, _mm256_set1_ps(-5.37397155531e-2f));
+  p = _mm256_fmadd_ps(p, z, _mm256_set1_ps(1.33314422036e-1f));
+  p = _mm256_fmadd_ps(p, z, _mm256_set1_ps(-3.33332819422e-1f));
+  const __m256 small = _mm256_fmadd_ps(_mm256_mul_ps(p, z), x, x);
+  // large |x|, with the sign of x
+  const __m256 one = _mm256_set1_ps(1.f);
+  const __m256 e = vmath_detail::exp_avx2(_mm256_add_ps(a, a));
+  const __m256 t = _mm256_sub_ps(
+      one, _mm256_div_ps(_mm256_set1_ps(2.f), _mm256_add_ps(e, one)));
+  const __m256 large = _mm256_or_ps(t, _mm256_and_ps(sign, x));
+  return _mm256_blendv_ps(
+      large, small,
+      _mm256_cmp_ps(a, _mm256_set1_ps(kTanhSmall), _CMP_LT_OQ));
+}
+
+__attribute__((target("avx2,fma"))) inline __m256
+sigmoid_avx2(const __m256 x) {
+  const __m256 one = _mm256_set1_ps(1.f);
+  const __m256 e =
+      vmath_detail::exp_avx2(_mm256_sub_ps(_mm256_setzero_ps(), x));
+  return _mm256_div_ps(one, _mm256_add_ps(one, e));
+}
+
+// t = tanh(kGELU * (x + kGELUCubic * x^3))
+__attribute__((target("avx2,fma"))) inline __m256
+gelu_tanh_avx2(const __m256 x) {
+  const __m256 x3 = _mm256_mul_ps(_mm256_mul_ps(x, x), x);
+  return tanh_avx2(_mm256_mul_ps(
+      _mm256_set1_ps(kGELU),
+      _mm256_fmadd_ps(_mm256_set1_ps(kGELUCubic), x3, x)));
+}
+
+inline __m256 tanh_op::avx2(const __m256 x) { return tanh_avx2(x); }
+
+inline __m256 gelu_op::avx2(const __m256 x) {
+  const __m256 half = _mm256_set1_ps(0.5f);
+  const __m256 t = gelu_tanh_avx2(x);
+  return _mm256_mul_ps(_mm256_mul_ps(half, x),
+                       _mm256_add_ps(_mm256_set1_ps(1.f), t));
+}
+
+inline __m256 silu_op::avx2(const __m256 x) {
+  return _mm256_mul_ps(x, sigmoid_avx2(x));
+}
+
+inline __m256 sigmoid_grad_op::avx2(const __m256 y, const __m256 g) {
+  return _mm256_mul_ps(
+      _mm256_mul_ps(g, y), _mm256_sub_ps(_mm256_set1_ps(1.f), y));
+}
+
+inline __m256 tanh_grad_op::avx2(const __m256 y, const __m256 g) {
+  return _mm256_mul_ps(g, _mm256_fnmadd_ps(y, y, _mm256_set1_ps(1.f)));
+}
+
+inline __m256 gelu_grad_op::avx2(const __m256 x, const __m256 g) {
+  const __m256 half = _mm256_set1_ps(0.5f);
+  const __m256 one = _mm256_set1_ps(1.f);
+  const __m256 t = gelu_tanh_avx2(x);
+  // 0.5 * (1 + t) + 0.5 * x * (1 - t^2) * kGELU * (1 + 3 * kGELUCubic * x^2)
+  const __m256 du = _mm256_mul_ps(
+      _mm256_set1_ps(kGELU),
+      _mm256_fmadd_ps(_mm256_set1_ps(3.f * kGELUCubic), _mm256_mul_ps(x, x),
+                      one));
+  const __m256 d = _mm256_fmadd_ps(
+      _mm256_mul_ps(_mm256_mul_ps(half, x), _mm256_fnmadd_ps(t, t, one)), du,
+      _mm256_mul_ps(half, _mm256_add_ps(one, t)));
+  return _mm256_mul_ps(g, d);
+}
+
+inline __m256 silu_grad_op::avx2(const __m256 x, const __m256 g) {
+  const __m256 one = _mm256_set1_ps(1.f);
+  const __m256 s = sigmoid_avx2(x);
+  const __m256 d =
+      _mm256_mul_ps(s, _mm256_fmadd_ps(x, _mm256_sub_ps(one, s), one));
+  return _mm256_mul_ps(g, d);
+}
+
+template <class Op>
+__attribute__((target("avx2,fma"))) void
+map_avx2(const float *x, const std::size_t n, float *y) {
+  std::size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    _mm256_storeu_ps(y + i, Op::avx2(_mm256_loadu_ps(x + i)));
+  }
+  map_generic<Op>(x + i, n - i, y + i);
+}
+
+template <class Op>
+__attribute__((target("avx2,fma"))) void
+map_avx2(const float *v, const float *gy, const std::size_t n, float *gx) {
+  std::size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    _mm256_storeu_ps(gx + i, Op::avx2(_mm256_loadu_ps(v + i),
+                                      _mm256_loadu_ps(gy + i)));
+  }
+  map_generic<Op>(v + i, gy + i, n - i, gx + i);
+}
+
+__attribute__((target("avx2,fma"))) inline void
+leaky_relu_avx2(const float *x, const std::size_t n, const float slope,
+                float *y, mask_word *mask) {
+  const __m256 zero = _mm256_setzero_ps();
+  const __m256 s = _mm256_set1_ps(slope);
+  std::size_t w = 0;
+  for (; (w + 1) * kMaskBits <= n; w++) {
+    mask_word bits = 0;
+    for (std::size_t j = 0; j < kMaskBits; j += 8) {
+      const std::size_t i = w * kMaskBits + j;
+      const __m256 v = _mm256_loadu_ps(x + i);
+      const __m256 positive = _mm256_cmp_ps(v, zero, _CMP_GT_OQ);
+      _mm256_storeu_ps(y + i,
+                       _mm256_blendv_ps(_mm256_mul_ps(v, s), v, positive));
+      bits |= static_cast<mask_word>(_mm256_movemask_ps(positive)) << j;
+    }
+    if (mask) {
+      mask[w] = bits;
+    }
+  }
+  const std::size_t done = w * kMaskBits;
+  leaky_relu_generic(x + done, n - done, slope, y + done,
+                     mask ? mask + w : nullptr);
+}
+
+__attribute__((target("avx2,fma"))) inline void
+relu_avx2(const float *x, const std::size_t n, float *y, mask_word *mask) {
+  const __m256 zero = _mm256_setzero_ps();
+  std::size_t w = 0;
+  for (; (w + 1) * kMaskBits <= n; w++) {
+    mask_word bits = 0;
+    for (std::size_t j = 0; j < kMaskBits; j += 8) {
+      const std::size_t i = w * kMaskBits + j;
+      const __m256 v = _mm256_loadu_ps(x + i);
+      const __m256 positive = _mm256_cmp_ps(v, zero, _CMP_GT_OQ);
+      _mm256_storeu_ps(y + i, _mm256_and_ps(v, positive));
+      bits |= static_cast<mask_word>(_mm256_movemask_ps(positive)) << j;
+    }
+    if (mask) {
+      mask[w] = bits;
+    }
+  }
+  const std::size_t done = w * kMaskBits;
+  relu_generic(x + done, n - done, y + done, mask ? mask + w : nullptr);
+}
+
+__attribute__((target("avx2,fma"))) inline void
+masked_grad_avx2(const float *gy, const mask_word *mask, const std::size_t n,
+                 const float slope, float *gx) {
+  // lane k tests bit k of a byte of the mask
+  const __m256i lane_bits = _mm256_setr_epi32(1, 2, 4, 8, 16, 32, 64, 128);
+  const __m256 s = _mm256_set1_ps(slope);
+  std::size_t w = 0;
+  for (; (w + 1) * kMaskBits <= n; w++) {
+    const mask_word bits = mask[w];
+    for (std::size_t j = 0; j < kMaskBits; j += 8) {
+      const std::size_t i = w * kMaskBits + j;
+      const __m256i byte =
+          _mm256_set1_epi32(static_cast<int>((bits >> j) & 0xff));
+      const __m256 set = _mm256_castsi256_ps(_mm256_cmpeq_epi32(
+          _mm256_and_si256(byte, lane_bits), lane_bits));
+      const __m256 g = _mm256_loadu_ps(gy + i);
+      _mm256_storeu_ps(gx + i,
+                       _mm256_blendv_ps(_mm256_mul_ps(g, s), g, set));
+    }
+  }
+  const std::size_t done = w * kMaskBits;
+  masked_grad_generic(gy + done, mask + w, n - done, slope, gx + done);
+}
+#endif // KUU_GEMM_X86
+
+// y = Op(x), or gx = Op(v, gy), in parallel chunks
+template <class Op>
+void map(const float *x, const std::size_t n, float *y) {
+  vmath_detail::for_each_chunk(n, [&](const std::size_t i0,
+                                      const std::size_t m) {
+#ifdef KUU_GEMM_X86
+    if (vmath_detail::has_avx2_fma()) {
+      map_avx2<Op>(x + i0, m, y + i0);
+      return;
+    }
+#endif
+    map_generic<Op>(x + i0, m, y + i0);
+  });
+}
+
+template <class Op>
+void map(const float *v, const float *gy, const std::size_t n, float *gx) {
+  vmath_detail::for_each_chunk(n, [&](const std::size_t i0,
+                                      const std::size_t m) {
+#ifdef KUU_GEMM_X86
+    if (vmath_detail::has_avx2_fma()) {
+      map_avx2<Op>(v + i0, gy + i0, m, gx + i0);
+      return;
+    }
+#endif
+    map_generic<Op>(v + i0, gy + i0, m, gx + i0);
+  });
+}
+
+} // namespace activation_detail
+
+// y[i] = max(x[i], 0) for i < n, 0 for NaN, and the mask of x > 0 into the
+// mask_words(n) words of mask if it is not null. y may alias x.
+inline void relu(const float *x, const std::size_t n, float *y,
+                 mask_word *mask) {
+  vmath_detail::for_each_chunk(n, [&](const std::size_t i0,
+                                      const std::size_t m) {
+    mask_word *words = mask ? mask + i0 / kMaskBits : nullptr;
+#ifdef KUU_GEMM_X86
+    if (vmath_detail::has_avx2_fma()) {
+      activation_detail::relu_avx2(x + i0, m, y + i0, words);
+      return;
+    }
+#endif
+    activation_detail::relu_generic(x + i0, m, y + i0, words);
+  });
+}
+
+// gx[i] = gy[i] where bit i of mask is set, and gy[i] * slope elsewhere,
+// e.g. 0 for relu. gx may alias gy.
+inline void masked_grad(const float *gy, const mask_word *mask,
+                        const std::size_t n, const float slope, float *gx) {
+  vmath_detail::for_each_chunk(n, [&](const std::size_t i0,
+                                      const std::size_t m) {
+    const mask_word *words = mask + i0 / kMaskBits;
+#ifdef KUU_GEMM_X86
+    if (vmath_detail::has_avx2_fma()) {
+      activation_detail::masked_grad_avx2(gy + i0, words, m, slope, gx + i0);
+      return;
+    }
+#endif
+    activation_detail::masked_grad_generic(gy + i0, words, m, slope,
+                                           gx + i0);
+  });
+}
+
+// y[i] = x[i] for x[i] > 0 and x[i] * slope otherwise, with the mask of
+// x > 0 as for relu.
+inline void leaky_relu(const float *x, const std::size_t n, const float slope,
+                       float *y, mask_word *mask) {
+  vmath_detail::for_each_chunk(n, [&](const std::size_t i0,
+                                      const std::size_t m) {
+    mask_word *words = mask ? mask + i0 / kMaskBits : nullptr;
+#ifdef KUU_GEMM_X86
+    if (vmath_detail::has_avx2_fma()) {
+      activation_detail::leaky_relu_avx2(x + i0, m, slope, y + i0, words);
+      return;
+    }
+#endif
+    activation_detail::leaky_relu_generic(x + i0, m, slope, y + i0, words);
+  });
+}
+
+// y = tanh(x). the largest error, measured over every float, is 1.33 ulp
+inline void vtanh(const float *x, const std::size_t n, float *y) {
+  activation_detail::map<activation_detail::tanh_op>(x, n, y);
+}
+
+// y = 0.5 * x * (1 + tanh(sqrt(2 / pi) * (x + 0.044715 * x^3)))
+inline void gelu(const float *x, const std::size_t n, float *y) {
+  activation_detail::map<activation_detail::gelu_op>(x, n, y);
+}
+
+// y = x * sigmoid(x)
+inline void silu(const float *x, const std::size_t n, float *y) {
+  activation_detail::map<activation_detail::silu_op>(x, n, y);
+}
+
+// gx = gy * y * (1 - y) from y = sigmoid(x)
+inline void sigmoid_grad(const float *y, const float *gy, const std::size_t n,
+                         float *gx) {
+  activation_detail::map<activation_detail::sigmoid_grad_op>(y, gy, n, gx);
+}
+
+// gx = gy * (1 - y^2) from y = tanh(x)
+inline void tanh_grad(const float *y, const float *gy, const std::size_t n,
+                      float *gx) {
+  activation_detail::map<activation_detail::tanh_grad_op>(y, gy, n, gx);
+}
+
+// gx = gy * gelu'(x)
+inline void gelu_grad(const float *x, const float *gy, const std::size_t n,
+                      float *gx) {
+  activation_detail::map<activation_detail::gelu_grad_op>(x, gy, n, gx);
+}
+
+// gx = gy * s * (1 + x * (1 - s)) with s = sigmoid(x)
+inline void silu_grad(const float *x, const float *gy, const std::size_t n,
+                      float *gx) {
+  activation_detail::map<activation_detail::silu_grad_op>(x, gy, n, gx);
+}
+
+} // namespace kernel
+} // namespace kuu
+
+#endif // KUU_KERNELS_ACTIVATION_HPP
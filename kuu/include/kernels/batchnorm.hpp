@@ -0,0 +1,285 @@
+#ifndef KUU_KERNELS_BATCHNORM_HPP
+#define KUU_KERNELS_BATCHNORM_HPP
+
+#include "kernels/gemm.hpp"
+#include <algorithm>
+#include <cstddef>
+#include <vector>
+
+// per-channel kernels of batch normalization. x is viewed as
+// {outer, C, inner}: {N, C, 1} for batchnorm_1d, {N, C, H * W} for NCHW and
+// {N * H * W, C, 1} for NHWC, so every layout is read in storage order.
+// work is split into tasks of whole rows of {C, inner}; the per-task
+// statistics are merged in task order, so results do not depend on the
+// number of threads.
+
+namespace kuu {
+namespace kernel {
+
+namespace batchnorm_detail {
+
+// elements per task
+constexpr std::size_t kChunk = 1 << 16;
+
+inline std::size_t rows_per_task(const std::size_t C, const std::size_t inner) {
+  return std::max<std::size_t>(1, kChunk / (C * inner));
+}
+
+// mean and sum of squared deviations of n contiguous values. the segment is
+// read twice, the second time from cache.
+inline void segment_moments(const float *x, const std::size_t n, double &mean,
+                            double &m2) {
+  float acc[8] = {};
+  std::size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    for (std::size_t j = 0; j < 8; j++) {
+      acc[j] += x[i + j];
+    }
+  }
+  double sum = 0;
+  for (; i < n; i++) {
+    sum += x[i];
+  }
+  for (std::size_t j = 0; j < 8; j++) {
+    sum += acc[j];
+  }
+  mean = sum / n;
+
+  const float m = static_cast<float>(mean);
+  float sq[8] = {};
+  for (i = 0; i + 8 <= n; i += 8) {
+    for (std::size_t j = 0; j < 8; j++) {
+      const float d = x[i + j] - m;
+      sq[j] += d * d;
+    }
+  }
+  double deviation = 0;
+  for (; i < n; i++) {
+    const double d = x[i] - m;
+    deviation += d * d;
+  }
+  for (std::size_t j = 0; j < 8; j++) {
+    deviation += sq[j];
+  }
+  // the correction for mean having been rounded to float
+  const double bias = mean - m;
+  m2 = std::max(0., deviation - n * bias * bias);
+}
+
+// Chan et al.'s update of (count_a, mean_a, m2_a) with a disjoint set b.
+inline void merge_moments(const double count_a, double &mean_a, double &m2_a,
+                          const double count_b, const double mean_b,
+                          const double m2_b) {
+  const double count = count_a + count_b;
+  const double delta = mean_b - mean_a;
+  mean_a += delta * count_b / count;
+  m2_a += m2_b + delta * delta * count_a * count_b / count;
+}
+
+} // namespace batchnorm_detail
+
+// mean[c] and biased variance var[c] of every channel of x, in a single
+// pass over x: Welford's update per element when inner == 1, and Chan's
+// merge of per-segment moments otherwise.
+inline void channel_moments(const std::size_t outer, const std::size_t C,
+                            const std::size_t inner, const float *x,
+                            float *mean, float *var) {
+  using namespace batchnorm_detail;
+  const std::size_t rows = rows_per_task(C, inner);
+  const std::size_t tasks = (outer + rows - 1) / rows;
+  const bool parallel = gemm_detail::kParallelWork <= outer * C * inner;
+  // {mean, m2} of every channel, per task
+  std::vector<double> moments(tasks * 2 * C, 0.);
+
+  gemm_detail::parallel_for(parallel, tasks, [&](const std::size_t t) {
+    double *m = moments.data() + t * 2 * C;
+    double *m2 = m + C;
+    const std::size_t o_end = std::min(outer, (t + 1) * rows);
+    double count = 0;
+    for (std::size_t o = t * rows; o < o_end; o++) {
+      const float *row = x + o * C * inner;
+      if (inner == 1) {
+        count += 1;
+        const double inv_count = 1. / count;
+        for (std::size_t c = 0; c < C; c++) {
+          const double delta = row[c] - m[c];
+          m[c] += delta * inv_count;
+          m2[c] += delta * (row[c] - m[c]);
+        }
+      } else {
+        for (std::size_t c = 0; c < C; c++) {
+          double segment_mean, segment_m2;
+          segment_moments(row + c * inner, inner, segment_mean, segment_m2);
+          merge_moments(count, m[c], m2[c], inner, segment_mean, segment_m2);
+        }
+        count += inner;
+      }
+    }
+  });
+
+  const double task_count = static_cast<double>(rows * inner);
+  for (std::size_t c = 0; c < C; c++) {
+    double m = moments[c];
+    double m2 = moments[C + c];
+    double count = std::min(rows, outer) * inner;
+    for (std::size_t t = 1; t < tasks; t++) {
+      const double n =
+          t + 1 < tasks ? task_count
+                        : static_cast<double>((outer - t * rows) * inner);
+      merge_moments(count, m, m2, n, moments[t * 2 * C + c],
+                    moments[t * 2 * C + C + c]);
+      count += n;
+    }
+    mean[c] = static_cast<float>(m);
+    var[c] = static_cast<float>(m2 / count);
+  }
+}
+
+// y = x * scale[c] + shift[c], i.e. normalization and the affine transform
+// folded into one multiply-add per element. y may alias x.
+inline void channel_affine(const std::size_t outer, const std::size_t C,
+                           const std::size_t inner, const float *x,
+                           const float *scale, const float *shift, float *y) {
+  using namespace batchnorm_detail;
+  const std::size_t rows = rows_per_task(C, inner);
+  const std::size_t tasks = (outer + rows - 1) / rows;
+  const bool parallel = gemm_detail::kParallelWork <= outer * C * inner;
+  gemm_detail::parallel_for(parallel, tasks, [&](const std::size_t t) {
+    const std::size_t o_end = std::min(outer, (t + 1) * rows);
+    for (std::size_t o = t * rows; o < o_end; o++) {
+      const float *src = x + o * C * inner;
+      float *dst = y + o * C * inner;
+      if (inner == 1) {
+        for (std::size_t c = 0; c < C; c++) {
+          dst[c] = src[c] * scale[c] + shift[c];
+        }
+      } else {
+        for (std::size_t c = 0; c < C; c++) {
+          const float a = scale[c];
+          const float b = shift[c];
+          for (std::size_t i = 0; i < inner; i++) {
+            dst[c * inner + i] = src[c * inner + i] * a + b;
+          }
+        }
+      }
+    }
+  });
+}
+
+// the reductions of batchnorm's backward: sum_gy[c] of gy and
+// sum_gy_xhat[c] of gy * xhat with xhat = (x - mean[c]) * inv_std[c], i.e.
+// the gradients of beta and gamma.
+inline void channel_grad_sums(const std::size_t outer, const std::size_t C,
+                              const std::size_t inner, const float *x,
+                              const float *gy, const float *mean,
+                              const float *inv_std, float *sum_gy,
+                              float *sum_gy_xhat) {
+  using namespace batchnorm_detail;
+  const std::size_t rows = rows_per_task(C, inner);
+  const std::size_t tasks = (outer + rows - 1) / rows;
+  const bool parallel = gemm_detail::kParallelWork <= outer * C * inner;
+  // {sum of gy, sum of gy * (x - mean)} of every channel, per task
+  std::vector<double> sums(tasks * 2 * C, 0.);
+
+  gemm_detail::parallel_for(parallel, tasks, [&](const std::size_t t) {
+    double *s = sums.data() + t * 2 * C;
+    double *sx = s + C;
+    const std::size_t o_end = std::min(outer, (t + 1) * rows);
+    for (std::size_t o = t * rows; o < o_end; o++) {
+      const float *x_row = x + o * C * inner;
+      const float *g_row = gy + o * C * inner;
+      if (inner == 1) {
+        for (std::size_t c = 0; c < C; c++) {
+          s[c] += g_row[c];
+          sx[c] += g_row[c] * (x_row[c] - mean[c]);
+        }
+        continue;
+      }
+      for (std::size_t c = 0; c < C; c++) {
+        const float *xs = x_row + c * inner;
+        const float *gs = g_row + c * inner;
+        const float m = mean[c];
+        float acc[8] = {}, acc_x[8] = {};
+        std::size_t i = 0;
+        for (; i + 8 <= inner; i += 8) {
+          for (std::size_t j = 0; j < 8; j++) {
+            acc[j] += gs[i + j];
+            acc_x[j] += gs[i + j] * (xs[i + j] - m);
+          }
+        }
+        for (; i < inner; i++) {
+          s[c] += gs[i];
+          sx[c] += gs[i] * (xs[i] - m);
+        }
+        for (std::size_t j = 0; j < 8; j++) {
+          s[c] += acc[j];
+          sx[c] += acc_x[j];
+        }
+      }
+    }
+  });
+
+  for (std::size_t c = 0; c < C; c++) {
+    double s = 0, sx = 0;
+    for (std::size_t t = 0; t < tasks; t++) {
+      s += sums[t * 2 * C + c];
+      sx += sums[t * 2 * C + C + c];
+    }
+    sum_gy[c] = static_cast<float>(s);
+    sum_gy_xhat[c] = static_cast<float>(sx * inv_std[c]);
+  }
+}
+
+// the input gradient of batchnorm from the sums of channel_grad_sums. with
+// batch statistics, M = outer * inner values per channel and
+// a = gamma[c] * inv_std[c],
+//   gx = a * (gy - sum_gy / M - xhat * sum_gy_xhat / M),
+// expanded to gx = a * gy + b[c] * (x - mean[c]) + d[c]. with running
+// statistics the mean and variance are constants and gx = a * gy. gamma may
+// be null for 1. gx may alias gy.
+inline void channel_input_grad(const std::size_t outer, const std::size_t C,
+                               const std::size_t inner, const float *x,
+                               const float *gy, const float *gamma,
+                               const float *mean, const float *inv_std,
+                               const float *sum_gy, const float *sum_gy_xhat,
+                               const bool batch_stats, float *gx) {
+  using namespace batchnorm_detail;
+  std::vector<float> a(C), b(C, 0.f), d(C, 0.f);
+  const double count = static_cast<double>(outer * inner);
+  for (std::size_t c = 0; c < C; c++) {
+    a[c] = (gamma ? gamma[c] : 1.f) * inv_std[c];
+    if (batch_stats) {
+      b[c] = static_cast<float>(-a[c] * inv_std[c] * sum_gy_xhat[c] / count);
+      d[c] = static_cast<float>(-a[c] * sum_gy[c] / count);
+    }
+  }
+
+  const std::size_t rows = rows_per_task(C, inner);
+  const std::size_t tasks = (outer + rows - 1) / rows;
+  const bool parallel = gemm_detail::kParallelWork <= outer * C * inner;
+  gemm_detail::parallel_for(parallel, tasks, [&](const std::size_t t) {
+    const std::size_t o_end = std::min(outer, (t + 1) * rows);
+    for (std::size_t o = t * rows; o < o_end; o++) {
+      const float *x_row = x + o * C * inner;
+      const float *g_row = gy + o * C * inner;
+      float *dst = gx + o * C * inner;
+      if (inner == 1) {
+        for (std::size_t c = 0; c < C; c++) {
+          dst[c] = a[c] * g_row[c] + b[c] * (x_row[c] - mean[c]) + d[c];
+        }
+      } else {
+        for (std::size_t c = 0; c < C; c++) {
+          const float ac = a[c], bc = b[c], dc = d[c], m = mean[c];
+          for (std::size_t i = c * inner; i < (c + 1) * inner; i++) {
+            dst[i] = ac * g_row[i] + bc * (x_row[i] - m) + dc;
+          }
+        }
+      }
+    }
+  });
+}
+
+} // namespace kernel
+} // namespace kuu
+
+#endif // KUU_KERNELS_BATCHNORM_HPP
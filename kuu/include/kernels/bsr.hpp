@@ -0,0 +1,419 @@
+#ifndef KUU_KERNELS_BSR_HPP
+#define KUU_KERNELS_BSR_HPP
+
+#include "kernels/gemm.hpp"
+#include <algorithm>
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <numeric>
+#include <vector>
+
+// products with a pruned weight B {K, N} in block sparse row format. a
+// block is one row k of B over kBsrBlock consecutive columns, and blocks
+// that are all zero are not stored, so their multiply-adds are skipped
+// altogether rather than done on zeros. the inner loops run over the
+// kBsrBlock columns of a block, i.e. whole SIMD registers.
+
+namespace kuu {
+namespace kernel {
+
+constexpr std::size_t kBsrBlock = 16;
+// share of stored blocks above which the dense GEMM is faster, for
+// bsr_gemm and for bsr_gemm_nt
+constexpr double kBsrMaxDensity = 0.5;
+constexpr double kBsrMaxDensityNt = 0.3;
+
+// op(B) {K, N}. the blocks of each column block are kept in ascending k,
+// and indexed once more by k for the transposed product.
+struct bsr_matrix {
+  std::size_t k = 0;
+  std::size_t n = 0;
+  std::vector<std::size_t> block_ptr; // column blocks + 1, into the blocks
+  std::vector<std::uint32_t> rows;    // k of each block
+  std::vector<std::uint32_t> cols;    // first column of each block
+  std::vector<float> values;          // kBsrBlock per block, zero past n
+  std::vector<std::size_t> row_ptr;   // K + 1, into row_blocks
+  std::vector<std::size_t> row_blocks; // blocks in k order
+
+  std::size_t column_blocks() const { return block_ptr.size() - 1; }
+  std::size_t stored_blocks() const { return rows.size(); }
+  // stored blocks over all blocks
+  double density() const {
+    const std::size_t all = k * column_blocks();
+    return all == 0 ? 1. : static_cast<double>(stored_blocks()) / all;
+  }
+};
+
+inline bsr_matrix pack_bsr(const bool trans_b, const std::size_t K,
+                           const std::size_t N, const float *B,
+                           const std::size_t ldb) {
+  bsr_matrix m;
+  m.k = K;
+  m.n = N;
+  const std::size_t column_blocks = (N + kBsrBlock - 1) / kBsrBlock;
+  m.block_ptr.assign(1, 0);
+  std::vector<std::size_t> row_count(K + 1, 0);
+  for (std::size_t jb = 0; jb < column_blocks; jb++) {
+    const std::size_t j0 = jb * kBsrBlock;
+    const std::size_t cols = std::min(kBsrBlock, N - j0);
+    for (std::size_t p = 0; p < K; p++) {
+      float block[kBsrBlock] = {};
+      bool stored = false;
+      for (std::size_t c = 0; c < cols; c++) {
+        block[c] = trans_b ? B[(j0 + c) * ldb + p] : B[p * ldb + j0 + c];
+        stored = stored || block[c] != 0.f;
+      }
+      if (stored) {
+        m.rows.push_back(static_cast<std::uint32_t>(p));
+        m.cols.push_back(static_cast<std::uint32_t>(j0));
+        m.values.insert(m.values.end(), block, block + kBsrBlock);
+        row_count[p + 1]++;
+      }
+    }
+    m.block_ptr.push_back(m.rows.size());
+  }
+  m.row_ptr.resize(K + 1);
+  std::partial_sum(row_count.begin(), row_count.end(), m.row_ptr.begin());
+  m.row_blocks.resize(m.rows.size());
+  std::vector<std::size_t> next(m.row_ptr.begin(), m.row_ptr.end() - 1);
+  for (std::size_t b = 0; b < m.rows.size(); b++) {
+    m.row_blocks[next[m.rows[b]]++] = b;
+  }
+  return m;
+}
+
+// acc[r * kBsrBlock + c] = sum over the count blocks of
+// a[r * lda + ks[b]] * values[b * kBsrBlock + c], for r < rows <= mr.
+using bsr_kernel_fn = void (*)(std::size_t rows, std::size_t count,
+                               const std::uint32_t *ks, const float *values,
+                               const float *a, std::size_t lda, float *acc);
+
+// c[r * ldc + p] = row r of g dotted with row p of B, for p < B.k and
+// r < rows <= mr. g is read up to the end of the last column block.
+using bsr_nt_kernel_fn = void (*)(std::size_t rows, const bsr_matrix &B,
+                                  const float *g, std::size_t ldg, float *c,
+                                  std::size_t ldc);
+
+struct bsr_kernel {
+  const char *name;
+  std::size_t mr;
+  bsr_kernel_fn fn;
+  bsr_nt_kernel_fn nt;
+};
+
+namespace bsr_detail {
+
+template <std::size_t MR>
+void kernel_generic(const std::size_t rows, const std::size_t count,
+                    const std::uint32_t *ks, const float *values,
+                    const float *a, const std::size_t lda, float *acc) {
+  std::fill(acc, acc + rows * kBsrBlock, 0.f);
+  for (std::size_t b = 0; b < count; b++) {
+    const float *w = values + b * kBsrBlock;
+    for (std::size_t r = 0; r < rows; r++) {
+      const float x = a[r * lda + ks[b]];
+      for (std::size_t c = 0; c < kBsrBlock; c++) {
+        acc[r * kBsrBlock + c] += x * w[c];
+      }
+    }
+  }
+}
+
+template <std::size_t MR>
+void nt_kernel_generic(const std::size_t rows, const bsr_matrix &B,
+                       const float *g, const std::size_t ldg, float *c,
+                       const std::size_t ldc) {
+  for (std::size_t p = 0; p < B.k; p++) {
+    for (std::size_t r = 0; r < rows; r++) {
+      float acc[kBsrBlock] = {};
+      for (std::size_t s = B.row_ptr[p]; s < B.row_ptr[p + 1]; s++) {
+        const std::size_t b = B.row_blocks[s];
+        const float *w = B.values.data() + b * kBsrBlock;
+        const float *gj = g + r * ldg + B.cols[b];
+        for (std::size_t j = 0; j < kBsrBlock; j++) {
+          acc[j] += gj[j] * w[j];
+        }
+      }
+      c[r * ldc + p] = std::accumulate(acc, acc + kBsrBlock, 0.f);
+    }
+  }
+}
+
+#ifdef KUU_GEMM_X86
+template <std::size_t R>
+__attribute__((target("avx512f"))) inline void
+tile_avx512(const std::size_t count, const std::uint32_t *ks,
+            const float *values, const float *a, const std::size_t lda,
+            float *acc) {
+  __m512 c[R];
+#pragma GCC unroll 8
+  for (std::size_t r = 0; r < R; r++) {
+    c[r] = _mm512_setzero_ps();
+  }
+  for (std::size_t b = 0; b < count; b++) {
+    const __m512 w = _mm512_loadu_ps(values + b * kBsrBlock);
+    const float *x = a + ks[b];
+#pragma GCC unroll 8
+    for (std::size_t r = 0; r < R; r++) {
+      c[r] = _mm512_fmadd_ps(_mm512_set1_ps(x[r * lda]), w, c[r]);
+    }
+  }
+#pragma GCC unroll 8
+  for (std::size_t r = 0; r < R; r++) {
+    _mm512_storeu_ps(acc + r * kBsrBlock, c[r]);
+  }
+}
+
+__attribute__((target("avx512f"))) inline void
+kernel_avx512(const std::size_t rows, const std::size_t count,
+              const std::uint32_t *ks, const float *values, const float *a,
+              const std::size_t lda, float *acc) {
+  switch (rows) {
+  case 8: tile_avx512<8>(count, ks, values, a, lda, acc); break;
+  case 7: tile_avx512<7>(count, ks, values, a, lda, acc); break;
+  case 6: tile_avx512<6>(count, ks, values, a, lda, acc); break;
+  case 5: tile_avx512<5>(count, ks, values, a, lda, acc); break;
+  case 4: tile_avx512<4>(count, ks, values, a, lda, acc); break;
+  case 3: tile_avx512<3>(count, ks, values, a, lda, acc); break;
+  case 2: tile_avx512<2>(count, ks, values, a, lda, acc); break;
+  default: tile_avx512<1>(count, ks, values, a, lda, acc); break;
+  }
+}
+
+// _mm512_reduce_add_ps. GCC's version, and _mm512_castps512_ps256, extract
+// the halves into undefined registers, which -Wmaybe-uninitialized reports;
+// the zero-masked extracts are the same instructions.
+__attribute__((target("avx512f"))) inline float reduce_add_avx512(__m512 v) {
+  const __m512d d = _mm512_castps_pd(v);
+  const __m256 lo = _mm256_castpd_ps(_mm512_maskz_extractf64x4_pd(0xF, d, 0));
+  const __m256 hi = _mm256_castpd_ps(_mm512_maskz_extractf64x4_pd(0xF, d, 1));
+  const __m256 s = _mm256_add_ps(lo, hi);
+  __m128 q = _mm_add_ps(_mm256_castps256_ps128(s), _mm256_extractf128_ps(s, 1));
+  q = _mm_add_ps(q, _mm_movehl_ps(q, q));
+  q = _mm_add_ss(q, _mm_movehdup_ps(q));
+  return _mm_cvtss_f32(q);
+}
+
+template <std::size_t R>
+__attribute__((target("avx512f"))) inline void
+nt_tile_avx512(const bsr_matrix &B, const float *g, const std::size_t ldg,
+               float *c, const std::size_t ldc) {
+  for (std::size_t p = 0; p < B.k; p++) {
+    __m512 acc[R] = {};
+    for (std::size_t s = B.row_ptr[p]; s < B.row_ptr[p + 1]; s++) {
+      const std::size_t b = B.row_blocks[s];
+      const __m512 w = _mm512_loadu_ps(B.values.data() + b * kBsrBlock);
+      const float *gj = g + B.cols[b];
+#pragma GCC unroll 8
+      for (std::size_t r = 0; r < R; r++) {
+        acc[r] = _mm512_fmadd_ps(_mm512_loadu_ps(gj + r * ldg), w, acc[r]);
+      }
+    }
+#pragma GCC unroll 8
+    for (std::size_t r = 0; r < R; r++) {
+      c[r * ldc + p] = reduce_add_avx512(acc[r]);
+    }
+  }
+}
+
+__attribute__((target("avx512f"))) inline void
+nt_kernel_avx512(const std::size_t rows, const bsr_matrix &B, const float *g,
+                 const std::size_t ldg, float *c, const std::size_t ldc) {
+  switch (rows) {
+  case 8: nt_tile_avx512<8>(B, g, ldg, c, ldc); break;
+  case 7: nt_tile_avx512<7>(B, g, ldg, c, ldc); break;
+  case 6: nt_tile_avx512<6>(B, g, ldg, c, ldc); break;
+  case 5: nt_tile_avx512<5>(B, g, ldg, c, ldc); break;
+  case 4: nt_tile_avx512<4>(B, g, ldg, c, ldc); break;
+  case 3: nt_tile_avx512<3>(B, g, ldg, c, ldc); break;
+  case 2: nt_tile_avx512<2>(B, g, ldg, c, ldc); break;
+  default: nt_tile_avx512<1>(B, g, ldg, c, ldc); break;
+  }
+}
+
+template <std::size_t R>
+__attribute__((target("avx2,fma"))) inline void
+tile_avx2(const std::size_t count, const std::uint32_t *ks,
+          const float *values, const float *a, const std::size_t lda,
+          float *acc) {
+  __m256 lo[R], hi[R];
+#pragma GCC unroll 6
+  for (std::size_t r = 0; r < R; r++) {
+    lo[r] = _mm256_setzero_ps();
+    hi[r] = _mm256_setzero_ps();
+  }
+  for (std::size_t b = 0; b < count; b++) {
+    const __m256 w0 = _mm256_loadu_ps(values + b * kBsrBlock);
+    const __m256 w1 = _mm256_loadu_ps(values + b * kBsrBlock + 8);
+    const float *x = a + ks[b];
+#pragma GCC unroll 6
+    for (std::size_t r = 0; r < R; r++) {
+      const __m256 v = _mm256_broadcast_ss(x + r * lda);
+      lo[r] = _mm256_fmadd_ps(v, w0, lo[r]);
+      hi[r] = _mm256_fmadd_ps(v, w1, hi[r]);
+    }
+  }
+#pragma GCC unroll 6
+  for (std::size_t r = 0; r < R; r++) {
+    _mm256_storeu_ps(acc + r * kBsrBlock, lo[r]);
+    _mm256_storeu_ps(acc + r * kBsrBlock + 8, hi[r]);
+  }
+}
+
+__attribute__((target("avx2,fma"))) inline void
+kernel_avx2(const std::size_t rows, const std::size_t count,
+            const std::uint32_t *ks, const float *values, const float *a,
+            const std::size_t lda, float *acc) {
+  switch (rows) {
+  case 6: tile_avx2<6>(count, ks, values, a, lda, acc); break;
+  case 5: tile_avx2<5>(count, ks, values, a, lda, acc); break;
+  case 4: tile_avx2<4>(count, ks, values, a, lda, acc); break;
+  case 3: tile_avx2<3>(count, ks, values, a, lda, acc); break;
+  case 2: tile_avx2<2>(count, ks, values, a, lda, acc); break;
+  default: tile_avx2<1>(count, ks, values, a, lda, acc); break;
+  }
+}
+template <std::size_t R>
+__attribute__((target("avx2,fma"))) inline void
+nt_tile_avx2(const bsr_matrix &B, const float *g, const std::size_t ldg,
+             float *c, const std::size_t ldc) {
+  for (std::size_t p = 0; p < B.k; p++) {
+    __m256 acc[R];
+#pragma GCC unroll 6
+    for (std::size_t r = 0; r < R; r++) {
+      acc[r] = _mm256_setzero_ps();
+    }
+    for (std::size_t s = B.row_ptr[p]; s < B.row_ptr[p + 1]; s++) {
+      const std::size_t b = B.row_blocks[s];
+      const __m256 w0 = _mm256_loadu_ps(B.values.data() + b * kBsrBlock);
+      const __m256 w1 = _mm256_loadu_ps(B.values.data() + b * kBsrBlock + 8);
+      const float *gj = g + B.cols[b];
+#pragma GCC unroll 6
+      for (std::size_t r = 0; r < R; r++) {
+        acc[r] = _mm256_fmadd_ps(_mm256_loadu_ps(gj + r * ldg), w0, acc[r]);
+        acc[r] =
+            _mm256_fmadd_ps(_mm256_loadu_ps(gj + r * ldg + 8), w1, acc[r]);
+      }
+    }
+#pragma GCC unroll 6
+    for (std::size_t r = 0; r < R; r++) {
+      const __m128 h = _mm_add_ps(_mm256_castps256_ps128(acc[r]),
+                                  _mm256_extractf128_ps(acc[r], 1));
+      const __m128 q = _mm_add_ps(h, _mm_movehl_ps(h, h));
+      c[r * ldc + p] = _mm_cvtss_f32(_mm_add_ss(q, _mm_movehdup_ps(q)));
+    }
+  }
+}
+
+__attribute__((target("avx2,fma"))) inline void
+nt_kernel_avx2(const std::size_t rows, const bsr_matrix &B, const float *g,
+               const std::size_t ldg, float *c, const std::size_t ldc) {
+  switch (rows) {
+  case 6: nt_tile_avx2<6>(B, g, ldg, c, ldc); break;
+  case 5: nt_tile_avx2<5>(B, g, ldg, c, ldc); break;
+  case 4: nt_tile_avx2<4>(B, g, ldg, c, ldc); break;
+  case 3: nt_tile_avx2<3>(B, g, ldg, c, ldc); break;
+  case 2: nt_tile_avx2<2>(B, g, ldg, c, ldc); break;
+  default: nt_tile_avx2<1>(B, g, ldg, c, ldc); break;
+  }
+}
+#endif // KUU_GEMM_X86
+
+// rows of C per task
+constexpr std::size_t kRowsPerTask = 64;
+
+} // namespace bsr_detail
+
+// every BSR kernel this machine can run, fastest first.
+inline const std::vector<bsr_kernel> &available_bsr_kernels() {
+  static const std::vector<bsr_kernel> kernels = [] {
+    std::vector<bsr_kernel> v;
+#ifdef KUU_GEMM_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f")) {
+      v.push_back({"avx512", 8, &bsr_detail::kernel_avx512,
+                   &bsr_detail::nt_kernel_avx512});
+    }
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+      v.push_back(
+          {"avx2", 6, &bsr_detail::kernel_avx2, &bsr_detail::nt_kernel_avx2});
+    }
+#endif
+    v.push_back({"generic", 4, &bsr_detail::kernel_generic<4>,
+                 &bsr_detail::nt_kernel_generic<4>});
+    return v;
+  }();
+  return kernels;
+}
+
+inline const bsr_kernel &default_bsr_kernel() {
+  return available_bsr_kernels().front();
+}
+
+// C {M, N} = A {M, K} * B + bias, bias being {N} or null.
+inline void bsr_gemm(const std::size_t M, const float *A,
+                     const std::size_t lda, const bsr_matrix &B,
+                     const float *bias, float *C, const std::size_t ldc,
+                     const bsr_kernel &uk = default_bsr_kernel()) {
+  const std::size_t row_tasks =
+      (M + bsr_detail::kRowsPerTask - 1) / bsr_detail::kRowsPerTask;
+  const std::size_t column_blocks = B.column_blocks();
+  const bool parallel =
+      gemm_detail::kParallelWork <= M * B.stored_blocks() * kBsrBlock;
+  gemm_detail::parallel_for(
+      parallel, row_tasks * column_blocks, [&](std::size_t t) {
+        const std::size_t jb = t % column_blocks;
+        const std::size_t i_end =
+            std::min(M, (t / column_blocks + 1) * bsr_detail::kRowsPerTask);
+        const std::size_t j0 = jb * kBsrBlock;
+        const std::size_t cols = std::min(kBsrBlock, B.n - j0);
+        const std::size_t b0 = B.block_ptr[jb];
+        const std::size_t count = B.block_ptr[jb + 1] - b0;
+        float acc[8 * kBsrBlock];
+        assert(uk.mr <= 8);
+        for (std::size_t i = (t / column_blocks) * bsr_detail::kRowsPerTask;
+             i < i_end; i += uk.mr) {
+          const std::size_t rows = std::min(uk.mr, i_end - i);
+          uk.fn(rows, count, B.rows.data() + b0,
+                B.values.data() + b0 * kBsrBlock, A + i * lda, lda, acc);
+          for (std::size_t r = 0; r < rows; r++) {
+            float *c = C + (i + r) * ldc + j0;
+            for (std::size_t j = 0; j < cols; j++) {
+              c[j] = acc[r * kBsrBlock + j] + (bias ? bias[j0 + j] : 0.f);
+            }
+          }
+        }
+      });
+}
+
+// C {M, K} = G {M, N} * B^T. each C(i, k) is the dot product of row i of G
+// with the stored blocks of row k of B. when N is not a multiple of
+// kBsrBlock, G is first copied with rows padded to whole blocks.
+inline void bsr_gemm_nt(const std::size_t M, const float *G,
+                        const std::size_t ldg, const bsr_matrix &B, float *C,
+                        const std::size_t ldc,
+                        const bsr_kernel &uk = default_bsr_kernel()) {
+  std::vector<float> padded;
+  std::size_t ld = ldg;
+  if (B.n % kBsrBlock != 0) {
+    ld = B.column_blocks() * kBsrBlock;
+    padded.assign(M * ld, 0.f);
+    for (std::size_t i = 0; i < M; i++) {
+      std::copy(G + i * ldg, G + i * ldg + B.n, padded.data() + i * ld);
+    }
+    G = padded.data();
+  }
+  const std::size_t tiles = (M + uk.mr - 1) / uk.mr;
+  const bool parallel =
+      gemm_detail::kParallelWork <= M * B.stored_blocks() * kBsrBlock;
+  gemm_detail::parallel_for(parallel, tiles, [&](std::size_t t) {
+    const std::size_t i = t * uk.mr;
+    uk.nt(std::min(uk.mr, M - i), B, G + i * ld, ld, C + i * ldc, ldc);
+  });
+}
+
+} // namespace kernel
+} // namespace kuu
+
+#endif // KUU_KERNELS_BSR_HPP
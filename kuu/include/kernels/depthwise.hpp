@@ -0,0 +1,340 @@
+#ifndef KUU_KERNELS_DEPTHWISE_HPP
+#define KUU_KERNELS_DEPTHWISE_HPP
+
+#include <algorithm>
+#include <cstddef>
+#include <execution>
+#include <numeric>
+#include <vector>
+
+// direct kernels for depthwise convolution (groups == C_in). output channel
+// co reads input channel co / multiplier, where multiplier = C_out / C_in.
+// the innermost loops run over contiguous memory (a row of W for NCHW, the
+// channels for NHWC) so that they are vectorized by the compiler.
+
+namespace kuu {
+namespace kernel {
+
+struct conv2d_geometry {
+  std::size_t N;
+  std::size_t C_in;
+  std::size_t H;
+  std::size_t W;
+  std::size_t C_out;
+  std::size_t H_f;
+  std::size_t W_f;
+  std::size_t stride_h;
+  std::size_t stride_w;
+  std::size_t pad_h;
+  std::size_t pad_w;
+
+  std::size_t H_out() const { return (H + 2 * pad_h - H_f) / stride_h + 1; }
+  std::size_t W_out() const { return (W + 2 * pad_w - W_f) / stride_w + 1; }
+  std::size_t multiplier() const { return C_out / C_in; }
+};
+
+namespace detail {
+// [lo, hi) of output columns j whose input column j * stride + q - pad is
+// inside [0, W).
+inline void valid_range(const std::ptrdiff_t q, const std::ptrdiff_t pad,
+                        const std::ptrdiff_t stride, const std::ptrdiff_t W,
+                        const std::ptrdiff_t W_out, std::ptrdiff_t &lo,
+                        std::ptrdiff_t &hi) {
+  const std::ptrdiff_t offset = q - pad;
+  lo = offset < 0 ? (-offset + stride - 1) / stride : 0;
+  hi = W - 1 - offset < 0 ? 0 : (W - 1 - offset) / stride + 1;
+  hi = std::min(hi, W_out);
+  lo = std::min(lo, hi);
+}
+
+inline std::vector<std::size_t> iota(const std::size_t n) {
+  std::vector<std::size_t> v(n);
+  std::iota(v.begin(), v.end(), 0);
+  return v;
+}
+} // namespace detail
+
+// x {N, C_in, H, W}, w {C_out, 1, H_f, W_f}, bias {C_out} or nullptr,
+// y {N, C_out, H_out, W_out}
+inline void depthwise_forward_nchw(const float *x, const float *w,
+                                   const float *bias, float *y,
+                                   const conv2d_geometry &g) {
+  const std::ptrdiff_t H = g.H, W = g.W;
+  const std::ptrdiff_t H_out = g.H_out(), W_out = g.W_out();
+  const std::ptrdiff_t sh = g.stride_h, sw = g.stride_w;
+  const std::ptrdiff_t ph = g.pad_h, pw = g.pad_w;
+  const std::size_t M = g.multiplier();
+
+  auto planes = detail::iota(g.N * g.C_out);
+  std::for_each(
+      std::execution::par, planes.begin(), planes.end(), [&](std::size_t nc) {
+        const std::size_t n = nc / g.C_out;
+        const std::size_t co = nc % g.C_out;
+        const float *xp = x + (n * g.C_in + co / M) * H * W;
+        const float *wp = w + co * g.H_f * g.W_f;
+        float *yp = y + nc * H_out * W_out;
+        std::fill(yp, yp + H_out * W_out, bias ? bias[co] : 0.f);
+
+        for (std::ptrdiff_t i = 0; i < H_out; i++) {
+          float *__restrict yrow = yp + i * W_out;
+          for (std::ptrdiff_t p = 0; p < static_cast<std::ptrdiff_t>(g.H_f);
+               p++) {
+            const std::ptrdiff_t h = i * sh + p - ph;
+            if (h < 0 || H <= h) {
+              continue;
+            }
+            const float *__restrict xrow = xp + h * W;
+            for (std::ptrdiff_t q = 0; q < static_cast<std::ptrdiff_t>(g.W_f);
+                 q++) {
+              const float wv = wp[p * g.W_f + q];
+              std::ptrdiff_t lo, hi;
+              detail::valid_range(q, pw, sw, W, W_out, lo, hi);
+              if (sw == 1) {
+                const float *__restrict xs = xrow + q - pw;
+                for (std::ptrdiff_t j = lo; j < hi; j++) {
+                  yrow[j] += wv * xs[j];
+                }
+              } else {
+                for (std::ptrdiff_t j = lo; j < hi; j++) {
+                  yrow[j] += wv * xrow[j * sw + q - pw];
+                }
+              }
+            }
+          }
+        }
+      });
+}
+
+// gx {N, C_in, H, W} and gw {C_out, 1, H_f, W_f} are overwritten. either may
+// be nullptr when that gradient is not needed.
+inline void depthwise_backward_nchw(const float *x, const float *w,
+                                    const float *gy, float *gx, float *gw,
+                                    const conv2d_geometry &g) {
+  const std::ptrdiff_t H = g.H, W = g.W;
+  const std::ptrdiff_t H_out = g.H_out(), W_out = g.W_out();
+  const std::ptrdiff_t sh = g.stride_h, sw = g.stride_w;
+  const std::ptrdiff_t ph = g.pad_h, pw = g.pad_w;
+  const std::size_t M = g.multiplier();
+  const std::size_t K = g.H_f * g.W_f;
+
+  // each task owns one input channel and its M output channels, so neither
+  // gx nor gw is shared between tasks.
+  auto channels = detail::iota(g.C_in);
+  std::for_each(
+      std::execution::par, channels.begin(), channels.end(),
+      [&](std::size_t ci) {
+        if (gw) {
+          std::fill(gw + ci * M * K, gw + (ci + 1) * M * K, 0.f);
+        }
+        for (std::size_t n = 0; n < g.N; n++) {
+          const float *xp = x + (n * g.C_in + ci) * H * W;
+          float *gxp = gx ? gx + (n * g.C_in + ci) * H * W : nullptr;
+          if (gxp) {
+            std::fill(gxp, gxp + H * W, 0.f);
+          }
+          for (std::size_t m = 0; m < M; m++) {
+            const std::size_t co = ci * M + m;
+            const float *gyp = gy + (n * g.C_out + co) * H_out * W_out;
+            const float *wp = w + co * K;
+            float *gwp = gw ? gw + co * K : nullptr;
+
+            for (std::ptrdiff_t i = 0; i < H_out; i++) {
+              const float *__restrict gyrow = gyp + i * W_out;
+              for (std::ptrdiff_t p = 0;
+                   p < static_cast<std::ptrdiff_t>(g.H_f); p++) {
+                const std::ptrdiff_t h = i * sh + p - ph;
+                if (h < 0 || H <= h) {
+                  continue;
+                }
+                const float *__restrict xrow = xp + h * W;
+                for (std::ptrdiff_t q = 0;
+                     q < static_cast<std::ptrdiff_t>(g.W_f); q++) {
+                  std::ptrdiff_t lo, hi;
+                  detail::valid_range(q, pw, sw, W, W_out, lo, hi);
+                  const std::ptrdiff_t offset = q - pw;
+                  if (gwp) {
+                    float acc = 0.f;
+                    for (std::ptrdiff_t j = lo; j < hi; j++) {
+                      acc += gyrow[j] * xrow[j * sw + offset];
+                    }
+                    gwp[p * g.W_f + q] += acc;
+                  }
+                  if (gxp) {
+                    const float wv = wp[p * g.W_f + q];
+                    float *__restrict gxrow = gxp + h * W;
+                    for (std::ptrdiff_t j = lo; j < hi; j++) {
+                      gxrow[j * sw + offset] += wv * gyrow[j];
+                    }
+                  }
+                }
+              }
+            }
+          }
+        }
+      });
+}
+
+// x {N, H, W, C_in}, w {C_out, 1, H_f, W_f}, bias {C_out} or nullptr,
+// y {N, H_out, W_out, C_out}
+inline void depthwise_forward_nhwc(const float *x, const float *w,
+                                   const float *bias, float *y,
+                                   const conv2d_geometry &g) {
+  const std::ptrdiff_t H = g.H, W = g.W;
+  const std::ptrdiff_t H_out = g.H_out(), W_out = g.W_out();
+  const std::ptrdiff_t sh = g.stride_h, sw = g.stride_w;
+  const std::ptrdiff_t ph = g.pad_h, pw = g.pad_w;
+  const std::size_t C_in = g.C_in, C_out = g.C_out;
+  const std::size_t M = g.multiplier();
+
+  // {H_f, W_f, C_out} so that a tap reads a contiguous run of channels
+  std::vector<float> wt(g.H_f * g.W_f * C_out);
+  for (std::size_t co = 0; co < C_out; co++) {
+    for (std::size_t k = 0; k < g.H_f * g.W_f; k++) {
+      wt[k * C_out + co] = w[co * g.H_f * g.W_f + k];
+    }
+  }
+
+  auto rows = detail::iota(g.N * H_out);
+  std::for_each(
+      std::execution::par, rows.begin(), rows.end(), [&](std::size_t ni) {
+        const std::ptrdiff_t n = ni / H_out;
+        const std::ptrdiff_t i = ni % H_out;
+        for (std::ptrdiff_t j = 0; j < W_out; j++) {
+          float *__restrict yv = y + (ni * W_out + j) * C_out;
+          if (bias) {
+            std::copy(bias, bias + C_out, yv);
+          } else {
+            std::fill(yv, yv + C_out, 0.f);
+          }
+          for (std::ptrdiff_t p = 0; p < static_cast<std::ptrdiff_t>(g.H_f);
+               p++) {
+            const std::ptrdiff_t h = i * sh + p - ph;
+            if (h < 0 || H <= h) {
+              continue;
+            }
+            for (std::ptrdiff_t q = 0; q < static_cast<std::ptrdiff_t>(g.W_f);
+                 q++) {
+              const std::ptrdiff_t v = j * sw + q - pw;
+              if (v < 0 || W <= v) {
+                continue;
+              }
+              const float *__restrict xv = x + ((n * H + h) * W + v) * C_in;
+              const float *__restrict wv = wt.data() + (p * g.W_f + q) * C_out;
+              if (M == 1) {
+                for (std::size_t c = 0; c < C_out; c++) {
+                  yv[c] += wv[c] * xv[c];
+                }
+              } else {
+                for (std::size_t c = 0; c < C_in; c++) {
+                  for (std::size_t m = 0; m < M; m++) {
+                    yv[c * M + m] += wv[c * M + m] * xv[c];
+                  }
+                }
+              }
+            }
+          }
+        }
+      });
+}
+
+// gx {N, H, W, C_in} and gw {C_out, 1, H_f, W_f} are overwritten. either may
+// be nullptr when that gradient is not needed.
+inline void depthwise_backward_nhwc(const float *x, const float *w,
+                                    const float *gy, float *gx, float *gw,
+                                    const conv2d_geometry &g) {
+  const std::ptrdiff_t H = g.H, W = g.W;
+  const std::ptrdiff_t H_out = g.H_out(), W_out = g.W_out();
+  const std::ptrdiff_t sh = g.stride_h, sw = g.stride_w;
+  const std::ptrdiff_t ph = g.pad_h, pw = g.pad_w;
+  const std::size_t C_in = g.C_in, C_out = g.C_out;
+  const std::size_t M = g.multiplier();
+  const std::size_t K = g.H_f * g.W_f;
+
+  std::vector<float> wt(K * C_out);
+  for (std::size_t co = 0; co < C_out; co++) {
+    for (std::size_t k = 0; k < K; k++) {
+      wt[k * C_out + co] = w[co * K + k];
+    }
+  }
+
+  // one partial {H_f, W_f, C_out} weight gradient per sample, summed below.
+  std::vector<float> partial(gw ? g.N * K * C_out : 0, 0.f);
+
+  auto samples = detail::iota(g.N);
+  std::for_each(
+      std::execution::par, samples.begin(), samples.end(),
+      [&](std::size_t n) {
+        float *gxn = gx ? gx + n * H * W * C_in : nullptr;
+        if (gxn) {
+          std::fill(gxn, gxn + H * W * C_in, 0.f);
+        }
+        float *gwn = gw ? partial.data() + n * K * C_out : nullptr;
+        for (std::ptrdiff_t i = 0; i < H_out; i++) {
+          for (std::ptrdiff_t j = 0; j < W_out; j++) {
+            const float *__restrict gyv =
+                gy + ((n * H_out + i) * W_out + j) * C_out;
+            for (std::ptrdiff_t p = 0;
+                 p < static_cast<std::ptrdiff_t>(g.H_f); p++) {
+              const std::ptrdiff_t h = i * sh + p - ph;
+              if (h < 0 || H <= h) {
+                continue;
+              }
+              for (std::ptrdiff_t q = 0;
+                   q < static_cast<std::ptrdiff_t>(g.W_f); q++) {
+                const std::ptrdiff_t v = j * sw + q - pw;
+                if (v < 0 || W <= v) {
+                  continue;
+                }
+                const std::size_t offset = ((n * H + h) * W + v) * C_in;
+                const std::size_t tap = p * g.W_f + q;
+                const float *__restrict xv = x + offset;
+                const float *__restrict wv = wt.data() + tap * C_out;
+                if (M == 1) {
+                  if (gwn) {
+                    float *__restrict gwv = gwn + tap * C_out;
+                    for (std::size_t c = 0; c < C_out; c++) {
+                      gwv[c] += gyv[c] * xv[c];
+                    }
+                  }
+                  if (gxn) {
+                    float *__restrict gxv = gx + offset;
+                    for (std::size_t c = 0; c < C_in; c++) {
+                      gxv[c] += gyv[c] * wv[c];
+                    }
+                  }
+                } else {
+                  for (std::size_t c = 0; c < C_in; c++) {
+                    for (std::size_t m = 0; m < M; m++) {
+                      const std::size_t co = c * M + m;
+                      if (gwn) {
+                        gwn[tap * C_out + co] += gyv[co] * xv[c];
+                      }
+                      if (gxn) {
+                        gx[offset + c] += gyv[co] * wv[co];
+                      }
+                    }
+                  }
+                }
+              }
+            }
+          }
+        }
+      });
+
+  if (gw) {
+    for (std::size_t co = 0; co < C_out; co++) {
+      for (std::size_t k = 0; k < K; k++) {
+        float sum = 0.f;
+        for (std::size_t n = 0; n < g.N; n++) {
+          sum += partial[(n * K + k) * C_out + co];
+        }
+        gw[co * K + k] = sum;
+      }
+    }
+  }
+}
+
+} // namespace kernel
+} // namespace kuu
+
+#endif // KUU_KERNELS_DEPTHWISE_HPP
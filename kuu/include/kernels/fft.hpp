@@ -0,0 +1,227 @@
+#ifndef KUU_KERNELS_FFT_HPP
+#define KUU_KERNELS_FFT_HPP
+
+#include <cassert>
+#include <cmath>
+#include <complex>
+#include <cstddef>
+#include <vector>
+
+// references:
+// mixed-radix decimation in time as in KISS FFT
+// https://github.com/mborgerding/kissfft
+
+namespace kuu {
+namespace kernel {
+
+using complex_type = std::complex<float>;
+
+// smallest size >= n whose prime factors are only 2, 3 and 5.
+inline std::size_t fft_size(std::size_t n) {
+  if (n <= 1) {
+    return 1;
+  }
+  for (std::size_t m = n;; m++) {
+    std::size_t r = m;
+    for (std::size_t p : {2, 3, 5}) {
+      while (r % p == 0) {
+        r /= p;
+      }
+    }
+    if (r == 1) {
+      return m;
+    }
+  }
+}
+
+class fft_plan {
+public:
+  fft_plan() : fft_plan{1} {}
+  explicit fft_plan(const std::size_t n) : n_{n}, twiddles_(n) {
+    assert(0 < n);
+    const double pi = std::acos(-1.0);
+    for (std::size_t k = 0; k < n; k++) {
+      const double phase = -2.0 * pi * static_cast<double>(k) / n;
+      twiddles_[k] = complex_type(static_cast<float>(std::cos(phase)),
+                                  static_cast<float>(std::sin(phase)));
+    }
+    // {p0, m0, p1, m1, ...} where m_i = n / (p0 * ... * p_i)
+    std::size_t m = n;
+    std::size_t p = 4;
+    while (1 < m) {
+      while (m % p != 0) {
+        p = (p == 4) ? 2 : (p == 2) ? 3 : p + 2;
+        if (m < p * p) {
+          p = m;
+        }
+      }
+      m /= p;
+      factors_.push_back(p);
+      factors_.push_back(m);
+    }
+  }
+
+  std::size_t size() const noexcept { return n_; }
+
+  // in-place, unnormalized
+  void forward(complex_type *data, const std::size_t stride = 1) const {
+    transform(data, stride);
+  }
+
+  // in-place, scaled by 1 / n
+  void inverse(complex_type *data, const std::size_t stride = 1) const {
+    for (std::size_t i = 0; i < n_; i++) {
+      data[i * stride] = std::conj(data[i * stride]);
+    }
+    transform(data, stride);
+    const float scale = 1.f / static_cast<float>(n_);
+    for (std::size_t i = 0; i < n_; i++) {
+      data[i * stride] = std::conj(data[i * stride]) * scale;
+    }
+  }
+
+private:
+  void transform(complex_type *data, const std::size_t stride) const {
+    if (n_ == 1) {
+      return;
+    }
+    thread_local std::vector<complex_type> buffer;
+    buffer.resize(n_);
+    for (std::size_t i = 0; i < n_; i++) {
+      buffer[i] = data[i * stride];
+    }
+    if (stride == 1) {
+      work(data, buffer.data(), 1, factors_.data());
+    } else {
+      thread_local std::vector<complex_type> out;
+      out.resize(n_);
+      work(out.data(), buffer.data(), 1, factors_.data());
+      for (std::size_t i = 0; i < n_; i++) {
+        data[i * stride] = out[i];
+      }
+    }
+  }
+
+  void work(complex_type *out, const complex_type *in, const std::size_t fstride,
+            const std::size_t *factors) const {
+    const std::size_t p = factors[0];
+    const std::size_t m = factors[1];
+    if (m == 1) {
+      for (std::size_t q = 0; q < p; q++) {
+        out[q] = in[q * fstride];
+      }
+    } else {
+      for (std::size_t q = 0; q < p; q++) {
+        work(out + q * m, in + q * fstride, fstride * p, factors + 2);
+      }
+    }
+    switch (p) {
+    case 2:
+      butterfly2(out, fstride, m);
+      break;
+    case 4:
+      butterfly4(out, fstride, m);
+      break;
+    default:
+      butterfly(out, fstride, m, p);
+      break;
+    }
+  }
+
+  void butterfly2(complex_type *out, const std::size_t fstride,
+                  const std::size_t m) const {
+    complex_type *out2 = out + m;
+    for (std::size_t k = 0; k < m; k++) {
+      const complex_type t = out2[k] * twiddles_[k * fstride];
+      out2[k] = out[k] - t;
+      out[k] += t;
+    }
+  }
+
+  void butterfly4(complex_type *out, const std::size_t fstride,
+                  const std::size_t m) const {
+    for (std::size_t k = 0; k < m; k++) {
+      const complex_type s0 = out[k + m] * twiddles_[k * fstride];
+      const complex_type s1 = out[k + 2 * m] * twiddles_[2 * k * fstride];
+      const complex_type s2 = out[k + 3 * m] * twiddles_[3 * k * fstride];
+      const complex_type s5 = out[k] - s1;
+      const complex_type s3 = s0 + s2;
+      const complex_type s4 = s0 - s2;
+      // multiply by -i
+      const complex_type s4i(s4.imag(), -s4.real());
+      out[k] += s1;
+      out[k + 2 * m] = out[k] - s3;
+      out[k] += s3;
+      out[k + m] = s5 + s4i;
+      out[k + 3 * m] = s5 - s4i;
+    }
+  }
+
+  void butterfly(complex_type *out, const std::size_t fstride,
+                 const std::size_t m, const std::size_t p) const {
+    thread_local std::vector<complex_type> scratch;
+    scratch.resize(p);
+    for (std::size_t u = 0; u < m; u++) {
+      for (std::size_t q = 0; q < p; q++) {
+        scratch[q] = out[u + q * m];
+      }
+      for (std::size_t q1 = 0; q1 < p; q1++) {
+        const std::size_t k = u + q1 * m;
+        std::size_t twidx = 0;
+        complex_type sum = scratch[0];
+        for (std::size_t q = 1; q < p; q++) {
+          twidx += fstride * k;
+          if (n_ <= twidx) {
+            twidx %= n_;
+          }
+          sum += scratch[q] * twiddles_[twidx];
+        }
+        out[k] = sum;
+      }
+    }
+  }
+
+  std::size_t n_;
+  std::vector<std::size_t> factors_;
+  std::vector<complex_type> twiddles_;
+};
+
+// row-major {h, w} transform built from two 1-d plans.
+class fft2d_plan {
+public:
+  fft2d_plan(const std::size_t h, const std::size_t w)
+      : rows_{w}, cols_{h}, h_{h}, w_{w} {}
+
+  std::size_t height() const noexcept { return h_; }
+  std::size_t width() const noexcept { return w_; }
+  std::size_t size() const noexcept { return h_ * w_; }
+
+  void forward(complex_type *data) const {
+    for (std::size_t i = 0; i < h_; i++) {
+      rows_.forward(data + i * w_);
+    }
+    for (std::size_t j = 0; j < w_; j++) {
+      cols_.forward(data + j, w_);
+    }
+  }
+
+  void inverse(complex_type *data) const {
+    for (std::size_t j = 0; j < w_; j++) {
+      cols_.inverse(data + j, w_);
+    }
+    for (std::size_t i = 0; i < h_; i++) {
+      rows_.inverse(data + i * w_);
+    }
+  }
+
+private:
+  fft_plan rows_;
+  fft_plan cols_;
+  std::size_t h_;
+  std::size_t w_;
+};
+
+} // namespace kernel
+} // namespace kuu
+
+#endif // KUU_KERNELS_FFT_HPP
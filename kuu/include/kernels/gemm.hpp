@@ -0,0 +1,579 @@
+#ifndef KUU_KERNELS_GEMM_HPP
+#define KUU_KERNELS_GEMM_HPP
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <cstddef>
+#include <execution>
+#include <numeric>
+#include <thread>
+#include <vector>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define KUU_GEMM_X86 1
+#include <immintrin.h>
+#endif
+
+// references:
+// Goto and van de Geijn, "Anatomy of High-Performance Matrix Multiplication"
+// https://github.com/flame/blis (loop structure and packing layout)
+
+namespace kuu {
+namespace kernel {
+
+// c[0:mr, 0:nr] += a * b over kc steps, where a is a packed {kc, mr} panel
+// of op(A) and b a packed {kc, nr} panel of op(B). when bias is given it is
+// added to each row, and relu clamps at zero, before the tile is stored.
+using micro_kernel_fn = void (*)(std::size_t kc, const float *a,
+                                 const float *b, float *c, std::size_t ldc,
+                                 const float *bias, bool relu);
+
+struct micro_kernel {
+  const char *name;
+  std::size_t mr;
+  std::size_t nr;
+  micro_kernel_fn fn;
+};
+
+enum class activation { kNone = 0, kReLU = 1, kSigmoid = 2, kGELU = 3 };
+
+// applied to C after the last K block, on each tile as soon as it is done.
+// C = act(C + bias). derivative, when given, has the layout of C and
+// receives act'(C + bias) for the backward pass.
+struct gemm_epilogue {
+  const float *bias = nullptr;
+  activation act = activation::kNone;
+  float *derivative = nullptr;
+};
+
+namespace gemm_detail {
+
+constexpr std::size_t kMC = 96;
+constexpr std::size_t kKC = 256;
+constexpr std::size_t kNC = 1024;
+constexpr std::size_t kMaxTile = 8 * 32;
+// below this many multiply-adds the threading overhead is not worth it.
+constexpr std::size_t kParallelWork = 1 << 18;
+
+template <std::size_t MR, std::size_t NR>
+void micro_kernel_generic(std::size_t kc, const float *a, const float *b,
+                          float *c, std::size_t ldc, const float *bias,
+                          bool relu) {
+  float acc[MR][NR] = {};
+  for (std::size_t p = 0; p < kc; p++) {
+    for (std::size_t i = 0; i < MR; i++) {
+      for (std::size_t j = 0; j < NR; j++) {
+        acc[i][j] += a[i] * b[j];
+      }
+    }
+    a += MR;
+    b += NR;
+  }
+  for (std::size_t i = 0; i < MR; i++) {
+    for (std::size_t j = 0; j < NR; j++) {
+      float v = c[i * ldc + j] + acc[i][j];
+      if (bias) {
+        v += bias[j];
+      }
+      c[i * ldc + j] = relu ? std::max(v, 0.f) : v;
+    }
+  }
+}
+
+#ifdef KUU_GEMM_X86
+// 6x16 tile in 12 ymm accumulators.
+__attribute__((target("avx2,fma"))) inline void
+micro_kernel_avx2(std::size_t kc, const float *a, const float *b, float *c,
+                  std::size_t ldc, const float *bias, bool relu) {
+  __m256 c00 = _mm256_setzero_ps(), c01 = _mm256_setzero_ps();
+  __m256 c10 = _mm256_setzero_ps(), c11 = _mm256_setzero_ps();
+  __m256 c20 = _mm256_setzero_ps(), c21 = _mm256_setzero_ps();
+  __m256 c30 = _mm256_setzero_ps(), c31 = _mm256_setzero_ps();
+  __m256 c40 = _mm256_setzero_ps(), c41 = _mm256_setzero_ps();
+  __m256 c50 = _mm256_setzero_ps(), c51 = _mm256_setzero_ps();
+  for (std::size_t p = 0; p < kc; p++) {
+    const __m256 b0 = _mm256_loadu_ps(b);
+    const __m256 b1 = _mm256_loadu_ps(b + 8);
+    __m256 ai = _mm256_broadcast_ss(a);
+    c00 = _mm256_fmadd_ps(ai, b0, c00);
+    c01 = _mm256_fmadd_ps(ai, b1, c01);
+    ai = _mm256_broadcast_ss(a + 1);
+    c10 = _mm256_fmadd_ps(ai, b0, c10);
+    c11 = _mm256_fmadd_ps(ai, b1, c11);
+    ai = _mm256_broadcast_ss(a + 2);
+    c20 = _mm256_fmadd_ps(ai, b0, c20);
+    c21 = _mm256_fmadd_ps(ai, b1, c21);
+    ai = _mm256_broadcast_ss(a + 3);
+    c30 = _mm256_fmadd_ps(ai, b0, c30);
+    c31 = _mm256_fmadd_ps(ai, b1, c31);
+    ai = _mm256_broadcast_ss(a + 4);
+    c40 = _mm256_fmadd_ps(ai, b0, c40);
+    c41 = _mm256_fmadd_ps(ai, b1, c41);
+    ai = _mm256_broadcast_ss(a + 5);
+    c50 = _mm256_fmadd_ps(ai, b0, c50);
+    c51 = _mm256_fmadd_ps(ai, b1, c51);
+    a += 6;
+    b += 16;
+  }
+  const __m256 acc[6][2] = {{c00, c01}, {c10, c11}, {c20, c21},
+                            {c30, c31}, {c40, c41}, {c50, c51}};
+  const __m256 zero = _mm256_setzero_ps();
+  const __m256 bias0 = bias ? _mm256_loadu_ps(bias) : zero;
+  const __m256 bias1 = bias ? _mm256_loadu_ps(bias + 8) : zero;
+  for (std::size_t i = 0; i < 6; i++) {
+    float *row = c + i * ldc;
+    __m256 r0 = _mm256_add_ps(_mm256_loadu_ps(row), acc[i][0]);
+    __m256 r1 = _mm256_add_ps(_mm256_loadu_ps(row + 8), acc[i][1]);
+    r0 = _mm256_add_ps(r0, bias0);
+    r1 = _mm256_add_ps(r1, bias1);
+    if (relu) {
+      r0 = _mm256_max_ps(r0, zero);
+      r1 = _mm256_max_ps(r1, zero);
+    }
+    _mm256_storeu_ps(row, r0);
+    _mm256_storeu_ps(row + 8, r1);
+  }
+}
+
+// 6x32 tile in 12 zmm accumulators.
+__attribute__((target("avx512f"))) inline void
+micro_kernel_avx512(std::size_t kc, const float *a, const float *b, float *c,
+                    std::size_t ldc, const float *bias, bool relu) {
+  __m512 c00 = _mm512_setzero_ps(), c01 = _mm512_setzero_ps();
+  __m512 c10 = _mm512_setzero_ps(), c11 = _mm512_setzero_ps();
+  __m512 c20 = _mm512_setzero_ps(), c21 = _mm512_setzero_ps();
+  __m512 c30 = _mm512_setzero_ps(), c31 = _mm512_setzero_ps();
+  __m512 c40 = _mm512_setzero_ps(), c41 = _mm512_setzero_ps();
+  __m512 c50 = _mm512_setzero_ps(), c51 = _mm512_setzero_ps();
+  for (std::size_t p = 0; p < kc; p++) {
+    const __m512 b0 = _mm512_loadu_ps(b);
+    const __m512 b1 = _mm512_loadu_ps(b + 16);
+    __m512 ai = _mm512_set1_ps(a[0]);
+    c00 = _mm512_fmadd_ps(ai, b0, c00);
+    c01 = _mm512_fmadd_ps(ai, b1, c01);
+    ai = _mm512_set1_ps(a[1]);
+    c10 = _mm512_fmadd_ps(ai, b0, c10);
+    c11 = _mm512_fmadd_ps(ai, b1, c11);
+    ai = _mm512_set1_ps(a[2]);
+    c20 = _mm512_fmadd_ps(ai, b0, c20);
+    c21 = _mm512_fmadd_ps(ai, b1, c21);
+    ai = _mm512_set1_ps(a[3]);
+    c30 = _mm512_fmadd_ps(ai, b0, c30);
+    c31 = _mm512_fmadd_ps(ai, b1, c31);
+    ai = _mm512_set1_ps(a[4]);
+    c40 = _mm512_fmadd_ps(ai, b0, c40);
+    c41 = _mm512_fmadd_ps(ai, b1, c41);
+    ai = _mm512_set1_ps(a[5]);
+    c50 = _mm512_fmadd_ps(ai, b0, c50);
+    c51 = _mm512_fmadd_ps(ai, b1, c51);
+    a += 6;
+    b += 32;
+  }
+  const __m512 acc[6][2] = {{c00, c01}, {c10, c11}, {c20, c21},
+                            {c30, c31}, {c40, c41}, {c50, c51}};
+  const __m512 zero = _mm512_setzero_ps();
+  const __m512 bias0 = bias ? _mm512_loadu_ps(bias) : zero;
+  const __m512 bias1 = bias ? _mm512_loadu_ps(bias + 16) : zero;
+  for (std::size_t i = 0; i < 6; i++) {
+    float *row = c + i * ldc;
+    __m512 r0 = _mm512_add_ps(_mm512_loadu_ps(row), acc[i][0]);
+    __m512 r1 = _mm512_add_ps(_mm512_loadu_ps(row + 16), acc[i][1]);
+    r0 = _mm512_add_ps(r0, bias0);
+    r1 = _mm512_add_ps(r1, bias1);
+    if (relu) {
+      // the zero-masked max is the same instruction as _mm512_max_ps, whose
+      // GCC expansion merges into an undefined register
+      r0 = _mm512_maskz_max_ps(0xFFFF, r0, zero);
+      r1 = _mm512_maskz_max_ps(0xFFFF, r1, zero);
+    }
+    _mm512_storeu_ps(row, r0);
+    _mm512_storeu_ps(row + 16, r1);
+  }
+}
+#endif // KUU_GEMM_X86
+
+template <typename Function>
+void parallel_for(const bool parallel, const std::size_t n, Function &&f) {
+  std::vector<std::size_t> indices(n);
+  std::iota(indices.begin(), indices.end(), 0);
+  if (parallel) {
+    std::for_each(std::execution::par, indices.begin(), indices.end(), f);
+  } else {
+    std::for_each(indices.begin(), indices.end(), f);
+  }
+}
+
+// {kc, mr} panel of alpha * op(A) starting at row i0, column p0. rows past m
+// are zero.
+inline void pack_a(const bool trans, const float *A, const std::size_t lda,
+                   const std::size_t m, const std::size_t i0,
+                   const std::size_t p0, const std::size_t kc,
+                   const std::size_t mr, const float alpha, float *dst) {
+  const std::size_t rows = std::min(mr, m - i0);
+  if (rows < mr) {
+    std::fill(dst, dst + kc * mr, 0.f);
+  }
+  if (trans) {
+    for (std::size_t p = 0; p < kc; p++) {
+      const float *src = A + (p0 + p) * lda + i0;
+      for (std::size_t i = 0; i < rows; i++) {
+        dst[p * mr + i] = alpha * src[i];
+      }
+    }
+  } else {
+    for (std::size_t i = 0; i < rows; i++) {
+      const float *src = A + (i0 + i) * lda + p0;
+      for (std::size_t p = 0; p < kc; p++) {
+        dst[p * mr + i] = alpha * src[p];
+      }
+    }
+  }
+}
+
+// {kc, nr} panel of op(B) starting at row p0, column j0. columns past n are
+// zero.
+inline void pack_b(const bool trans, const float *B, const std::size_t ldb,
+                   const std::size_t n, const std::size_t p0,
+                   const std::size_t j0, const std::size_t kc,
+                   const std::size_t nr, float *dst) {
+  const std::size_t cols = std::min(nr, n - j0);
+  if (cols < nr) {
+    std::fill(dst, dst + kc * nr, 0.f);
+  }
+  if (trans) {
+    for (std::size_t j = 0; j < cols; j++) {
+      const float *src = B + (j0 + j) * ldb + p0;
+      for (std::size_t p = 0; p < kc; p++) {
+        dst[p * nr + j] = src[p];
+      }
+    }
+  } else {
+    for (std::size_t p = 0; p < kc; p++) {
+      const float *src = B + (p0 + p) * ldb + j0;
+      std::copy(src, src + cols, dst + p * nr);
+    }
+  }
+}
+
+} // namespace gemm_detail
+
+// the tanh approximation of GELU, gelu(x) = 0.5 * x * (1 + t) with
+// t = tanh(kGELU * (x + kGELUCubic * x^3)). shared by the GEMM epilogue and
+// kernels/activation.hpp, which bring their own tanh.
+namespace gelu_detail {
+
+// sqrt(2 / pi)
+constexpr float kGELU = 0.7978845608f;
+constexpr float kGELUCubic = 0.044715f;
+
+// the argument of tanh
+inline float inner(const float x) {
+  return kGELU * (x + kGELUCubic * x * x * x);
+}
+
+inline float value(const float x, const float t) {
+  return 0.5f * x * (1.f + t);
+}
+
+// gelu'(x)
+inline float grad(const float x, const float t) {
+  return 0.5f * (1.f + t) +
+         0.5f * x * (1.f - t * t) * kGELU * (1.f + 3.f * kGELUCubic * x * x);
+}
+
+} // namespace gelu_detail
+
+namespace gemm_detail {
+
+// scalar epilogue over a {rows, cols} tile of C at column j. the bias is
+// skipped when the micro-kernel already added it.
+inline void finish_tile(const gemm_epilogue &ep, float *c, float *derivative,
+                        const std::size_t ldc, const std::size_t rows,
+                        const std::size_t cols, const std::size_t j,
+                        const bool add_bias) {
+  for (std::size_t r = 0; r < rows; r++) {
+    for (std::size_t s = 0; s < cols; s++) {
+      float z = c[r * ldc + s];
+      if (add_bias && ep.bias) {
+        z += ep.bias[j + s];
+      }
+      float y = z, dy = 1.f;
+      switch (ep.act) {
+      case activation::kNone:
+        break;
+      case activation::kReLU:
+        y = std::max(z, 0.f);
+        dy = 0.f < z ? 1.f : 0.f;
+        break;
+      case activation::kSigmoid:
+        y = 1.f / (1.f + std::exp(-z));
+        dy = y * (1.f - y);
+        break;
+      case activation::kGELU: {
+        const float t = std::tanh(gelu_detail::inner(z));
+        y = gelu_detail::value(z, t);
+        dy = gelu_detail::grad(z, t);
+        break;
+      }
+      }
+      c[r * ldc + s] = y;
+      if (derivative) {
+        derivative[r * ldc + s] = dy;
+      }
+    }
+  }
+}
+
+// runs the micro-kernel over the tiles of C[i0:i0+mb, j0:j0+nb]. edge tiles
+// go through a scratch tile so that the kernel always writes mr x nr. ep is
+// only given for the last K block. bias and ReLU of full tiles are applied in
+// registers; anything else right after the tile is stored, while it is hot.
+inline void macro_kernel(const micro_kernel &uk, const std::size_t kc,
+                         const float *packed_a, const float *packed_b,
+                         const std::size_t M, const std::size_t N,
+                         const std::size_t i0, const std::size_t mb,
+                         const std::size_t j0, const std::size_t nb, float *C,
+                         const std::size_t ldc, const gemm_epilogue *ep) {
+  const std::size_t mr = uk.mr, nr = uk.nr;
+  const bool in_register =
+      ep && !ep->derivative &&
+      (ep->act == activation::kNone || ep->act == activation::kReLU);
+  for (std::size_t j = j0; j < j0 + nb; j += nr) {
+    const float *b = packed_b + (j / nr) * nr * kc;
+    const std::size_t cols = std::min(nr, N - j);
+    for (std::size_t i = i0; i < i0 + mb; i += mr) {
+      const float *a = packed_a + (i / mr) * mr * kc;
+      const std::size_t rows = std::min(mr, M - i);
+      float *c = C + i * ldc + j;
+      float *derivative =
+          ep && ep->derivative ? ep->derivative + i * ldc + j : nullptr;
+      if (rows == mr && cols == nr) {
+        if (in_register) {
+          uk.fn(kc, a, b, c, ldc, ep->bias ? ep->bias + j : nullptr,
+                ep->act == activation::kReLU);
+        } else {
+          const float *bias = ep && ep->bias ? ep->bias + j : nullptr;
+          uk.fn(kc, a, b, c, ldc, bias, false);
+          if (ep) {
+            finish_tile(*ep, c, derivative, ldc, rows, cols, j, false);
+          }
+        }
+      } else {
+        float tile[kMaxTile] = {};
+        uk.fn(kc, a, b, tile, nr, nullptr, false);
+        for (std::size_t r = 0; r < rows; r++) {
+          for (std::size_t s = 0; s < cols; s++) {
+            c[r * ldc + s] += tile[r * nr + s];
+          }
+        }
+        if (ep) {
+          finish_tile(*ep, c, derivative, ldc, rows, cols, j, true);
+        }
+      }
+    }
+  }
+}
+
+} // namespace gemm_detail
+
+// every micro-kernel this machine can run, fastest first.
+inline const std::vector<micro_kernel> &available_micro_kernels() {
+  static const std::vector<micro_kernel> kernels = [] {
+    std::vector<micro_kernel> v;
+#ifdef KUU_GEMM_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f")) {
+      v.push_back({"avx512", 6, 32, &gemm_detail::micro_kernel_avx512});
+    }
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+      v.push_back({"avx2", 6, 16, &gemm_detail::micro_kernel_avx2});
+    }
+#endif
+    v.push_back({"generic", 4, 16, &gemm_detail::micro_kernel_generic<4, 16>});
+    return v;
+  }();
+  return kernels;
+}
+
+inline const micro_kernel &default_micro_kernel() {
+  return available_micro_kernels().front();
+}
+
+// op(B) packed once into the panel layout sgemm works on, for operands that
+// are reused across calls such as weights. only valid for micro-kernels with
+// the same nr.
+struct packed_matrix {
+  std::size_t k = 0;
+  std::size_t n = 0;
+  std::size_t nr = 0;
+  // K blocks of kKC rows one after another, each split into {kc, nr} panels.
+  std::vector<float> data;
+
+  const float *block(const std::size_t p0) const {
+    return data.data() + p0 * ((n + nr - 1) / nr) * nr;
+  }
+};
+
+namespace gemm_detail {
+
+// C = alpha * op(A) * B + beta * C, where block_b(p0, kc, parallel) returns
+// the packed {kc, N} block of op(B) starting at row p0.
+template <typename BlockB>
+void sgemm_blocked(const bool trans_a, const std::size_t M, const std::size_t N,
+                   const std::size_t K, const float alpha, const float *A,
+                   const std::size_t lda, const float beta, float *C,
+                   const std::size_t ldc, const gemm_epilogue &ep,
+                   const micro_kernel &uk, BlockB &&block_b) {
+  if (M == 0 || N == 0) {
+    return;
+  }
+  const bool has_epilogue = ep.bias || ep.act != activation::kNone;
+  for (std::size_t i = 0; i < M; i++) {
+    float *row = C + i * ldc;
+    if (beta == 0.f) {
+      std::fill(row, row + N, 0.f);
+    } else if (beta != 1.f) {
+      for (std::size_t j = 0; j < N; j++) {
+        row[j] *= beta;
+      }
+    }
+  }
+  if (K == 0 || alpha == 0.f) {
+    if (has_epilogue) {
+      float *derivative = ep.derivative;
+      for (std::size_t i = 0; i < M; i++) {
+        finish_tile(ep, C + i * ldc, derivative ? derivative + i * ldc : nullptr,
+                    ldc, 1, N, 0, true);
+      }
+    }
+    return;
+  }
+
+  const std::size_t mr = uk.mr, nr = uk.nr;
+  const std::size_t m_panels = (M + mr - 1) / mr;
+  const std::size_t n_panels = (N + nr - 1) / nr;
+  const std::size_t mc = std::max(mr, kMC / mr * mr);
+  const std::size_t m_blocks = (M + mc - 1) / mc;
+  const bool parallel = kParallelWork <= M * N * K;
+
+  // with few row blocks (small batches), split the columns further so that
+  // every thread gets a block.
+  std::size_t nc = std::max(nr, kNC / nr * nr);
+  const std::size_t threads = std::max(1u, std::thread::hardware_concurrency());
+  if (parallel && m_blocks < threads) {
+    const std::size_t splits = (threads + m_blocks - 1) / m_blocks;
+    const std::size_t per_split = (n_panels + splits - 1) / splits;
+    nc = std::min(nc, std::max<std::size_t>(1, per_split) * nr);
+  }
+  const std::size_t n_blocks = (N + nc - 1) / nc;
+
+  // per call rather than thread_local: a worker may pick up another GEMM
+  // while it waits inside this one.
+  std::vector<float> packed_a(m_panels * mr * std::min(K, kKC));
+  float *pa = packed_a.data();
+
+  for (std::size_t p0 = 0; p0 < K; p0 += kKC) {
+    const std::size_t kc = std::min(kKC, K - p0);
+    parallel_for(parallel, m_panels, [&](std::size_t r) {
+      pack_a(trans_a, A, lda, M, r * mr, p0, kc, mr, alpha, pa + r * mr * kc);
+    });
+    const float *pb = block_b(p0, kc, parallel);
+    const gemm_epilogue *last =
+        has_epilogue && K <= p0 + kc ? &ep : nullptr;
+    // blocks of C are disjoint, so they run concurrently.
+    parallel_for(parallel, m_blocks * n_blocks, [&](std::size_t t) {
+      const std::size_t i0 = (t / n_blocks) * mc;
+      const std::size_t j0 = (t % n_blocks) * nc;
+      macro_kernel(uk, kc, pa, pb, M, N, i0, std::min(mc, M - i0), j0,
+                   std::min(nc, N - j0), C, ldc, last);
+    });
+  }
+}
+
+} // namespace gemm_detail
+
+// row-major C = alpha * op(A) * op(B) + beta * C, where op(A) is {M, K} and
+// op(B) is {K, N}. op transposes when the corresponding flag is set, without
+// materializing the transpose: it is folded into packing.
+inline void sgemm(const bool trans_a, const bool trans_b, const std::size_t M,
+                  const std::size_t N, const std::size_t K, const float alpha,
+                  const float *A, const std::size_t lda, const float *B,
+                  const std::size_t ldb, const float beta, float *C,
+                  const std::size_t ldc, const gemm_epilogue &ep = {},
+                  const micro_kernel &uk = default_micro_kernel()) {
+  using namespace gemm_detail;
+  const std::size_t nr = uk.nr;
+  const std::size_t n_panels = (N + nr - 1) / nr;
+  std::vector<float> packed_b(n_panels * nr * std::min(K, kKC));
+  sgemm_blocked(trans_a, M, N, K, alpha, A, lda, beta, C, ldc, ep, uk,
+                [&](std::size_t p0, std::size_t kc, bool parallel) {
+                  float *pb = packed_b.data();
+                  parallel_for(parallel, n_panels, [&](std::size_t c) {
+                    pack_b(trans_b, B, ldb, N, p0, c * nr, kc, nr,
+                           pb + c * nr * kc);
+                  });
+                  return static_cast<const float *>(pb);
+                });
+}
+
+// packs op(B), {K, N}, for the given micro-kernel.
+inline packed_matrix pack_matrix(const bool trans_b, const std::size_t K,
+                                 const std::size_t N, const float *B,
+                                 const std::size_t ldb,
+                                 const micro_kernel &uk = default_micro_kernel()) {
+  using namespace gemm_detail;
+  packed_matrix packed;
+  packed.k = K;
+  packed.n = N;
+  packed.nr = uk.nr;
+  const std::size_t n_panels = (N + uk.nr - 1) / uk.nr;
+  packed.data.resize(K * n_panels * uk.nr);
+  for (std::size_t p0 = 0; p0 < K; p0 += kKC) {
+    const std::size_t kc = std::min(kKC, K - p0);
+    float *block = packed.data.data() + p0 * n_panels * uk.nr;
+    parallel_for(kParallelWork <= K * N, n_panels, [&](std::size_t c) {
+      pack_b(trans_b, B, ldb, N, p0, c * uk.nr, kc, uk.nr,
+             block + c * uk.nr * kc);
+    });
+  }
+  return packed;
+}
+
+// C = alpha * op(A) * B + beta * C with B packed by pack_matrix.
+inline void sgemm(const bool trans_a, const std::size_t M, const float alpha,
+                  const float *A, const std::size_t lda, const packed_matrix &B,
+                  const float beta, float *C, const std::size_t ldc,
+                  const gemm_epilogue &ep = {},
+                  const micro_kernel &uk = default_micro_kernel()) {
+  assert(B.nr == uk.nr);
+  gemm_detail::sgemm_blocked(
+      trans_a, M, B.n, B.k, alpha, A, lda, beta, C, ldc, ep, uk,
+      [&](std::size_t p0, std::size_t, bool) { return B.block(p0); });
+}
+
+// C[i] = alpha * op(A[i]) * op(B[i]) + beta * C[i] for i < batch, with the
+// matrices given as pointer arrays so that broadcast operands can repeat a
+// pointer. the C[i] must not overlap. small matrices run one per task, larger
+// ones one after another with the parallelism inside each GEMM.
+inline void sgemm_batched(const bool trans_a, const bool trans_b,
+                          const std::size_t M, const std::size_t N,
+                          const std::size_t K, const float alpha,
+                          const float *const *A, const std::size_t lda,
+                          const float *const *B, const std::size_t ldb,
+                          const float beta, float *const *C,
+                          const std::size_t ldc, const std::size_t batch,
+                          const micro_kernel &uk = default_micro_kernel()) {
+  using namespace gemm_detail;
+  const std::size_t work = M * N * std::max<std::size_t>(K, 1);
+  const bool per_task = work < kParallelWork && kParallelWork <= work * batch;
+  parallel_for(per_task, batch, [&](std::size_t i) {
+    sgemm(trans_a, trans_b, M, N, K, alpha, A[i], lda, B[i], ldb, beta, C[i],
+          ldc, {}, uk);
+  });
+}
+
+} // namespace kernel
+} // namespace kuu
+
+#endif // KUU_KERNELS_GEMM_HPP
@@ -0,0 +1,253 @@
+#ifndef KUU_KERNELS_HALF_HPP
+#define KUU_KERNELS_HALF_HPP
+
+#include "kernels/gemm.hpp"
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+// 16-bit floating point storage. values are converted with round to nearest
+// even and computed on as fp32; only the storage is narrow.
+//   bfloat16: fp32 with the low 16 mantissa bits dropped, same range.
+//   fp16: IEEE binary16, 10 mantissa bits, largest finite value 65504.
+// reference for the fp16 conversions:
+// https://gist.github.com/rygorous/2156668 (float_to_half_fast3_rtne)
+
+namespace kuu {
+namespace kernel {
+
+enum class half_format { kBFloat16, kFloat16 };
+
+namespace half_detail {
+
+inline std::uint32_t bits(const float f) {
+  std::uint32_t u;
+  std::memcpy(&u, &f, sizeof(u));
+  return u;
+}
+
+inline float from_bits(const std::uint32_t u) {
+  float f;
+  std::memcpy(&f, &u, sizeof(f));
+  return f;
+}
+
+// elements per task of the bulk conversions
+constexpr std::size_t kChunk = 1 << 16;
+
+} // namespace half_detail
+
+inline std::uint16_t float_to_bf16(const float f) {
+  const std::uint32_t u = half_detail::bits(f);
+  // NaN stays a quiet NaN instead of rounding into infinity
+  const std::uint32_t rounded = u + 0x7fff + ((u >> 16) & 1);
+  return static_cast<std::uint16_t>(
+      (u & 0x7fffffff) > 0x7f800000 ? (u >> 16) | 0x40 : rounded >> 16);
+}
+
+inline float bf16_to_float(const std::uint16_t h) {
+  return half_detail::from_bits(static_cast<std::uint32_t>(h) << 16);
+}
+
+inline std::uint16_t float_to_fp16(const float f) {
+  std::uint32_t u = half_detail::bits(f);
+  const std::uint32_t sign = u & 0x80000000u;
+  u ^= sign;
+  std::uint32_t h;
+  if (u >= (127u + 16) << 23) {
+    // too large for fp16, infinity or NaN
+    h = 0x7f800000u < u ? 0x7e00 : 0x7c00;
+  } else if (u < 113u << 23) {
+    // subnormal or zero: adding 0.5 aligns the mantissa to the fp16 ulp,
+    // and the fp32 addition rounds it.
+    const float denorm_magic = 0.5f;
+    h = half_detail::bits(half_detail::from_bits(u) + denorm_magic) -
+        half_detail::bits(denorm_magic);
+  } else {
+    const std::uint32_t mantissa_odd = (u >> 13) & 1;
+    u += (static_cast<std::uint32_t>(15 - 127) << 23) + 0xfff;
+    u += mantissa_odd;
+    h = u >> 13;
+  }
+  return static_cast<std::uint16_t>(h | (sign >> 16));
+}
+
+inline float fp16_to_float(const std::uint16_t h) {
+  constexpr std::uint32_t shifted_exponent = 0x7c00u << 13;
+  std::uint32_t u = (h & 0x7fffu) << 13;
+  const std::uint32_t exponent = shifted_exponent & u;
+  u += static_cast<std::uint32_t>(127 - 15) << 23;
+  float f;
+  if (exponent == shifted_exponent) {
+    // infinity or NaN
+    f = half_detail::from_bits(u + (static_cast<std::uint32_t>(128 - 16)
+                                    << 23));
+  } else if (exponent == 0) {
+    // zero or subnormal, renormalized by the fp32 subtraction
+    f = half_detail::from_bits(u + (1u << 23)) -
+        half_detail::from_bits(113u << 23);
+  } else {
+    f = half_detail::from_bits(u);
+  }
+  return half_detail::from_bits(half_detail::bits(f) |
+                                ((h & 0x8000u) << 16));
+}
+
+namespace half_detail {
+
+inline void compress_generic(const half_format format, const float *src,
+                             const std::size_t n, std::uint16_t *dst) {
+  if (format == half_format::kBFloat16) {
+    for (std::size_t i = 0; i < n; i++) {
+      dst[i] = float_to_bf16(src[i]);
+    }
+  } else {
+    for (std::size_t i = 0; i < n; i++) {
+      dst[i] = float_to_fp16(src[i]);
+    }
+  }
+}
+
+inline void decompress_generic(const half_format format,
+                               const std::uint16_t *src, const std::size_t n,
+                               float *dst) {
+  if (format == half_format::kBFloat16) {
+    for (std::size_t i = 0; i < n; i++) {
+      dst[i] = bf16_to_float(src[i]);
+    }
+  } else {
+    for (std::size_t i = 0; i < n; i++) {
+      dst[i] = fp16_to_float(src[i]);
+    }
+  }
+}
+
+#ifdef KUU_GEMM_X86
+__attribute__((target("avx2"))) inline void
+compress_bf16_avx2(const float *src, const std::size_t n, std::uint16_t *dst) {
+  const __m256i bias = _mm256_set1_epi32(0x7fff);
+  const __m256i one = _mm256_set1_epi32(1);
+  const __m256i quiet = _mm256_set1_epi32(0x40);
+  std::size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    const __m256 v = _mm256_loadu_ps(src + i);
+    const __m256i u = _mm256_castps_si256(v);
+    const __m256i high = _mm256_srli_epi32(u, 16);
+    const __m256i rounded = _mm256_srli_epi32(
+        _mm256_add_epi32(_mm256_add_epi32(u, bias),
+                         _mm256_and_si256(high, one)),
+        16);
+    const __m256i nan = _mm256_castps_si256(_mm256_cmp_ps(v, v, _CMP_UNORD_Q));
+    const __m256i h = _mm256_blendv_epi8(
+        rounded, _mm256_or_si256(high, quiet), nan);
+    // both halves hold values below 2^16, so the unsigned pack is exact
+    const __m256i packed = _mm256_permute4x64_epi64(
+        _mm256_packus_epi32(h, h), 0xD8);
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + i),
+                     _mm256_castsi256_si128(packed));
+  }
+  compress_generic(half_format::kBFloat16, src + i, n - i, dst + i);
+}
+
+__attribute__((target("avx2,f16c"))) inline void
+compress_fp16_f16c(const float *src, const std::size_t n, std::uint16_t *dst) {
+  std::size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    _mm_storeu_si128(
+        reinterpret_cast<__m128i *>(dst + i),
+        _mm256_cvtps_ph(_mm256_loadu_ps(src + i), _MM_FROUND_TO_NEAREST_INT));
+  }
+  compress_generic(half_format::kFloat16, src + i, n - i, dst + i);
+}
+
+__attribute__((target("avx2,f16c"))) inline void
+decompress_fp16_f16c(const std::uint16_t *src, const std::size_t n,
+                     float *dst) {
+  std::size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    _mm256_storeu_ps(dst + i,
+                     _mm256_cvtph_ps(_mm_loadu_si128(
+                         reinterpret_cast<const __m128i *>(src + i))));
+  }
+  decompress_generic(half_format::kFloat16, src + i, n - i, dst + i);
+}
+
+inline bool has_avx2() {
+  static const bool supported = [] {
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2");
+  }();
+  return supported;
+}
+
+inline bool has_f16c() {
+  static const bool supported = [] {
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("f16c");
+  }();
+  return supported;
+}
+#endif // KUU_GEMM_X86
+
+} // namespace half_detail
+
+// dst[i] = src[i] in the given format, for i < n.
+inline void compress(const half_format format, const float *src,
+                     const std::size_t n, std::uint16_t *dst) {
+  const std::size_t chunks =
+      (n + half_detail::kChunk - 1) / half_detail::kChunk;
+  gemm_detail::parallel_for(1 < chunks, chunks, [&](std::size_t c) {
+    const std::size_t i0 = c * half_detail::kChunk;
+    const std::size_t m = std::min(n - i0, half_detail::kChunk);
+#ifdef KUU_GEMM_X86
+    if (format == half_format::kFloat16 && half_detail::has_f16c()) {
+      half_detail::compress_fp16_f16c(src + i0, m, dst + i0);
+      return;
+    }
+    if (format == half_format::kBFloat16 && half_detail::has_avx2()) {
+      half_detail::compress_bf16_avx2(src + i0, m, dst + i0);
+      return;
+    }
+#endif
+    half_detail::compress_generic(format, src + i0, m, dst + i0);
+  });
+}
+
+inline void decompress(const half_format format, const std::uint16_t *src,
+                       const std::size_t n, float *dst) {
+  const std::size_t chunks =
+      (n + half_detail::kChunk - 1) / half_detail::kChunk;
+  gemm_detail::parallel_for(1 < chunks, chunks, [&](std::size_t c) {
+    const std::size_t i0 = c * half_detail::kChunk;
+    const std::size_t m = std::min(n - i0, half_detail::kChunk);
+#ifdef KUU_GEMM_X86
+    if (format == half_format::kFloat16 && half_detail::has_f16c()) {
+      half_detail::decompress_fp16_f16c(src + i0, m, dst + i0);
+      return;
+    }
+#endif
+    half_detail::decompress_generic(format, src + i0, m, dst + i0);
+  });
+}
+
+// rounds x in place to the nearest value the format can store.
+inline void round_to_half(const half_format format, float *x,
+                          const std::size_t n) {
+  const std::size_t chunks =
+      (n + half_detail::kChunk - 1) / half_detail::kChunk;
+  gemm_detail::parallel_for(1 < chunks, chunks, [&](std::size_t c) {
+    std::uint16_t buffer[256];
+    const std::size_t end = std::min(n, (c + 1) * half_detail::kChunk);
+    for (std::size_t i = c * half_detail::kChunk; i < end; i += 256) {
+      const std::size_t m = std::min<std::size_t>(256, end - i);
+      half_detail::compress_generic(format, x + i, m, buffer);
+      half_detail::decompress_generic(format, buffer, m, x + i);
+    }
+  });
+}
+
+} // namespace kernel
+} // namespace kuu
+
+#endif // KUU_KERNELS_HALF_HPP
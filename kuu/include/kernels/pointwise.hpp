@@ -0,0 +1,216 @@
+#ifndef KUU_KERNELS_POINTWISE_HPP
+#define KUU_KERNELS_POINTWISE_HPP
+
+#include "kernels/batchnorm.hpp"
+#include "kernels/gemm.hpp"
+#include <algorithm>
+#include <cstddef>
+#include <cstring>
+#include <vector>
+
+// chains of pointwise ops run in one pass over memory. x is viewed as
+// {outer, C, inner} as in kernels/batchnorm.hpp, so per-channel operands
+// work for every layout. each block of at most kBlock values is read once,
+// goes through every op while it stays in L1, and is written once.
+
+namespace kuu {
+namespace kernel {
+
+enum class pointwise_kind {
+  kAffine, // x * scale[c] + shift[c]
+  kScale,  // x * value
+  kReLU,   // max(x, 0)
+};
+
+struct pointwise_op {
+  pointwise_kind kind = pointwise_kind::kReLU;
+  // per channel, for kAffine; null for a scale of 1 or a shift of 0
+  const float *scale = nullptr;
+  const float *shift = nullptr;
+  // for kScale
+  float value = 1.f;
+};
+
+namespace pointwise_detail {
+
+constexpr std::size_t kBlock = 256;
+
+// op on the n values of v. they all belong to channel c when same_channel,
+// and to channels c, c + 1, ... otherwise.
+inline void apply(const pointwise_op &op, float *v, const std::size_t n,
+                  const std::size_t c, const bool same_channel) {
+  switch (op.kind) {
+  case pointwise_kind::kAffine:
+    if (same_channel) {
+      const float a = op.scale ? op.scale[c] : 1.f;
+      const float b = op.shift ? op.shift[c] : 0.f;
+      for (std::size_t i = 0; i < n; i++) {
+        v[i] = v[i] * a + b;
+      }
+    } else {
+      for (std::size_t i = 0; i < n; i++) {
+        v[i] = (op.scale ? v[i] * op.scale[c + i] : v[i]) +
+               (op.shift ? op.shift[c + i] : 0.f);
+      }
+    }
+    break;
+  case pointwise_kind::kScale:
+    for (std::size_t i = 0; i < n; i++) {
+      v[i] *= op.value;
+    }
+    break;
+  case pointwise_kind::kReLU:
+    for (std::size_t i = 0; i < n; i++) {
+      v[i] = std::max(v[i], 0.f);
+    }
+    break;
+  }
+}
+
+// f(offset, n, c, same_channel) over the blocks of rows [o_begin, o_end).
+template <class Function>
+void for_each_block(const std::size_t o_begin, const std::size_t o_end,
+                    const std::size_t C, const std::size_t inner,
+                    Function &&f) {
+  for (std::size_t o = o_begin; o < o_end; o++) {
+    if (inner == 1) {
+      for (std::size_t c = 0; c < C; c += kBlock) {
+        f(o * C + c, std::min(kBlock, C - c), c, false);
+      }
+      continue;
+    }
+    for (std::size_t c = 0; c < C; c++) {
+      const std::size_t base = (o * C + c) * inner;
+      for (std::size_t i = 0; i < inner; i += kBlock) {
+        f(base + i, std::min(kBlock, inner - i), c, true);
+      }
+    }
+  }
+}
+
+} // namespace pointwise_detail
+
+// y = op[n_ops - 1](... op[0](x)). y may alias x.
+inline void pointwise_forward(const std::size_t outer, const std::size_t C,
+                              const std::size_t inner,
+                              const pointwise_op *ops, const std::size_t n_ops,
+                              const float *x, float *y) {
+  using namespace pointwise_detail;
+  const std::size_t rows = batchnorm_detail::rows_per_task(C, inner);
+  const std::size_t tasks = (outer + rows - 1) / rows;
+  const bool parallel = gemm_detail::kParallelWork <= outer * C * inner;
+  gemm_detail::parallel_for(parallel, tasks, [&](const std::size_t t) {
+    for_each_block(t * rows, std::min(outer, (t + 1) * rows), C, inner,
+                   [&](const std::size_t offset, const std::size_t n,
+                       const std::size_t c, const bool same_channel) {
+                     float *v = y + offset;
+                     if (v != x + offset) {
+                       std::memcpy(v, x + offset, n * sizeof(float));
+                     }
+                     for (std::size_t k = 0; k < n_ops; k++) {
+                       apply(ops[k], v, n, c, same_channel);
+                     }
+                   });
+  });
+}
+
+// the backward of pointwise_forward from gy: gx (if not null) and, for
+// every kAffine op k, the per-channel gradients of its operands into
+// gscale[k] and gshift[k] (each C values, if not null). the forward values
+// are recomputed from x block by block instead of being saved. gx may
+// alias gy.
+inline void pointwise_backward(const std::size_t outer, const std::size_t C,
+                               const std::size_t inner,
+                               const pointwise_op *ops,
+                               const std::size_t n_ops, const float *x,
+                               const float *gy, float *gx,
+                               float *const *gscale, float *const *gshift) {
+  using namespace pointwise_detail;
+  const std::size_t rows = batchnorm_detail::rows_per_task(C, inner);
+  const std::size_t tasks = (outer + rows - 1) / rows;
+  const bool parallel = gemm_detail::kParallelWork <= outer * C * inner;
+  // {scale, shift} grads of every op and channel, per task, merged in task
+  // order so that the sums do not depend on the number of threads
+  std::vector<double> sums(tasks * n_ops * 2 * C, 0.);
+
+  gemm_detail::parallel_for(parallel, tasks, [&](const std::size_t t) {
+    double *task_sums = sums.data() + t * n_ops * 2 * C;
+    // the input of every op, and the running gradient
+    std::vector<float> values((n_ops + 1) * kBlock);
+    float *g = values.data() + n_ops * kBlock;
+    for_each_block(
+        t * rows, std::min(outer, (t + 1) * rows), C, inner,
+        [&](const std::size_t offset, const std::size_t n,
+            const std::size_t c, const bool same_channel) {
+          std::memcpy(values.data(), x + offset, n * sizeof(float));
+          for (std::size_t k = 0; k + 1 < n_ops; k++) {
+            float *v = values.data() + (k + 1) * kBlock;
+            std::memcpy(v, v - kBlock, n * sizeof(float));
+            apply(ops[k], v, n, c, same_channel);
+          }
+          std::memcpy(g, gy + offset, n * sizeof(float));
+
+          for (std::size_t k = n_ops; k-- > 0;) {
+            const pointwise_op &op = ops[k];
+            const float *v = values.data() + k * kBlock;
+            if (op.kind == pointwise_kind::kReLU) {
+              for (std::size_t i = 0; i < n; i++) {
+                g[i] = 0.f < v[i] ? g[i] : 0.f;
+              }
+              continue;
+            }
+            if (op.kind == pointwise_kind::kScale) {
+              for (std::size_t i = 0; i < n; i++) {
+                g[i] *= op.value;
+              }
+              continue;
+            }
+            double *s_scale = task_sums + k * 2 * C;
+            double *s_shift = s_scale + C;
+            if (same_channel) {
+              float sg = 0.f, sgv = 0.f;
+              for (std::size_t i = 0; i < n; i++) {
+                sg += g[i];
+                sgv += g[i] * v[i];
+              }
+              s_scale[c] += sgv;
+              s_shift[c] += sg;
+              const float a = op.scale ? op.scale[c] : 1.f;
+              for (std::size_t i = 0; i < n; i++) {
+                g[i] *= a;
+              }
+            } else {
+              for (std::size_t i = 0; i < n; i++) {
+                s_scale[c + i] += g[i] * v[i];
+                s_shift[c + i] += g[i];
+                g[i] = op.scale ? g[i] * op.scale[c + i] : g[i];
+              }
+            }
+          }
+          if (gx) {
+            std::memcpy(gx + offset, g, n * sizeof(float));
+          }
+        });
+  });
+
+  for (std::size_t k = 0; k < n_ops; k++) {
+    for (std::size_t c = 0; c < C; c++) {
+      double s_scale = 0, s_shift = 0;
+      for (std::size_t t = 0; t < tasks; t++) {
+        s_scale += sums[(t * n_ops + k) * 2 * C + c];
+        s_shift += sums[(t * n_ops + k) * 2 * C + C + c];
+      }
+      if (gscale && gscale[k]) {
+        gscale[k][c] = static_cast<float>(s_scale);
+      }
+      if (gshift && gshift[k]) {
+        gshift[k][c] = static_cast<float>(s_shift);
+      }
+    }
+  }
+}
+
+} // namespace kernel
+} // namespace kuu
+
+#endif // KUU_KERNELS_POINTWISE_HPP
@@ -0,0 +1,402 @@
+#ifndef KUU_KERNELS_POOLING_HPP
+#define KUU_KERNELS_POOLING_HPP
+
+#include "kernels/depthwise.hpp"
+#include <algorithm>
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <execution>
+#include <limits>
+#include <vector>
+
+// max and average pooling over {H_f, W_f} windows. as in the depthwise
+// kernels, the loops run tap by tap over whole rows of outputs, so that the
+// innermost loop goes over contiguous memory: the output columns for NCHW,
+// the channels for NHWC. max pooling keeps, per output, the position of its
+// maximum within the window, p * W_f + q, in 16 bits instead of a full
+// index into x. padding is never the maximum, and counts as zeros in the
+// average, whose divisor is always H_f * W_f.
+
+namespace kuu {
+namespace kernel {
+
+using pool_index = std::uint16_t;
+
+struct pool2d_geometry {
+  std::size_t N;
+  std::size_t C;
+  std::size_t H;
+  std::size_t W;
+  std::size_t H_f;
+  std::size_t W_f;
+  std::size_t stride_h;
+  std::size_t stride_w;
+  std::size_t pad_h;
+  std::size_t pad_w;
+
+  std::size_t H_out() const { return (H + 2 * pad_h - H_f) / stride_h + 1; }
+  std::size_t W_out() const { return (W + 2 * pad_w - W_f) / stride_w + 1; }
+  // every window holds at least one element of x, and its positions fit in
+  // a pool_index
+  bool is_valid() const {
+    return 0 < H_f && 0 < W_f && pad_h < H_f && pad_w < W_f &&
+           H_f <= H + 2 * pad_h && W_f <= W + 2 * pad_w &&
+           H_f * W_f <= std::numeric_limits<pool_index>::max() + 1;
+  }
+};
+
+namespace pooling_detail {
+
+// v replaces m if it is larger or NaN, so that NaN propagates.
+inline bool takes_max(const float v, const float m) {
+  return m < v || v != v;
+}
+
+// the first tap of window (i, j) inside x. it starts the search for the
+// maximum, so that a window of -inf never points at padding.
+inline pool_index first_tap(const std::ptrdiff_t i, const std::ptrdiff_t j,
+                            const pool2d_geometry &g) {
+  const std::ptrdiff_t h = i * static_cast<std::ptrdiff_t>(g.stride_h) -
+                           static_cast<std::ptrdiff_t>(g.pad_h);
+  const std::ptrdiff_t w = j * static_cast<std::ptrdiff_t>(g.stride_w) -
+                           static_cast<std::ptrdiff_t>(g.pad_w);
+  const std::size_t p = h < 0 ? -h : 0;
+  const std::size_t q = w < 0 ? -w : 0;
+  return static_cast<pool_index>(p * g.W_f + q);
+}
+
+} // namespace pooling_detail
+
+// x {N, C, H, W}, y {N, C, H_out, W_out}, index of the same shape as y
+inline void maxpool_forward_nchw(const float *x, float *y, pool_index *index,
+                                 const pool2d_geometry &g) {
+  assert(g.is_valid());
+  const std::ptrdiff_t H = g.H, W = g.W;
+  const std::ptrdiff_t H_out = g.H_out(), W_out = g.W_out();
+  const std::ptrdiff_t sh = g.stride_h, sw = g.stride_w;
+  const std::ptrdiff_t ph = g.pad_h, pw = g.pad_w;
+
+  auto planes = detail::iota(g.N * g.C);
+  std::for_each(
+      std::execution::par, planes.begin(), planes.end(), [&](std::size_t nc) {
+        const float *xp = x + nc * H * W;
+        float *yp = y + nc * H_out * W_out;
+        pool_index *ip = index + nc * H_out * W_out;
+        std::fill(yp, yp + H_out * W_out,
+                  -std::numeric_limits<float>::infinity());
+        for (std::ptrdiff_t i = 0; i < H_out; i++) {
+          for (std::ptrdiff_t j = 0; j < W_out; j++) {
+            ip[i * W_out + j] = pooling_detail::first_tap(i, j, g);
+          }
+        }
+
+        for (std::ptrdiff_t i = 0; i < H_out; i++) {
+          float *__restrict yrow = yp + i * W_out;
+          pool_index *__restrict irow = ip + i * W_out;
+          for (std::ptrdiff_t p = 0; p < static_cast<std::ptrdiff_t>(g.H_f);
+               p++) {
+            const std::ptrdiff_t h = i * sh + p - ph;
+            if (h < 0 || H <= h) {
+              continue;
+            }
+            const float *__restrict xrow = xp + h * W;
+            for (std::ptrdiff_t q = 0; q < static_cast<std::ptrdiff_t>(g.W_f);
+                 q++) {
+              const auto tap = static_cast<pool_index>(p * g.W_f + q);
+              std::ptrdiff_t lo, hi;
+              detail::valid_range(q, pw, sw, W, W_out, lo, hi);
+              const std::ptrdiff_t offset = q - pw;
+              for (std::ptrdiff_t j = lo; j < hi; j++) {
+                const float v = xrow[j * sw + offset];
+                const bool take = pooling_detail::takes_max(v, yrow[j]);
+                yrow[j] = take ? v : yrow[j];
+                irow[j] = take ? tap : irow[j];
+              }
+            }
+          }
+        }
+      });
+}
+
+// gx {N, C, H, W} is overwritten from gy and the index of the forward pass.
+inline void maxpool_backward_nchw(const float *gy, const pool_index *index,
+                                  float *gx, const pool2d_geometry &g) {
+  const std::ptrdiff_t H = g.H, W = g.W;
+  const std::ptrdiff_t H_out = g.H_out(), W_out = g.W_out();
+  const std::ptrdiff_t sh = g.stride_h, sw = g.stride_w;
+  const std::ptrdiff_t ph = g.pad_h, pw = g.pad_w;
+  const std::ptrdiff_t W_f = g.W_f;
+
+  auto planes = detail::iota(g.N * g.C);
+  std::for_each(
+      std::execution::par, planes.begin(), planes.end(), [&](std::size_t nc) {
+        const float *gyp = gy + nc * H_out * W_out;
+        const pool_index *ip = index + nc * H_out * W_out;
+        float *gxp = gx + nc * H * W;
+        std::fill(gxp, gxp + H * W, 0.f);
+        for (std::ptrdiff_t i = 0; i < H_out; i++) {
+          for (std::ptrdiff_t j = 0; j < W_out; j++) {
+            const std::ptrdiff_t tap = ip[i * W_out + j];
+            const std::ptrdiff_t h = i * sh + tap / W_f - ph;
+            const std::ptrdiff_t w = j * sw + tap % W_f - pw;
+            gxp[h * W + w] += gyp[i * W_out + j];
+          }
+        }
+      });
+}
+
+// x {N, H, W, C}, y {N, H_out, W_out, C}, index of the same shape as y
+inline void maxpool_forward_nhwc(const float *x, float *y, pool_index *index,
+                                 const pool2d_geometry &g) {
+  assert(g.is_valid());
+  const std::ptrdiff_t H = g.H, W = g.W;
+  const std::ptrdiff_t H_out = g.H_out(), W_out = g.W_out();
+  const std::ptrdiff_t sh = g.stride_h, sw = g.stride_w;
+  const std::ptrdiff_t ph = g.pad_h, pw = g.pad_w;
+  const std::size_t C = g.C;
+
+  auto rows = detail::iota(g.N * H_out);
+  std::for_each(
+      std::execution::par, rows.begin(), rows.end(), [&](std::size_t ni) {
+        const std::ptrdiff_t n = ni / H_out;
+        const std::ptrdiff_t i = ni % H_out;
+        float *yrow = y + ni * W_out * C;
+        pool_index *irow = index + ni * W_out * C;
+        std::fill(yrow, yrow + W_out * C,
+                  -std::numeric_limits<float>::infinity());
+        for (std::ptrdiff_t j = 0; j < W_out; j++) {
+          std::fill(irow + j * C, irow + (j + 1) * C,
+                    pooling_detail::first_tap(i, j, g));
+        }
+
+        for (std::ptrdiff_t j = 0; j < W_out; j++) {
+          float *__restrict yc = yrow + j * C;
+          pool_index *__restrict ic = irow + j * C;
+          for (std::ptrdiff_t p = 0; p < static_cast<std::ptrdiff_t>(g.H_f);
+               p++) {
+            const std::ptrdiff_t h = i * sh + p - ph;
+            if (h < 0 || H <= h) {
+              continue;
+            }
+            for (std::ptrdiff_t q = 0; q < static_cast<std::ptrdiff_t>(g.W_f);
+                 q++) {
+              const std::ptrdiff_t w = j * sw + q - pw;
+              if (w < 0 || W <= w) {
+                continue;
+              }
+              const auto tap = static_cast<pool_index>(p * g.W_f + q);
+              const float *__restrict xc = x + ((n * H + h) * W + w) * C;
+              for (std::size_t c = 0; c < C; c++) {
+                const bool take = pooling_detail::takes_max(xc[c], yc[c]);
+                yc[c] = take ? xc[c] : yc[c];
+                ic[c] = take ? tap : ic[c];
+              }
+            }
+          }
+        }
+      });
+}
+
+// gx {N, H, W, C} is overwritten from gy and the index of the forward pass.
+// windows of one image overlap when the stride is below the kernel size, so
+// tasks are whole images.
+inline void maxpool_backward_nhwc(const float *gy, const pool_index *index,
+                                  float *gx, const pool2d_geometry &g) {
+  const std::ptrdiff_t H = g.H, W = g.W;
+  const std::ptrdiff_t H_out = g.H_out(), W_out = g.W_out();
+  const std::ptrdiff_t sh = g.stride_h, sw = g.stride_w;
+  const std::ptrdiff_t ph = g.pad_h, pw = g.pad_w;
+  const std::ptrdiff_t W_f = g.W_f;
+  const std::size_t C = g.C;
+
+  auto images = detail::iota(g.N);
+  std::for_each(
+      std::execution::par, images.begin(), images.end(), [&](std::size_t n) {
+        float *gxn = gx + n * H * W * C;
+        std::fill(gxn, gxn + H * W * C, 0.f);
+        for (std::ptrdiff_t i = 0; i < H_out; i++) {
+          for (std::ptrdiff_t j = 0; j < W_out; j++) {
+            const std::size_t o = ((n * H_out + i) * W_out + j) * C;
+            for (std::size_t c = 0; c < C; c++) {
+              const std::ptrdiff_t tap = index[o + c];
+              const std::ptrdiff_t h = i * sh + tap / W_f - ph;
+              const std::ptrdiff_t w = j * sw + tap % W_f - pw;
+              gxn[(h * W + w) * C + c] += gy[o + c];
+            }
+          }
+        }
+      });
+}
+
+// x {N, C, H, W}, y {N, C, H_out, W_out}
+inline void avgpool_forward_nchw(const float *x, float *y,
+                                 const pool2d_geometry &g) {
+  assert(g.is_valid());
+  const std::ptrdiff_t H = g.H, W = g.W;
+  const std::ptrdiff_t H_out = g.H_out(), W_out = g.W_out();
+  const std::ptrdiff_t sh = g.stride_h, sw = g.stride_w;
+  const std::ptrdiff_t ph = g.pad_h, pw = g.pad_w;
+  const float scale = 1.f / static_cast<float>(g.H_f * g.W_f);
+
+  auto planes = detail::iota(g.N * g.C);
+  std::for_each(
+      std::execution::par, planes.begin(), planes.end(), [&](std::size_t nc) {
+        const float *xp = x + nc * H * W;
+        float *yp = y + nc * H_out * W_out;
+        std::fill(yp, yp + H_out * W_out, 0.f);
+        for (std::ptrdiff_t i = 0; i < H_out; i++) {
+          float *__restrict yrow = yp + i * W_out;
+          for (std::ptrdiff_t p = 0; p < static_cast<std::ptrdiff_t>(g.H_f);
+               p++) {
+            const std::ptrdiff_t h = i * sh + p - ph;
+            if (h < 0 || H <= h) {
+              continue;
+            }
+            const float *__restrict xrow = xp + h * W;
+            for (std::ptrdiff_t q = 0; q < static_cast<std::ptrdiff_t>(g.W_f);
+                 q++) {
+              std::ptrdiff_t lo, hi;
+              detail::valid_range(q, pw, sw, W, W_out, lo, hi);
+              const std::ptrdiff_t offset = q - pw;
+              for (std::ptrdiff_t j = lo; j < hi; j++) {
+                yrow[j] += xrow[j * sw + offset];
+              }
+            }
+          }
+          for (std::ptrdiff_t j = 0; j < W_out; j++) {
+            yrow[j] *= scale;
+          }
+        }
+      });
+}
+
+// gx {N, C, H, W} is overwritten from gy.
+inline void avgpool_backward_nchw(const float *gy, float *gx,
+                                  const pool2d_geometry &g) {
+  const std::ptrdiff_t H = g.H, W = g.W;
+  const std::ptrdiff_t H_out = g.H_out(), W_out = g.W_out();
+  const std::ptrdiff_t sh = g.stride_h, sw = g.stride_w;
+  const std::ptrdiff_t ph = g.pad_h, pw = g.pad_w;
+  const float scale = 1.f / static_cast<float>(g.H_f * g.W_f);
+
+  auto planes = detail::iota(g.N * g.C);
+  std::for_each(
+      std::execution::par, planes.begin(), planes.end(), [&](std::size_t nc) {
+        const float *gyp = gy + nc * H_out * W_out;
+        float *gxp = gx + nc * H * W;
+        std::fill(gxp, gxp + H * W, 0.f);
+        for (std::ptrdiff_t i = 0; i < H_out; i++) {
+          const float *__restrict gyrow = gyp + i * W_out;
+          for (std::ptrdiff_t p = 0; p < static_cast<std::ptrdiff_t>(g.H_f);
+               p++) {
+            const std::ptrdiff_t h = i * sh + p - ph;
+            if (h < 0 || H <= h) {
+              continue;
+            }
+            float *__restrict gxrow = gxp + h * W;
+            for (std::ptrdiff_t q = 0; q < static_cast<std::ptrdiff_t>(g.W_f);
+                 q++) {
+              std::ptrdiff_t lo, hi;
+              detail::valid_range(q, pw, sw, W, W_out, lo, hi);
+              const std::ptrdiff_t offset = q - pw;
+              for (std::ptrdiff_t j = lo; j < hi; j++) {
+                gxrow[j * sw + offset] += gyrow[j] * scale;
+              }
+            }
+          }
+        }
+      });
+}
+
+// x {N, H, W, C}, y {N, H_out, W_out, C}
+inline void avgpool_forward_nhwc(const float *x, float *y,
+                                 const pool2d_geometry &g) {
+  assert(g.is_valid());
+  const std::ptrdiff_t H = g.H, W = g.W;
+  const std::ptrdiff_t H_out = g.H_out(), W_out = g.W_out();
+  const std::ptrdiff_t sh = g.stride_h, sw = g.stride_w;
+  const std::ptrdiff_t ph = g.pad_h, pw = g.pad_w;
+  const std::size_t C = g.C;
+  const float scale = 1.f / static_cast<float>(g.H_f * g.W_f);
+
+  auto rows = detail::iota(g.N * H_out);
+  std::for_each(
+      std::execution::par, rows.begin(), rows.end(), [&](std::size_t ni) {
+        const std::ptrdiff_t n = ni / H_out;
+        const std::ptrdiff_t i = ni % H_out;
+        float *yrow = y + ni * W_out * C;
+        std::fill(yrow, yrow + W_out * C, 0.f);
+        for (std::ptrdiff_t j = 0; j < W_out; j++) {
+          float *__restrict yc = yrow + j * C;
+          for (std::ptrdiff_t p = 0; p < static_cast<std::ptrdiff_t>(g.H_f);
+               p++) {
+            const std::ptrdiff_t h = i * sh + p - ph;
+            if (h < 0 || H <= h) {
+              continue;
+            }
+            for (std::ptrdiff_t q = 0; q < static_cast<std::ptrdiff_t>(g.W_f);
+                 q++) {
+              const std::ptrdiff_t w = j * sw + q - pw;
+              if (w < 0 || W <= w) {
+                continue;
+              }
+              const float *__restrict xc = x + ((n * H + h) * W + w) * C;
+              for (std::size_t c = 0; c < C; c++) {
+                yc[c] += xc[c];
+              }
+            }
+          }
+          for (std::size_t c = 0; c < C; c++) {
+            yc[c] *= scale;
+          }
+        }
+      });
+}
+
+// gx {N, H, W, C} is overwritten from gy, one image per task.
+inline void avgpool_backward_nhwc(const float *gy, float *gx,
+                                  const pool2d_geometry &g) {
+  const std::ptrdiff_t H = g.H, W = g.W;
+  const std::ptrdiff_t H_out = g.H_out(), W_out = g.W_out();
+  const std::ptrdiff_t sh = g.stride_h, sw = g.stride_w;
+  const std::ptrdiff_t ph = g.pad_h, pw = g.pad_w;
+  const std::size_t C = g.C;
+  const float scale = 1.f / static_cast<float>(g.H_f * g.W_f);
+
+  auto images = detail::iota(g.N);
+  std::for_each(
+      std::execution::par, images.begin(), images.end(), [&](std::size_t n) {
+        float *gxn = gx + n * H * W * C;
+        std::fill(gxn, gxn + H * W * C, 0.f);
+        for (std::ptrdiff_t i = 0; i < H_out; i++) {
+          for (std::ptrdiff_t j = 0; j < W_out; j++) {
+            const float *__restrict gyc =
+                gy + ((n * H_out + i) * W_out + j) * C;
+            for (std::ptrdiff_t p = 0;
+                 p < static_cast<std::ptrdiff_t>(g.H_f); p++) {
+              const std::ptrdiff_t h = i * sh + p - ph;
+              if (h < 0 || H <= h) {
+                continue;
+              }
+              for (std::ptrdiff_t q = 0;
+                   q < static_cast<std::ptrdiff_t>(g.W_f); q++) {
+                const std::ptrdiff_t w = j * sw + q - pw;
+                if (w < 0 || W <= w) {
+                  continue;
+                }
+                float *__restrict gxc = gxn + (h * W + w) * C;
+                for (std::size_t c = 0; c < C; c++) {
+                  gxc[c] += gyc[c] * scale;
+                }
+              }
+            }
+          }
+        }
+      });
+}
+
+} // namespace kernel
+} // namespace kuu
+
+#endif // KUU_KERNELS_POOLING_HPP
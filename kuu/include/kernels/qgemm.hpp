@@ -0,0 +1,376 @@
+#ifndef KUU_KERNELS_QGEMM_HPP
+#define KUU_KERNELS_QGEMM_HPP
+
+#include "kernels/gemm.hpp"
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+// int8 GEMM for inference. weights are symmetric int8 with one scale per
+// output column; activations are symmetric int8 with one scale per call,
+// stored offset by 128 as uint8 so that VNNI's u8 x s8 dot product applies.
+// the offset is removed with the column sums of the weights in the epilogue:
+//   sum_k (a + 128) * w = sum_k a * w + 128 * sum_k w.
+// products accumulate in int32, so there is no saturation.
+
+namespace kuu {
+namespace kernel {
+
+// columns per block of the packed weights, and blocks per kernel call
+constexpr std::size_t kQBlock = 16;
+constexpr std::size_t kQBlocks = 4;
+constexpr std::size_t kQTile = kQBlock * kQBlocks;
+constexpr std::int32_t kActivationOffset = 128;
+
+// op(B) {K, N} quantized per column and packed in blocks of kQBlock columns.
+// each block is {k4 / 4, kQBlock, 4}: four consecutive k of a column are
+// adjacent, which is the operand layout of VNNI.
+struct qpacked_matrix {
+  std::size_t k = 0;
+  std::size_t n = 0;
+  std::size_t k4 = 0; // k rounded up to a multiple of 4
+  std::vector<std::int8_t> data;
+  std::vector<std::int32_t> col_sum;
+  std::vector<float> scale;
+
+  const std::int8_t *block(const std::size_t j0) const {
+    return data.data() + (j0 / kQBlock) * k4 * kQBlock;
+  }
+  std::size_t bytes() const {
+    return data.size() + col_sum.size() * sizeof(std::int32_t) +
+           scale.size() * sizeof(float);
+  }
+};
+
+// acc[r * kQTile + c] = sum over k4 of a[r * lda + k] * b for r < rows,
+// rows <= mr, over nb <= kQBlocks consecutive packed blocks of columns.
+using qgemm_kernel_fn = void (*)(std::size_t rows, std::size_t nb,
+                                 std::size_t k4, const std::uint8_t *a,
+                                 std::size_t lda, const std::int8_t *b,
+                                 std::int32_t *acc);
+
+struct qgemm_kernel {
+  const char *name;
+  std::size_t mr;
+  qgemm_kernel_fn fn;
+};
+
+namespace qgemm_detail {
+
+inline void qgemm_kernel_generic(std::size_t rows, std::size_t nb,
+                                 std::size_t k4, const std::uint8_t *a,
+                                 std::size_t lda, const std::int8_t *b,
+                                 std::int32_t *acc) {
+  for (std::size_t r = 0; r < rows; r++) {
+    for (std::size_t q = 0; q < nb; q++) {
+      std::int32_t *c = acc + r * kQTile + q * kQBlock;
+      const std::int8_t *bq = b + q * k4 * kQBlock;
+      std::fill(c, c + kQBlock, 0);
+      for (std::size_t g = 0; g < k4 / 4; g++) {
+        const std::uint8_t *ar = a + r * lda + g * 4;
+        const std::int8_t *bg = bq + g * kQBlock * 4;
+        for (std::size_t j = 0; j < kQBlock; j++) {
+          for (std::size_t t = 0; t < 4; t++) {
+            c[j] += static_cast<std::int32_t>(ar[t]) * bg[j * 4 + t];
+          }
+        }
+      }
+    }
+  }
+}
+
+#ifdef KUU_GEMM_X86
+inline std::int32_t load4(const std::uint8_t *p) {
+  std::int32_t v;
+  std::memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+// one row at a time through madd: a's four bytes are widened to 16 bits and
+// repeated, b's columns are widened, and pairs of products land in int32.
+// the two partial sums of each column are added once at the end.
+template <std::size_t R>
+__attribute__((target("avx2"))) void
+qgemm_rows_avx2(std::size_t k4, const std::uint8_t *a, std::size_t lda,
+                const std::int8_t *b, std::int32_t *acc) {
+  __m256i c[R][4];
+#pragma GCC unroll 4
+  for (std::size_t r = 0; r < R; r++) {
+#pragma GCC unroll 4
+    for (std::size_t q = 0; q < 4; q++) {
+      c[r][q] = _mm256_setzero_si256();
+    }
+  }
+  for (std::size_t g = 0; g < k4 / 4; g++) {
+    const std::int8_t *bg = b + g * kQBlock * 4;
+    __m256i w[4];
+#pragma GCC unroll 4
+    for (std::size_t q = 0; q < 4; q++) {
+      w[q] = _mm256_cvtepi8_epi16(_mm_loadu_si128(
+          reinterpret_cast<const __m128i *>(bg + q * 16)));
+    }
+#pragma GCC unroll 4
+    for (std::size_t r = 0; r < R; r++) {
+      const __m256i x = _mm256_cvtepu8_epi16(
+          _mm_set1_epi32(load4(a + r * lda + g * 4)));
+#pragma GCC unroll 4
+      for (std::size_t q = 0; q < 4; q++) {
+        c[r][q] = _mm256_add_epi32(c[r][q], _mm256_madd_epi16(x, w[q]));
+      }
+    }
+  }
+#pragma GCC unroll 4
+  for (std::size_t r = 0; r < R; r++) {
+    // hadd leaves columns {0, 1, 4, 5 | 2, 3, 6, 7}; permute restores order.
+    const __m256i lo = _mm256_permute4x64_epi64(
+        _mm256_hadd_epi32(c[r][0], c[r][1]), 0xD8);
+    const __m256i hi = _mm256_permute4x64_epi64(
+        _mm256_hadd_epi32(c[r][2], c[r][3]), 0xD8);
+    _mm256_storeu_si256(reinterpret_cast<__m256i *>(acc + r * kQTile), lo);
+    _mm256_storeu_si256(reinterpret_cast<__m256i *>(acc + r * kQTile + 8),
+                        hi);
+  }
+}
+
+__attribute__((target("avx2"))) inline void
+qgemm_kernel_avx2(std::size_t rows, std::size_t nb, std::size_t k4,
+                  const std::uint8_t *a, std::size_t lda, const std::int8_t *b,
+                  std::int32_t *acc) {
+  for (std::size_t q = 0; q < nb; q++) {
+    const std::int8_t *bq = b + q * k4 * kQBlock;
+    if (rows == 2) {
+      qgemm_rows_avx2<2>(k4, a, lda, bq, acc + q * kQBlock);
+    } else {
+      qgemm_rows_avx2<1>(k4, a, lda, bq, acc + q * kQBlock);
+    }
+  }
+}
+
+// R rows by NB blocks of 16 columns in registers: per group of four k, NB
+// weight loads and R broadcasts feed R * NB dot products. the loops are
+// unrolled so that the accumulators stay in registers.
+template <std::size_t R, std::size_t NB>
+__attribute__((target("avx512f,avx512vnni"))) void
+qgemm_tile_vnni(std::size_t k4, const std::uint8_t *a, std::size_t lda,
+                const std::int8_t *b, std::int32_t *acc) {
+  __m512i c[R][NB];
+#pragma GCC unroll 4
+  for (std::size_t r = 0; r < R; r++) {
+#pragma GCC unroll 4
+    for (std::size_t q = 0; q < NB; q++) {
+      c[r][q] = _mm512_setzero_si512();
+    }
+  }
+  for (std::size_t g = 0; g < k4 / 4; g++) {
+    __m512i w[NB];
+#pragma GCC unroll 4
+    for (std::size_t q = 0; q < NB; q++) {
+      w[q] = _mm512_loadu_si512(b + q * k4 * kQBlock + g * kQBlock * 4);
+    }
+#pragma GCC unroll 4
+    for (std::size_t r = 0; r < R; r++) {
+      const __m512i x = _mm512_set1_epi32(load4(a + r * lda + g * 4));
+#pragma GCC unroll 4
+      for (std::size_t q = 0; q < NB; q++) {
+        c[r][q] = _mm512_dpbusd_epi32(c[r][q], x, w[q]);
+      }
+    }
+  }
+#pragma GCC unroll 4
+  for (std::size_t r = 0; r < R; r++) {
+#pragma GCC unroll 4
+    for (std::size_t q = 0; q < NB; q++) {
+      _mm512_storeu_si512(acc + r * kQTile + q * kQBlock, c[r][q]);
+    }
+  }
+}
+
+template <std::size_t R>
+__attribute__((target("avx512f,avx512vnni"))) void
+qgemm_rows_vnni(std::size_t nb, std::size_t k4, const std::uint8_t *a,
+                std::size_t lda, const std::int8_t *b, std::int32_t *acc) {
+  switch (nb) {
+  case 4:
+    qgemm_tile_vnni<R, 4>(k4, a, lda, b, acc);
+    break;
+  case 3:
+    qgemm_tile_vnni<R, 3>(k4, a, lda, b, acc);
+    break;
+  case 2:
+    qgemm_tile_vnni<R, 2>(k4, a, lda, b, acc);
+    break;
+  default:
+    qgemm_tile_vnni<R, 1>(k4, a, lda, b, acc);
+    break;
+  }
+}
+
+__attribute__((target("avx512f,avx512vnni"))) inline void
+qgemm_kernel_vnni(std::size_t rows, std::size_t nb, std::size_t k4,
+                  const std::uint8_t *a, std::size_t lda, const std::int8_t *b,
+                  std::int32_t *acc) {
+  switch (rows) {
+  case 4:
+    qgemm_rows_vnni<4>(nb, k4, a, lda, b, acc);
+    break;
+  case 3:
+    qgemm_rows_vnni<3>(nb, k4, a, lda, b, acc);
+    break;
+  case 2:
+    qgemm_rows_vnni<2>(nb, k4, a, lda, b, acc);
+    break;
+  default:
+    qgemm_rows_vnni<1>(nb, k4, a, lda, b, acc);
+    break;
+  }
+}
+#endif // KUU_GEMM_X86
+
+inline std::int8_t quantize_value(const float x, const float inv_scale) {
+  const float q = std::nearbyint(x * inv_scale);
+  return static_cast<std::int8_t>(std::clamp(q, -127.f, 127.f));
+}
+
+} // namespace qgemm_detail
+
+// every int8 kernel this machine can run, fastest first.
+inline const std::vector<qgemm_kernel> &available_qgemm_kernels() {
+  static const std::vector<qgemm_kernel> kernels = [] {
+    std::vector<qgemm_kernel> v;
+#ifdef KUU_GEMM_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f") &&
+        __builtin_cpu_supports("avx512vnni")) {
+      v.push_back({"vnni", 4, &qgemm_detail::qgemm_kernel_vnni});
+    }
+    if (__builtin_cpu_supports("avx2")) {
+      v.push_back({"avx2", 2, &qgemm_detail::qgemm_kernel_avx2});
+    }
+#endif
+    v.push_back({"generic", 1, &qgemm_detail::qgemm_kernel_generic});
+    return v;
+  }();
+  return kernels;
+}
+
+inline const qgemm_kernel &default_qgemm_kernel() {
+  return available_qgemm_kernels().front();
+}
+
+// quantizes op(B) {K, N} with a symmetric scale per column, max |b| / 127.
+inline qpacked_matrix quantize_matrix(const bool trans_b, const std::size_t K,
+                                      const std::size_t N, const float *B,
+                                      const std::size_t ldb) {
+  auto at = [&](std::size_t k, std::size_t j) {
+    return trans_b ? B[j * ldb + k] : B[k * ldb + j];
+  };
+  qpacked_matrix packed;
+  packed.k = K;
+  packed.n = N;
+  packed.k4 = (K + 3) / 4 * 4;
+  const std::size_t blocks = (N + kQBlock - 1) / kQBlock;
+  packed.data.assign(blocks * packed.k4 * kQBlock, 0);
+  packed.col_sum.assign(N, 0);
+  packed.scale.assign(N, 1.f);
+  for (std::size_t j = 0; j < N; j++) {
+    float max_abs = 0.f;
+    for (std::size_t k = 0; k < K; k++) {
+      max_abs = std::max(max_abs, std::abs(at(k, j)));
+    }
+    const float scale = 0.f < max_abs ? max_abs / 127.f : 1.f;
+    packed.scale[j] = scale;
+    std::int8_t *block = packed.data.data() + (j / kQBlock) * packed.k4 * kQBlock;
+    for (std::size_t k = 0; k < K; k++) {
+      const std::int8_t q = qgemm_detail::quantize_value(at(k, j), 1.f / scale);
+      block[(k / 4) * kQBlock * 4 + (j % kQBlock) * 4 + k % 4] = q;
+      packed.col_sum[j] += q;
+    }
+  }
+  return packed;
+}
+
+// symmetric scale of an activation, max |a| / 127.
+inline float activation_scale(const std::size_t M, const std::size_t K,
+                              const float *A, const std::size_t lda) {
+  float max_abs = 0.f;
+  for (std::size_t i = 0; i < M; i++) {
+    for (std::size_t k = 0; k < K; k++) {
+      max_abs = std::max(max_abs, std::abs(A[i * lda + k]));
+    }
+  }
+  return 0.f < max_abs ? max_abs / 127.f : 1.f;
+}
+
+// A {M, K} to uint8 rows of k4 entries, offset by 128. padding is the zero.
+inline void quantize_activations(const std::size_t M, const std::size_t K,
+                                 const float *A, const std::size_t lda,
+                                 const float scale, std::uint8_t *out,
+                                 const std::size_t k4) {
+  const float inv_scale = 1.f / scale;
+  gemm_detail::parallel_for(gemm_detail::kParallelWork <= M * K, M, [&](std::size_t i) {
+    for (std::size_t k = 0; k < K; k++) {
+      out[i * k4 + k] = static_cast<std::uint8_t>(
+          qgemm_detail::quantize_value(A[i * lda + k], inv_scale) +
+          kActivationOffset);
+    }
+    std::fill(out + i * k4 + K, out + (i + 1) * k4,
+              static_cast<std::uint8_t>(kActivationOffset));
+  });
+}
+
+// C {M, N} = dequantized A * B + bias, where A holds uint8 rows of B.k4
+// entries quantized with a_scale. bias may be null.
+inline void qgemm(const std::size_t M, const std::uint8_t *A,
+                  const float a_scale, const qpacked_matrix &B,
+                  const float *bias, float *C, const std::size_t ldc,
+                  const qgemm_kernel &uk = default_qgemm_kernel()) {
+  const std::size_t N = B.n, k4 = B.k4;
+  const std::size_t row_tiles = (M + uk.mr - 1) / uk.mr;
+  const std::size_t tiles = (N + kQTile - 1) / kQTile;
+  assert(uk.mr <= 4);
+  gemm_detail::parallel_for(
+      gemm_detail::kParallelWork <= M * N * B.k, row_tiles * tiles,
+      [&](std::size_t t) {
+        // row tiles vary fastest, so that consecutive tiles reuse the
+        // weights of one column tile from cache.
+        const std::size_t i0 = (t % row_tiles) * uk.mr;
+        const std::size_t j0 = (t / row_tiles) * kQTile;
+        const std::size_t rows = std::min(uk.mr, M - i0);
+        const std::size_t cols = std::min(kQTile, N - j0);
+        const std::size_t nb = (cols + kQBlock - 1) / kQBlock;
+        std::int32_t acc[4 * kQTile];
+        uk.fn(rows, nb, k4, A + i0 * k4, k4, B.block(j0), acc);
+        for (std::size_t r = 0; r < rows; r++) {
+          float *c = C + (i0 + r) * ldc + j0;
+          for (std::size_t j = 0; j < cols; j++) {
+            const std::int32_t v = acc[r * kQTile + j] -
+                                   kActivationOffset * B.col_sum[j0 + j];
+            c[j] = static_cast<float>(v) * (a_scale * B.scale[j0 + j]) +
+                   (bias ? bias[j0 + j] : 0.f);
+          }
+        }
+      });
+}
+
+// quantizes A {M, B.k} with the given scale, or with its own range when the
+// scale is not positive, and runs qgemm.
+inline void qgemm(const std::size_t M, const float *A, const std::size_t lda,
+                  float a_scale, const qpacked_matrix &B, const float *bias,
+                  float *C, const std::size_t ldc,
+                  const qgemm_kernel &uk = default_qgemm_kernel()) {
+  if (!(0.f < a_scale)) {
+    a_scale = activation_scale(M, B.k, A, lda);
+  }
+  std::vector<std::uint8_t> quantized(M * B.k4);
+  quantize_activations(M, B.k, A, lda, a_scale, quantized.data(), B.k4);
+  qgemm(M, quantized.data(), a_scale, B, bias, C, ldc, uk);
+}
+
+} // namespace kernel
+} // namespace kuu
+
+#endif // KUU_KERNELS_QGEMM_HPP
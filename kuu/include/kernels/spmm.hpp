@@ -0,0 +1,96 @@
+#ifndef KUU_KERNELS_SPMM_HPP
+#define KUU_KERNELS_SPMM_HPP
+
+#include <algorithm>
+#include <cstddef>
+#include <execution>
+#include <numeric>
+#include <vector>
+
+// sparse-dense products for a CSR matrix A {rows, cols}. only the stored
+// entries are visited, and each one updates a contiguous row of the dense
+// operand, so the inner loops vectorize.
+
+namespace kuu {
+namespace kernel {
+
+struct csr_view {
+  std::size_t rows;
+  std::size_t cols;
+  const std::size_t *row_ptr; // rows + 1
+  const std::size_t *col_idx; // nnz
+  const float *values;        // nnz
+};
+
+// C {rows, N} = A * B with B {cols, N}. rows of C are independent.
+inline void spmm(const csr_view &A, const float *B, const std::size_t ldb,
+                 const std::size_t N, float *C, const std::size_t ldc) {
+  std::vector<std::size_t> rows(A.rows);
+  std::iota(rows.begin(), rows.end(), 0);
+  std::for_each(std::execution::par, rows.begin(), rows.end(),
+                [&](std::size_t r) {
+                  float *c = C + r * ldc;
+                  std::fill(c, c + N, 0.f);
+                  for (std::size_t e = A.row_ptr[r]; e < A.row_ptr[r + 1];
+                       e++) {
+                    const float v = A.values[e];
+                    const float *b = B + A.col_idx[e] * ldb;
+                    for (std::size_t j = 0; j < N; j++) {
+                      c[j] += v * b[j];
+                    }
+                  }
+                });
+}
+
+// C {cols, N} = A^T * G with G {rows, N}, writing only the rows of C whose
+// column of A has a stored entry. returns those rows in ascending order.
+// the entries are regrouped by column first, so that every row of C is
+// owned by one task.
+inline std::vector<std::size_t> spmm_transposed(const csr_view &A,
+                                                const float *G,
+                                                const std::size_t ldg,
+                                                const std::size_t N, float *C,
+                                                const std::size_t ldc) {
+  const std::size_t nnz = A.row_ptr[A.rows];
+  std::vector<std::size_t> col_ptr(A.cols + 1, 0);
+  for (std::size_t e = 0; e < nnz; e++) {
+    col_ptr[A.col_idx[e] + 1]++;
+  }
+  std::partial_sum(col_ptr.begin(), col_ptr.end(), col_ptr.begin());
+
+  // entries of each column, in row order: {row, index into values}
+  std::vector<std::size_t> entry_row(nnz), entry_index(nnz);
+  std::vector<std::size_t> next(col_ptr.begin(), col_ptr.end() - 1);
+  for (std::size_t r = 0; r < A.rows; r++) {
+    for (std::size_t e = A.row_ptr[r]; e < A.row_ptr[r + 1]; e++) {
+      const std::size_t slot = next[A.col_idx[e]]++;
+      entry_row[slot] = r;
+      entry_index[slot] = e;
+    }
+  }
+
+  std::vector<std::size_t> active;
+  for (std::size_t c = 0; c < A.cols; c++) {
+    if (col_ptr[c] < col_ptr[c + 1]) {
+      active.push_back(c);
+    }
+  }
+  std::for_each(std::execution::par, active.begin(), active.end(),
+                [&](std::size_t c) {
+                  float *out = C + c * ldc;
+                  std::fill(out, out + N, 0.f);
+                  for (std::size_t s = col_ptr[c]; s < col_ptr[c + 1]; s++) {
+                    const float v = A.values[entry_index[s]];
+                    const float *g = G + entry_row[s] * ldg;
+                    for (std::size_t j = 0; j < N; j++) {
+                      out[j] += v * g[j];
+                    }
+                  }
+                });
+  return active;
+}
+
+} // namespace kernel
+} // namespace kuu
+
+#endif // KUU_KERNELS_SPMM_HPP
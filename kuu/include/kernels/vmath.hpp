@@ -0,0 +1,560 @@
+#ifndef KUU_KERNELS_VMATH_HPP
+#define KUU_KERNELS_VMATH_HPP
+
+#include "kernels/gemm.hpp"
+#include <algorithm>
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+
+// vectorized fp32 exp and log, and the sigmoid, softmax and log-softmax
+// built on them. both use Cody-Waite range reduction and the minimax
+// polynomials of Cephes' expf and logf. measured over every float against
+// a double precision reference, the largest errors are
+//   exp: 1.01 ulp for normal results, 0.75 * 2^-149 for subnormal ones
+//   log: 0.83 ulp
+// the AVX2 path evaluates the same polynomials with fused
+// multiply-adds and may differ from the generic one in the last bit.
+// exp(+-inf) and log(0), log(+inf), log(x < 0) follow IEEE; NaN propagates.
+// reference: Stephen L. Moshier, Cephes Math Library (expf.c, logf.c)
+
+namespace kuu {
+namespace kernel {
+
+namespace vmath_detail {
+
+constexpr float kLog2e = 1.44269504088896341f;
+// ln 2 split so that n * kLn2Hi is exact for the n exp can reach
+constexpr float kLn2Hi = 0.693359375f;
+constexpr float kLn2Lo = -2.12194440e-4f;
+// exp's argument is clamped to this range, past which it rounds to zero or
+// overflows to infinity anyway.
+constexpr float kExpMin = -110.f;
+constexpr float kExpMax = 89.f;
+// adding 1.5 * 2^23 rounds to an integer held in the low mantissa bits
+constexpr float kRoundMagic = 12582912.f;
+constexpr float kSqrtHalf = 0.707106781186547524f;
+
+// elements per task of the bulk kernels
+constexpr std::size_t kChunk = 1 << 16;
+
+inline std::uint32_t bits(const float f) {
+  std::uint32_t u;
+  std::memcpy(&u, &f, sizeof(u));
+  return u;
+}
+
+inline float from_bits(const std::uint32_t u) {
+  float f;
+  std::memcpy(&f, &u, sizeof(f));
+  return f;
+}
+
+inline float exp_generic(const float x) {
+  const float c = std::min(std::max(x, kExpMin), kExpMax);
+  const float t = c * kLog2e + kRoundMagic;
+  const float n = t - kRoundMagic;
+  const std::int32_t k = static_cast<std::int32_t>(bits(t) - bits(kRoundMagic));
+  float r = c - n * kLn2Hi;
+  r = r - n * kLn2Lo;
+  float p = 1.9875691500e-4f;
+  p = p * r + 1.3981999507e-3f;
+  p = p * r + 8.3334519073e-3f;
+  p = p * r + 4.1665795894e-2f;
+  p = p * r + 1.6666665459e-1f;
+  p = p * r + 5.0000001201e-1f;
+  const float y = p * (r * r) + r + 1.f;
+  // 2^k in two factors, each a normal float, so that results near the
+  // range ends underflow or overflow in a single rounding.
+  const std::int32_t h = k >> 1;
+  const float result =
+      y * from_bits(static_cast<std::uint32_t>(h + 127) << 23) *
+      from_bits(static_cast<std::uint32_t>(k - h + 127) << 23);
+  return x != x ? x : result;
+}
+
+inline float log_generic(const float x) {
+  // subnormals are scaled into the normal range first
+  const bool tiny = x < std::numeric_limits<float>::min();
+  const std::uint32_t u = bits(tiny ? x * 8388608.f : x);
+  // x = m * 2^e with m in [sqrt(1/2), sqrt(2))
+  std::int32_t e = static_cast<std::int32_t>(u >> 23) - 126 - (tiny ? 23 : 0);
+  float m = from_bits((u & 0x007fffffu) | 0x3f000000u);
+  const bool low = m < kSqrtHalf;
+  e -= low ? 1 : 0;
+  m = low ? m + m - 1.f : m - 1.f;
+  const float fe = static_cast<float>(e);
+
+  const float z = m * m;
+  float p = 7.0376836292e-2f;
+  p = p * m - 1.1514610310e-1f;
+  p = p * m + 1.1676998740e-1f;
+  p = p * m - 1.2420140846e-1f;
+  p = p * m + 1.4249322787e-1f;
+  p = p * m - 1.6668057665e-1f;
+  p = p * m + 2.0000714765e-1f;
+  p = p * m - 2.4999993993e-1f;
+  p = p * m + 3.3333331174e-1f;
+  float y = p * m * z;
+  y += fe * kLn2Lo;
+  y -= 0.5f * z;
+  const float result = m + y + fe * kLn2Hi;
+
+  constexpr float inf = std::numeric_limits<float>::infinity();
+  return 0.f < x && x < inf
+             ? result
+             : x == 0.f ? -inf
+                        : x < 0.f ? std::numeric_limits<float>::quiet_NaN()
+                                  : x;
+}
+
+inline void exp_rows_generic(const float *x, const std::size_t n, float *y) {
+  for (std::size_t i = 0; i < n; i++) {
+    y[i] = exp_generic(x[i]);
+  }
+}
+
+inline void log_rows_generic(const float *x, const std::size_t n, float *y) {
+  for (std::size_t i = 0; i < n; i++) {
+    y[i] = log_generic(x[i]);
+  }
+}
+
+inline void sigmoid_rows_generic(const float *x, const std::size_t n,
+                                 float *y) {
+  for (std::size_t i = 0; i < n; i++) {
+    y[i] = 1.f / (1.f + exp_generic(-x[i]));
+  }
+}
+
+inline float max_generic(const float *x, const std::size_t n) {
+  float m = -std::numeric_limits<float>::infinity();
+  for (std::size_t i = 0; i < n; i++) {
+    m = std::max(m, x[i]);
+  }
+  return m;
+}
+
+inline void softmax_row_generic(const std::size_t n, const float *x,
+                                float *y) {
+  const float m = max_generic(x, n);
+  float sum = 0.f;
+  for (std::size_t i = 0; i < n; i++) {
+    y[i] = exp_generic(x[i] - m);
+    sum += y[i];
+  }
+  const float scale = 1.f / sum;
+  for (std::size_t i = 0; i < n; i++) {
+    y[i] *= scale;
+  }
+}
+
+inline float log_sum_exp_generic(const std::size_t n, const float *x) {
+  const float m = max_generic(x, n);
+  float sum = 0.f;
+  for (std::size_t i = 0; i < n; i++) {
+    sum += exp_generic(x[i] - m);
+  }
+  return m + log_generic(sum);
+}
+
+inline void log_softmax_row_generic(const std::size_t n, const float *x,
+                                    float *y) {
+  const float lse = log_sum_exp_generic(n, x);
+  for (std::size_t i = 0; i < n; i++) {
+    y[i] = x[i] - lse;
+  }
+}
+
+// gx = scale * (exp(x - lse) - t), t taken as 0 when null
+inline void softmax_grad_row_generic(const std::size_t n, const float *x,
+                                     const float lse, const float *t,
+                                     const float scale, float *gx) {
+  for (std::size_t i = 0; i < n; i++) {
+    gx[i] = scale * (exp_generic(x[i] - lse) - (t ? t[i] : 0.f));
+  }
+}
+
+#ifdef KUU_GEMM_X86
+__attribute__((target("avx2,fma"))) inline __m256 exp_avx2(const __m256 x) {
+  const __m256 c = _mm256_min_ps(
+      _mm256_max_ps(x, _mm256_set1_ps(kExpMin)), _mm256_set1_ps(kExpMax));
+  const __m256 magic = _mm256_set1_ps(kRoundMagic);
+  const __m256 t = _mm256_fmadd_ps(c, _mm256_set1_ps(kLog2e), magic);
+  const __m256 n = _mm256_sub_ps(t, magic);
+  const __m256i k = _mm256_sub_epi32(_mm256_castps_si256(t),
+                                     _mm256_castps_si256(magic));
+  __m256 r = _mm256_fnmadd_ps(n, _mm256_set1_ps(kLn2Hi), c);
+  r = _mm256_fnmadd_ps(n, _mm256_set1_ps(kLn2Lo), r);
+  __m256 p = _mm256_set1_ps(1.9875691500e-4f);
+  p = _mm256_fmadd_ps(p, r, _mm256_set1_ps(1.3981999507e-3f));
+  p = _mm256_fmadd_ps(p, r, _mm256_set1_ps(8.3334519073e-3f));
+  p = _mm256_fmadd_ps(p, r, _mm256_set1_ps(4.1665795894e-2f));
+  p = _mm256_fmadd_ps(p, r, _mm256_set1_ps(1.6666665459e-1f));
+  p = _mm256_fmadd_ps(p, r, _mm256_set1_ps(5.0000001201e-1f));
+  const __m256 y = _mm256_add_ps(
+      _mm256_fmadd_ps(p, _mm256_mul_ps(r, r), r), _mm256_set1_ps(1.f));
+  const __m256i bias = _mm256_set1_epi32(127);
+  const __m256i h = _mm256_srai_epi32(k, 1);
+  const __m256 s0 = _mm256_castsi256_ps(
+      _mm256_slli_epi32(_mm256_add_epi32(h, bias), 23));
+  const __m256 s1 = _mm256_castsi256_ps(_mm256_slli_epi32(
+      _mm256_add_epi32(_mm256_sub_epi32(k, h), bias), 23));
+  const __m256 result = _mm256_mul_ps(_mm256_mul_ps(y, s0), s1);
+  return _mm256_blendv_ps(result, x, _mm256_cmp_ps(x, x, _CMP_UNORD_Q));
+}
+
+__attribute__((target("avx2,fma"))) inline __m256 log_avx2(const __m256 x) {
+  const __m256 tiny =
+      _mm256_cmp_ps(x, _mm256_set1_ps(std::numeric_limits<float>::min()),
+                    _CMP_LT_OQ);
+  const __m256i u = _mm256_castps_si256(_mm256_blendv_ps(
+      x, _mm256_mul_ps(x, _mm256_set1_ps(8388608.f)), tiny));
+  __m256i e = _mm256_sub_epi32(_mm256_srli_epi32(u, 23),
+                               _mm256_set1_epi32(126));
+  e = _mm256_sub_epi32(
+      e, _mm256_and_si256(_mm256_castps_si256(tiny), _mm256_set1_epi32(23)));
+  __m256 m = _mm256_castsi256_ps(
+      _mm256_or_si256(_mm256_and_si256(u, _mm256_set1_epi32(0x007fffff)),
+                      _mm256_set1_epi32(0x3f000000)));
+  const __m256 low =
+      _mm256_cmp_ps(m, _mm256_set1_ps(kSqrtHalf), _CMP_LT_OQ);
+  // the all-ones mask is -1
+  e = _mm256_add_epi32(e, _mm256_castps_si256(low));
+  const __m256 one = _mm256_set1_ps(1.f);
+  m = _mm256_sub_ps(_mm256_add_ps(m, _mm256_and_ps(m, low)), one);
+  const __m256 fe = _mm256_cvtepi32_ps(e);
+
+  const __m256 z = _mm256_mul_ps(m, m);
+  __m256 p = _mm256_set1_ps(7.0376836292e-2f);
+  p = _mm256_fmadd_ps(p, m, _mm256_set1_ps(-1.1514610310e-1f));
+  p = _mm256_fmadd_ps(p, m, _mm256_set1_ps(1.1676998740e-1f));
+  p = _mm256_fmadd_ps(p, m, _mm256_set1_ps(-1.2420140846e-1f));
+  p = _mm256_fmadd_ps(p, m, _mm256_set1_ps(1.4249322787e-1f));
+  p = _mm256_fmadd_ps(p, m, _mm256_set1_ps(-1.6668057665e-1f));
+  p = _mm256_fmadd_ps(p, m, _mm256_set1_ps(2.0000714765e-1f));
+  p = _mm256_fmadd_ps(p, m, _mm256_set1_ps(-2.4999993993e-1f));
+  p = _mm256_fmadd_ps(p, m, _mm256_set1_ps(3.3333331174e-1f));
+  __m256 y = _mm256_mul_ps(_mm256_mul_ps(p, m), z);
+  y = _mm256_fmadd_ps(fe, _mm256_set1_ps(kLn2Lo), y);
+  y = _mm256_fnmadd_ps(_mm256_set1_ps(0.5f), z, y);
+  const __m256 result =
+      _mm256_fmadd_ps(fe, _mm256_set1_ps(kLn2Hi), _mm256_add_ps(m, y));
+
+  const __m256 zero = _mm256_setzero_ps();
+  const __m256 inf = _mm256_set1_ps(std::numeric_limits<float>::infinity());
+  const __m256 finite_positive =
+      _mm256_and_ps(_mm256_cmp_ps(zero, x, _CMP_LT_OQ),
+                    _mm256_cmp_ps(x, inf, _CMP_LT_OQ));
+  __m256 special = _mm256_blendv_ps(
+      x, _mm256_set1_ps(std::numeric_limits<float>::quiet_NaN()),
+      _mm256_cmp_ps(x, zero, _CMP_LT_OQ));
+  special = _mm256_blendv_ps(special, _mm256_sub_ps(zero, inf),
+                             _mm256_cmp_ps(x, zero, _CMP_EQ_OQ));
+  return _mm256_blendv_ps(special, result, finite_positive);
+}
+
+__attribute__((target("avx2,fma"))) inline void
+exp_rows_avx2(const float *x, const std::size_t n, float *y) {
+  std::size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    _mm256_storeu_ps(y + i, exp_avx2(_mm256_loadu_ps(x + i)));
+  }
+  exp_rows_generic(x + i, n - i, y + i);
+}
+
+__attribute__((target("avx2,fma"))) inline void
+log_rows_avx2(const float *x, const std::size_t n, float *y) {
+  std::size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    _mm256_storeu_ps(y + i, log_avx2(_mm256_loadu_ps(x + i)));
+  }
+  log_rows_generic(x + i, n - i, y + i);
+}
+
+__attribute__((target("avx2,fma"))) inline void
+sigmoid_rows_avx2(const float *x, const std::size_t n, float *y) {
+  const __m256 one = _mm256_set1_ps(1.f);
+  const __m256 zero = _mm256_setzero_ps();
+  std::size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    const __m256 e = exp_avx2(_mm256_sub_ps(zero, _mm256_loadu_ps(x + i)));
+    _mm256_storeu_ps(y + i, _mm256_div_ps(one, _mm256_add_ps(one, e)));
+  }
+  sigmoid_rows_generic(x + i, n - i, y + i);
+}
+
+__attribute__((target("avx2,fma"))) inline float hsum_avx2(const __m256 v) {
+  __m128 s = _mm_add_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1));
+  s = _mm_add_ps(s, _mm_movehl_ps(s, s));
+  s = _mm_add_ss(s, _mm_movehdup_ps(s));
+  return _mm_cvtss_f32(s);
+}
+
+__attribute__((target("avx2,fma"))) inline float
+max_avx2(const float *x, const std::size_t n) {
+  __m256 m = _mm256_set1_ps(-std::numeric_limits<float>::infinity());
+  std::size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    m = _mm256_max_ps(m, _mm256_loadu_ps(x + i));
+  }
+  __m128 s = _mm_max_ps(_mm256_castps256_ps128(m), _mm256_extractf128_ps(m, 1));
+  s = _mm_max_ps(s, _mm_movehl_ps(s, s));
+  s = _mm_max_ss(s, _mm_movehdup_ps(s));
+  return std::max(_mm_cvtss_f32(s), max_generic(x + i, n - i));
+}
+
+__attribute__((target("avx2,fma"))) inline void
+softmax_row_avx2(const std::size_t n, const float *x, float *y) {
+  const float m = max_avx2(x, n);
+  const __m256 vm = _mm256_set1_ps(m);
+  __m256 acc = _mm256_setzero_ps();
+  std::size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    const __m256 e = exp_avx2(_mm256_sub_ps(_mm256_loadu_ps(x + i), vm));
+    _mm256_storeu_ps(y + i, e);
+    acc = _mm256_add_ps(acc, e);
+  }
+  float sum = hsum_avx2(acc);
+  for (; i < n; i++) {
+    y[i] = exp_generic(x[i] - m);
+    sum += y[i];
+  }
+  const __m256 scale = _mm256_set1_ps(1.f / sum);
+  for (i = 0; i + 8 <= n; i += 8) {
+    _mm256_storeu_ps(y + i, _mm256_mul_ps(_mm256_loadu_ps(y + i), scale));
+  }
+  for (; i < n; i++) {
+    y[i] *= 1.f / sum;
+  }
+}
+
+__attribute__((target("avx2,fma"))) inline float
+log_sum_exp_avx2(const std::size_t n, const float *x) {
+  const float m = max_avx2(x, n);
+  const __m256 vm = _mm256_set1_ps(m);
+  __m256 acc = _mm256_setzero_ps();
+  std::size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    acc = _mm256_add_ps(
+        acc, exp_avx2(_mm256_sub_ps(_mm256_loadu_ps(x + i), vm)));
+  }
+  float sum = hsum_avx2(acc);
+  for (; i < n; i++) {
+    sum += exp_generic(x[i] - m);
+  }
+  return m + log_generic(sum);
+}
+
+__attribute__((target("avx2,fma"))) inline void
+log_softmax_row_avx2(const std::size_t n, const float *x, float *y) {
+  const float lse = log_sum_exp_avx2(n, x);
+  const __m256 vlse = _mm256_set1_ps(lse);
+  std::size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    _mm256_storeu_ps(y + i, _mm256_sub_ps(_mm256_loadu_ps(x + i), vlse));
+  }
+  for (; i < n; i++) {
+    y[i] = x[i] - lse;
+  }
+}
+
+__attribute__((target("avx2,fma"))) inline void
+softmax_grad_row_avx2(const std::size_t n, const float *x, const float lse,
+                      const float *t, const float scale, float *gx) {
+  const __m256 vlse = _mm256_set1_ps(lse);
+  const __m256 vscale = _mm256_set1_ps(scale);
+  std::size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    __m256 p = exp_avx2(_mm256_sub_ps(_mm256_loadu_ps(x + i), vlse));
+    if (t) {
+      p = _mm256_sub_ps(p, _mm256_loadu_ps(t + i));
+    }
+    _mm256_storeu_ps(gx + i, _mm256_mul_ps(p, vscale));
+  }
+  softmax_grad_row_generic(n - i, x + i, lse, t ? t + i : nullptr, scale,
+                           gx + i);
+}
+
+inline bool has_avx2_fma() {
+  static const bool supported = [] {
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+  }();
+  return supported;
+}
+#endif // KUU_GEMM_X86
+
+inline float log_sum_exp_row(const std::size_t n, const float *x) {
+#ifdef KUU_GEMM_X86
+  if (has_avx2_fma()) {
+    return log_sum_exp_avx2(n, x);
+  }
+#endif
+  return log_sum_exp_generic(n, x);
+}
+
+inline void softmax_grad_row(const std::size_t n, const float *x,
+                             const float lse, const float *t,
+                             const float scale, float *gx) {
+#ifdef KUU_GEMM_X86
+  if (has_avx2_fma()) {
+    softmax_grad_row_avx2(n, x, lse, t, scale, gx);
+    return;
+  }
+#endif
+  softmax_grad_row_generic(n, x, lse, t, scale, gx);
+}
+
+// f(x + i0, m, y + i0) over chunks of at most kChunk elements.
+template <class Function>
+void for_each_chunk(const std::size_t n, Function &&f) {
+  const std::size_t chunks = (n + kChunk - 1) / kChunk;
+  gemm_detail::parallel_for(1 < chunks, chunks, [&](const std::size_t c) {
+    const std::size_t i0 = c * kChunk;
+    f(i0, std::min(n - i0, kChunk));
+  });
+}
+
+// f(row) for every row, in tasks of whole rows.
+template <class Function>
+void for_each_row(const std::size_t rows, const std::size_t cols,
+                  Function &&f) {
+  const std::size_t per_task = std::max<std::size_t>(1, kChunk / cols);
+  const std::size_t tasks = (rows + per_task - 1) / per_task;
+  gemm_detail::parallel_for(1 < tasks, tasks, [&](const std::size_t t) {
+    const std::size_t end = std::min(rows, (t + 1) * per_task);
+    for (std::size_t r = t * per_task; r < end; r++) {
+      f(r);
+    }
+  });
+}
+
+} // namespace vmath_detail
+
+// y[i] = exp(x[i]) for i < n. y may alias x.
+inline void vexp(const float *x, const std::size_t n, float *y) {
+  vmath_detail::for_each_chunk(n, [&](const std::size_t i0,
+                                      const std::size_t m) {
+#ifdef KUU_GEMM_X86
+    if (vmath_detail::has_avx2_fma()) {
+      vmath_detail::exp_rows_avx2(x + i0, m, y + i0);
+      return;
+    }
+#endif
+    vmath_detail::exp_rows_generic(x + i0, m, y + i0);
+  });
+}
+
+// y[i] = log(x[i]) for i < n. y may alias x.
+inline void vlog(const float *x, const std::size_t n, float *y) {
+  vmath_detail::for_each_chunk(n, [&](const std::size_t i0,
+                                      const std::size_t m) {
+#ifdef KUU_GEMM_X86
+    if (vmath_detail::has_avx2_fma()) {
+      vmath_detail::log_rows_avx2(x + i0, m, y + i0);
+      return;
+    }
+#endif
+    vmath_detail::log_rows_generic(x + i0, m, y + i0);
+  });
+}
+
+// y[i] = 1 / (1 + exp(-x[i])) for i < n. y may alias x.
+inline void vsigmoid(const float *x, const std::size_t n, float *y) {
+  vmath_detail::for_each_chunk(n, [&](const std::size_t i0,
+                                      const std::size_t m) {
+#ifdef KUU_GEMM_X86
+    if (vmath_detail::has_avx2_fma()) {
+      vmath_detail::sigmoid_rows_avx2(x + i0, m, y + i0);
+      return;
+    }
+#endif
+    vmath_detail::sigmoid_rows_generic(x + i0, m, y + i0);
+  });
+}
+
+// softmax of each of the rows of x, a {rows, cols} row-major matrix, with
+// the row maximum subtracted before exp. rows run in parallel. y may alias
+// x.
+inline void softmax(const std::size_t rows, const std::size_t cols,
+                    const float *x, float *y) {
+  vmath_detail::for_each_row(rows, cols, [&](const std::size_t r) {
+#ifdef KUU_GEMM_X86
+    if (vmath_detail::has_avx2_fma()) {
+      vmath_detail::softmax_row_avx2(cols, x + r * cols, y + r * cols);
+      return;
+    }
+#endif
+    vmath_detail::softmax_row_generic(cols, x + r * cols, y + r * cols);
+  });
+}
+
+// x - log(sum(exp(x))) for each of the rows of x, as in softmax.
+inline void log_softmax(const std::size_t rows, const std::size_t cols,
+                        const float *x, float *y) {
+  vmath_detail::for_each_row(rows, cols, [&](const std::size_t r) {
+#ifdef KUU_GEMM_X86
+    if (vmath_detail::has_avx2_fma()) {
+      vmath_detail::log_softmax_row_avx2(cols, x + r * cols, y + r * cols);
+      return;
+    }
+#endif
+    vmath_detail::log_softmax_row_generic(cols, x + r * cols, y + r * cols);
+  });
+}
+
+// fused softmax cross-entropy of each of the rows of x, a {rows, cols}
+// matrix of scores: lse[r] = log(sum(exp(x[r]))) and
+//   loss[r] = lse[r] - x[r, labels[r]]                 for class labels,
+//   loss[r] = sum_j targets[r, j] * (lse[r] - x[r, j])  for soft targets.
+// labels are class indices stored as floats; exactly one of labels and
+// targets is given. lse is what softmax_cross_entropy_grad needs.
+inline void softmax_cross_entropy(const std::size_t rows,
+                                  const std::size_t cols, const float *x,
+                                  const float *labels, const float *targets,
+                                  float *lse, float *loss) {
+  assert((labels == nullptr) != (targets == nullptr));
+  vmath_detail::for_each_row(rows, cols, [&](const std::size_t r) {
+    const float *row = x + r * cols;
+    lse[r] = vmath_detail::log_sum_exp_row(cols, row);
+    if (labels) {
+      const auto label = static_cast<std::size_t>(labels[r]);
+      assert(label < cols);
+      loss[r] = lse[r] - row[label];
+      return;
+    }
+    const float *t = targets + r * cols;
+    float sum = 0.f;
+    for (std::size_t j = 0; j < cols; j++) {
+      sum += t[j] * (lse[r] - row[j]);
+    }
+    loss[r] = sum;
+  });
+}
+
+// gx = scale * (softmax(x) - t) for each row, with softmax(x) = exp(x - lse)
+// from the lse of softmax_cross_entropy and t the one-hot rows of labels or
+// the targets, one of which is given. gx may alias x.
+inline void softmax_cross_entropy_grad(const std::size_t rows,
+                                       const std::size_t cols, const float *x,
+                                       const float *lse, const float *labels,
+                                       const float *targets, const float scale,
+                                       float *gx) {
+  assert((labels == nullptr) != (targets == nullptr));
+  vmath_detail::for_each_row(rows, cols, [&](const std::size_t r) {
+    const float *t = targets ? targets + r * cols : nullptr;
+    vmath_detail::softmax_grad_row(cols, x + r * cols, lse[r], t, scale,
+                                   gx + r * cols);
+    if (labels) {
+      gx[r * cols + static_cast<std::size_t>(labels[r])] -= scale;
+    }
+  });
+}
+
+} // namespace kernel
+} // namespace kuu
+
+#endif // KUU_KERNELS_VMATH_HPP
@@ -1,6 +1,8 @@
 #ifndef KUU_LAYOUT_HPP
 #define KUU_LAYOUT_HPP
 
+#include <cstdint>
+
 namespace kuu {
 struct NHWC {
   static constexpr uint16_t N = 0;
@@ -16,5 +18,9 @@ struct NCHW {
   static constexpr uint16_t W = 3;
 };
 
+// memory format of a 4-d tensor. the shape of the data follows the storage
+// order, i.e. a kNHWC tensor has shape {N, H, W, C}.
+enum class memory_format { kNCHW = 0, kNHWC = 1 };
+
 } // namespace kuu
-#endif //  KUU_LAYOUT_HPP
\ No newline at end of file
+#endif //  KUU_LAYOUT_HPP
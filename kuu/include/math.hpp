@@ -1,41 +1,101 @@
 #ifndef KUU_MATH_HPP
 #define KUU_MATH_HPP
 
+#include "config.hpp"
+#include "kernels/gemm.hpp"
+#include "kernels/vmath.hpp"
+#include <cassert>
+#include <type_traits>
 #include <xtensor/xexpression.hpp>
+#include <xtensor/xmanipulation.hpp>
 #include <xtensor/xmath.hpp>
 #include <xtensor/xoperation.hpp>
 
 namespace kuu {
 namespace math {
-template <class E> auto softmax(const xt::xexpression<E> &e, size_t axis = 1) {
-  auto x = e.derived_cast();
-  auto xmax = xt::amax(x, {axis});
+namespace math_detail {
 
-  for (std::size_t i = 0; i < x.shape()[0]; i++) {
-    xt::view(x, i, xt::all()) -= xmax(i);
+// kernel(rows, cols, src, dst) over the rows of e along axis. other axes
+// than the last are moved last for the kernel and back.
+template <class E, class Kernel>
+xt::xarray<value_type> along_axis(const xt::xexpression<E> &e,
+                                  const std::size_t axis, const Kernel &kernel) {
+  xt::xarray<value_type> x = e.derived_cast();
+  assert(axis < x.dimension());
+  if (x.size() == 0) {
+    return x;
+  }
+  const std::size_t last = x.dimension() - 1;
+  if (axis != last) {
+    xt::xarray<value_type> t = xt::swapaxes(x, axis, last);
+    kernel(t.size() / t.shape()[last], t.shape()[last], t.data(), t.data());
+    return xt::swapaxes(t, axis, last);
   }
-  return xt::eval(xt::exp(x - xmax) / xt::sum(xt::exp(x - xmax), {axis}));
+  kernel(x.size() / x.shape()[last], x.shape()[last], x.data(), x.data());
+  return x;
 }
 
+} // namespace math_detail
+
+// softmax along axis, with the maximum subtracted before exp, computed row
+// by row in parallel with the kernels of kernels/vmath.hpp.
 template <class E>
-auto log_softmax(const xt::xexpression<E> &e, size_t axis = 1) {
-  xt::xarray<value_type> x = e.derived_cast();
-  auto y = x;
-  auto xmax = xt::amax(x, {axis});
-  for (std::size_t i = 0; i < x.shape()[0]; i++) {
-    xt::view(y, i, xt::all()) -= xmax(i);
-  }
-  auto log_sum_exp = xt::log(xt::sum(xt::exp(y), {axis})) + xmax;
+xt::xarray<value_type> softmax(const xt::xexpression<E> &e, size_t axis = 1) {
+  return math_detail::along_axis(e, axis, kernel::softmax);
+}
 
-  for (std::size_t i = 0; i < x.shape()[0]; i++) {
-    xt::view(x, i, xt::all()) -= log_sum_exp(i);
-  }
+// x - log(sum(exp(x))) along axis, as in softmax.
+template <class E>
+xt::xarray<value_type> log_softmax(const xt::xexpression<E> &e,
+                                   size_t axis = 1) {
+  return math_detail::along_axis(e, axis, kernel::log_softmax);
+}
 
-  return x;
+// op(a) * op(b) for 2-d row-major containers, where op transposes when the
+// flag is set. the transpose is folded into the GEMM's packing instead of
+// being materialized.
+template <class E0, class E1>
+xt::xarray<value_type> gemm(const E0 &a, const E1 &b, const bool trans_a = false,
+                            const bool trans_b = false) {
+  static_assert(std::is_same_v<typename E0::value_type, float> &&
+                std::is_same_v<typename E1::value_type, float>);
+  assert(a.dimension() == 2 && b.dimension() == 2);
+  assert(a.layout() == xt::layout_type::row_major);
+  assert(b.layout() == xt::layout_type::row_major);
+  const std::size_t M = a.shape()[trans_a ? 1 : 0];
+  const std::size_t K = a.shape()[trans_a ? 0 : 1];
+  const std::size_t N = b.shape()[trans_b ? 0 : 1];
+  assert(b.shape()[trans_b ? 1 : 0] == K);
+
+  xt::xarray<value_type> c = xt::xarray<value_type>::from_shape({M, N});
+  kernel::sgemm(trans_a, trans_b, M, N, K, 1.f, a.data(), a.shape()[1],
+                b.data(), b.shape()[1], 0.f, c.data(), N);
+  return c;
 }
 
-template <class E> inline auto sigmoid(const xt::xexpression<E> &x) {
-  return xt::eval(1. / (1. + xt::exp(-x.derived_cast())));
+// op(a) * b with b prepacked, see tensor_container::packed. the epilogue's
+// bias and activation are applied while the output tiles are still hot.
+template <class E0>
+xt::xarray<value_type> gemm(const E0 &a, const kernel::packed_matrix &b,
+                            const bool trans_a = false,
+                            const kernel::gemm_epilogue &epilogue = {}) {
+  static_assert(std::is_same_v<typename E0::value_type, float>);
+  assert(a.dimension() == 2);
+  assert(a.layout() == xt::layout_type::row_major);
+  const std::size_t M = a.shape()[trans_a ? 1 : 0];
+  assert(a.shape()[trans_a ? 0 : 1] == b.k);
+
+  xt::xarray<value_type> c = xt::xarray<value_type>::from_shape({M, b.n});
+  kernel::sgemm(trans_a, M, 1.f, a.data(), a.shape()[1], b, 0.f, c.data(),
+                b.n, epilogue);
+  return c;
+}
+
+template <class E>
+inline xt::xarray<value_type> sigmoid(const xt::xexpression<E> &x) {
+  xt::xarray<value_type> y = x.derived_cast();
+  kernel::vsigmoid(y.data(), y.size(), y.data());
+  return y;
 }
 } // namespace math
 } // namespace kuu
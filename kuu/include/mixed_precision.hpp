@@ -0,0 +1,118 @@
+#ifndef KUU_MIXED_PRECISION_HPP
+#define KUU_MIXED_PRECISION_HPP
+
+#include "graph.hpp"
+#include "kernels/half.hpp"
+#include "mixin/non_copyable.hpp"
+#include "mixin/non_movable.hpp"
+#include "optimizer.hpp"
+#include "tensor.hpp"
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <cstddef>
+#include <optional>
+#include <xtensor/xbuilder.hpp>
+
+// mixed precision training: activations saved for backward are stored in 16
+// bits while linear and convolution keep computing and accumulating in fp32.
+// together with optimizer::use_master_weights and a grad_scaler:
+//
+//   optim.use_master_weights(kernel::half_format::kFloat16);
+//   grad_scaler scaler;
+//   ...
+//   optim.clear_grad();
+//   {
+//     autocast storage{kernel::half_format::kFloat16};
+//     loss = net.forward(input, gt);
+//   }
+//   scaler.backward(loss);
+//   scaler.step(optim);
+
+namespace kuu {
+
+// while alive, activations saved for backward are kept in the given format.
+class autocast : private non_copyable<autocast>,
+                 private non_movable<autocast> {
+public:
+  explicit autocast(
+      const kernel::half_format format = kernel::half_format::kBFloat16)
+      : previous_{detail::g->activation_format()} {
+    detail::g->set_activation_format(format);
+  }
+  ~autocast() { detail::g->set_activation_format(previous_); }
+
+private:
+  std::optional<kernel::half_format> previous_;
+};
+
+// dynamic loss scaling. the loss is scaled before backward so that small
+// grads survive 16-bit precision, and the grads are unscaled before the
+// update. a step whose grads overflowed is skipped and the scale backs off;
+// after growth_interval steps without overflow the scale grows again.
+class grad_scaler {
+public:
+  struct options {
+    float init_scale = 65536.f;
+    float growth_factor = 2.f;
+    float backoff_factor = 0.5f;
+    std::size_t growth_interval = 2000;
+  };
+
+  grad_scaler() : grad_scaler(options{}) {}
+  explicit grad_scaler(options &&hyperparams)
+      : hyperparams_{std::move(hyperparams)},
+        scale_{hyperparams_.init_scale} {
+    assert(0 < hyperparams_.init_scale);
+    assert(1 < hyperparams_.growth_factor);
+    assert(0 < hyperparams_.backoff_factor && hyperparams_.backoff_factor < 1);
+  }
+
+  // backward of scale() * loss, seeded with the scale instead of building
+  // the product.
+  void backward(tensor &loss) {
+    loss.set_grad(xt::ones_like(loss.data()) * scale_);
+    trace::run_backward(loss);
+  }
+
+  // unscales the grads of the optimizer's parameters and updates them,
+  // unless a grad is inf or NaN. returns whether the update ran.
+  bool step(optimizer &optim) {
+    const float inv_scale = 1.f / scale_;
+    bool finite = true;
+    for (auto &param : optim.parameters()) {
+      if (!param.requires_grad()) {
+        continue;
+      }
+      auto &grad = param.grad();
+      grad *= inv_scale;
+      finite = finite && std::all_of(grad.storage().cbegin(),
+                                     grad.storage().cend(), [](const auto g) {
+                                       return std::isfinite(g);
+                                     });
+    }
+    if (!finite) {
+      optim.discard();
+      scale_ *= hyperparams_.backoff_factor;
+      clean_steps_ = 0;
+      return false;
+    }
+    optim.update();
+    if (++clean_steps_ == hyperparams_.growth_interval) {
+      scale_ *= hyperparams_.growth_factor;
+      clean_steps_ = 0;
+    }
+    return true;
+  }
+
+  float scale() const noexcept { return scale_; }
+
+private:
+  options hyperparams_;
+  float scale_;
+  std::size_t clean_steps_ = 0;
+};
+
+} // namespace kuu
+
+#endif // KUU_MIXED_PRECISION_HPP
@@ -5,6 +5,7 @@
 #include "initializer.hpp"
 #include "tensor.hpp"
 #include <execution>
+#include <functional>
 #include <map>
 #include <memory>
 #include <unordered_map>
@@ -58,7 +59,12 @@ public:
         is_initialized_{false} {}
   ~module() = default;
 
+  // called after forward with the module, its input and its output.
+  using forward_hook =
+      std::function<void(module &, const tensor &, const tensor &)>;
+
   inline std::string id() const noexcept { return id_; }
+  inline const std::string &name() const noexcept { return name_; }
   inline bool is_training() const noexcept { return is_training_; }
   inline bool is_initialized() const noexcept { return is_initialized_; }
 
@@ -67,9 +73,16 @@ public:
   template <class F> void initialize(F initializer_function);
 
   void clear_grad(const bool recursive = true);
+  // calls f(module &) on this module and then on every submodule, depth
+  // first, in the order of their names.
+  template <class F> void apply(F &&f);
   void set_name(std::string name) { name_ = name; }
   void train(bool on = true);
 
+  // returns a handle for remove_forward_hook.
+  std::size_t register_forward_hook(forward_hook hook);
+  void remove_forward_hook(const std::size_t handle);
+
   std::vector<tensor> parameters(bool recursive = true);
   std::optional<tensor> parameter(std::string name) {
     if (util::find(params_, name)) {
@@ -87,6 +100,9 @@ protected:
   tensor &register_parameter(std::string name, tensor param,
                              bool requires_grad = true);
 
+  // to be called by forward once the output is computed.
+  void run_forward_hooks(const tensor &input, const tensor &output);
+
   std::unordered_map<std::string, tensor> params_;
   std::map<std::string, std::shared_ptr<module>> submodules_;
   bool is_initialized_;
@@ -95,6 +111,8 @@ private:
   id_type id_;
   std::string name_;
   bool is_training_;
+  std::map<std::size_t, forward_hook> forward_hooks_;
+  std::size_t next_hook_ = 0;
 }; // namespace kuu
 
 template <class F, class... U>
@@ -137,6 +155,13 @@ template <class F> void module::initialize(F initializer_function) {
                 });
 }
 
+template <class F> void module::apply(F &&f) {
+  f(*this);
+  for (auto &submodule : submodules_) {
+    submodule.second->apply(f);
+  }
+}
+
 template <class ModuleType>
 std::shared_ptr<ModuleType>
 module::register_module(std::string name, module_holder<ModuleType> holder) {
@@ -199,6 +224,21 @@ void module::train(bool on) {
   is_training_ = on;
 }
 
+std::size_t module::register_forward_hook(forward_hook hook) {
+  forward_hooks_[next_hook_] = std::move(hook);
+  return next_hook_++;
+}
+
+void module::remove_forward_hook(const std::size_t handle) {
+  forward_hooks_.erase(handle);
+}
+
+void module::run_forward_hooks(const tensor &input, const tensor &output) {
+  for (auto &hook : forward_hooks_) {
+    hook.second(*this, input, output);
+  }
+}
+
 } // namespace kuu
 
 #endif // KUU_MODULE_HPP
\ No newline at end of file
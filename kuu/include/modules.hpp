@@ -1,3 +1,4 @@
 #include "modules/batchnorm.hpp"
 #include "modules/convolution.hpp"
-#include "modules/linear.hpp"
\ No newline at end of file
+#include "modules/linear.hpp"
+#include "modules/pooling.hpp"
\ No newline at end of file
@@ -2,7 +2,10 @@
 #define KUU_MODULES_BATCHNORM_HPP
 
 #include "functions/batchnorm.hpp"
+#include "functions/pointwise.hpp"
 #include "module.hpp"
+#include <array>
+#include <cstdint>
 
 namespace kuu {
 struct batchnorm_options {
@@ -20,16 +23,35 @@ public:
                  bool track_running_status = true, double momentum = 0.1);
   batchnorm_impl(const batchnorm_options &options);
 
+  // in evaluation mode with running statistics, the normalization and the
+  // affine transform are one multiply-add per element with no graph node,
+  // unless the input requires grad.
   tensor forward(const tensor &input);
   // void pretty_print(std::ostream &stream) const override;
 
+  // hands out the per-channel scale and shift of evaluation mode, to be
+  // folded into the preceding layer, and makes forward the identity from
+  // then on. false, with nothing changed, while training or without running
+  // statistics. see fold_batchnorm.
+  bool fold(tensor_type &scale, tensor_type &shift);
+  bool is_folded() const noexcept { return folded_; }
+
 private:
   void reset();
+  // refolds inference_scale_ and inference_shift_ when a parameter or a
+  // running statistic has changed since.
+  void update_inference_affine();
   batchnorm_options options_;
   tensor weight_;
   tensor bias_;
   tensor running_mean_;
   tensor running_var_;
+  tensor_type inference_scale_;
+  tensor_type inference_shift_;
+  // versions of weight, bias, running mean and running var folded into them
+  std::array<std::uint64_t, 4> inference_versions_{};
+  bool has_inference_affine_ = false;
+  bool folded_ = false;
 };
 
 batchnorm_impl::batchnorm_impl(std::size_t in_channels, double eps, bool affine,
@@ -77,10 +99,57 @@ void batchnorm_impl::reset() {
   this->is_initialized_ = true; // skip initializing parameters
 }
 
+void batchnorm_impl::update_inference_affine() {
+  const std::array<std::uint64_t, 4> versions = {
+      weight_.is_empty() ? 0 : weight_.version(),
+      bias_.is_empty() ? 0 : bias_.version(), running_mean_.version(),
+      running_var_.version()};
+  if (has_inference_affine_ && versions == inference_versions_) {
+    return;
+  }
+  function::batchnorm_inference::affine(weight_, bias_, running_mean_,
+                                        running_var_, options_.eps,
+                                        inference_scale_, inference_shift_);
+  inference_versions_ = versions;
+  has_inference_affine_ = true;
+}
+
+bool batchnorm_impl::fold(tensor_type &scale, tensor_type &shift) {
+  if (this->is_training() || !options_.track_running_status || folded_) {
+    return false;
+  }
+  update_inference_affine();
+  scale = inference_scale_;
+  shift = inference_shift_;
+  folded_ = true;
+  return true;
+}
+
 tensor batchnorm_impl::forward(const tensor &input) {
-  return function::batchnorm::forward(
-      input, weight_, bias_, running_mean_, running_var_, options_.eps,
-      options_.momentum, this->is_training() && options_.track_running_status);
+  tensor output;
+  if (folded_) {
+    output = input;
+  } else if (!this->is_training() && options_.track_running_status &&
+             !input.requires_grad() && 2 <= input.dim()) {
+    update_inference_affine();
+    if (detail::g->lazy_pointwise()) {
+      // deferred, to be fused with e.g. a following relu
+      output = function::pointwise::affine(
+          input, tensor{inference_scale_, false},
+          tensor{inference_shift_, false});
+    } else {
+      output = function::batchnorm_inference::forward(
+          input, inference_scale_, inference_shift_);
+    }
+  } else {
+    // without running statistics, the batch ones are used in both modes
+    output = function::batchnorm::forward(
+        input, weight_, bias_, running_mean_, running_var_, options_.eps,
+        options_.momentum,
+        this->is_training() || !options_.track_running_status);
+  }
+  run_forward_hooks(input, output);
+  return output;
 }
 
 /*
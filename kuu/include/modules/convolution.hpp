@@ -2,6 +2,7 @@
 #define KUU_MODULES_CONVOLUTION_HPP
 
 #include "functions/convolution.hpp"
+#include "functions/quantized.hpp"
 #include "module.hpp"
 
 namespace kuu {
@@ -16,6 +17,8 @@ template <std::size_t D> struct conv_options {
   bool use_bias = false;
   bool transposed = false;
   exarray<D> out_padding = 0;
+  conv_algorithm algorithm = conv_algorithm::kAuto;
+  std::size_t groups = 1;
 };
 
 class conv2d_impl : public virtual module {
@@ -27,20 +30,53 @@ public:
   explicit conv2d_impl(conv_options<2> &&options);
   tensor forward(const tensor &input);
 
+  // switches forward to int8 inference for inputs in the given format, with
+  // per-output-channel weight scales. grouped and transposed convolutions
+  // stay in fp32, and false is returned for them.
+  bool quantize(const memory_format format = memory_format::kNCHW,
+                const bool release_float_weights = false);
+  bool is_quantized() const noexcept { return static_cast<bool>(qweight_); }
+  // fixed scale of the int8 inputs; 0 derives it from every input's range.
+  void set_activation_scale(const float scale) noexcept {
+    activation_scale_ = scale;
+  }
+  // the weight is {C_in, C_out, H_f, W_f} instead of {C_out, C_in, ...}
+  bool is_transposed() const noexcept { return options_.transposed; }
+  // folds y * scale + shift over the output channels into the weight and
+  // bias, adding a bias if there is none. see fold_batchnorm.
+  void fold_affine(const tensor_type &scale, const tensor_type &shift);
+
 private:
   void reset();
+  std::vector<std::size_t> weight_shape() const;
   conv_options<2> options_;
   tensor weight_;
   tensor bias_;
+  std::shared_ptr<const kernel::qpacked_matrix> qweight_;
+  memory_format qformat_ = memory_format::kNCHW;
+  float activation_scale_ = 0.f;
 };
 
-void conv2d_impl::reset() {
-  std::vector<std::size_t> weight_shape = {
-      options_.out_channels, options_.in_channels,
-      options_.kernel_size.get<0>(), options_.kernel_size.get<1>()};
+std::vector<std::size_t> conv2d_impl::weight_shape() const {
+  return options_.transposed
+             ? std::vector<std::size_t>{options_.in_channels,
+                                        options_.out_channels,
+                                        options_.kernel_size.get<0>(),
+                                        options_.kernel_size.get<1>()}
+             : std::vector<std::size_t>{options_.out_channels,
+                                        options_.in_channels / options_.groups,
+                                        options_.kernel_size.get<0>(),
+                                        options_.kernel_size.get<1>()};
+}
 
+void conv2d_impl::reset() {
+  assert(0 < options_.groups);
+  assert(options_.in_channels % options_.groups == 0);
+  assert(options_.out_channels % options_.groups == 0);
+  // transposed convolutions keep the weight of the convolution they invert.
+  assert(!options_.transposed || options_.groups == 1);
   weight_ = this->register_parameter("conv2d weight",
-                                     tensor{std::move(weight_shape)}, true);
+                                     tensor{weight_shape()}, true);
   if (options_.use_bias) {
     bias_ = this->register_parameter(
         "conv2d bias", tensor{std::vector<std::size_t>{options_.out_channels}},
@@ -61,9 +97,68 @@ conv2d_impl::conv2d_impl(conv_options<2> &&options)
 }
 
 tensor conv2d_impl::forward(const tensor &input) {
-  return function::convolution_2d::forward(input, weight_, bias_,
-                                           options_.stride, options_.padding,
-                                           options_.dilation);
+  tensor output;
+  if (qweight_) {
+    assert(input.format() == qformat_);
+    output = function::quantized_convolution_2d::forward(
+        input, weight_shape(), *qweight_, bias_, options_.stride,
+        options_.padding, options_.dilation, activation_scale_);
+  } else if (options_.transposed) {
+    output = function::convolution_transpose_2d::forward(
+        input, weight_, bias_, options_.stride, options_.padding,
+        options_.out_padding);
+  } else {
+    output = function::convolution_2d::forward(
+        input, weight_, bias_, options_.stride, options_.padding,
+        options_.dilation, options_.groups, options_.algorithm);
+  }
+  run_forward_hooks(input, output);
+  return output;
+}
+
+bool conv2d_impl::quantize(const memory_format format,
+                           const bool release_float_weights) {
+  if (options_.transposed || 1 < options_.groups) {
+    return false;
+  }
+  const auto shape = weight_shape();
+  const std::size_t C_out = shape[0];
+  const std::size_t Cols = shape[1] * shape[2] * shape[3];
+  // {C_out, Cols} in the window order of im2col / im2col_nhwc
+  tensor_type filter = format == memory_format::kNHWC
+                           ? tensor_type(xt::transpose(weight_.cdata(),
+                                                       {0, 2, 3, 1}))
+                           : weight_.cdata();
+  qweight_ = std::make_shared<const kernel::qpacked_matrix>(
+      kernel::quantize_matrix(true, Cols, C_out, filter.data(), Cols));
+  qformat_ = format;
+  if (release_float_weights) {
+    // frees the data and the (zero) grad, and keeps the shape
+    weight_.clear_grad();
+    weight_.release_data();
+  }
+  return true;
+}
+
+void conv2d_impl::fold_affine(const tensor_type &scale,
+                              const tensor_type &shift) {
+  assert(!qweight_);
+  assert(scale.size() == options_.out_channels);
+  assert(shift.size() == options_.out_channels);
+  tensor_type s = scale;
+  if (options_.transposed) {
+    s.reshape({1, options_.out_channels, 1, 1});
+  } else {
+    s.reshape({options_.out_channels, 1, 1, 1});
+  }
+  weight_ = weight_.cdata() * s;
+  if (options_.use_bias) {
+    bias_ = bias_.cdata() * scale + shift;
+  } else {
+    bias_ = this->register_parameter("conv2d bias", tensor{shift},
+                                     this->is_training());
+    options_.use_bias = true;
+  }
 }
 
 using conv2d = module_holder<conv2d_impl>;
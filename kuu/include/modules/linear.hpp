@@ -2,7 +2,10 @@
 #define KUU_MODULES_LINEAR_HPP
 
 #include "functions/linear.hpp"
+#include "functions/quantized.hpp"
+#include "functions/relu.hpp"
 #include "module.hpp"
+#include "sparse_tensor.hpp"
 #include "tensor.hpp"
 #include "util/converter.hpp"
 #include "util/io.hpp"
@@ -20,6 +23,8 @@ struct linear_options {
   size_t in_size;
   size_t out_size;
   bool use_bias;
+  // applied in the GEMM epilogue, see function::fused_linear
+  activation act = activation::kNone;
 };
 
 class linear_impl : public virtual module {
@@ -31,10 +36,31 @@ public:
   ~linear_impl() = default;
 
   tensor forward(const tensor &in);
+  tensor forward(const sparse_tensor &in);
+
+  // switches forward to int8 inference with per-output-channel weight
+  // scales. the fp32 weight can be dropped to keep only the int8 copy.
+  void quantize(const bool release_float_weights = false);
+  bool is_quantized() const noexcept { return static_cast<bool>(qweight_); }
+  // fixed scale of the int8 inputs; 0 derives it from every input's range.
+  void set_activation_scale(const float scale) noexcept {
+    activation_scale_ = scale;
+  }
+  const kernel::qpacked_matrix *quantized_weight() const noexcept {
+    return qweight_.get();
+  }
+  // folds y * scale + shift over the output features into the weight and
+  // bias, adding a bias if there is none. see fold_batchnorm.
+  void fold_affine(const tensor_type &scale, const tensor_type &shift);
 
 private:
   linear_options options_;
   tensor weight_, bias_;
+  std::shared_ptr<const kernel::qpacked_matrix> qweight_;
+  float activation_scale_ = 0.f;
+  // weight gradient rows written by the last sparse backward
+  std::shared_ptr<function::sparse_grad_rows> sparse_grad_rows_ =
+      std::make_shared<function::sparse_grad_rows>();
 };
 
 linear_impl::linear_impl(linear_options &&options)
@@ -51,12 +77,77 @@ linear_impl::linear_impl(linear_options &&options)
 }
 
 tensor linear_impl::forward(const tensor &input) {
-  tensor output = options_.use_bias
-                      ? function::linear::forward(input, weight_, bias_)
-                      : function::linear::forward(input, weight_, tensor{});
+  // the dense backward replaces the weight gradient
+  sparse_grad_rows_->grad = nullptr;
+  tensor output;
+  if (qweight_) {
+    output = function::quantized_linear::forward(
+        input, *qweight_, options_.use_bias ? bias_ : tensor{},
+        activation_scale_, options_.act);
+  } else if (options_.act != activation::kNone) {
+    output = function::fused_linear::forward(
+        input, weight_, options_.use_bias ? bias_ : tensor{}, options_.act);
+  } else {
+    output = options_.use_bias
+                 ? function::linear::forward(input, weight_, bias_)
+                 : function::linear::forward(input, weight_, tensor{});
+  }
+  run_forward_hooks(input, output);
+  return output;
+}
+
+tensor linear_impl::forward(const sparse_tensor &input) {
+  // forward hooks take dense tensors, so they are not run here.
+  auto output =
+      function::linear::forward(input, weight_,
+                                options_.use_bias ? bias_ : tensor{},
+                                sparse_grad_rows_);
+  // the activation epilogue is only fused into the dense GEMM, so it is
+  // applied on its own, in place over the linear's output.
+  switch (options_.act) {
+  case activation::kNone:
+    break;
+  case activation::kReLU:
+    output = function::relu::forward(output, true);
+    break;
+  case activation::kSigmoid:
+    output = function::sigmoid::forward(output, true);
+    break;
+  case activation::kGELU:
+    output = function::gelu::forward(output, true);
+    break;
+  }
   return output;
 }
 
+void linear_impl::quantize(const bool release_float_weights) {
+  const auto &w = weight_.data(); // {in, out}
+  qweight_ = std::make_shared<const kernel::qpacked_matrix>(
+      kernel::quantize_matrix(false, w.shape()[0], w.shape()[1], w.data(),
+                              w.shape()[1]));
+  if (release_float_weights) {
+    // frees the data and the (zero) grad, and keeps the shape
+    weight_.clear_grad();
+    weight_.release_data();
+  }
+}
+
+void linear_impl::fold_affine(const tensor_type &scale,
+                              const tensor_type &shift) {
+  assert(!qweight_);
+  assert(scale.size() == options_.out_size);
+  assert(shift.size() == options_.out_size);
+  // {in, out} * {out} scales every output column
+  weight_ = weight_.cdata() * scale;
+  if (options_.use_bias) {
+    bias_ = bias_.cdata() * scale + shift;
+  } else {
+    bias_ = register_parameter("linear-bias", tensor{shift},
+                               this->is_training());
+    options_.use_bias = true;
+  }
+}
+
 using linear = module_holder<linear_impl>;
 } // namespace kuu
 #endif // KUU_MODULES_LINEAR_HPP
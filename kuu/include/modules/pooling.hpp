@@ -0,0 +1,67 @@
+#ifndef KUU_MODULES_POOLING_HPP
+#define KUU_MODULES_POOLING_HPP
+
+#include "functions/pooling.hpp"
+#include "module.hpp"
+
+namespace kuu {
+
+template <std::size_t D> struct pool_options {
+  exarray<D> kernel_size;
+  exarray<D> stride = 0; // 0: the kernel size
+  exarray<D> padding = 0;
+};
+
+class maxpool2d_impl : public virtual module {
+public:
+  using self_type = maxpool2d_impl;
+  maxpool2d_impl(const exarray<2> kernel_size);
+  explicit maxpool2d_impl(pool_options<2> &&options);
+  tensor forward(const tensor &input);
+
+private:
+  pool_options<2> options_;
+};
+
+maxpool2d_impl::maxpool2d_impl(const exarray<2> kernel_size)
+    : options_{pool_options<2>{kernel_size}} {}
+
+maxpool2d_impl::maxpool2d_impl(pool_options<2> &&options)
+    : options_{std::move(options)} {}
+
+tensor maxpool2d_impl::forward(const tensor &input) {
+  auto output = function::max_pool_2d::forward(
+      input, options_.kernel_size, options_.stride, options_.padding);
+  run_forward_hooks(input, output);
+  return output;
+}
+
+class avgpool2d_impl : public virtual module {
+public:
+  using self_type = avgpool2d_impl;
+  avgpool2d_impl(const exarray<2> kernel_size);
+  explicit avgpool2d_impl(pool_options<2> &&options);
+  tensor forward(const tensor &input);
+
+private:
+  pool_options<2> options_;
+};
+
+avgpool2d_impl::avgpool2d_impl(const exarray<2> kernel_size)
+    : options_{pool_options<2>{kernel_size}} {}
+
+avgpool2d_impl::avgpool2d_impl(pool_options<2> &&options)
+    : options_{std::move(options)} {}
+
+tensor avgpool2d_impl::forward(const tensor &input) {
+  auto output = function::avg_pool_2d::forward(
+      input, options_.kernel_size, options_.stride, options_.padding);
+  run_forward_hooks(input, output);
+  return output;
+}
+
+using maxpool2d = module_holder<maxpool2d_impl>;
+using avgpool2d = module_holder<avgpool2d_impl>;
+} // namespace kuu
+
+#endif // KUU_MODULES_POOLING_HPP
@@ -2,8 +2,12 @@
 #define KUU_OPTIMIZER_HPP
 
 #include "graph.hpp"
+#include "kernels/half.hpp"
 #include "tensor.hpp"
 #include <execution>
+#include <optional>
+#include <unordered_map>
+#include <utility>
 #include <vector>
 
 namespace kuu {
@@ -18,17 +22,37 @@ public:
       : steps_{0}, parameters_{std::move(parameters)} {}
 
   void update();
+  // ends the step without updating, e.g. when the grads overflowed.
+  void discard();
 
   virtual void apply(tensor &) = 0;
 
   void clear_grad();
   auto steps() { return steps_; }
+  std::vector<tensor> &parameters() noexcept { return parameters_; }
+
+  // keeps fp32 master copies of the parameters, which the updates are
+  // applied to, and leaves the parameters themselves rounded to format for
+  // forward and backward.
+  void use_master_weights(const kernel::half_format format);
 
 protected:
   unsigned long long int steps_;
   std::vector<tensor> parameters_;
+  std::optional<kernel::half_format> master_format_;
+  std::unordered_map<id_type, tensor_type> master_;
 };
 
+void optimizer::use_master_weights(const kernel::half_format format) {
+  master_format_ = format;
+  for (auto &param : parameters_) {
+    auto &data = param.data();
+    master_[param.id()] = data;
+    kernel::round_to_half(format, data.data(), data.size());
+    param.bump_version();
+  }
+}
+
 void optimizer::clear_grad() {
   std::for_each(std::begin(parameters_), std::end(parameters_),
                 [](auto &param) { param.clear_grad(); });
@@ -38,9 +62,24 @@ void optimizer::update() {
   this->steps_++;
 
   std::for_each(std::begin(parameters_), std::end(parameters_),
-                [this](auto &param) { apply(param); });
+                [this](auto &param) {
+                  if (master_format_) {
+                    auto &data = param.data();
+                    auto &master = master_[param.id()];
+                    std::swap(data, master);
+                    apply(param);
+                    master = data;
+                    kernel::round_to_half(*master_format_, data.data(),
+                                          data.size());
+                  } else {
+                    apply(param);
+                  }
+                  param.bump_version();
+                });
   detail::g->clear();
 }
 
+void optimizer::discard() { detail::g->clear(); }
+
 } // namespace kuu
 #endif // KUU_OPTIMIZER_HPP
\ No newline at end of file
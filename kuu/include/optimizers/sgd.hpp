@@ -39,6 +39,11 @@ void sgd::apply(tensor &parameter) {
   }
   auto grad = parameter.cgrad();
   auto &data = parameter.data();
+  // pruned entries get no grad and no momentum, and stay zero.
+  const auto *mask = parameter.mask();
+  if (mask) {
+    grad *= *mask;
+  }
   if (hyperparams_.weight_decay != 0) {
     grad += (hyperparams_.weight_decay * data);
   }
@@ -58,6 +63,9 @@ void sgd::apply(tensor &parameter) {
     }
   }
   data -= hyperparams_.learning_rate * grad;
+  if (mask) {
+    data *= *mask;
+  }
 }
 
 } // namespace kuu
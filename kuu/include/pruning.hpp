@@ -0,0 +1,166 @@
+#ifndef KUU_PRUNING_HPP
+#define KUU_PRUNING_HPP
+
+#include "kernels/bsr.hpp"
+#include "module.hpp"
+#include "modules/convolution.hpp"
+#include "modules/linear.hpp"
+#include "tensor.hpp"
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <cstddef>
+#include <numeric>
+#include <vector>
+
+// weight pruning. a pruned weight carries a 0/1 mask (tensor::mask): sgd
+// keeps the masked-out weights at zero, and linear and convolution_2d switch
+// to the block sparse kernels of kernels/bsr.hpp once few enough blocks are
+// left. the kernels skip whole 1 x kernel::kBsrBlock blocks, i.e. one input
+// feature over 16 consecutive output channels, so only structured masks make
+// them faster; unstructured masks shrink nothing but the weight's values.
+
+namespace kuu {
+
+enum class pruning_method {
+  kMagnitude, // drops the sparsity share of the smallest blocks per layer
+  kNM,        // keeps the n largest blocks of every m along the input axis
+};
+
+struct pruning_options {
+  pruning_method method = pruning_method::kMagnitude;
+  // share of the blocks to drop, for kMagnitude
+  double sparsity = 0.5;
+  // n of every m kept, for kNM
+  std::size_t n = 2;
+  std::size_t m = 4;
+  // blocks of kernel::kBsrBlock output channels rather than single weights
+  bool structured = true;
+};
+
+namespace pruning_detail {
+
+// 0/1 mask of a weight seen as {K, N}, K the input features and N the
+// output channels, with element (k, j) at w[k * k_stride + j * n_stride].
+// the mask is laid out like the weight.
+inline std::vector<float>
+build_mask(const float *w, const std::size_t K, const std::size_t N,
+           const std::size_t k_stride, const std::size_t n_stride,
+           const pruning_options &options) {
+  const std::size_t width = options.structured ? kernel::kBsrBlock : 1;
+  const std::size_t column_blocks = (N + width - 1) / width;
+
+  // mean magnitude of every block, indexed k * column_blocks + jb. the last
+  // block may be narrower than the others.
+  std::vector<float> score(K * column_blocks, 0.f);
+  for (std::size_t k = 0; k < K; k++) {
+    for (std::size_t j = 0; j < N; j++) {
+      const std::size_t jb = j / width;
+      score[k * column_blocks + jb] +=
+          std::abs(w[k * k_stride + j * n_stride]) /
+          std::min(width, N - jb * width);
+    }
+  }
+
+  std::vector<bool> keep(score.size(), true);
+  // the lowest scores of indices are dropped, ties broken by position so
+  // that the mask is deterministic.
+  auto drop_smallest = [&](std::vector<std::size_t> &indices,
+                           const std::size_t count) {
+    if (count == 0) {
+      return;
+    }
+    std::nth_element(indices.begin(), indices.begin() + (count - 1),
+                     indices.end(), [&](std::size_t l, std::size_t r) {
+                       return score[l] < score[r] ||
+                              (score[l] == score[r] && l < r);
+                     });
+    for (std::size_t i = 0; i < count; i++) {
+      keep[indices[i]] = false;
+    }
+  };
+
+  if (options.method == pruning_method::kMagnitude) {
+    assert(0 <= options.sparsity && options.sparsity <= 1);
+    std::vector<std::size_t> indices(score.size());
+    std::iota(indices.begin(), indices.end(), 0);
+    drop_smallest(indices, static_cast<std::size_t>(std::floor(
+                               options.sparsity * score.size())));
+  } else {
+    assert(0 < options.m && options.n <= options.m);
+    std::vector<std::size_t> indices;
+    for (std::size_t jb = 0; jb < column_blocks; jb++) {
+      for (std::size_t k0 = 0; k0 < K; k0 += options.m) {
+        const std::size_t group = std::min(options.m, K - k0);
+        indices.clear();
+        for (std::size_t k = k0; k < k0 + group; k++) {
+          indices.push_back(k * column_blocks + jb);
+        }
+        drop_smallest(indices, group - std::min(options.n, group));
+      }
+    }
+  }
+
+  std::vector<float> mask(K * N);
+  for (std::size_t k = 0; k < K; k++) {
+    for (std::size_t j = 0; j < N; j++) {
+      mask[k * k_stride + j * n_stride] =
+          keep[k * column_blocks + j / width] ? 1.f : 0.f;
+    }
+  }
+  return mask;
+}
+
+// masks weight and zeroes its pruned entries.
+inline void prune_weight(tensor weight, const std::size_t K,
+                         const std::size_t N, const std::size_t k_stride,
+                         const std::size_t n_stride,
+                         const pruning_options &options) {
+  auto &data = weight.data();
+  assert(data.size() == K * N);
+  const auto values =
+      build_mask(data.data(), K, N, k_stride, n_stride, options);
+  tensor::tensor_type mask = tensor::tensor_type::from_shape(data.shape());
+  std::copy(values.begin(), values.end(), mask.begin());
+  data *= mask;
+  weight.set_mask(std::move(mask));
+  weight.bump_version();
+}
+
+} // namespace pruning_detail
+
+// prunes the weight of every linear and conv2d in the module tree, in
+// place, and returns the number of pruned layers. quantized and transposed
+// layers are left as they are. pruning again replaces the masks, so a
+// schedule of growing sparsity can be applied between training epochs.
+inline std::size_t prune(module &root, const pruning_options &options = {}) {
+  std::size_t pruned = 0;
+  root.apply([&](module &m) {
+    if (auto *layer = dynamic_cast<linear_impl *>(&m)) {
+      if (layer->is_quantized()) {
+        return;
+      }
+      // {in, out}
+      tensor weight = *layer->parameter("linear-weight");
+      const std::size_t K = weight.shape()[0];
+      const std::size_t N = weight.shape()[1];
+      pruning_detail::prune_weight(weight, K, N, N, 1, options);
+      pruned++;
+    } else if (auto *layer = dynamic_cast<conv2d_impl *>(&m)) {
+      if (layer->is_quantized() || layer->is_transposed()) {
+        return;
+      }
+      // {C_out, C_in / groups, H_f, W_f}, i.e. {N, K}
+      tensor weight = *layer->parameter("conv2d weight");
+      const std::size_t N = weight.shape()[0];
+      const std::size_t K = weight.size() / N;
+      pruning_detail::prune_weight(weight, K, N, 1, K, options);
+      pruned++;
+    }
+  });
+  return pruned;
+}
+
+} // namespace kuu
+
+#endif // KUU_PRUNING_HPP
@@ -0,0 +1,311 @@
+#ifndef KUU_QUANTIZATION_HPP
+#define KUU_QUANTIZATION_HPP
+
+#include "layout.hpp"
+#include "mixin/non_copyable.hpp"
+#include "mixin/non_movable.hpp"
+#include "module.hpp"
+#include "modules/convolution.hpp"
+#include "modules/linear.hpp"
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <cstddef>
+#include <execution>
+#include <limits>
+#include <mutex>
+#include <numeric>
+#include <string>
+#include <vector>
+
+namespace kuu {
+
+struct quantization_options {
+  // layout of the inputs the convolutions will see
+  memory_format format = memory_format::kNCHW;
+  // keep only the int8 weights, a quarter of the fp32 footprint
+  bool release_float_weights = false;
+};
+
+// converts every linear and conv2d in the module tree to int8 inference, in
+// place. returns the number of converted layers; grouped and transposed
+// convolutions are left in fp32.
+inline std::size_t quantize(module &root,
+                            const quantization_options &options = {}) {
+  std::size_t converted = 0;
+  root.apply([&](module &m) {
+    if (auto *layer = dynamic_cast<linear_impl *>(&m)) {
+      layer->quantize(options.release_float_weights);
+      converted++;
+    } else if (auto *layer = dynamic_cast<conv2d_impl *>(&m)) {
+      if (layer->quantize(options.format, options.release_float_weights)) {
+        converted++;
+      }
+    }
+  });
+  return converted;
+}
+
+enum class calibration_method {
+  kMinMax,    // the largest magnitude seen
+  kHistogram, // a percentile of the magnitudes, which clips rare outliers
+};
+
+struct calibration_options {
+  calibration_method method = calibration_method::kMinMax;
+  // bins of the magnitude histogram, a power of two
+  std::size_t bins = 2048;
+  // share of the magnitudes kept unclipped by kHistogram
+  double percentile = 0.9999;
+};
+
+// running min / max and histogram of |x| of one tensor. the histogram spans
+// [0, range) with range a power of two, doubled by folding pairs of bins, so
+// observers of different batches can be merged exactly.
+class range_observer {
+public:
+  explicit range_observer(const std::size_t bins = 2048) : histogram_(bins) {
+    assert(1 < bins && (bins & (bins - 1)) == 0);
+  }
+
+  void observe(const float *x, const std::size_t n) {
+    if (n == 0) {
+      return;
+    }
+    std::vector<std::size_t> chunks((n + kChunk - 1) / kChunk);
+    std::iota(chunks.begin(), chunks.end(), 0);
+    using bounds = std::pair<float, float>;
+    const bounds b = std::transform_reduce(
+        std::execution::par, chunks.begin(), chunks.end(),
+        bounds{std::numeric_limits<float>::max(),
+               std::numeric_limits<float>::lowest()},
+        [](const bounds &l, const bounds &r) {
+          return bounds{std::min(l.first, r.first),
+                        std::max(l.second, r.second)};
+        },
+        [&](const std::size_t c) {
+          const auto [lo, hi] = std::minmax_element(
+              x + c * kChunk, x + std::min(n, (c + 1) * kChunk));
+          return bounds{*lo, *hi};
+        });
+    min_ = std::min(min_, b.first);
+    max_ = std::max(max_, b.second);
+    grow(std::max(std::abs(b.first), std::abs(b.second)));
+
+    // one histogram per chunk, summed afterwards
+    const std::size_t bins = histogram_.size();
+    std::vector<std::size_t> partial(chunks.size() * bins, 0);
+    std::for_each(std::execution::par, chunks.begin(), chunks.end(),
+                  [&](const std::size_t c) {
+                    std::size_t *h = partial.data() + c * bins;
+                    for (std::size_t i = c * kChunk;
+                         i < std::min(n, (c + 1) * kChunk); i++) {
+                      h[bin(std::abs(x[i]))]++;
+                    }
+                  });
+    for (std::size_t c = 0; c < chunks.size(); c++) {
+      for (std::size_t i = 0; i < bins; i++) {
+        histogram_[i] += partial[c * bins + i];
+      }
+    }
+    count_ += n;
+  }
+
+  void merge(const range_observer &other) {
+    assert(histogram_.size() == other.histogram_.size());
+    if (other.count_ == 0) {
+      return;
+    }
+    min_ = std::min(min_, other.min_);
+    max_ = std::max(max_, other.max_);
+    grow(other.range_);
+    auto h = other.histogram_;
+    fold(h, other.range_, range_);
+    for (std::size_t i = 0; i < h.size(); i++) {
+      histogram_[i] += h[i];
+    }
+    count_ += other.count_;
+  }
+
+  float min() const noexcept { return min_; }
+  float max() const noexcept { return max_; }
+  std::size_t count() const noexcept { return count_; }
+
+  // magnitude mapped to the int8 limit
+  float threshold(const calibration_options &options) const {
+    const float max_abs = std::max(std::abs(min_), std::abs(max_));
+    if (count_ == 0 || options.method == calibration_method::kMinMax) {
+      return count_ == 0 ? 0.f : max_abs;
+    }
+    const auto target = static_cast<std::size_t>(
+        std::ceil(options.percentile * static_cast<double>(count_)));
+    std::size_t seen = 0;
+    for (std::size_t i = 0; i < histogram_.size(); i++) {
+      seen += histogram_[i];
+      if (target <= seen) {
+        return std::min(max_abs, (i + 1) * range_ / histogram_.size());
+      }
+    }
+    return max_abs;
+  }
+
+  // symmetric scale of the int8 values, as kernel::activation_scale
+  float scale(const calibration_options &options) const {
+    const float t = threshold(options);
+    return 0.f < t ? t / 127.f : 1.f;
+  }
+
+private:
+  static constexpr std::size_t kChunk = 1 << 16;
+
+  std::size_t bin(const float magnitude) const {
+    if (range_ == 0.f) {
+      return 0;
+    }
+    return std::min(histogram_.size() - 1,
+                    static_cast<std::size_t>(magnitude / range_ *
+                                             histogram_.size()));
+  }
+
+  // widens the range to cover max_abs. while nothing but zeros has been
+  // seen, every count sits in the first bin of any range.
+  void grow(const float max_abs) {
+    if (max_abs <= range_) {
+      return;
+    }
+    const float range = std::exp2(std::ceil(std::log2(max_abs)));
+    if (range_ == 0.f) {
+      range_ = range;
+      return;
+    }
+    fold(histogram_, range_, range);
+    range_ = range;
+  }
+
+  // rebins h from [0, from) to [0, to), both powers of two with from <= to.
+  static void fold(std::vector<std::size_t> &h, const float from,
+                   const float to) {
+    if (from == 0.f) {
+      return;
+    }
+    for (float r = from; r < to; r *= 2) {
+      const std::size_t half = h.size() / 2;
+      for (std::size_t i = 0; i < half; i++) {
+        h[i] = h[2 * i] + h[2 * i + 1];
+      }
+      std::fill(h.begin() + half, h.end(), 0);
+    }
+  }
+
+  float min_ = std::numeric_limits<float>::max();
+  float max_ = std::numeric_limits<float>::lowest();
+  float range_ = 0.f;
+  std::vector<std::size_t> histogram_;
+  std::size_t count_ = 0;
+};
+
+struct layer_quantization {
+  std::string name;
+  float min;   // of the layer inputs
+  float max;   // of the layer inputs
+  float scale; // of the int8 inputs
+};
+
+// post-training calibration of the activation scales. forward hooks on every
+// module of the tree record the ranges of their inputs while a calibration
+// set is run through the model; the ranges then give the scales of the
+// int8 layers. the observations are merged under a lock, but forward passes
+// record into the global graph, which is not synchronized, so calibration
+// batches must be run one at a time.
+class calibrator : private non_copyable<calibrator>,
+                   private non_movable<calibrator> {
+public:
+  explicit calibrator(module &root, const calibration_options &options = {})
+      : root_{root}, options_{options} {
+    root.apply([this](module &m) {
+      const std::size_t index = layers_.size();
+      layers_.push_back({&m, 0, range_observer{options_.bins}});
+      layers_.back().hook = m.register_forward_hook(
+          [this, index](module &, const tensor &input, const tensor &) {
+            observe(index, input);
+          });
+    });
+  }
+
+  ~calibrator() {
+    for (auto &layer : layers_) {
+      layer.layer->remove_forward_hook(layer.hook);
+    }
+  }
+
+  // runs forward(i) for i in [0, n_batches) in evaluation mode, e.g. with
+  // forward loading the i-th batch of a dataset and passing it to the model.
+  template <class Forward>
+  void run(const std::size_t n_batches, Forward &&forward) {
+    const bool training = root_.is_training();
+    root_.train(false);
+    for (std::size_t i = 0; i < n_batches; i++) {
+      forward(i);
+    }
+    root_.train(training);
+  }
+
+  // one entry per module that has seen inputs, in the order of apply.
+  std::vector<layer_quantization> parameters() const {
+    std::lock_guard<std::mutex> lock{mutex_};
+    std::vector<layer_quantization> params;
+    for (const auto &layer : layers_) {
+      if (0 < layer.observer.count()) {
+        params.push_back({layer.layer->name(), layer.observer.min(),
+                          layer.observer.max(),
+                          layer.observer.scale(options_)});
+      }
+    }
+    return params;
+  }
+
+  // sets the activation scale of every observed linear and conv2d, and
+  // returns their number. the scales take effect once they are quantized.
+  std::size_t apply() const {
+    std::lock_guard<std::mutex> lock{mutex_};
+    std::size_t applied = 0;
+    for (const auto &layer : layers_) {
+      if (layer.observer.count() == 0) {
+        continue;
+      }
+      const float scale = layer.observer.scale(options_);
+      if (auto *l = dynamic_cast<linear_impl *>(layer.layer)) {
+        l->set_activation_scale(scale);
+        applied++;
+      } else if (auto *c = dynamic_cast<conv2d_impl *>(layer.layer)) {
+        c->set_activation_scale(scale);
+        applied++;
+      }
+    }
+    return applied;
+  }
+
+private:
+  struct observed_layer {
+    module *layer;
+    std::size_t hook;
+    range_observer observer;
+  };
+
+  void observe(const std::size_t index, const tensor &input) {
+    tensor x = input; // shallow, for the raw pointer
+    range_observer batch{options_.bins};
+    batch.observe(x.data().data(), x.size());
+    std::lock_guard<std::mutex> lock{mutex_};
+    layers_[index].observer.merge(batch);
+  }
+
+  module &root_;
+  calibration_options options_;
+  std::vector<observed_layer> layers_;
+  mutable std::mutex mutex_;
+};
+
+} // namespace kuu
+
+#endif // KUU_QUANTIZATION_HPP
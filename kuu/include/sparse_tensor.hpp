@@ -0,0 +1,92 @@
+#ifndef KUU_SPARSE_TENSOR_HPP
+#define KUU_SPARSE_TENSOR_HPP
+
+#include "config.hpp"
+#include "kernels/spmm.hpp"
+#include <cassert>
+#include <cstddef>
+#include <memory>
+#include <vector>
+#include <xtensor/xarray.hpp>
+#include <xtensor/xbuilder.hpp>
+
+namespace kuu {
+
+// 2-d matrix in compressed sparse row format, {rows, cols}. meant for
+// inputs such as sparse feature batches, so it carries no gradient. copies
+// share the same storage, like tensor_container.
+class sparse_tensor {
+public:
+  sparse_tensor() : internal_{std::make_shared<csr_data>()} {}
+
+  // row_ptr has rows + 1 entries; col_idx and values one per stored entry.
+  sparse_tensor(const std::size_t rows, const std::size_t cols,
+                std::vector<std::size_t> row_ptr,
+                std::vector<std::size_t> col_idx,
+                std::vector<value_type> values)
+      : internal_{std::make_shared<csr_data>()} {
+    assert(row_ptr.size() == rows + 1);
+    assert(col_idx.size() == values.size());
+    assert(row_ptr.back() == values.size());
+    internal_->rows = rows;
+    internal_->cols = cols;
+    internal_->row_ptr = std::move(row_ptr);
+    internal_->col_idx = std::move(col_idx);
+    internal_->values = std::move(values);
+  }
+
+  // keeps the non-zero entries of a 2-d dense matrix.
+  template <class E> static sparse_tensor from_dense(const E &dense) {
+    assert(dense.dimension() == 2);
+    const std::size_t rows = dense.shape()[0];
+    const std::size_t cols = dense.shape()[1];
+    std::vector<std::size_t> row_ptr{0}, col_idx;
+    std::vector<value_type> values;
+    for (std::size_t r = 0; r < rows; r++) {
+      for (std::size_t c = 0; c < cols; c++) {
+        if (dense(r, c) != 0) {
+          col_idx.push_back(c);
+          values.push_back(dense(r, c));
+        }
+      }
+      row_ptr.push_back(values.size());
+    }
+    return sparse_tensor{rows, cols, std::move(row_ptr), std::move(col_idx),
+                         std::move(values)};
+  }
+
+  tensor_type to_dense() const {
+    tensor_type dense = xt::zeros<value_type>({rows(), cols()});
+    for (std::size_t r = 0; r < rows(); r++) {
+      for (std::size_t e = internal_->row_ptr[r]; e < internal_->row_ptr[r + 1];
+           e++) {
+        dense(r, internal_->col_idx[e]) = internal_->values[e];
+      }
+    }
+    return dense;
+  }
+
+  std::size_t rows() const noexcept { return internal_->rows; }
+  std::size_t cols() const noexcept { return internal_->cols; }
+  std::size_t nnz() const noexcept { return internal_->values.size(); }
+  std::vector<std::size_t> shape() const { return {rows(), cols()}; }
+
+  kernel::csr_view view() const {
+    return {internal_->rows, internal_->cols, internal_->row_ptr.data(),
+            internal_->col_idx.data(), internal_->values.data()};
+  }
+
+private:
+  struct csr_data {
+    std::size_t rows = 0;
+    std::size_t cols = 0;
+    std::vector<std::size_t> row_ptr{0};
+    std::vector<std::size_t> col_idx;
+    std::vector<value_type> values;
+  };
+  std::shared_ptr<csr_data> internal_;
+};
+
+} // namespace kuu
+
+#endif // KUU_SPARSE_TENSOR_HPP
@@ -2,9 +2,15 @@
 #define KUU_TENSOR_HPP
 
 #include "config.hpp"
+#include "kernels/bsr.hpp"
+#include "kernels/gemm.hpp"
+#include "kernels/half.hpp"
+#include "layout.hpp"
 #include "util/converter.hpp"
 #include "util/util.hpp"
+#include <algorithm>
 #include <cstddef>
+#include <cstdint>
 #include <memory>
 #include <variant>
 #include <vector>
@@ -21,6 +27,13 @@ class module;
 namespace detail {
 template <typename T> struct tensor_info;
 extern std::shared_ptr<graph> g;
+
+// data that is computed on first access, see tensor_container::defer
+template <typename T> struct deferred_data {
+  virtual ~deferred_data() = default;
+  // fills data, which already has the tensor's shape
+  virtual void compute(T &data) const = 0;
+};
 } // namespace detail
 
 template <typename T> class tensor_container {
@@ -79,11 +92,96 @@ public:
 
   id_type creator_id() const noexcept { return this->internal_->creator_id; }
 
-  tensor_type &data() { return this->internal_->data; }
-  tensor_type &grad() { return this->internal_->grad; }
+  tensor_type &data() {
+    restore_data();
+    return this->internal_->data;
+  }
+  tensor_type &grad() {
+    restore_grad();
+    return this->internal_->grad;
+  }
 
   std::size_t dim() const { return this->shape().size(); }
 
+  memory_format format() const noexcept { return this->internal_->format; }
+
+  // incremented whenever data is replaced, or updated in place through
+  // bump_version(), so that caches derived from data can tell they are stale.
+  std::uint64_t version() const noexcept { return this->internal_->version; }
+  void bump_version() noexcept { this->internal_->version++; }
+
+  // keeps data only as 16-bit values until it is accessed again, e.g. for
+  // activations saved for backward. a grad that is still all zeros is
+  // dropped as well, and comes back as zeros.
+  void compress(const kernel::half_format format);
+  bool is_compressed() const noexcept {
+    return !this->internal_->half.empty();
+  }
+
+  // replaces data with deferred, which computes it of the given shape on
+  // first access, e.g. a chain of fused pointwise functions (fusion.hpp).
+  // the grad comes back as zeros.
+  void defer(std::vector<std::size_t> shape,
+             std::shared_ptr<const detail::deferred_data<T>> deferred);
+  const detail::deferred_data<T> *deferred() const noexcept {
+    return this->internal_->deferred.get();
+  }
+  bool is_deferred() const noexcept {
+    return static_cast<bool>(this->internal_->deferred);
+  }
+
+  // drops data for good, e.g. an activation whose consumers only read their
+  // grads in backward, see trace::release_saved_data. the shape stays, and
+  // a grad that is still all zeros is dropped as well. data must not be
+  // read again until it is assigned.
+  void release_data();
+  bool is_released() const noexcept { return this->internal_->released; }
+
+  // the number of tensors sharing this one
+  long use_count() const noexcept { return this->internal_.use_count(); }
+
+  // data packed as a GEMM operand by pack(data). the result is kept until the
+  // version changes or another tag (another way of packing) is requested.
+  template <typename Pack>
+  const kernel::packed_matrix &packed(const int tag, Pack &&pack) const {
+    restore_data();
+    auto &info = *this->internal_;
+    if (!info.packed || info.packed_tag != tag ||
+        info.packed_version != info.version) {
+      info.packed = std::make_shared<const kernel::packed_matrix>(
+          std::forward<Pack>(pack)(info.data));
+      info.packed_tag = tag;
+      info.packed_version = info.version;
+    }
+    return *info.packed;
+  }
+
+  // data packed in block sparse form by pack(data), cached like packed().
+  template <typename Pack>
+  const kernel::bsr_matrix &packed_sparse(const int tag, Pack &&pack) const {
+    restore_data();
+    auto &info = *this->internal_;
+    if (!info.sparse || info.sparse_tag != tag ||
+        info.sparse_version != info.version) {
+      info.sparse = std::make_shared<const kernel::bsr_matrix>(
+          std::forward<Pack>(pack)(info.data));
+      info.sparse_tag = tag;
+      info.sparse_version = info.version;
+    }
+    return *info.sparse;
+  }
+
+  // 0/1 mask of the same shape as data, e.g. of pruned weights. optimizers
+  // keep the masked-out entries at zero.
+  const tensor_type *mask() const noexcept {
+    return this->internal_->mask.get();
+  }
+  void set_mask(tensor_type mask) {
+    assert(mask.shape() == this->internal_->data.shape());
+    this->internal_->mask =
+        std::make_shared<const tensor_type>(std::move(mask));
+  }
+
   // setter
   void set_creator_id(const id_type creator_id) {
     assert(this->internal_->creator_id == "");
@@ -97,6 +195,10 @@ public:
     assert(this->internal_);
     this->internal_->name = name;
   }
+  void set_format(const memory_format format) {
+    assert(this->internal_);
+    this->internal_->format = format;
+  }
   template <class XtensorType,
             typename = std::enable_if_t<std::is_base_of_v<
                 xt::xexpression<std::remove_reference_t<XtensorType>>,
@@ -123,6 +225,9 @@ public:
   }
 
 private:
+  void restore_data() const;
+  void restore_grad() const;
+
   std::shared_ptr<detail::tensor_info<T>> internal_;
 };
 
@@ -134,6 +239,23 @@ template <typename T> struct tensor_info {
   std::vector<std::size_t> shape;
   id_type creator_id; // function id
   bool requires_grad;
+  memory_format format = memory_format::kNCHW;
+  std::uint64_t version = 0;
+  std::shared_ptr<const kernel::packed_matrix> packed;
+  std::uint64_t packed_version = 0;
+  int packed_tag = 0;
+  std::shared_ptr<const kernel::bsr_matrix> sparse;
+  std::uint64_t sparse_version = 0;
+  int sparse_tag = 0;
+  std::shared_ptr<const T> mask;
+  // data in 16 bits while compressed, see compress()
+  std::vector<std::uint16_t> half;
+  kernel::half_format half_format = kernel::half_format::kBFloat16;
+  // computes data while it is not yet there, see defer()
+  std::shared_ptr<const deferred_data<T>> deferred;
+  // data is gone, see release_data()
+  bool released = false;
+  bool grad_released = false;
   std::string name;
   std::string id;
 };
@@ -177,16 +299,109 @@ tensor_container<T>::tensor_container(value_type scalar,
 
 template <typename T> T tensor_container<T>::cdata() const noexcept {
   assert(this->internal_);
+  restore_data();
   return this->internal_->data;
 }
 
 template <typename T> T tensor_container<T>::cgrad() const noexcept {
   assert(this->internal_);
+  restore_grad();
   return this->internal_->grad;
 }
 
+template <typename T>
+void tensor_container<T>::compress(const kernel::half_format format) {
+  auto &info = *this->internal_;
+  if (is_compressed() || info.data.size() == 0) {
+    return;
+  }
+  info.half.resize(info.data.size());
+  kernel::compress(format, info.data.data(), info.data.size(),
+                   info.half.data());
+  info.half_format = format;
+  info.data = T::from_shape({0});
+  info.version++; // rounded
+  info.packed.reset();
+  info.sparse.reset();
+  if (!info.grad_released &&
+      std::all_of(info.grad.storage().cbegin(), info.grad.storage().cend(),
+                  [](const auto g) { return g == 0; })) {
+    info.grad = T::from_shape({0});
+    info.grad_released = true;
+  }
+}
+
+template <typename T>
+void tensor_container<T>::defer(
+    std::vector<std::size_t> shape,
+    std::shared_ptr<const detail::deferred_data<T>> deferred) {
+  auto &info = *this->internal_;
+  info.shape = std::move(shape);
+  info.data = T::from_shape({0});
+  info.half = std::vector<std::uint16_t>{};
+  info.grad = T::from_shape({0});
+  info.grad_released = true;
+  info.deferred = std::move(deferred);
+  info.released = false;
+  info.version++;
+  info.packed.reset();
+  info.sparse.reset();
+}
+
+template <typename T> void tensor_container<T>::release_data() {
+  auto &info = *this->internal_;
+  if (info.released) {
+    return;
+  }
+  info.deferred.reset();
+  info.data = T::from_shape({0});
+  info.half = std::vector<std::uint16_t>{};
+  info.released = true;
+  info.version++;
+  info.packed.reset();
+  info.sparse.reset();
+  if (!info.grad_released &&
+      std::all_of(info.grad.storage().cbegin(), info.grad.storage().cend(),
+                  [](const auto g) { return g == 0; })) {
+    info.grad = T::from_shape({0});
+    info.grad_released = true;
+  }
+}
+
+template <typename T> void tensor_container<T>::restore_data() const {
+  auto &info = *this->internal_;
+  assert(!info.released);
+  if (info.deferred) {
+    const auto deferred = std::move(info.deferred);
+    info.deferred.reset();
+    info.data = T::from_shape(info.shape);
+    deferred->compute(info.data);
+    return;
+  }
+  if (info.half.empty()) {
+    return;
+  }
+  info.data = T::from_shape(info.shape);
+  kernel::decompress(info.half_format, info.half.data(), info.half.size(),
+                     info.data.data());
+  info.half = std::vector<std::uint16_t>{};
+}
+
+template <typename T> void tensor_container<T>::restore_grad() const {
+  auto &info = *this->internal_;
+  if (!info.grad_released) {
+    return;
+  }
+  info.grad = xt::zeros<typename T::value_type>(info.shape);
+  info.grad_released = false;
+}
+
 template <typename T> std::vector<size_t> tensor_container<T>::shape() const {
   assert(this->internal_);
+  if (is_compressed() || is_deferred() || is_released() ||
+      this->internal_->grad_released) {
+    return this->internal_->shape;
+  }
   assert(this->internal_->data.shape() == this->internal_->grad.shape());
   assert(this->internal_->data.shape().size() == this->internal_->shape.size());
   auto s = this->internal_->data.shape();
@@ -214,7 +429,13 @@ template <typename T> std::size_t tensor_container<T>::size() const noexcept {
 }
 
 template <typename T> void tensor_container<T>::clear_grad() {
-  this->internal_->grad = xt::zeros_like(this->internal_->data);
+  if (this->internal_->grad_released) {
+    return; // zeros already
+  }
+  this->internal_->grad =
+      is_compressed() || is_deferred() || is_released()
+          ? T(xt::zeros<typename T::value_type>(this->internal_->shape))
+          : T(xt::zeros_like(this->internal_->data));
 }
 
 template <typename T> tensor_container<T> tensor_container<T>::clone() const {
@@ -222,12 +443,14 @@ template <typename T> tensor_container<T> tensor_container<T>::clone() const {
   copy.set_grad(this->cgrad());
   copy.set_creator_id(this->creator_id());
   copy.set_name(this->name());
+  copy.set_format(this->format());
   return copy;
 };
 
 template <typename T>
 template <class XtensorType, typename>
 void tensor_container<T>::set_grad(XtensorType &&grad) {
+  this->internal_->grad_released = false;
   this->internal_->grad = std::forward<XtensorType>(grad);
   this->shape();
 }
@@ -235,7 +458,13 @@ void tensor_container<T>::set_grad(XtensorType &&grad) {
 template <typename T>
 template <class XtensorType, typename>
 inline tensor_container<T> &tensor_container<T>::operator=(XtensorType &&e) {
+  this->internal_->deferred.reset(); // overwritten anyway
+  this->internal_->released = false;
+  restore_data();
   this->internal_->data = std::forward<XtensorType>(e);
+  this->internal_->version++;
+  this->internal_->packed.reset(); // stale, and may be large
+  this->internal_->sparse.reset();
   this->shape();
   return *this;
 }
@@ -243,6 +472,8 @@ inline tensor_container<T> &tensor_container<T>::operator=(XtensorType &&e) {
 template <typename T>
 inline tensor_container<T>
     tensor_container<T>::operator[](const size_t i) const {
+  restore_data();
+  restore_grad();
   T stride = xt::strided_view(this->internal_->data, {i, xt::ellipsis()});
   tensor_container<T> clone{std::move(stride), this->internal_->requires_grad};
   clone.set_grad(xt::strided_view(this->internal_->grad, {i, xt::ellipsis()}));
@@ -255,7 +486,7 @@ void run_backward(const tensor &root);
 
 template <typename T> void tensor_container<T>::backward() {
   // std::cout << "tensor::backward" << std::endl;
-  set_grad(xt::ones_like(internal_->data));
+  set_grad(xt::ones_like(data()));
   trace::run_backward(*this);
 }
 
@@ -25,6 +25,70 @@ std::string graph::node_name(const id_type node_id) {
   }
 }
 
+bool graph::needs_grad(const tensor &t) {
+  if (t.is_empty()) {
+    return false;
+  }
+  const id_type node_id = t.creator_id();
+  if (node_id == "" || !util::find(operator_inputs_, node_id)) {
+    return t.requires_grad(); // leaf
+  }
+  if (!util::find(needs_grad_, node_id)) {
+    bool any = false;
+    for (const auto &input : operator_inputs_[node_id]) {
+      any = needs_grad(input) || any;
+    }
+    needs_grad_[node_id] = any;
+  }
+  return needs_grad_[node_id];
+}
+
+std::vector<bool> graph::input_mask(const id_type &node_id) {
+  const auto &inputs = operator_inputs_[node_id];
+  std::vector<bool> mask(inputs.size());
+  for (std::size_t i = 0; i < inputs.size(); i++) {
+    mask[i] = needs_grad(inputs[i]);
+  }
+  return mask;
+}
+
+void graph::save_inputs(const id_type &node_id, std::vector<tensor> inputs) {
+  // the inputs of the previous node are no longer held by its caller
+  release_unused_data();
+  auto &saved = operator_inputs_[node_id];
+  saved = std::move(inputs);
+  for (const auto &input : saved) {
+    if (!input.is_empty()) {
+      saved_copies_[input.id()]++;
+      data_readers_[input.id()]++;
+    }
+  }
+  if (!activation_format_) {
+    return;
+  }
+  // outputs of other nodes only; parameters and user inputs stay as they are
+  for (auto &input : saved) {
+    if (!input.is_empty() && input.creator_id() != "") {
+      input.compress(*activation_format_);
+    }
+  }
+}
+
+void graph::release_unused_data() {
+  for (auto it = releasable_.begin(); it != releasable_.end();) {
+    const id_type &id = it->first;
+    if (0 < data_readers_[id]) {
+      it = releasable_.erase(it); // some node reads it
+    } else if (it->second.use_count() ==
+               static_cast<long>(saved_copies_[id] + 1)) {
+      it->second.release_data();
+      it = releasable_.erase(it);
+    } else {
+      ++it;
+    }
+  }
+}
+
 namespace trace {
 void run_backward(const tensor &root) {
   id_type node_id = root.creator_id();
@@ -38,9 +102,10 @@ void run_backward(const tensor &root) {
 
   if (util::find(detail::g->operator_inputs_, node_id) &&
       detail::g->operator_inputs_[node_id].size() > 0) {
+    const auto mask = detail::g->input_mask(node_id);
     if (detail::g->nodes_[node_id]->n_output() == 1) {
       detail::g->nodes_[node_id]->backward_function(
-          {root}, detail::g->operator_inputs_[node_id]);
+          {root}, detail::g->operator_inputs_[node_id], mask);
       done_backward = true;
     } else if (util::find(detail::g->backward_stack_, node_id)) {
       detail::g->backward_stack_[node_id].push_back(root);
@@ -50,7 +115,7 @@ void run_backward(const tensor &root) {
             std::move(detail::g->backward_stack_[node_id])};
         detail::g->backward_stack_[node_id] = std::vector<tensor>{};
         detail::g->nodes_[node_id]->backward_function(
-            outputs, detail::g->operator_inputs_[node_id]);
+            outputs, detail::g->operator_inputs_[node_id], mask);
         done_backward = true;
       } else {
         assert(detail::g->backward_stack_[node_id].size() <
@@ -59,12 +124,47 @@ void run_backward(const tensor &root) {
     }
 
     if (done_backward) {
-      for_each(detail::g->operator_inputs_[node_id].begin(),
-               detail::g->operator_inputs_[node_id].end(),
-               [](auto &var) { run_backward(var); }); // sequential process
+      // sequential process, only into the inputs that need grad
+      auto &inputs = detail::g->operator_inputs_[node_id];
+      for (std::size_t i = 0; i < inputs.size(); i++) {
+        if (mask[i]) {
+          run_backward(inputs[i]);
+        }
+      }
     }
   }
 }
+
+void release_saved_data(const tensor &input) {
+  if (input.is_empty()) {
+    return;
+  }
+  auto &readers = detail::g->data_readers_[input.id()];
+  assert(0 < readers);
+  readers--;
+  // leaves are held by the user anyway
+  if (input.creator_id() != "") {
+    detail::g->releasable_.emplace(input.id(), input);
+  }
+}
+
+void retain_saved_data(const tensor &t) {
+  if (!t.is_empty()) {
+    detail::g->data_readers_[t.id()]++;
+  }
+}
+
+bool reads_saved_data(const tensor &t) {
+  const auto &readers = detail::g->data_readers_;
+  const auto it = readers.find(t.id());
+  return it != readers.end() && 0 < it->second;
+}
+
+std::size_t consumers(const id_type &tensor_id) {
+  const auto &copies = detail::g->saved_copies_;
+  const auto it = copies.find(tensor_id);
+  return it == copies.end() ? 0 : it->second;
+}
 } // namespace trace
 
 } // namespace kuu
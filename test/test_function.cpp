@@ -1,8 +1,13 @@
 
 #include "function.hpp"
 #include "functions.hpp"
+#include "fusion.hpp"
 #include "test_common.hpp"
+#include <cstdio>
+#include <functional>
 #include <gtest/gtest.h>
+#include <memory>
+#include <optional>
 #include <string>
 #include <xtensor/xarray.hpp>
 #include <xtensor/xbuilder.hpp>
@@ -59,6 +64,226 @@ TEST(FunctionTest, TestLinearForward) {
   TENSOR_CLONE_EQ(res, kuu::tensor{ans1});
 }
 
+TEST(FunctionTest, TestLinearWeightUpdate) {
+  // the packed weight is rebuilt once the weight changes
+  kuu::tensor x{kuu::tensor_type{{2, 3}}, true};
+  kuu::tensor w{kuu::tensor_type{{1, 2}, {3, 4}}, true};
+  auto y0 = kuu::function::linear::forward(x, w);
+  ASSERT_EQ(y0.data(), (kuu::tensor_type{{11, 16}}));
+
+  w.data() *= 2;
+  w.bump_version();
+  auto y1 = kuu::function::linear::forward(x, w);
+  ASSERT_EQ(y1.data(), (kuu::tensor_type{{22, 32}}));
+
+  w = kuu::tensor_type{{1, 0}, {0, 1}};
+  auto y2 = kuu::function::linear::forward(x, w);
+  ASSERT_EQ(y2.data(), (kuu::tensor_type{{2, 3}}));
+}
+
+TEST(FunctionTest, TestFusedLinear) {
+  kuu::tensor_type x = {{2, -3}, {-1, 1}};
+  kuu::tensor_type w = {{1, 2}, {3, 4}};
+  kuu::tensor_type b = {5, -6};
+  kuu::tensor_type z = {{2 - 9 + 5, 4 - 12 - 6}, {-1 + 3 + 5, -2 + 4 - 6}};
+
+  // forward, against linear + activation
+  kuu::tensor t0{x, true}, t1{w, true}, t2{b, true};
+  auto relu = kuu::function::fused_linear::forward(t0, t1, t2,
+                                                   kuu::activation::kReLU);
+  ASSERT_EQ(relu.data(), (kuu::tensor_type{{0, 0}, {7, 0}}));
+  // backward keeps a bit mask of z > 0, not the output
+  ASSERT_FALSE(kuu::trace::reads_saved_data(relu));
+
+  // backward, through the stored mask: only (1, 0) is active
+  relu.backward();
+  ASSERT_EQ(t0.grad(), (kuu::tensor_type{{0, 0}, {1, 3}}));
+  ASSERT_EQ(t1.grad(), (kuu::tensor_type{{-1, 0}, {1, 0}}));
+  ASSERT_EQ(t2.grad(), (kuu::tensor_type{1, 0}));
+
+  auto gelu = kuu::function::fused_linear::forward(t0, t1, t2,
+                                                   kuu::activation::kGELU);
+  kuu::tensor_type expected =
+      0.5 * z * (1 + xt::tanh(0.7978845608 * (z + 0.044715 * z * z * z)));
+  ASSERT_TRUE(xt::allclose(gelu.data(), expected, 1e-5, 1e-5));
+
+  // sigmoid's backward reads its output
+  auto sigmoid = kuu::function::fused_linear::forward(
+      t0, t1, t2, kuu::activation::kSigmoid);
+  ASSERT_TRUE(kuu::trace::reads_saved_data(sigmoid));
+  sigmoid.backward();
+  const kuu::tensor_type s = 1 / (1 + xt::exp(-z));
+  const kuu::tensor_type gb = xt::sum(s * (1 - s), {0});
+  CLOSE_ALL(t2.grad(), gb, 1e-5);
+}
+
+TEST(FunctionTest, TestBackwardGradMask) {
+  // the data batch does not require grad, so neither it nor the relu node
+  // under it gets a gradient; the weight still does.
+  kuu::tensor x{kuu::tensor_type{{-2, 3}}, false};
+  kuu::tensor w{kuu::tensor_type{{1, 2}, {3, 4}}, true};
+  auto h = kuu::function::relu::forward(x);
+  auto y = kuu::function::linear::forward(h, w);
+  y.backward();
+  ASSERT_EQ(x.grad(), (kuu::tensor_type{{0, 0}}));
+  ASSERT_EQ(h.grad(), (kuu::tensor_type{{0, 0}}));
+  ASSERT_EQ(w.grad(), (kuu::tensor_type{{0, 0}, {3, 3}}));
+
+  // called outside of the graph, an explicit mask is honored
+  std::vector<kuu::tensor> out{y}, in{h, w, kuu::tensor{}};
+  w.clear_grad();
+  kuu::function::linear::backward(out, in, {true, false, false});
+  ASSERT_EQ(h.grad(), (kuu::tensor_type{{3, 7}}));
+  ASSERT_EQ(w.grad(), (kuu::tensor_type{{0, 0}, {0, 0}}));
+}
+
+namespace {
+// a node that records the grad mask of its input when backward reaches it
+struct mask_probe : kuu::traceable_function {
+  mask_probe() : traceable_function{1} { set_name("mask-probe"); }
+
+  static kuu::tensor forward(const kuu::tensor &input, kuu::grad_mask &mask) {
+    kuu::tensor output{input.cdata(), true};
+    kuu::trace::register_node<mask_probe>(
+        {input}, output,
+        [&mask](const std::vector<kuu::tensor> &, std::vector<kuu::tensor> &,
+                const kuu::grad_mask &m) { mask = m; });
+    return output;
+  }
+};
+} // namespace
+
+TEST(FunctionTest, TestGradMaskAuxiliaryInputs) {
+  // eps, momentum and the saved statistics of a batchnorm are not trainable,
+  // so once its data, weight and bias need no grad, backward stops above it
+  kuu::tensor x{xt::random::randn<kuu::value_type>({4, 3}), false};
+  kuu::tensor gamma{xt::ones<kuu::value_type>({3}), true};
+  kuu::tensor beta{xt::zeros<kuu::value_type>({3}), true};
+  kuu::tensor running_mean{xt::zeros<kuu::value_type>({3}), false};
+  kuu::tensor running_var{xt::ones<kuu::value_type>({3}), false};
+  auto y = kuu::function::batchnorm_1d::forward(
+      x, gamma, beta, running_mean, running_var, 1e-5, 0.1, true);
+  ASSERT_TRUE(y.requires_grad());
+  // frozen after forward
+  gamma.set_required_grad(false);
+  beta.set_required_grad(false);
+  kuu::grad_mask mask;
+  mask_probe::forward(y, mask).backward();
+  ASSERT_EQ(mask, kuu::grad_mask{false});
+
+  // and the same for the saved log-sum-exp of a loss over frozen scores
+  kuu::tensor scores{xt::random::randn<kuu::value_type>({4, 3}), false};
+  kuu::tensor labels{kuu::tensor_type{0, 2, 1, 1}, false};
+  auto loss = kuu::function::softmax_cross_entropy::forward(scores, labels);
+  mask_probe::forward(loss, mask).backward();
+  ASSERT_EQ(mask, kuu::grad_mask{false});
+}
+
+TEST(FunctionTest, TestMatmulBroadcast) {
+  // a {2, 1, 3, 4} and b {3, 4, 5} broadcast to a batch of {2, 3}
+  kuu::tensor_type a = xt::random::randn<kuu::value_type>({2, 1, 3, 4});
+  kuu::tensor_type b = xt::random::randn<kuu::value_type>({3, 4, 5});
+  kuu::tensor_type gy = xt::random::randn<kuu::value_type>({2, 3, 3, 5});
+  kuu::tensor_type y = xt::zeros<kuu::value_type>({2, 3, 3, 5});
+  kuu::tensor_type ga = xt::zeros<kuu::value_type>(a.shape());
+  kuu::tensor_type gb = xt::zeros<kuu::value_type>(b.shape());
+  for (std::size_t i = 0; i < 2; i++) {
+    for (std::size_t j = 0; j < 3; j++) {
+      for (std::size_t m = 0; m < 3; m++) {
+        for (std::size_t n = 0; n < 5; n++) {
+          for (std::size_t k = 0; k < 4; k++) {
+            y(i, j, m, n) += a(i, 0, m, k) * b(j, k, n);
+            ga(i, 0, m, k) += gy(i, j, m, n) * b(j, k, n);
+            gb(j, k, n) += a(i, 0, m, k) * gy(i, j, m, n);
+          }
+        }
+      }
+    }
+  }
+
+  kuu::tensor t0{a, true}, t1{b, true};
+  auto out = kuu::function::matmul::forward(t0, t1);
+  CLOSE_ALL(out.data(), y, 1e-4);
+
+  std::vector<kuu::tensor> outputs{out}, inputs{t0, t1};
+  outputs[0].set_grad(gy);
+  kuu::function::matmul::backward(outputs, inputs);
+  CLOSE_ALL(t0.grad(), ga, 1e-4);
+  CLOSE_ALL(t1.grad(), gb, 1e-4);
+}
+
+TEST(FunctionTest, TestLinearSparse) {
+  // feature 1 is never active, so its row of the weight gradient stays zero
+  kuu::tensor_type x = {{0, 0, 2}, {1, 0, 0}, {0, 0, 0}};
+  kuu::tensor_type w = {{1, 2}, {3, 4}, {5, 6}};
+  kuu::tensor_type b = {1, -1};
+  auto sparse = kuu::sparse_tensor::from_dense(x);
+  ASSERT_EQ(sparse.nnz(), 2);
+  ASSERT_EQ(sparse.to_dense(), x);
+
+  kuu::tensor weight{w, true}, bias{b, true};
+  auto y = kuu::function::linear::forward(sparse, weight, bias);
+  ASSERT_EQ(y.data(), (kuu::tensor_type{{11, 11}, {2, 1}, {1, -1}}));
+
+  y.backward();
+  ASSERT_EQ(weight.grad(), (kuu::tensor_type{{1, 1}, {0, 0}, {2, 2}}));
+  ASSERT_EQ(bias.grad(), (kuu::tensor_type{3, 3}));
+
+  // with the rows written kept, the next backward reuses the gradient
+  // buffer and clears the rows that are no longer active
+  auto written = std::make_shared<kuu::function::sparse_grad_rows>();
+  kuu::function::linear::forward(sparse, weight, bias, written).backward();
+  const auto *buffer = weight.get()->grad.data();
+  ASSERT_EQ(written->rows, (std::vector<std::size_t>{0, 2}));
+  kuu::tensor_type x2 = {{0, 3, 0}, {0, 0, 0}, {0, 0, 0}};
+  kuu::function::linear::forward(kuu::sparse_tensor::from_dense(x2), weight,
+                                 bias, written)
+      .backward();
+  ASSERT_EQ(weight.get()->grad.data(), buffer);
+  ASSERT_EQ(written->rows, (std::vector<std::size_t>{1}));
+  ASSERT_EQ(weight.grad(), (kuu::tensor_type{{0, 0}, {3, 3}, {0, 0}}));
+}
+
+TEST(FunctionTest, TestLinearPruned) {
+  // three of every four 1 x 16 blocks of the weight are pruned, sparse
+  // enough for both the forward and the input gradient block kernels
+  kuu::tensor_type x = xt::random::randn<kuu::value_type>({5, 40});
+  kuu::tensor_type w = xt::random::randn<kuu::value_type>({40, 40});
+  kuu::tensor_type b = xt::random::randn<kuu::value_type>({40});
+  kuu::tensor_type mask = xt::zeros<kuu::value_type>({40, 40});
+  for (std::size_t k = 0; k < 40; k++) {
+    for (std::size_t j = 0; j < 40; j++) {
+      mask(k, j) = (k + j / kuu::kernel::kBsrBlock) % 4 == 0 ? 1 : 0;
+    }
+  }
+  w *= mask;
+
+  kuu::tensor weight{w, true}, dense{w, true};
+  weight.set_mask(mask);
+  std::vector<kuu::tensor> out, in, out_dense, in_dense;
+  in.emplace_back(x, true);
+  in.push_back(weight);
+  in.emplace_back(b, true);
+  in_dense.emplace_back(x, true);
+  in_dense.push_back(dense);
+  in_dense.emplace_back(b, true);
+
+  auto y = kuu::function::linear::forward(in[0], in[1], in[2]);
+  auto y_dense =
+      kuu::function::linear::forward(in_dense[0], in_dense[1], in_dense[2]);
+  CLOSE_ALL(y.data(), y_dense.data(), 1e-4);
+
+  kuu::tensor_type gy = xt::random::randn<kuu::value_type>(y.shape());
+  out.emplace_back(y.data(), true);
+  out[0].set_grad(gy);
+  out_dense.emplace_back(y_dense.data(), true);
+  out_dense[0].set_grad(gy);
+  kuu::function::linear::backward(out, in);
+  kuu::function::linear::backward(out_dense, in_dense);
+  CLOSE_ALL(in[0].grad(), in_dense[0].grad(), 1e-4);
+  CLOSE_ALL(in[1].grad(), in_dense[1].grad(), 1e-4);
+}
+
 TEST(FunctionTest, TestLinearBackward) {
   kuu::tensor_type x = {{2, 3}};         // 1 x 2
   kuu::tensor_type w = {{1, 2}, {3, 4}}; // 2 x 2
@@ -110,6 +335,103 @@ TEST(FunctionTest, TestReluBackward) {
   ASSERT_EQ(in[0].data(), x);
 }
 
+TEST(FunctionTest, TestReluReleasesInput) {
+  kuu::tensor input{kuu::tensor_type{{-2, 3}, {1, -5}}, true};
+  kuu::tensor w1{kuu::tensor_type{{1, -1}, {2, 1}}, true};
+  kuu::tensor w2{kuu::tensor_type{{1, -1}, {2, 1}}, true};
+  // shares h without keeping it alive
+  std::weak_ptr<kuu::detail::tensor_info<kuu::tensor_type>> hidden, kept;
+  kuu::tensor y, other;
+  {
+    auto h = kuu::function::linear::forward(input, w1); // {{4, 5}, {-9, -6}}
+    hidden = h.get();
+    y = kuu::function::relu::forward(h);
+    // h is also read by the backward of a linear, so it is kept
+    auto h2 = kuu::function::linear::forward(input, w1);
+    kept = h2.get();
+    other = kuu::function::linear::forward(kuu::function::relu::forward(h2),
+                                           w2);
+    kuu::function::linear::forward(h2, w2);
+  }
+  ASSERT_FALSE(kuu::tensor{hidden.lock()}.is_released());
+  // released at the registration of the next node
+  auto z = kuu::function::linear::forward(y, w2);
+  ASSERT_TRUE(kuu::tensor{hidden.lock()}.is_released());
+  ASSERT_FALSE(kuu::tensor{kept.lock()}.is_released());
+  // and the leaf input is never released
+  kuu::function::relu::forward(input);
+  kuu::function::relu::forward(w2);
+  ASSERT_FALSE(input.is_released());
+
+  z.backward();
+  ASSERT_EQ(input.grad(), (kuu::tensor_type{{-3, 3}, {0, 0}}));
+  ASSERT_EQ(w1.grad(), (kuu::tensor_type{{0, -6}, {0, 9}}));
+  ASSERT_EQ(w2.grad(), (kuu::tensor_type{{4, 4}, {5, 5}}));
+}
+
+TEST(FunctionTest, TestActivations) {
+  // 51 elements, past a vector width
+  kuu::tensor_type x = xt::random::randn<kuu::value_type>({3, 17});
+  kuu::tensor_type gy = xt::random::randn<kuu::value_type>({3, 17});
+  kuu::tensor_type s = 1.f / (1.f + xt::exp(-x));
+  kuu::tensor_type t = xt::tanh(x);
+  kuu::tensor_type u = xt::tanh(0.7978845608f * (x + 0.044715f * x * x * x));
+  kuu::tensor_type positive = xt::cast<kuu::value_type>(x > 0.f);
+
+  struct activation {
+    std::function<kuu::tensor(const kuu::tensor &)> forward;
+    kuu::tensor_type y, gx;
+  };
+  const std::vector<activation> activations{
+      {[](const kuu::tensor &in) { return kuu::function::sigmoid::forward(in); },
+       s, gy * s * (1.f - s)},
+      {[](const kuu::tensor &in) { return kuu::function::tanh::forward(in); },
+       t, gy * (1.f - t * t)},
+      {[](const kuu::tensor &in) { return kuu::function::gelu::forward(in); },
+       0.5f * x * (1.f + u),
+       gy * (0.5f * (1.f + u) + 0.5f * x * (1.f - u * u) * 0.7978845608f *
+                                    (1.f + 3.f * 0.044715f * x * x))},
+      {[](const kuu::tensor &in) { return kuu::function::silu::forward(in); },
+       x * s, gy * s * (1.f + x * (1.f - s))},
+      {[](const kuu::tensor &in) {
+         return kuu::function::leaky_relu::forward(in, 0.1f);
+       },
+       x * (positive + 0.1f * (1.f - positive)),
+       gy * (positive + 0.1f * (1.f - positive))},
+  };
+  for (const auto &a : activations) {
+    kuu::tensor input{x, true};
+    auto y = a.forward(input);
+    CLOSE_ALL(y.data(), a.y, 1e-5);
+    y.set_grad(gy);
+    kuu::trace::run_backward(y);
+    CLOSE_ALL(input.grad(), a.gx, 1e-5);
+  }
+
+  // in place, over the output of a linear with an identity weight
+  kuu::tensor input{x, true};
+  kuu::tensor w{kuu::tensor_type{xt::eye<kuu::value_type>(17)}, true};
+  auto h = kuu::function::linear::forward(input, w);
+  auto y = kuu::function::sigmoid::forward(h, true);
+  ASSERT_TRUE(h.is_released());
+  CLOSE_ALL(y.data(), s, 1e-5);
+  y.set_grad(gy);
+  kuu::trace::run_backward(y);
+  CLOSE_ALL(input.grad(), gy * s * (1.f - s), 1e-5);
+  // but not over a leaf, with or without grad, nor when backward needs the
+  // input
+  kuu::function::tanh::forward(input, true);
+  ASSERT_FALSE(input.is_released());
+  kuu::tensor plain{x, false};
+  auto z = kuu::function::sigmoid::forward(plain, true);
+  ASSERT_FALSE(plain.is_released());
+  ASSERT_EQ(plain.data(), x);
+  CLOSE_ALL(z.data(), s, 1e-5);
+  auto h2 = kuu::function::linear::forward(input, w);
+  kuu::function::gelu::forward(h2, true);
+  ASSERT_FALSE(h2.is_released());
+}
+
 TEST(FunctionTest, TestConv2dForward) {
   kuu::tensor_type x = xt::ones<kuu::value_type>({2, 1, 5, 5});
   kuu::tensor_type w = xt::ones<kuu::value_type>({1, 1, 3, 3});
@@ -343,6 +665,358 @@ TEST(FunctionTest, TestConv2dBackward) {
   // CLOSE_ALL(dx, expected_dx);
 }
 
+TEST(FunctionTest, TestConv2dFFTForward) {
+  kuu::tensor_type x = xt::random::randn<kuu::value_type>({2, 3, 8, 6});
+  kuu::tensor_type w = xt::random::randn<kuu::value_type>({4, 3, 5, 3});
+  kuu::tensor_type b = {1, 2, 3, 4};
+
+  kuu::tensor data{std::move(x)};
+  kuu::tensor weight{std::move(w)};
+  kuu::tensor bias{std::move(b)};
+
+  for (std::size_t stride : {1, 2}) {
+    auto im2col = kuu::function::convolution_2d::forward(
+        data, weight, bias, {stride, stride}, {2, 1}, 1, 1,
+        kuu::conv_algorithm::kIm2col);
+    auto fft = kuu::function::convolution_2d::forward(
+        data, weight, bias, {stride, stride}, {2, 1}, 1, 1,
+        kuu::conv_algorithm::kFFT);
+    ASSERT_EQ(im2col.shape(), fft.shape());
+    CLOSE_ALL(im2col.data(), fft.data(), 1e-4);
+  }
+}
+
+TEST(FunctionTest, TestSelectConvAlgorithm) {
+  std::vector<std::size_t> small_x = {16, 1, 28, 28};
+  std::vector<std::size_t> small_w = {8, 1, 5, 5};
+  ASSERT_EQ(kuu::select_conv_algorithm(small_x, small_w, 1, 2),
+            kuu::conv_algorithm::kIm2col);
+
+  std::vector<std::size_t> large_x = {16, 64, 56, 56};
+  std::vector<std::size_t> large_w = {64, 64, 7, 7};
+  ASSERT_EQ(kuu::select_conv_algorithm(large_x, large_w, 1, 3),
+            kuu::conv_algorithm::kFFT);
+
+  // the same inputs channels last
+  std::vector<std::size_t> small_nhwc = {16, 28, 28, 1};
+  std::vector<std::size_t> large_nhwc = {16, 56, 56, 64};
+  ASSERT_EQ(kuu::select_conv_algorithm(small_nhwc, small_w, 1, 2, 1, 1,
+                                       kuu::memory_format::kNHWC),
+            kuu::conv_algorithm::kIm2col);
+  ASSERT_EQ(kuu::select_conv_algorithm(large_nhwc, large_w, 1, 3, 1, 1,
+                                       kuu::memory_format::kNHWC),
+            kuu::conv_algorithm::kFFT);
+}
+
+TEST(FunctionTest, TestConv2dAutotuner) {
+  kuu::tensor data{xt::random::randn<kuu::value_type>({2, 3, 8, 8})};
+  kuu::tensor weight{xt::random::randn<kuu::value_type>({4, 3, 3, 3})};
+  kuu::tensor bias{kuu::tensor_type{1, 2, 3, 4}};
+
+  auto &tuner = kuu::conv_autotuner::instance();
+  const std::string path = "conv_autotuner_test.txt";
+  std::remove(path.c_str());
+  tuner.clear();
+  tuner.set_cache_file(path);
+  tuner.enable();
+
+  auto expected = kuu::function::convolution_2d::forward(
+      data, weight, bias, 1, 1, 1, 1, kuu::conv_algorithm::kIm2col);
+  auto tuned = kuu::function::convolution_2d::forward(data, weight, bias, 1, 1);
+  CLOSE_ALL(expected.data(), tuned.data(), 1e-4);
+  ASSERT_EQ(tuner.size(), 1);
+
+  // cached: no new entry for the same key
+  kuu::function::convolution_2d::forward(data, weight, bias, 1, 1);
+  ASSERT_EQ(tuner.size(), 1);
+
+  const std::string key = kuu::function::convolution_2d::conv_key(
+      data, weight, 1, 1, 1);
+  auto algorithm = tuner.find(key);
+  ASSERT_TRUE(algorithm.has_value());
+
+  tuner.clear();
+  tuner.load(path);
+  ASSERT_EQ(tuner.find(key), algorithm);
+
+  tuner.enable(false);
+  tuner.set_cache_file("");
+  tuner.clear();
+  std::remove(path.c_str());
+}
+
+TEST(FunctionTest, TestConv2dChannelsLast) {
+  kuu::tensor_type x = xt::random::randn<kuu::value_type>({2, 3, 6, 6});
+  kuu::tensor_type w = xt::random::randn<kuu::value_type>({4, 3, 3, 3});
+  kuu::tensor_type b = {1, 2, 3, 4};
+  kuu::tensor_type x_nhwc = xt::transpose(x, {0, 2, 3, 1});
+
+  kuu::tensor data{x};
+  kuu::tensor weight{w};
+  kuu::tensor bias{b};
+
+  auto y = kuu::function::convolution_2d::forward(data, weight, bias, 1, 1);
+  auto data_nhwc = kuu::function::memory_format_cast::forward(
+      data, kuu::memory_format::kNHWC);
+  ASSERT_EQ(data_nhwc.format(), kuu::memory_format::kNHWC);
+  CLOSE_ALL(data_nhwc.data(), x_nhwc);
+
+  auto y_nhwc =
+      kuu::function::convolution_2d::forward(data_nhwc, weight, bias, 1, 1);
+  ASSERT_EQ(y_nhwc.format(), kuu::memory_format::kNHWC);
+  kuu::tensor_type y_nchw = xt::transpose(y_nhwc.data(), {0, 3, 1, 2});
+  ASSERT_EQ(y.data().shape(), y_nchw.shape());
+  CLOSE_ALL(y.data(), y_nchw, 1e-4);
+
+  kuu::tensor_type gy = xt::random::randn<kuu::value_type>(y.shape());
+  kuu::tensor_type gy_nhwc = xt::transpose(gy, {0, 2, 3, 1});
+
+  std::vector<kuu::tensor> in, in_nhwc;
+  in.emplace_back(x, true);
+  in_nhwc.emplace_back(x_nhwc, true);
+  in_nhwc[0].set_format(kuu::memory_format::kNHWC);
+  for (auto *inputs : {&in, &in_nhwc}) {
+    inputs->emplace_back(w, true);
+    inputs->emplace_back(b, true);
+    inputs->emplace_back(kuu::exarray<2>{1, 1}.asTensor()); // stride
+    inputs->emplace_back(kuu::exarray<2>{1, 1}.asTensor()); // padding
+    inputs->emplace_back(kuu::exarray<2>{1, 1}.asTensor()); // dilation
+  }
+  std::vector<kuu::tensor> out, out_nhwc;
+  out.emplace_back(y.data(), true);
+  out[0].set_grad(gy);
+  out_nhwc.emplace_back(y_nhwc.data(), true);
+  out_nhwc[0].set_grad(gy_nhwc);
+  out_nhwc[0].set_format(kuu::memory_format::kNHWC);
+
+  kuu::function::convolution_2d::backward(out, in);
+  kuu::function::convolution_2d::backward(out_nhwc, in_nhwc);
+
+  kuu::tensor_type dx_nchw = xt::transpose(in_nhwc[0].grad(), {0, 3, 1, 2});
+  CLOSE_ALL(in[0].grad(), dx_nchw, 1e-4);
+  ASSERT_EQ(in[1].grad().shape(), in_nhwc[1].grad().shape());
+  CLOSE_ALL(in[1].grad(), in_nhwc[1].grad(), 1e-3);
+  CLOSE_ALL(in[2].grad(), in_nhwc[2].grad(), 1e-4);
+}
+
+TEST(FunctionTest, TestConv2dPruned) {
+  // whole blocks of 16 output channels are pruned per input position
+  kuu::tensor_type x = xt::random::randn<kuu::value_type>({2, 3, 6, 6});
+  kuu::tensor_type w = xt::random::randn<kuu::value_type>({20, 3, 3, 3});
+  kuu::tensor_type b = xt::random::randn<kuu::value_type>({20});
+  kuu::tensor_type mask = xt::zeros<kuu::value_type>(w.shape());
+  for (std::size_t o = 0; o < 20; o++) {
+    for (std::size_t k = 0; k < 27; k++) {
+      mask.data()[o * 27 + k] =
+          (k + o / kuu::kernel::kBsrBlock) % 4 == 0 ? 1 : 0;
+    }
+  }
+  w *= mask;
+  kuu::tensor_type x_nhwc = xt::transpose(x, {0, 2, 3, 1});
+
+  for (const bool channels_last : {false, true}) {
+    kuu::tensor weight{w, true}, dense{w, true};
+    weight.set_mask(mask);
+    std::vector<kuu::tensor> out, in, out_dense, in_dense;
+    for (auto *inputs : {&in, &in_dense}) {
+      inputs->emplace_back(channels_last ? x_nhwc : x, true);
+      if (channels_last) {
+        inputs->back().set_format(kuu::memory_format::kNHWC);
+      }
+      inputs->push_back(inputs == &in ? weight : dense);
+      inputs->emplace_back(b, true);
+      inputs->emplace_back(kuu::exarray<2>{1, 1}.asTensor()); // stride
+      inputs->emplace_back(kuu::exarray<2>{1, 1}.asTensor()); // padding
+      inputs->emplace_back(kuu::exarray<2>{1, 1}.asTensor()); // dilation
+    }
+
+    auto y = kuu::function::convolution_2d::forward(in[0], in[1], in[2], 1, 1);
+    auto y_dense = kuu::function::convolution_2d::forward(
+        in_dense[0], in_dense[1], in_dense[2], 1, 1);
+    CLOSE_ALL(y.data(), y_dense.data(), 1e-4);
+
+    kuu::tensor_type gy = xt::random::randn<kuu::value_type>(y.shape());
+    for (auto *o : {&out, &out_dense}) {
+      o->emplace_back(y.data(), true);
+      o->back().set_grad(gy);
+      o->back().set_format(y.format());
+    }
+    kuu::function::convolution_2d::backward(out, in);
+    kuu::function::convolution_2d::backward(out_dense, in_dense);
+    CLOSE_ALL(in[0].grad(), in_dense[0].grad(), 1e-4);
+    CLOSE_ALL(in[1].grad(), in_dense[1].grad(), 1e-3);
+  }
+}
+
+TEST(FunctionTest, TestConv2dGrouped) {
+  // two groups equal two independent convolutions over halves of the channels
+  kuu::tensor_type x = xt::random::randn<kuu::value_type>({2, 4, 6, 6});
+  kuu::tensor_type w = xt::random::randn<kuu::value_type>({6, 2, 3, 3});
+  kuu::tensor_type b = {1, 2, 3, 4, 5, 6};
+  kuu::tensor_type gy = xt::random::randn<kuu::value_type>({2, 6, 6, 6});
+
+  std::vector<kuu::tensor> in;
+  in.emplace_back(x, true);
+  in.emplace_back(w, true);
+  in.emplace_back(b, true);
+  in.emplace_back(kuu::exarray<2>{1, 1}.asTensor()); // stride
+  in.emplace_back(kuu::exarray<2>{1, 1}.asTensor()); // padding
+  in.emplace_back(kuu::exarray<2>{1, 1}.asTensor()); // dilation
+  in.emplace_back(kuu::exarray<1>{2}.asTensor());    // groups
+
+  auto y = kuu::function::convolution_2d::forward(in[0], in[1], in[2], 1, 1, 1,
+                                                  2);
+  ASSERT_EQ(y.shape(), std::vector<std::size_t>({2, 6, 6, 6}));
+
+  std::vector<kuu::tensor> out;
+  out.emplace_back(y.data(), true);
+  out[0].set_grad(gy);
+  kuu::function::convolution_2d::backward(out, in);
+
+  for (std::size_t g = 0; g < 2; g++) {
+    auto c_in = xt::range(2 * g, 2 * g + 2);
+    auto c_out = xt::range(3 * g, 3 * g + 3);
+    std::vector<kuu::tensor> in_g;
+    in_g.emplace_back(xt::eval(xt::view(x, xt::all(), c_in)), true);
+    in_g.emplace_back(xt::eval(xt::view(w, c_out)), true);
+    in_g.emplace_back(xt::eval(xt::view(b, c_out)), true);
+    in_g.emplace_back(kuu::exarray<2>{1, 1}.asTensor());
+    in_g.emplace_back(kuu::exarray<2>{1, 1}.asTensor());
+    in_g.emplace_back(kuu::exarray<2>{1, 1}.asTensor());
+    auto y_g = kuu::function::convolution_2d::forward(in_g[0], in_g[1],
+                                                      in_g[2], 1, 1);
+    CLOSE_ALL(y_g.data(), xt::eval(xt::view(y.data(), xt::all(), c_out)),
+              1e-4);
+
+    std::vector<kuu::tensor> out_g;
+    out_g.emplace_back(y_g.data(), true);
+    out_g[0].set_grad(xt::eval(xt::view(gy, xt::all(), c_out)));
+    kuu::function::convolution_2d::backward(out_g, in_g);
+    CLOSE_ALL(in_g[0].grad(),
+              xt::eval(xt::view(in[0].grad(), xt::all(), c_in)), 1e-3);
+    CLOSE_ALL(in_g[1].grad(), xt::eval(xt::view(in[1].grad(), c_out)), 1e-3);
+    CLOSE_ALL(in_g[2].grad(), xt::eval(xt::view(in[2].grad(), c_out)), 1e-3);
+  }
+}
+
+TEST(FunctionTest, TestConv2dDepthwise) {
+  // the direct kernel against the grouped GEMM path, with a channel
+  // multiplier of 2
+  kuu::tensor_type x = xt::random::randn<kuu::value_type>({2, 3, 7, 7});
+  kuu::tensor_type w = xt::random::randn<kuu::value_type>({6, 1, 3, 3});
+  kuu::tensor_type b = {1, 2, 3, 4, 5, 6};
+  kuu::tensor_type x_nhwc = xt::transpose(x, {0, 2, 3, 1});
+
+  for (auto format : {kuu::memory_format::kNCHW, kuu::memory_format::kNHWC}) {
+    kuu::tensor data{format == kuu::memory_format::kNHWC ? x_nhwc : x};
+    data.set_format(format);
+    kuu::tensor weight{w};
+    kuu::tensor bias{b};
+    for (std::size_t stride : {1, 2}) {
+      auto direct = kuu::function::convolution_2d::forward(
+          data, weight, bias, {stride, stride}, 1, 1, 3,
+          kuu::conv_algorithm::kDirect);
+      auto gemm = kuu::function::convolution_2d::forward(
+          data, weight, bias, {stride, stride}, 1, 1, 3,
+          kuu::conv_algorithm::kIm2col);
+      ASSERT_EQ(direct.shape(), gemm.shape());
+      ASSERT_EQ(direct.format(), format);
+      CLOSE_ALL(direct.data(), gemm.data(), 1e-4);
+    }
+  }
+  ASSERT_EQ(kuu::select_conv_algorithm(std::vector<std::size_t>{2, 3, 7, 7},
+                                       w.shape(), 1, 1, 1, 3),
+            kuu::conv_algorithm::kDirect);
+}
+
+TEST(FunctionTest, TestPool2d) {
+  kuu::tensor_type x = {{{{1, 2, 3, 4},
+                          {5, 6, 7, 8},
+                          {9, 10, 11, 12},
+                          {13, 14, 15, 16}}}};
+  kuu::tensor_type x_nhwc = xt::transpose(x, {0, 2, 3, 1});
+  kuu::tensor_type y_max = {{{{6, 8}, {14, 16}}}};
+  kuu::tensor_type y_avg = {{{{3.5, 5.5}, {11.5, 13.5}}}};
+  kuu::tensor_type gx_max = {{{{0, 0, 0, 0},
+                               {0, 1, 0, 1},
+                               {0, 0, 0, 0},
+                               {0, 1, 0, 1}}}};
+
+  for (auto format : {kuu::memory_format::kNCHW, kuu::memory_format::kNHWC}) {
+    const bool nhwc = format == kuu::memory_format::kNHWC;
+    auto layout = [nhwc](const kuu::tensor_type &t) -> kuu::tensor_type {
+      if (nhwc) {
+        return xt::transpose(t, {0, 2, 3, 1});
+      }
+      return t;
+    };
+    kuu::tensor data{nhwc ? x_nhwc : x, true};
+    data.set_format(format);
+
+    auto max = kuu::function::max_pool_2d::forward(data, 2);
+    ASSERT_EQ(max.format(), format);
+    ASSERT_EQ(max.data(), layout(y_max));
+    max.backward();
+    ASSERT_EQ(data.grad(), layout(gx_max));
+    ASSERT_FALSE(data.is_released());
+
+    data.clear_grad();
+    auto avg = kuu::function::avg_pool_2d::forward(data, 2);
+    ASSERT_EQ(avg.data(), layout(y_avg));
+    avg.backward();
+    ASSERT_EQ(data.grad(), xt::ones_like(data.data()) * 0.25f);
+  }
+}
+
+TEST(FunctionTest, TestConvTranspose2d) {
+  // a transposed convolution is the input gradient of the convolution with
+  // the same weight, and its own input gradient is that convolution.
+  kuu::tensor_type x = xt::random::randn<kuu::value_type>({2, 4, 4, 5});
+  kuu::tensor_type w = xt::random::randn<kuu::value_type>({4, 3, 3, 3});
+  kuu::tensor_type b = xt::zeros<kuu::value_type>({3});
+
+  std::vector<kuu::tensor> in;
+  in.emplace_back(x, true);
+  in.emplace_back(w, true);
+  in.emplace_back(b, true);
+  in.emplace_back(kuu::exarray<2>{2, 2}.asTensor()); // stride
+  in.emplace_back(kuu::exarray<2>{1, 1}.asTensor()); // padding
+  in.emplace_back(kuu::exarray<2>{1, 0}.asTensor()); // out_padding
+
+  auto y = kuu::function::convolution_transpose_2d::forward(
+      in[0], in[1], in[2], 2, 1, {1, 0});
+  ASSERT_EQ(y.shape(), std::vector<std::size_t>({2, 3, 8, 9}));
+
+  // y as the input gradient of a stride 2 convolution from {8, 9} to {4, 5}
+  std::vector<kuu::tensor> conv_in;
+  conv_in.emplace_back(xt::zeros<kuu::value_type>(y.shape()), true);
+  conv_in.emplace_back(w, true);
+  conv_in.emplace_back(kuu::tensor_type{0, 0, 0, 0}, false);
+  conv_in.emplace_back(kuu::exarray<2>{2, 2}.asTensor());
+  conv_in.emplace_back(kuu::exarray<2>{1, 1}.asTensor());
+  conv_in.emplace_back(kuu::exarray<2>{1, 1}.asTensor());
+  std::vector<kuu::tensor> conv_out;
+  conv_out.emplace_back(xt::zeros<kuu::value_type>(x.shape()), true);
+  conv_out[0].set_grad(x);
+  kuu::function::convolution_2d::backward(conv_out, conv_in);
+  CLOSE_ALL(y.data(), conv_in[0].grad(), 1e-4);
+
+  kuu::tensor_type gy = xt::random::randn<kuu::value_type>(y.shape());
+  std::vector<kuu::tensor> out;
+  out.emplace_back(y.data(), true);
+  out[0].set_grad(gy);
+  kuu::function::convolution_transpose_2d::backward(out, in);
+
+  kuu::tensor gy_tensor{gy};
+  kuu::tensor weight{w};
+  kuu::tensor no_bias{kuu::tensor_type{0, 0, 0, 0}, false};
+  auto dx = kuu::function::convolution_2d::forward(gy_tensor, weight, no_bias,
+                                                   2, 1);
+  CLOSE_ALL(in[0].grad(), dx.data(), 1e-4);
+  ASSERT_EQ(in[1].grad().shape(), w.shape());
+  CLOSE_ALL(in[2].grad(), xt::eval(xt::sum(gy, {0, 2, 3})), 1e-3);
+}
+
 TEST(FunctionTest, TestIm2Col) {
   xt::xarray<int> im = {1,  2,  3,  4,  5,  6,  7,  8,  9,
                         10, 11, 12, 13, 14, 15, 16, 17, 18};
@@ -417,13 +1091,16 @@ TEST(FunctionTest, TestSoftmaxCrossEntropyBackward) {
   xt::xarray<float> t0 = {1, 0, 2};
   xt::xarray<float> t1 = {{0, 1, 0}, {1, 0, 0}, {0, 0, 1}};
 
-  std::vector<kuu::tensor> out;
-  out.emplace_back(1.0986, true);
-  out[0].set_grad(xt::ones_like(out[0].data()));
-  std::vector<kuu::tensor> in;
-  in.emplace_back(x, true);
-  in.emplace_back(t0, true);
-  kuu::function::softmax_cross_entropy::backward(out, in);
+  // backward reads the log-sum-exp saved by forward
+  std::vector<kuu::tensor> inputs;
+  for (const auto &t : {t0, t1}) {
+    inputs.emplace_back(x, true);
+    kuu::tensor label{t, false};
+    auto y = kuu::function::softmax_cross_entropy::forward(inputs.back(),
+                                                           label);
+    y.set_grad(xt::ones_like(y.data()));
+    kuu::trace::run_backward(y);
+  }
 
   auto scores = kuu::math::log_softmax(x, 1);
   std::cout << "scores: " << scores << std::endl;
@@ -435,7 +1112,75 @@ TEST(FunctionTest, TestSoftmaxCrossEntropyBackward) {
   xt::xtensor<float, 2> torch_gx = {{0.1111, -0.2222, 0.1111},
                                     {-0.2222, 0.1111, 0.1111},
                                     {0.1111, 0.1111, -0.2222}};
-  CLOSE_ALL(in[0].grad(), torch_gx, 0.001);
+  for (auto &input : inputs) {
+    CLOSE_ALL(input.grad(), torch_gx, 0.001);
+  }
+
+  // without the mean, the gradient is not divided by N
+  kuu::tensor input{x, true};
+  kuu::tensor label{t0, false};
+  auto y = kuu::function::softmax_cross_entropy::forward(
+      input, label,
+      kuu::function::softmax_cross_entropy::reduction_type::kSum);
+  EXPECT_NEAR(y.data()(), 3 * 1.0986, 0.001);
+  y.set_grad(xt::ones_like(y.data()));
+  kuu::trace::run_backward(y);
+  CLOSE_ALL(input.grad(), 3 * torch_gx, 0.003);
+}
+
+TEST(FunctionTest, TestSoftmax) {
+  xt::xarray<float> x = xt::random::randn<float>({3, 4, 5});
+  for (const std::size_t axis : {0, 1, 2}) {
+    auto e = xt::exp(x - xt::amax(x, {axis}, xt::keep_dims));
+    xt::xarray<float> expected = e / xt::sum(e, {axis}, xt::keep_dims);
+    CLOSE_ALL(kuu::math::softmax(x, axis), expected, 1e-6);
+    CLOSE_ALL(kuu::math::log_softmax(x, axis), xt::log(expected), 1e-5);
+  }
+  CLOSE_ALL(kuu::math::sigmoid(x), 1.f / (1.f + xt::exp(-x)), 1e-6);
+}
+
+TEST(FunctionTest, TestPointwiseFusion) {
+  xt::xarray<float> x = xt::random::randn<float>({2, 3, 4, 5});
+  xt::xarray<float> scale = xt::random::randn<float>({3});
+  xt::xarray<float> shift = xt::random::randn<float>({3});
+  xt::xarray<float> gy = xt::random::randn<float>({2, 3, 4, 5});
+
+  xt::xarray<float> s = scale, b = shift;
+  s.reshape({1, 3, 1, 1});
+  b.reshape({1, 3, 1, 1});
+  xt::xarray<float> z = 2.f * x * s + b;
+  xt::xarray<float> g = gy * (z > 0);
+  xt::xarray<float> expected = xt::fmax(z, 0.f);
+  xt::xarray<float> expected_gx = g * s * 2.f;
+  xt::xarray<float> expected_gscale = xt::sum(g * 2.f * x, {0, 2, 3});
+  xt::xarray<float> expected_gshift = xt::sum(g, {0, 2, 3});
+
+  for (const bool lazy : {false, true}) {
+    kuu::tensor input{x, true};
+    kuu::tensor scale_t{scale, true};
+    kuu::tensor shift_t{shift, true};
+    kuu::tensor y;
+    {
+      std::optional<kuu::fuse_pointwise> fusion;
+      if (lazy) {
+        fusion.emplace();
+      }
+      auto scaled = kuu::function::pointwise::scale(input, 2.f);
+      y = kuu::function::relu::forward(
+          kuu::function::pointwise::affine(scaled, scale_t, shift_t));
+      // nothing is computed until the data is read
+      ASSERT_EQ(y.is_deferred(), lazy);
+      ASSERT_EQ(y.shape(), input.shape());
+    }
+    CLOSE_ALL(y.data(), expected, 1e-5);
+    ASSERT_FALSE(y.is_deferred());
+
+    y.set_grad(gy);
+    kuu::trace::run_backward(y);
+    CLOSE_ALL(input.grad(), expected_gx, 1e-5);
+    CLOSE_ALL(scale_t.grad(), expected_gscale, 1e-4);
+    CLOSE_ALL(shift_t.grad(), expected_gshift, 1e-4);
+  }
 }
 
 TEST(FunctionTest, TestBatchNorm1dForward) {
@@ -516,10 +1261,11 @@ TEST(FunctionTest, TestBatchNormNdForward) {
   kuu::tensor mean{running_mean};
   kuu::tensor var{running_var};
 
-  auto out0 =
-      kuu::function::batchnorm::forward(input, w, b, mean, var, eps, 0.1, true);
+  // training updates the running statistics, so evaluation goes first
   auto out1 = kuu::function::batchnorm::forward(input, w, b, mean, var, eps,
                                                 0.1, false);
+  auto out0 =
+      kuu::function::batchnorm::forward(input, w, b, mean, var, eps, 0.1, true);
 
   running_mean.reshape({1, 3, 1});
   running_var.reshape({1, 3, 1});
@@ -537,4 +1283,131 @@ TEST(FunctionTest, TestBatchNormNdForward) {
   EXPECT_EQ(out1.shape(), x_shape);
   CLOSE_ALL(out0.data(), y0);
   CLOSE_ALL(out1.data(), y1);
-}
\ No newline at end of file
+}
+
+TEST(FunctionTest, TestBatchNormChannelsLast) {
+  xt::xarray<float> x = xt::random::randn<float>({2, 3, 4, 5});
+  xt::xarray<float> x_nhwc = xt::transpose(x, {0, 2, 3, 1});
+  kuu::tensor w{xt::xarray<float>{5, 6, 7}};
+  kuu::tensor b{xt::xarray<float>{1, 2, 3}};
+  kuu::tensor mean{xt::xarray<float>{1, 2, 3}};
+  kuu::tensor var{xt::xarray<float>{3, 2, 1}};
+
+  kuu::tensor input{x};
+  kuu::tensor input_nhwc{x_nhwc};
+  input_nhwc.set_format(kuu::memory_format::kNHWC);
+
+  for (bool training : {true, false}) {
+    auto y = kuu::function::batchnorm::forward(input, w, b, mean, var, 1e-5,
+                                               0.1, training);
+    auto y_nhwc = kuu::function::batchnorm::forward(input_nhwc, w, b, mean,
+                                                    var, 1e-5, 0.1, training);
+    ASSERT_EQ(y_nhwc.format(), kuu::memory_format::kNHWC);
+    xt::xarray<float> y_nchw = xt::transpose(y_nhwc.data(), {0, 3, 1, 2});
+    CLOSE_ALL(y.data(), y_nchw, 1e-4);
+  }
+}
+
+TEST(FunctionTest, TestBatchNormBackward) {
+  xt::xarray<float> x = xt::random::randn<float>({4, 3, 5, 6}) * 2.f + 3.f;
+  xt::xarray<float> gy = xt::random::randn<float>(x.shape());
+  xt::xarray<float> gamma = {5, 6, 7};
+  const float eps = 1e-5;
+
+  // closed form with the batch statistics
+  xt::xarray<float> mean = xt::mean(x, {0, 2, 3});
+  xt::xarray<float> var = xt::variance(x, {0, 2, 3});
+  mean.reshape({1, 3, 1, 1});
+  var.reshape({1, 3, 1, 1});
+  xt::xarray<float> inv_std = 1.f / xt::sqrt(var + eps);
+  xt::xarray<float> xhat = (x - mean) * inv_std;
+  xt::xarray<float> mean_gy = xt::mean(gy, {0, 2, 3});
+  xt::xarray<float> mean_gy_xhat = xt::mean(gy * xhat, {0, 2, 3});
+  mean_gy.reshape({1, 3, 1, 1});
+  mean_gy_xhat.reshape({1, 3, 1, 1});
+  xt::xarray<float> g = gamma;
+  g.reshape({1, 3, 1, 1});
+  xt::xarray<float> gx = g * inv_std * (gy - mean_gy - xhat * mean_gy_xhat);
+  xt::xarray<float> ggamma = xt::sum(gy * xhat, {0, 2, 3});
+  xt::xarray<float> gbeta = xt::sum(gy, {0, 2, 3});
+
+  for (bool channels_last : {false, true}) {
+    kuu::tensor input{channels_last
+                          ? xt::xarray<float>(xt::transpose(x, {0, 2, 3, 1}))
+                          : x,
+                      true};
+    if (channels_last) {
+      input.set_format(kuu::memory_format::kNHWC);
+    }
+    kuu::tensor w{gamma, true};
+    kuu::tensor b{xt::xarray<float>{1, 2, 3}, true};
+    kuu::tensor running_mean{xt::xarray<float>{0, 0, 0}};
+    kuu::tensor running_var{xt::xarray<float>{1, 1, 1}};
+    auto y = kuu::function::batchnorm::forward(input, w, b, running_mean,
+                                               running_var, eps, 0.1, true);
+    y.set_grad(channels_last
+                   ? xt::xarray<float>(xt::transpose(gy, {0, 2, 3, 1}))
+                   : gy);
+    kuu::trace::run_backward(y);
+
+    xt::xarray<float> input_grad =
+        channels_last ? xt::xarray<float>(
+                            xt::transpose(input.grad(), {0, 3, 1, 2}))
+                      : input.grad();
+    CLOSE_ALL(input_grad, gx, 1e-3);
+    CLOSE_ALL(w.grad(), ggamma, 1e-2);
+    CLOSE_ALL(b.grad(), gbeta, 1e-3);
+  }
+
+  // a {N, C} input is the same as {N, C, 1, 1}
+  xt::xarray<float> x2 = xt::view(x, xt::all(), xt::all(), 0, 0);
+  xt::xarray<float> gy2 = xt::view(gy, xt::all(), xt::all(), 0, 0);
+  xt::xarray<float> x4 = x2;
+  x4.reshape({4, 3, 1, 1});
+  std::vector<kuu::tensor> grads;
+  for (auto *data : {&x2, &x4}) {
+    kuu::tensor input{*data, true};
+    kuu::tensor w{gamma, true};
+    kuu::tensor b{xt::xarray<float>{1, 2, 3}, true};
+    kuu::tensor running_mean{xt::xarray<float>{0, 0, 0}};
+    kuu::tensor running_var{xt::xarray<float>{1, 1, 1}};
+    auto y = kuu::function::batchnorm::forward(input, w, b, running_mean,
+                                               running_var, eps, 0.1, true);
+    xt::xarray<float> seed = gy2;
+    seed.reshape(data->shape());
+    y.set_grad(std::move(seed));
+    kuu::trace::run_backward(y);
+    grads.push_back(input);
+  }
+  CLOSE_ALL(grads[0].grad(), grads[1].grad(), 1e-4);
+}
+
+TEST(FunctionTest, TestBatchNormRunningStats) {
+  xt::xarray<float> x = xt::random::randn<float>({4, 3, 5, 5}) + 2.f;
+  kuu::tensor input{x};
+  kuu::tensor w{xt::xarray<float>{5, 6, 7}};
+  kuu::tensor b{xt::xarray<float>{1, 2, 3}};
+  kuu::tensor running_mean{xt::xarray<float>{0, 0, 0}};
+  kuu::tensor running_var{xt::xarray<float>{1, 1, 1}};
+  const auto version = running_mean.version();
+
+  // updated by a forward-only run, with the weight of the batch being
+  // 1 - momentum
+  kuu::function::batchnorm::forward(input, w, b, running_mean, running_var,
+                                    1e-5, 0.1, true);
+  xt::xarray<float> batch_mean = xt::mean(x, {0, 2, 3});
+  xt::xarray<float> batch_var = xt::variance(x, {0, 2, 3});
+  CLOSE_ALL(running_mean.data(), 0.9f * batch_mean, 1e-4);
+  CLOSE_ALL(running_var.data(), 0.1f + 0.9f * batch_var, 1e-4);
+  ASSERT_NE(running_mean.version(), version);
+
+  // the folded inference path matches evaluation mode
+  auto expected = kuu::function::batchnorm::forward(
+      input, w, b, running_mean, running_var, 1e-5, 0.1, false);
+  kuu::tensor_type scale, shift;
+  kuu::function::batchnorm_inference::affine(w, b, running_mean, running_var,
+                                             1e-5, scale, shift);
+  auto y = kuu::function::batchnorm_inference::forward(input, scale, shift);
+  ASSERT_FALSE(y.requires_grad());
+  CLOSE_ALL(y.data(), expected.data(), 1e-4);
+}
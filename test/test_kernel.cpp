@@ -0,0 +1,997 @@
+#include "kernels/activation.hpp"
+#include "kernels/batchnorm.hpp"
+#include "kernels/bsr.hpp"
+#include "kernels/depthwise.hpp"
+#include "kernels/fft.hpp"
+#include "kernels/gemm.hpp"
+#include "kernels/half.hpp"
+#include "kernels/pointwise.hpp"
+#include "kernels/pooling.hpp"
+#include "kernels/qgemm.hpp"
+#include "kernels/spmm.hpp"
+#include "kernels/vmath.hpp"
+#include "test_common.hpp"
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <complex>
+#include <gtest/gtest.h>
+#include <limits>
+#include <random>
+#include <vector>
+
+TEST(KernelTest, TestFFTSize) {
+  ASSERT_EQ(kuu::kernel::fft_size(1), 1);
+  ASSERT_EQ(kuu::kernel::fft_size(7), 8);
+  ASSERT_EQ(kuu::kernel::fft_size(31), 32);
+  ASSERT_EQ(kuu::kernel::fft_size(33), 36);
+  ASSERT_EQ(kuu::kernel::fft_size(45), 45);
+}
+
+TEST(KernelTest, TestFFTForward) {
+  std::mt19937 engine{0};
+  std::normal_distribution<float> dist;
+  const double pi = std::acos(-1.0);
+  for (std::size_t n : {1, 2, 3, 4, 7, 8, 12, 15, 16, 25, 30, 64}) {
+    std::vector<kuu::kernel::complex_type> x(n);
+    for (auto &v : x) {
+      v = {dist(engine), dist(engine)};
+    }
+    auto y = x;
+    kuu::kernel::fft_plan plan{n};
+    plan.forward(y.data());
+    for (std::size_t k = 0; k < n; k++) {
+      std::complex<double> dft = 0;
+      for (std::size_t j = 0; j < n; j++) {
+        dft += std::complex<double>(x[j]) *
+               std::polar(1.0, -2. * pi * static_cast<double>(j * k % n) / n);
+      }
+      EXPECT_NEAR(dft.real(), y[k].real(), 1e-4);
+      EXPECT_NEAR(dft.imag(), y[k].imag(), 1e-4);
+    }
+    plan.inverse(y.data());
+    for (std::size_t j = 0; j < n; j++) {
+      EXPECT_NEAR(x[j].real(), y[j].real(), 1e-5);
+      EXPECT_NEAR(x[j].imag(), y[j].imag(), 1e-5);
+    }
+  }
+}
+
+TEST(KernelTest, TestFFT2d) {
+  std::mt19937 engine{0};
+  std::normal_distribution<float> dist;
+  kuu::kernel::fft2d_plan plan{6, 10};
+  std::vector<kuu::kernel::complex_type> x(plan.size());
+  for (auto &v : x) {
+    v = dist(engine);
+  }
+  auto y = x;
+  plan.forward(y.data());
+  // DC term is the plain sum
+  kuu::kernel::complex_type sum = 0;
+  for (auto &v : x) {
+    sum += v;
+  }
+  EXPECT_NEAR(sum.real(), y[0].real(), 1e-4);
+  plan.inverse(y.data());
+  for (std::size_t i = 0; i < x.size(); i++) {
+    EXPECT_NEAR(x[i].real(), y[i].real(), 1e-5);
+    EXPECT_NEAR(0, y[i].imag(), 1e-5);
+  }
+}
+
+namespace {
+// naive depthwise convolution on NCHW / NHWC buffers. returns y and, given gy,
+// the gradients gx and gw.
+void naive_depthwise(const std::vector<float> &x, const std::vector<float> &w,
+                     const std::vector<float> &gy, std::vector<float> &y,
+                     std::vector<float> &gx, std::vector<float> &gw,
+                     const kuu::kernel::conv2d_geometry &g,
+                     const bool channels_last) {
+  const std::size_t Ho = g.H_out(), Wo = g.W_out(), M = g.multiplier();
+  auto xi = [&](std::size_t n, std::size_t c, std::size_t h, std::size_t v) {
+    return channels_last ? ((n * g.H + h) * g.W + v) * g.C_in + c
+                         : ((n * g.C_in + c) * g.H + h) * g.W + v;
+  };
+  auto yi = [&](std::size_t n, std::size_t c, std::size_t i, std::size_t j) {
+    return channels_last ? ((n * Ho + i) * Wo + j) * g.C_out + c
+                         : ((n * g.C_out + c) * Ho + i) * Wo + j;
+  };
+  y.assign(g.N * g.C_out * Ho * Wo, 0.f);
+  gx.assign(x.size(), 0.f);
+  gw.assign(w.size(), 0.f);
+  for (std::size_t n = 0; n < g.N; n++) {
+    for (std::size_t co = 0; co < g.C_out; co++) {
+      for (std::size_t i = 0; i < Ho; i++) {
+        for (std::size_t j = 0; j < Wo; j++) {
+          for (std::size_t p = 0; p < g.H_f; p++) {
+            for (std::size_t q = 0; q < g.W_f; q++) {
+              const long h = static_cast<long>(i * g.stride_h + p) -
+                             static_cast<long>(g.pad_h);
+              const long v = static_cast<long>(j * g.stride_w + q) -
+                             static_cast<long>(g.pad_w);
+              if (h < 0 || v < 0 || static_cast<long>(g.H) <= h ||
+                  static_cast<long>(g.W) <= v) {
+                continue;
+              }
+              const std::size_t a = xi(n, co / M, h, v);
+              const std::size_t b = (co * g.H_f + p) * g.W_f + q;
+              const std::size_t c = yi(n, co, i, j);
+              y[c] += x[a] * w[b];
+              gx[a] += gy[c] * w[b];
+              gw[b] += gy[c] * x[a];
+            }
+          }
+        }
+      }
+    }
+  }
+}
+} // namespace
+
+TEST(KernelTest, TestDepthwise) {
+  std::mt19937 engine{0};
+  std::normal_distribution<float> dist;
+  auto fill = [&](std::vector<float> &v) {
+    for (auto &e : v) {
+      e = dist(engine);
+    }
+  };
+  // {N, C_in, H, W, C_out, H_f, W_f, stride_h, stride_w, pad_h, pad_w}
+  const std::vector<kuu::kernel::conv2d_geometry> geometries = {
+      {2, 3, 7, 9, 3, 3, 3, 1, 1, 1, 1},
+      {2, 4, 8, 6, 8, 3, 5, 2, 1, 1, 2},
+      {1, 2, 9, 9, 2, 5, 5, 2, 2, 2, 2},
+  };
+  for (const auto &g : geometries) {
+    for (const bool channels_last : {false, true}) {
+      std::vector<float> x(g.N * g.C_in * g.H * g.W);
+      std::vector<float> w(g.C_out * g.H_f * g.W_f);
+      std::vector<float> gy(g.N * g.C_out * g.H_out() * g.W_out());
+      fill(x);
+      fill(w);
+      fill(gy);
+      std::vector<float> y0, gx0, gw0;
+      naive_depthwise(x, w, gy, y0, gx0, gw0, g, channels_last);
+
+      std::vector<float> y(y0.size()), gx(gx0.size()), gw(gw0.size());
+      if (channels_last) {
+        kuu::kernel::depthwise_forward_nhwc(x.data(), w.data(), nullptr,
+                                            y.data(), g);
+        kuu::kernel::depthwise_backward_nhwc(x.data(), w.data(), gy.data(),
+                                             gx.data(), gw.data(), g);
+      } else {
+        kuu::kernel::depthwise_forward_nchw(x.data(), w.data(), nullptr,
+                                            y.data(), g);
+        kuu::kernel::depthwise_backward_nchw(x.data(), w.data(), gy.data(),
+                                             gx.data(), gw.data(), g);
+      }
+      CLOSE_ALL(y0, y, 1e-4);
+      CLOSE_ALL(gx0, gx, 1e-4);
+      CLOSE_ALL(gw0, gw, 1e-4);
+    }
+  }
+}
+
+TEST(KernelTest, TestSgemm) {
+  std::mt19937 engine{0};
+  std::normal_distribution<float> dist;
+  // {M, N, K}, including edge tiles and more than one K block
+  const std::vector<std::array<std::size_t, 3>> sizes = {
+      {1, 1, 1}, {7, 13, 5}, {6, 32, 16}, {37, 70, 300}, {130, 19, 64}};
+  for (const auto &kernel : kuu::kernel::available_micro_kernels()) {
+    for (const auto &size : sizes) {
+      const std::size_t M = size[0], N = size[1], K = size[2];
+      for (const bool trans_a : {false, true}) {
+        for (const bool trans_b : {false, true}) {
+          std::vector<float> A(M * K), B(K * N), C(M * N);
+          for (auto *v : {&A, &B, &C}) {
+            for (auto &e : *v) {
+              e = dist(engine);
+            }
+          }
+          const float alpha = 0.5f, beta = 2.f;
+          std::vector<float> expected(M * N);
+          for (std::size_t i = 0; i < M; i++) {
+            for (std::size_t j = 0; j < N; j++) {
+              double sum = 0;
+              for (std::size_t p = 0; p < K; p++) {
+                const float a = trans_a ? A[p * M + i] : A[i * K + p];
+                const float b = trans_b ? B[j * K + p] : B[p * N + j];
+                sum += static_cast<double>(a) * b;
+              }
+              expected[i * N + j] = alpha * sum + beta * C[i * N + j];
+            }
+          }
+          kuu::kernel::sgemm(trans_a, trans_b, M, N, K, alpha, A.data(),
+                             trans_a ? M : K, B.data(), trans_b ? K : N, beta,
+                             C.data(), N, {}, kernel);
+          CLOSE_ALL(expected, C, 1e-3);
+        }
+      }
+    }
+  }
+}
+
+TEST(KernelTest, TestSgemmPacked) {
+  std::mt19937 engine{0};
+  std::normal_distribution<float> dist;
+  const std::size_t M = 9, N = 41, K = 300;
+  std::vector<float> A(M * K), B(N * K), expected(M * N), C(M * N);
+  for (auto *v : {&A, &B}) {
+    for (auto &e : *v) {
+      e = dist(engine);
+    }
+  }
+  for (const auto &kernel : kuu::kernel::available_micro_kernels()) {
+    // B is stored {N, K} and used transposed, as a convolution filter is.
+    kuu::kernel::sgemm(false, true, M, N, K, 1.f, A.data(), K, B.data(), K,
+                       0.f, expected.data(), N, {}, kernel);
+    auto packed = kuu::kernel::pack_matrix(true, K, N, B.data(), K, kernel);
+    kuu::kernel::sgemm(false, M, 1.f, A.data(), K, packed, 0.f, C.data(), N,
+                       {}, kernel);
+    CLOSE_ALL(expected, C);
+  }
+}
+
+TEST(KernelTest, TestSgemmEpilogue) {
+  std::mt19937 engine{0};
+  std::normal_distribution<float> dist;
+  // 12 x 32 has only full tiles for every kernel, 13 x 37 has edge tiles too
+  for (const auto &size : std::vector<std::array<std::size_t, 3>>{
+           {12, 32, 20}, {13, 37, 300}}) {
+    const std::size_t M = size[0], N = size[1], K = size[2];
+    std::vector<float> A(M * K), B(K * N), bias(N);
+    for (auto *v : {&A, &B, &bias}) {
+      for (auto &e : *v) {
+        e = dist(engine);
+      }
+    }
+    for (const auto &kernel : kuu::kernel::available_micro_kernels()) {
+      std::vector<float> z(M * N);
+      kuu::kernel::sgemm(false, false, M, N, K, 1.f, A.data(), K, B.data(), N,
+                         0.f, z.data(), N, {}, kernel);
+      for (std::size_t i = 0; i < M; i++) {
+        for (std::size_t j = 0; j < N; j++) {
+          z[i * N + j] += bias[j];
+        }
+      }
+      for (auto act : {kuu::kernel::activation::kNone,
+                       kuu::kernel::activation::kReLU,
+                       kuu::kernel::activation::kSigmoid,
+                       kuu::kernel::activation::kGELU}) {
+        std::vector<float> y(M * N), derivative(M * N);
+        kuu::kernel::sgemm(false, false, M, N, K, 1.f, A.data(), K, B.data(),
+                           N, 0.f, y.data(), N,
+                           {bias.data(), act, derivative.data()}, kernel);
+        for (std::size_t i = 0; i < M * N; i++) {
+          // reference values and central differences of the activation
+          auto f = [act](double v) {
+            switch (act) {
+            case kuu::kernel::activation::kReLU:
+              return std::max(v, 0.);
+            case kuu::kernel::activation::kSigmoid:
+              return 1. / (1. + std::exp(-v));
+            case kuu::kernel::activation::kGELU:
+              return 0.5 * v * (1. + std::erf(v / std::sqrt(2.)));
+            default:
+              return v;
+            }
+          };
+          EXPECT_NEAR(f(z[i]), y[i], 2e-3);
+          if (0.01 < std::abs(z[i])) {
+            const double h = 1e-3;
+            EXPECT_NEAR((f(z[i] + h) - f(z[i] - h)) / (2 * h), derivative[i],
+                        2e-3);
+          }
+        }
+        if (act == kuu::kernel::activation::kReLU) {
+          // the in-register path, without derivative output
+          std::vector<float> y_fast(M * N);
+          kuu::kernel::sgemm(false, false, M, N, K, 1.f, A.data(), K,
+                             B.data(), N, 0.f, y_fast.data(), N,
+                             {bias.data(), act}, kernel);
+          CLOSE_ALL(y, y_fast, 1e-4);
+        }
+      }
+    }
+  }
+}
+
+TEST(KernelTest, TestSgemmBatched) {
+  std::mt19937 engine{0};
+  std::normal_distribution<float> dist;
+  // A is broadcast: every batch entry points at the same matrix
+  const std::size_t batch = 64, M = 7, N = 9, K = 5;
+  std::vector<float> A(M * K), B(batch * K * N), C(batch * M * N),
+      expected(batch * M * N);
+  for (auto *v : {&A, &B}) {
+    for (auto &e : *v) {
+      e = dist(engine);
+    }
+  }
+  std::vector<const float *> a(batch, A.data()), b(batch);
+  std::vector<float *> c(batch);
+  for (std::size_t i = 0; i < batch; i++) {
+    b[i] = B.data() + i * K * N;
+    c[i] = C.data() + i * M * N;
+    kuu::kernel::sgemm(true, false, M, N, K, 1.f, A.data(), M, b[i], N, 0.f,
+                       expected.data() + i * M * N, N);
+  }
+  kuu::kernel::sgemm_batched(true, false, M, N, K, 1.f, a.data(), M, b.data(),
+                             N, 0.f, c.data(), N, batch);
+  CLOSE_ALL(expected, C, 1e-5);
+}
+
+TEST(KernelTest, TestHalfConversion) {
+  using kuu::kernel::half_format;
+  ASSERT_EQ(kuu::kernel::float_to_bf16(1.f), 0x3f80);
+  ASSERT_EQ(kuu::kernel::float_to_fp16(1.f), 0x3c00);
+  ASSERT_EQ(kuu::kernel::float_to_fp16(65504.f), 0x7bff);
+  ASSERT_EQ(kuu::kernel::float_to_fp16(65520.f), 0x7c00); // overflows
+  ASSERT_EQ(kuu::kernel::float_to_fp16(-std::ldexp(1.f, -24)), 0x8001);
+  // ties go to even
+  ASSERT_EQ(kuu::kernel::float_to_bf16(1.f + std::ldexp(1.f, -8)), 0x3f80);
+  ASSERT_EQ(kuu::kernel::float_to_fp16(1.f + std::ldexp(1.f, -11)), 0x3c00);
+  ASSERT_TRUE(std::isnan(
+      kuu::kernel::bf16_to_float(kuu::kernel::float_to_bf16(std::nanf("")))));
+  for (std::uint32_t h = 0; h < 0x7c00; h++) {
+    const float f = kuu::kernel::fp16_to_float(static_cast<std::uint16_t>(h));
+    ASSERT_EQ(kuu::kernel::float_to_fp16(f), h);
+  }
+
+  // the bulk conversions, across several chunks and a ragged tail
+  const std::size_t n = (1 << 17) + 13;
+  std::mt19937 engine{0};
+  std::normal_distribution<float> dist{0.f, 100.f};
+  std::vector<float> x(n), y(n);
+  for (auto &v : x) {
+    v = dist(engine);
+  }
+  std::vector<std::uint16_t> h(n);
+  for (const auto format : {half_format::kBFloat16, half_format::kFloat16}) {
+    kuu::kernel::compress(format, x.data(), n, h.data());
+    kuu::kernel::decompress(format, h.data(), n, y.data());
+    std::vector<float> rounded = x;
+    kuu::kernel::round_to_half(format, rounded.data(), n);
+    for (std::size_t i = 0; i < n; i++) {
+      const std::uint16_t expected = format == half_format::kBFloat16
+                                         ? kuu::kernel::float_to_bf16(x[i])
+                                         : kuu::kernel::float_to_fp16(x[i]);
+      ASSERT_EQ(h[i], expected);
+      ASSERT_EQ(y[i], rounded[i]);
+    }
+    const float precision =
+        format == half_format::kBFloat16 ? 1.f / 256 : 1.f / 2048;
+    for (std::size_t i = 0; i < n; i++) {
+      ASSERT_LE(std::abs(x[i] - y[i]), std::abs(x[i]) * precision);
+    }
+  }
+}
+
+TEST(KernelTest, TestSpmm) {
+  // A {3, 5} with an empty row and unused columns 1 and 4
+  const std::vector<std::size_t> row_ptr = {0, 2, 2, 5};
+  const std::vector<std::size_t> col_idx = {0, 3, 0, 2, 3};
+  const std::vector<float> values = {1, 2, 3, 4, 5};
+  const kuu::kernel::csr_view A{3, 5, row_ptr.data(), col_idx.data(),
+                                values.data()};
+  std::vector<float> dense(3 * 5, 0.f);
+  for (std::size_t r = 0; r < 3; r++) {
+    for (std::size_t e = row_ptr[r]; e < row_ptr[r + 1]; e++) {
+      dense[r * 5 + col_idx[e]] = values[e];
+    }
+  }
+
+  const std::size_t N = 4;
+  std::mt19937 engine{0};
+  std::normal_distribution<float> dist;
+  std::vector<float> B(5 * N), G(3 * N);
+  for (auto *v : {&B, &G}) {
+    for (auto &e : *v) {
+      e = dist(engine);
+    }
+  }
+
+  std::vector<float> C(3 * N), expected(3 * N);
+  kuu::kernel::sgemm(false, false, 3, N, 5, 1.f, dense.data(), 5, B.data(), N,
+                     0.f, expected.data(), N);
+  kuu::kernel::spmm(A, B.data(), N, N, C.data(), N);
+  CLOSE_ALL(expected, C, 1e-5);
+
+  // untouched rows keep their previous values
+  std::vector<float> CT(5 * N, -1.f), expected_t(5 * N);
+  kuu::kernel::sgemm(true, false, 5, N, 3, 1.f, dense.data(), 5, G.data(), N,
+                     0.f, expected_t.data(), N);
+  const auto active =
+      kuu::kernel::spmm_transposed(A, G.data(), N, N, CT.data(), N);
+  ASSERT_EQ(active, (std::vector<std::size_t>{0, 2, 3}));
+  for (std::size_t c : {1, 4}) {
+    for (std::size_t j = 0; j < N; j++) {
+      ASSERT_EQ(CT[c * N + j], -1.f);
+      CT[c * N + j] = 0.f;
+    }
+  }
+  CLOSE_ALL(expected_t, CT, 1e-5);
+}
+
+TEST(KernelTest, TestQgemm) {
+  std::mt19937 engine{0};
+  std::normal_distribution<float> dist;
+  // K and N are not multiples of the packing, M not of any row tile
+  const std::size_t M = 7, N = 37, K = 45;
+  std::vector<float> A(M * K), B(N * K), bias(N);
+  for (auto *v : {&A, &B, &bias}) {
+    for (auto &e : *v) {
+      e = dist(engine);
+    }
+  }
+  // B is {N, K}, i.e. transposed like a convolution filter
+  const auto packed = kuu::kernel::quantize_matrix(true, K, N, B.data(), K);
+  ASSERT_LT(packed.bytes(), B.size() * sizeof(float) / 2);
+
+  std::vector<float> expected(M * N);
+  kuu::kernel::sgemm(false, true, M, N, K, 1.f, A.data(), K, B.data(), K, 0.f,
+                     expected.data(), N);
+  for (std::size_t i = 0; i < M; i++) {
+    for (std::size_t j = 0; j < N; j++) {
+      expected[i * N + j] += bias[j];
+    }
+  }
+
+  for (const auto &kernel : kuu::kernel::available_qgemm_kernels()) {
+    std::vector<float> C(M * N);
+    kuu::kernel::qgemm(M, A.data(), K, 0.f, packed, bias.data(), C.data(), N,
+                       kernel);
+    // about 1% of the output range from the two 8 bit roundings
+    CLOSE_ALL(expected, C, 0.3);
+  }
+
+  // every kernel sees the same integers, so they agree exactly
+  std::vector<std::uint8_t> quantized(M * packed.k4);
+  const float scale = kuu::kernel::activation_scale(M, K, A.data(), K);
+  kuu::kernel::quantize_activations(M, K, A.data(), K, scale,
+                                    quantized.data(), packed.k4);
+  std::vector<float> reference(M * N);
+  const auto &kernels = kuu::kernel::available_qgemm_kernels();
+  kuu::kernel::qgemm(M, quantized.data(), scale, packed, nullptr,
+                     reference.data(), N, kernels.back());
+  for (const auto &kernel : kernels) {
+    std::vector<float> C(M * N);
+    kuu::kernel::qgemm(M, quantized.data(), scale, packed, nullptr, C.data(),
+                       N, kernel);
+    ASSERT_EQ(reference, C) << kernel.name;
+  }
+}
+
+TEST(KernelTest, TestBsr) {
+  std::mt19937 engine{0};
+  std::normal_distribution<float> dist;
+  // N is not a multiple of the block, M not of any row tile
+  const std::size_t M = 11, K = 23, N = 37;
+  std::vector<float> A(M * K), B(K * N), bias(N), G(M * N);
+  for (auto *v : {&A, &B, &bias, &G}) {
+    for (auto &e : *v) {
+      e = dist(engine);
+    }
+  }
+  // every other block of B is pruned
+  const std::size_t block = kuu::kernel::kBsrBlock;
+  for (std::size_t k = 0; k < K; k++) {
+    for (std::size_t j = 0; j < N; j++) {
+      if ((k + j / block) % 2 == 1) {
+        B[k * N + j] = 0.f;
+      }
+    }
+  }
+  const auto S = kuu::kernel::pack_bsr(false, K, N, B.data(), N);
+  ASSERT_EQ(S.column_blocks(), 3);
+  ASSERT_EQ(S.stored_blocks(), 35);
+  // B as {N, K} gives the same blocks
+  std::vector<float> BT(N * K);
+  for (std::size_t k = 0; k < K; k++) {
+    for (std::size_t j = 0; j < N; j++) {
+      BT[j * K + k] = B[k * N + j];
+    }
+  }
+  const auto ST = kuu::kernel::pack_bsr(true, K, N, BT.data(), K);
+  ASSERT_EQ(S.values, ST.values);
+
+  std::vector<float> expected(M * N), expected_nt(M * K);
+  kuu::kernel::sgemm(false, false, M, N, K, 1.f, A.data(), K, B.data(), N,
+                     0.f, expected.data(), N);
+  for (std::size_t i = 0; i < M; i++) {
+    for (std::size_t j = 0; j < N; j++) {
+      expected[i * N + j] += bias[j];
+    }
+  }
+  kuu::kernel::sgemm(false, true, M, K, N, 1.f, G.data(), N, B.data(), N, 0.f,
+                     expected_nt.data(), K);
+
+  for (const auto &kernel : kuu::kernel::available_bsr_kernels()) {
+    std::vector<float> C(M * N), CT(M * K);
+    kuu::kernel::bsr_gemm(M, A.data(), K, S, bias.data(), C.data(), N, kernel);
+    CLOSE_ALL(expected, C, 1e-4);
+    kuu::kernel::bsr_gemm_nt(M, G.data(), N, S, CT.data(), K, kernel);
+    CLOSE_ALL(expected_nt, CT, 1e-4);
+  }
+}
+
+TEST(KernelTest, TestChannelMoments) {
+  std::mt19937 engine{0};
+  // an offset mean stresses the single pass update
+  std::normal_distribution<float> dist{100.f, 2.f};
+  // {outer, C, inner}: NCHW-like, NHWC-like, and enough rows for several
+  // tasks with a partial last one
+  for (const auto &shape : std::vector<std::array<std::size_t, 3>>{
+           {4, 3, 25}, {50, 7, 1}, {70000, 3, 1}, {9, 5, 3001}}) {
+    const auto [outer, C, inner] = shape;
+    std::vector<float> x(outer * C * inner);
+    for (auto &e : x) {
+      e = dist(engine);
+    }
+    std::vector<double> expected_mean(C, 0.), expected_var(C, 0.);
+    for (std::size_t o = 0; o < outer; o++) {
+      for (std::size_t c = 0; c < C; c++) {
+        for (std::size_t i = 0; i < inner; i++) {
+          expected_mean[c] += x[(o * C + c) * inner + i];
+        }
+      }
+    }
+    for (auto &m : expected_mean) {
+      m /= outer * inner;
+    }
+    for (std::size_t o = 0; o < outer; o++) {
+      for (std::size_t c = 0; c < C; c++) {
+        for (std::size_t i = 0; i < inner; i++) {
+          const double d = x[(o * C + c) * inner + i] - expected_mean[c];
+          expected_var[c] += d * d;
+        }
+      }
+    }
+    for (auto &v : expected_var) {
+      v /= outer * inner;
+    }
+
+    std::vector<float> mean(C), var(C);
+    kuu::kernel::channel_moments(outer, C, inner, x.data(), mean.data(),
+                                 var.data());
+    CLOSE_ALL(expected_mean, mean, 1e-4);
+    CLOSE_ALL(expected_var, var, 1e-3);
+
+    // y = x * scale + shift, in place
+    std::vector<float> scale(C), shift(C);
+    for (std::size_t c = 0; c < C; c++) {
+      scale[c] = 1.f / std::sqrt(var[c]);
+      shift[c] = -mean[c] * scale[c];
+    }
+    auto y = x;
+    kuu::kernel::channel_affine(outer, C, inner, y.data(), scale.data(),
+                                shift.data(), y.data());
+    for (std::size_t k = 0; k < y.size(); k += 997) {
+      const std::size_t c = k / inner % C;
+      ASSERT_NEAR(y[k], x[k] * scale[c] + shift[c], 1e-4);
+    }
+  }
+}
+
+TEST(KernelTest, TestChannelGrad) {
+  std::mt19937 engine{0};
+  std::normal_distribution<float> dist;
+  for (const auto &shape : std::vector<std::array<std::size_t, 3>>{
+           {6, 3, 20}, {70000, 3, 1}}) {
+    const auto [outer, C, inner] = shape;
+    const std::size_t M = outer * inner;
+    std::vector<float> x(outer * C * inner), gy(x.size());
+    for (auto *v : {&x, &gy}) {
+      for (auto &e : *v) {
+        e = dist(engine);
+      }
+    }
+    std::vector<float> mean(C), var(C), inv_std(C), gamma(C);
+    kuu::kernel::channel_moments(outer, C, inner, x.data(), mean.data(),
+                                 var.data());
+    for (std::size_t c = 0; c < C; c++) {
+      inv_std[c] = 1.f / std::sqrt(var[c] + 1e-5f);
+      gamma[c] = c + 1.f;
+    }
+
+    std::vector<double> sum_gy(C, 0.), sum_gy_xhat(C, 0.);
+    for (std::size_t k = 0; k < x.size(); k++) {
+      const std::size_t c = k / inner % C;
+      sum_gy[c] += gy[k];
+      sum_gy_xhat[c] += gy[k] * (x[k] - mean[c]) * inv_std[c];
+    }
+    std::vector<float> s(C), sx(C);
+    kuu::kernel::channel_grad_sums(outer, C, inner, x.data(), gy.data(),
+                                   mean.data(), inv_std.data(), s.data(),
+                                   sx.data());
+    CLOSE_ALL(sum_gy, s, 1e-2);
+    CLOSE_ALL(sum_gy_xhat, sx, 1e-2);
+
+    for (const bool batch_stats : {true, false}) {
+      std::vector<float> gx(x.size());
+      kuu::kernel::channel_input_grad(outer, C, inner, x.data(), gy.data(),
+                                      gamma.data(), mean.data(),
+                                      inv_std.data(), s.data(), sx.data(),
+                                      batch_stats, gx.data());
+      for (std::size_t k = 0; k < x.size(); k += 101) {
+        const std::size_t c = k / inner % C;
+        const double xhat = (x[k] - mean[c]) * inv_std[c];
+        const double expected =
+            gamma[c] * inv_std[c] *
+            (batch_stats
+                 ? gy[k] - sum_gy[c] / M - xhat * sum_gy_xhat[c] / M
+                 : gy[k]);
+        ASSERT_NEAR(gx[k], expected, 1e-4);
+      }
+    }
+  }
+}
+
+TEST(KernelTest, TestVMath) {
+  // error of y in units in the last place of the correctly rounded result
+  auto ulp_error = [](const float y, const double exact) {
+    const float rounded = static_cast<float>(exact);
+    const double ulp = std::nextafter(std::abs(rounded), INFINITY) -
+                       static_cast<double>(std::abs(rounded));
+    return std::abs(y - exact) / ulp;
+  };
+
+  const std::size_t n = (1 << 17) + 13;
+  std::mt19937 engine{0};
+  std::uniform_real_distribution<float> exp_dist{-87.f, 88.f};
+  std::uniform_real_distribution<float> log_dist{-120.f, 120.f};
+  std::vector<float> x(n), y(n), z(n);
+  for (std::size_t i = 0; i < n; i++) {
+    x[i] = exp_dist(engine);
+    z[i] = std::exp2(log_dist(engine));
+  }
+  kuu::kernel::vexp(x.data(), n, y.data());
+  for (std::size_t i = 0; i < n; i++) {
+    ASSERT_LE(ulp_error(y[i], std::exp(static_cast<double>(x[i]))), 1.01);
+  }
+  kuu::kernel::vlog(z.data(), n, y.data());
+  for (std::size_t i = 0; i < n; i++) {
+    ASSERT_LE(ulp_error(y[i], std::log(static_cast<double>(z[i]))), 0.83);
+  }
+  kuu::kernel::vsigmoid(x.data(), n, y.data());
+  for (std::size_t i = 0; i < n; i++) {
+    const double exact = 1. / (1. + std::exp(-static_cast<double>(x[i])));
+    ASSERT_LE(ulp_error(y[i], exact), 3.);
+  }
+
+  // special values, in a full vector and in the scalar tail
+  constexpr float inf = std::numeric_limits<float>::infinity();
+  std::vector<float> special = {0.f, -inf, inf, -200.f, 200.f,
+                                std::nanf(""), -1.f, 1e-45f, 0.f};
+  std::vector<float> e(special.size()), l(special.size());
+  kuu::kernel::vexp(special.data(), special.size(), e.data());
+  kuu::kernel::vlog(special.data(), special.size(), l.data());
+  for (const std::size_t i : {0, 8}) {
+    ASSERT_EQ(e[i], 1.f);
+    ASSERT_EQ(l[i], -inf);
+  }
+  ASSERT_EQ(e[1], 0.f);
+  ASSERT_EQ(e[2], inf);
+  ASSERT_EQ(l[2], inf);
+  ASSERT_EQ(e[3], 0.f);
+  ASSERT_EQ(e[4], inf);
+  ASSERT_TRUE(std::isnan(e[5]) && std::isnan(l[5]));
+  ASSERT_TRUE(std::isnan(l[6]));
+  ASSERT_NEAR(l[7], std::log(static_cast<double>(1e-45f)), 1e-5);
+
+  // softmax and log-softmax of each row against a double reference
+  const std::size_t rows = 37, cols = 1003;
+  std::normal_distribution<float> dist{0.f, 10.f};
+  std::vector<float> a(rows * cols), s(rows * cols), ls(rows * cols);
+  for (auto &v : a) {
+    v = dist(engine);
+  }
+  kuu::kernel::softmax(rows, cols, a.data(), s.data());
+  ls = a;
+  kuu::kernel::log_softmax(rows, cols, ls.data(), ls.data()); // in place
+  for (std::size_t r = 0; r < rows; r++) {
+    const float *row = a.data() + r * cols;
+    const double m = *std::max_element(row, row + cols);
+    double sum = 0;
+    for (std::size_t j = 0; j < cols; j++) {
+      sum += std::exp(row[j] - m);
+    }
+    for (std::size_t j = 0; j < cols; j++) {
+      const double log_p = row[j] - m - std::log(sum);
+      const double p = std::exp(log_p);
+      ASSERT_NEAR(s[r * cols + j], p, 1e-6 + 1e-5 * p);
+      ASSERT_NEAR(ls[r * cols + j], log_p, 1e-5 * (1 + std::abs(log_p)));
+    }
+  }
+
+  // the fused cross-entropy and its gradient, with class labels
+  std::vector<float> labels(rows), lse(rows), loss(rows), g(rows * cols);
+  for (std::size_t r = 0; r < rows; r++) {
+    labels[r] = static_cast<float>(r * 31 % cols);
+  }
+  kuu::kernel::softmax_cross_entropy(rows, cols, a.data(), labels.data(),
+                                     nullptr, lse.data(), loss.data());
+  kuu::kernel::softmax_cross_entropy_grad(rows, cols, a.data(), lse.data(),
+                                          labels.data(), nullptr, 0.5f,
+                                          g.data());
+  for (std::size_t r = 0; r < rows; r++) {
+    const std::size_t label = r * 31 % cols;
+    ASSERT_NEAR(loss[r], -ls[r * cols + label], 1e-4);
+    for (std::size_t j = 0; j < cols; j++) {
+      const float expected = 0.5f * (s[r * cols + j] - (j == label));
+      ASSERT_NEAR(g[r * cols + j], expected, 1e-6);
+    }
+  }
+}
+
+TEST(KernelTest, TestPointwise) {
+  using kuu::kernel::pointwise_kind;
+  std::mt19937 engine{0};
+  std::normal_distribution<float> dist{0.f, 1.f};
+  // {outer, C, inner}: NCHW-like, and channels last with C over a block
+  for (const auto &dims : std::vector<std::array<std::size_t, 3>>{
+           {3, 4, 300}, {70, 300, 1}}) {
+    const std::size_t outer = dims[0], C = dims[1], inner = dims[2];
+    const std::size_t n = outer * C * inner;
+    std::vector<float> x(n), gy(n), scale(C), shift(C);
+    for (auto *v : {&x, &gy, &scale, &shift}) {
+      for (auto &e : *v) {
+        e = dist(engine);
+      }
+    }
+    // x * 2 * scale + shift, then relu
+    const kuu::kernel::pointwise_op ops[] = {
+        {pointwise_kind::kScale, nullptr, nullptr, 2.f},
+        {pointwise_kind::kAffine, scale.data(), shift.data(), 1.f},
+        {pointwise_kind::kReLU, nullptr, nullptr, 1.f}};
+    std::vector<float> y(n), gx(n), gscale(C), gshift(C);
+    kuu::kernel::pointwise_forward(outer, C, inner, ops, 3, x.data(),
+                                   y.data());
+    float *gscales[] = {nullptr, gscale.data(), nullptr};
+    float *gshifts[] = {nullptr, gshift.data(), nullptr};
+    kuu::kernel::pointwise_backward(outer, C, inner, ops, 3, x.data(),
+                                    gy.data(), gx.data(), gscales, gshifts);
+
+    std::vector<double> expected_gscale(C, 0.), expected_gshift(C, 0.);
+    for (std::size_t i = 0; i < n; i++) {
+      const std::size_t c = i / inner % C;
+      const float z = 2.f * x[i] * scale[c] + shift[c];
+      ASSERT_NEAR(y[i], std::max(z, 0.f), 1e-5 * (1 + std::abs(z)));
+      const float g = 0.f < z ? gy[i] : 0.f;
+      ASSERT_NEAR(gx[i], g * scale[c] * 2.f, 1e-5 * (1 + std::abs(g)));
+      expected_gscale[c] += g * 2.f * x[i];
+      expected_gshift[c] += g;
+    }
+    for (std::size_t c = 0; c < C; c++) {
+      ASSERT_NEAR(gscale[c], expected_gscale[c], 1e-3);
+      ASSERT_NEAR(gshift[c], expected_gshift[c], 1e-3);
+    }
+  }
+}
+
+TEST(KernelTest, TestReluMask) {
+  std::mt19937 engine{0};
+  std::normal_distribution<float> dist{0.f, 1.f};
+  // a partial last word, and more than one parallel chunk
+  for (const std::size_t n : {std::size_t{1}, std::size_t{200},
+                              std::size_t{(1 << 16) + 77}}) {
+    std::vector<float> x(n), gy(n);
+    for (std::size_t i = 0; i < n; i++) {
+      x[i] = dist(engine);
+      gy[i] = dist(engine);
+    }
+    x[0] = -0.f;
+    if (2 < n) {
+      x[1] = std::numeric_limits<float>::quiet_NaN();
+      x[2] = 0.f;
+    }
+    std::vector<float> y(n), gx(n), leaky(n);
+    std::vector<kuu::kernel::mask_word> mask(kuu::kernel::mask_words(n));
+    kuu::kernel::relu(x.data(), n, y.data(), mask.data());
+    kuu::kernel::masked_grad(gy.data(), mask.data(), n, 0.f, gx.data());
+    kuu::kernel::masked_grad(gy.data(), mask.data(), n, 0.1f, leaky.data());
+    for (std::size_t i = 0; i < n; i++) {
+      const bool positive = 0.f < x[i];
+      ASSERT_EQ(y[i], positive ? x[i] : 0.f);
+      ASSERT_EQ((mask[i / 64] >> (i % 64)) & 1, positive);
+      ASSERT_EQ(gx[i], positive ? gy[i] : 0.f);
+      ASSERT_EQ(leaky[i], positive ? gy[i] : gy[i] * 0.1f);
+    }
+    // in place, without a mask
+    kuu::kernel::relu(x.data(), n, x.data(), nullptr);
+    ASSERT_EQ(x, y);
+  }
+}
+
+TEST(KernelTest, TestActivations) {
+  // both signs, tails past the clamps of exp, and a tail for the generic path
+  const std::size_t n = 2003;
+  std::vector<float> x(n), gy(n);
+  for (std::size_t i = 0; i < n; i++) {
+    x[i] = -60.f + 120.f * static_cast<float>(i) / (n - 1);
+    gy[i] = std::cos(static_cast<float>(i));
+  }
+  x[n / 2] = 0.f;
+  x[n / 2 + 1] = 1e-20f;
+  x[n / 2 + 2] = -0.3f;
+  std::vector<float> t(n), s(n), gelu(n), silu(n), leaky(n);
+  std::vector<float> gt(n), gs(n), ggelu(n), gsilu(n);
+  std::vector<kuu::kernel::mask_word> mask(kuu::kernel::mask_words(n));
+  kuu::kernel::vtanh(x.data(), n, t.data());
+  kuu::kernel::vsigmoid(x.data(), n, s.data());
+  kuu::kernel::gelu(x.data(), n, gelu.data());
+  kuu::kernel::silu(x.data(), n, silu.data());
+  kuu::kernel::leaky_relu(x.data(), n, 0.01f, leaky.data(), mask.data());
+  kuu::kernel::tanh_grad(t.data(), gy.data(), n, gt.data());
+  kuu::kernel::sigmoid_grad(s.data(), gy.data(), n, gs.data());
+  kuu::kernel::gelu_grad(x.data(), gy.data(), n, ggelu.data());
+  kuu::kernel::silu_grad(x.data(), gy.data(), n, gsilu.data());
+
+  for (std::size_t i = 0; i < n; i++) {
+    const double v = x[i], g = gy[i];
+    const double th = std::tanh(v);
+    const double sg = 1 / (1 + std::exp(-v));
+    const double u = std::tanh(0.7978845608 * (v + 0.044715 * v * v * v));
+    ASSERT_NEAR(t[i], th, 2e-7 * std::abs(th) + 1e-30);
+    ASSERT_NEAR(s[i], sg, 1e-6 * sg);
+    ASSERT_NEAR(gelu[i], 0.5 * v * (1 + u), 1e-6 * (1 + std::abs(v)));
+    ASSERT_NEAR(silu[i], v * sg, 1e-6 * (1 + std::abs(v)));
+    ASSERT_EQ(leaky[i], 0.f < x[i] ? x[i] : x[i] * 0.01f);
+    ASSERT_EQ((mask[i / 64] >> (i % 64)) & 1, 0.f < x[i]);
+
+    ASSERT_NEAR(gt[i], g * (1 - th * th), 1e-6);
+    ASSERT_NEAR(gs[i], g * sg * (1 - sg), 1e-6);
+    const double dgelu = 0.5 * (1 + u) + 0.5 * v * (1 - u * u) * 0.7978845608 *
+                                             (1 + 3 * 0.044715 * v * v);
+    ASSERT_NEAR(ggelu[i], g * dgelu, 1e-5);
+    ASSERT_NEAR(gsilu[i], g * sg * (1 + v * (1 - sg)), 1e-5);
+  }
+
+  // in place
+  kuu::kernel::vtanh(x.data(), n, x.data());
+  ASSERT_EQ(x, t);
+}
+
+namespace {
+// naive max and average pooling on NCHW / NHWC buffers, with the gradients
+// gx_max and gx_avg of both given gy.
+void naive_pooling(const std::vector<float> &x, const std::vector<float> &gy,
+                   std::vector<float> &y_max, std::vector<float> &y_avg,
+                   std::vector<float> &gx_max, std::vector<float> &gx_avg,
+                   const kuu::kernel::pool2d_geometry &g,
+                   const bool channels_last) {
+  const std::size_t Ho = g.H_out(), Wo = g.W_out();
+  auto xi = [&](std::size_t n, std::size_t c, std::size_t h, std::size_t v) {
+    return channels_last ? ((n * g.H + h) * g.W + v) * g.C + c
+                         : ((n * g.C + c) * g.H + h) * g.W + v;
+  };
+  auto yi = [&](std::size_t n, std::size_t c, std::size_t i, std::size_t j) {
+    return channels_last ? ((n * Ho + i) * Wo + j) * g.C + c
+                         : ((n * g.C + c) * Ho + i) * Wo + j;
+  };
+  const float K = static_cast<float>(g.H_f * g.W_f);
+  y_max.assign(g.N * g.C * Ho * Wo, 0.f);
+  y_avg.assign(y_max.size(), 0.f);
+  gx_max.assign(x.size(), 0.f);
+  gx_avg.assign(x.size(), 0.f);
+  for (std::size_t n = 0; n < g.N; n++) {
+    for (std::size_t c = 0; c < g.C; c++) {
+      for (std::size_t i = 0; i < Ho; i++) {
+        for (std::size_t j = 0; j < Wo; j++) {
+          const std::size_t o = yi(n, c, i, j);
+          float best = -std::numeric_limits<float>::infinity();
+          bool first = true;
+          std::size_t arg = 0;
+          for (std::size_t p = 0; p < g.H_f; p++) {
+            for (std::size_t q = 0; q < g.W_f; q++) {
+              const long h = static_cast<long>(i * g.stride_h + p) -
+                             static_cast<long>(g.pad_h);
+              const long v = static_cast<long>(j * g.stride_w + q) -
+                             static_cast<long>(g.pad_w);
+              if (h < 0 || v < 0 || static_cast<long>(g.H) <= h ||
+                  static_cast<long>(g.W) <= v) {
+                continue;
+              }
+              const std::size_t a = xi(n, c, h, v);
+              if (first || best < x[a]) {
+                best = x[a];
+                arg = a;
+                first = false;
+              }
+              y_avg[o] += x[a] / K;
+              gx_avg[a] += gy[o] / K;
+            }
+          }
+          y_max[o] = best;
+          gx_max[arg] += gy[o];
+        }
+      }
+    }
+  }
+}
+} // namespace
+
+TEST(KernelTest, TestPooling) {
+  std::mt19937 engine{0};
+  std::normal_distribution<float> dist;
+  auto fill = [&](std::vector<float> &v) {
+    for (auto &e : v) {
+      e = dist(engine);
+    }
+  };
+  // {N, C, H, W, H_f, W_f, stride_h, stride_w, pad_h, pad_w}
+  const std::vector<kuu::kernel::pool2d_geometry> geometries = {
+      {2, 3, 8, 8, 2, 2, 2, 2, 0, 0},
+      {2, 5, 7, 9, 3, 3, 2, 2, 1, 1},
+      {1, 4, 9, 6, 3, 2, 1, 2, 0, 1},
+  };
+  for (const auto &g : geometries) {
+    ASSERT_TRUE(g.is_valid());
+    for (const bool channels_last : {false, true}) {
+      std::vector<float> x(g.N * g.C * g.H * g.W);
+      std::vector<float> gy(g.N * g.C * g.H_out() * g.W_out());
+      fill(x);
+      fill(gy);
+      std::vector<float> y_max0, y_avg0, gx_max0, gx_avg0;
+      naive_pooling(x, gy, y_max0, y_avg0, gx_max0, gx_avg0, g, channels_last);
+
+      std::vector<float> y_max(gy.size()), y_avg(gy.size());
+      std::vector<float> gx_max(x.size()), gx_avg(x.size());
+      std::vector<kuu::kernel::pool_index> index(gy.size());
+      if (channels_last) {
+        kuu::kernel::maxpool_forward_nhwc(x.data(), y_max.data(), index.data(),
+                                          g);
+        kuu::kernel::maxpool_backward_nhwc(gy.data(), index.data(),
+                                           gx_max.data(), g);
+        kuu::kernel::avgpool_forward_nhwc(x.data(), y_avg.data(), g);
+        kuu::kernel::avgpool_backward_nhwc(gy.data(), gx_avg.data(), g);
+      } else {
+        kuu::kernel::maxpool_forward_nchw(x.data(), y_max.data(), index.data(),
+                                          g);
+        kuu::kernel::maxpool_backward_nchw(gy.data(), index.data(),
+                                           gx_max.data(), g);
+        kuu::kernel::avgpool_forward_nchw(x.data(), y_avg.data(), g);
+        kuu::kernel::avgpool_backward_nchw(gy.data(), gx_avg.data(), g);
+      }
+      ASSERT_EQ(y_max0, y_max);
+      CLOSE_ALL(gx_max0, gx_max, 1e-5);
+      CLOSE_ALL(y_avg0, y_avg, 1e-5);
+      CLOSE_ALL(gx_avg0, gx_avg, 1e-5);
+    }
+  }
+
+  // windows of -inf point at their first element inside x, not at padding
+  for (const bool channels_last : {false, true}) {
+    const kuu::kernel::pool2d_geometry g{1, 2, 3, 3, 3, 3, 2, 2, 1, 1};
+    std::vector<float> x(2 * 3 * 3, -std::numeric_limits<float>::infinity());
+    std::vector<float> gy(2 * 2 * 2, 1.f);
+    std::vector<float> y_max0, y_avg0, gx_max0, gx_avg0;
+    naive_pooling(x, gy, y_max0, y_avg0, gx_max0, gx_avg0, g, channels_last);
+
+    std::vector<float> y(gy.size()), gx(x.size());
+    std::vector<kuu::kernel::pool_index> index(gy.size());
+    if (channels_last) {
+      kuu::kernel::maxpool_forward_nhwc(x.data(), y.data(), index.data(), g);
+      kuu::kernel::maxpool_backward_nhwc(gy.data(), index.data(), gx.data(),
+                                         g);
+    } else {
+      kuu::kernel::maxpool_forward_nchw(x.data(), y.data(), index.data(), g);
+      kuu::kernel::maxpool_backward_nchw(gy.data(), index.data(), gx.data(),
+                                         g);
+    }
+    ASSERT_EQ(y_max0, y);
+    ASSERT_EQ(gx_max0, gx);
+    ASSERT_EQ(index[0], 4); // p = 1, q = 1
+  }
+
+  // NaN is the maximum of its window
+  const kuu::kernel::pool2d_geometry g{1, 1, 2, 2, 2, 2, 2, 2, 0, 0};
+  const std::vector<float> x{1.f, std::nanf(""), 3.f, 2.f};
+  float y;
+  kuu::kernel::pool_index index;
+  kuu::kernel::maxpool_forward_nchw(x.data(), &y, &index, g);
+  ASSERT_TRUE(std::isnan(y));
+  ASSERT_EQ(index, 1);
+}
@@ -1,13 +1,19 @@
+#include "folding.hpp"
 #include "functions.hpp"
+#include "mixed_precision.hpp"
 #include "module.hpp"
 #include "modules.hpp"
 #include "optimizer.hpp"
 #include "optimizers.hpp"
+#include "pruning.hpp"
+#include "quantization.hpp"
 #include "tensor.hpp"
 #include "test_common.hpp"
 #include <gtest/gtest.h>
+#include <limits>
 #include <string>
 #include <xtensor/xbuilder.hpp>
+#include <xtensor/xrandom.hpp>
 
 template <class OptimizerClass, typename OpmizerOptions>
 void test_update(OpmizerOptions &&options) {
@@ -89,3 +95,357 @@ TEST(OptimizerTest, TestSGDUpdate) {
   // test_update<kuu::sgd>(kuu::sgd::options{0.001, 0.01, 0.9, 0.1, false});
   test_update<kuu::sgd>(kuu::sgd::options{0.001, 0.01, 0.9, 0, true});
 }
+
+TEST(OptimizerTest, TestMixedPrecision) {
+  kuu::linear l1{kuu::linear_options{6, 8, true}};
+  kuu::linear l2{kuu::linear_options{8, 2, true}};
+  l1->initialize(kuu::initializer::normal, 0, 0.3);
+  l2->initialize(kuu::initializer::normal, 0, 0.3);
+  auto params = l1->parameters();
+  for (auto &p : l2->parameters()) {
+    params.push_back(p);
+  }
+  kuu::tensor input{xt::random::randn<kuu::value_type>({4, 6}), false};
+  kuu::tensor gt{xt::random::randn<kuu::value_type>({4, 2}), false};
+  const auto format = kuu::kernel::half_format::kFloat16;
+
+  kuu::sgd optim{std::vector<kuu::tensor>{params},
+                 kuu::sgd::options{0.1, 0, 0, 0, false}};
+  optim.use_master_weights(format);
+  for (auto &p : params) {
+    kuu::tensor_type rounded = p.data();
+    kuu::kernel::round_to_half(format, rounded.data(), rounded.size());
+    ASSERT_EQ(p.data(), rounded);
+  }
+
+  kuu::grad_scaler scaler{kuu::grad_scaler::options{1024.f, 2.f, 0.5f, 1}};
+  kuu::tensor loss, hidden;
+  {
+    kuu::autocast storage{format};
+    hidden = kuu::function::relu::forward(l1->forward(input));
+    loss = kuu::function::mean_squared_error::forward(l2->forward(hidden), gt);
+  }
+  // saved for the backward of l2
+  ASSERT_TRUE(hidden.is_compressed());
+  const kuu::tensor_type before = params[0].cdata();
+  scaler.backward(loss);
+  ASSERT_TRUE(scaler.step(optim));
+  ASSERT_EQ(scaler.scale(), 2048.f);
+  ASSERT_FALSE(params[0].cdata() == before);
+
+  // an overflowing grad skips the update and backs off
+  optim.clear_grad();
+  loss = kuu::function::mean_squared_error::forward(
+      l2->forward(kuu::function::relu::forward(l1->forward(input))), gt);
+  const kuu::tensor_type unchanged = params[0].cdata();
+  scaler.backward(loss);
+  params[0].grad().storage()[0] = std::numeric_limits<float>::infinity();
+  ASSERT_FALSE(scaler.step(optim));
+  ASSERT_EQ(scaler.scale(), 1024.f);
+  ASSERT_EQ(params[0].cdata(), unchanged);
+}
+
+TEST(QuantizationTest, TestQuantizeModules) {
+  struct net : public kuu::module {
+    net()
+        : conv{kuu::conv_options<2>{3, 4, 3, 1, 1, 1, true}},
+          depthwise{kuu::conv_options<2>{4, 4, 3, 1, 1, 1, false, false, 0,
+                                         kuu::conv_algorithm::kAuto, 4}},
+          fc{kuu::linear_options{4 * 5 * 5, 3, true}} {
+      register_module("conv", conv);
+      register_module("depthwise", depthwise);
+      register_module("fc", fc);
+    }
+    kuu::tensor forward(const kuu::tensor &input) {
+      return fc->forward(depthwise->forward(conv->forward(input)));
+    }
+    kuu::conv2d conv, depthwise;
+    kuu::linear fc;
+  };
+  net n;
+  n.initialize(kuu::initializer::normal, 0, 0.3);
+  kuu::tensor input{xt::random::randn<kuu::value_type>({2, 3, 5, 5}), false};
+  const kuu::tensor_type expected = n.forward(input).data();
+
+  // the depthwise convolution stays in fp32
+  ASSERT_EQ(kuu::quantize(n, {kuu::memory_format::kNCHW, true}), 2);
+  ASSERT_TRUE(n.fc->is_quantized());
+  ASSERT_FALSE(n.depthwise->is_quantized());
+  // the float weights are freed, while their shapes stay known
+  auto freed = [](const kuu::tensor &weight) {
+    return weight.is_released() && weight.get()->data.size() == 0 &&
+           weight.get()->grad.size() == 0;
+  };
+  ASSERT_TRUE(freed(*n.fc->parameter("linear-weight")));
+  ASSERT_TRUE(freed(*n.conv->parameter("conv2d weight")));
+  ASSERT_EQ(n.fc->parameter("linear-weight")->shape(),
+            (std::vector<std::size_t>{4 * 5 * 5, 3}));
+
+  const auto y = n.forward(input);
+  ASSERT_FALSE(y.requires_grad());
+  const double range = xt::amax(xt::abs(expected))();
+  ASSERT_TRUE(xt::allclose(y.data(), expected, 0, 0.05 * range));
+}
+
+TEST(QuantizationTest, TestCalibration) {
+  struct net : public kuu::module {
+    net()
+        : conv{kuu::conv_options<2>{3, 4, 3, 1, 1, 1, true}},
+          fc{kuu::linear_options{4 * 5 * 5, 3, true}} {
+      register_module("conv", conv);
+      register_module("fc", fc);
+    }
+    kuu::tensor forward(const kuu::tensor &input) {
+      return fc->forward(conv->forward(input));
+    }
+    kuu::conv2d conv;
+    kuu::linear fc;
+  };
+  net n;
+  n.initialize(kuu::initializer::normal, 0, 0.3);
+  std::vector<kuu::tensor_type> batches;
+  for (std::size_t i = 0; i < 4; i++) {
+    batches.push_back(xt::random::randn<kuu::value_type>({2, 3, 5, 5}));
+  }
+
+  {
+    kuu::calibrator calib{n};
+    calib.run(batches.size(), [&](std::size_t i) {
+      n.forward(kuu::tensor{batches[i], false});
+    });
+    ASSERT_TRUE(n.is_training());
+    const auto params = calib.parameters();
+    ASSERT_EQ(params.size(), 2);
+    ASSERT_EQ(params[0].name, "conv");
+    ASSERT_EQ(params[1].name, "fc");
+    float max_abs = 0;
+    for (const auto &b : batches) {
+      max_abs = std::max(max_abs, xt::amax(xt::abs(b))());
+    }
+    ASSERT_FLOAT_EQ(params[0].scale, max_abs / 127.f);
+    ASSERT_EQ(calib.apply(), 2);
+  }
+
+  kuu::tensor input{batches[0], false};
+  const kuu::tensor_type expected = n.forward(input).data();
+  kuu::quantize(n);
+  const auto y = n.forward(input);
+  const double range = xt::amax(xt::abs(expected))();
+  ASSERT_TRUE(xt::allclose(y.data(), expected, 0, 0.05 * range));
+}
+
+TEST(PruningTest, TestPruneModules) {
+  struct net : public kuu::module {
+    net()
+        : conv{kuu::conv_options<2>{3, 32, 3, 1, 1, 1, true}},
+          fc{kuu::linear_options{32 * 5 * 5, 20, true}} {
+      register_module("conv", conv);
+      register_module("fc", fc);
+    }
+    kuu::tensor forward(const kuu::tensor &input) {
+      return fc->forward(conv->forward(input));
+    }
+    kuu::conv2d conv;
+    kuu::linear fc;
+  };
+  net n;
+  n.initialize(kuu::initializer::normal, 0, 0.3);
+
+  ASSERT_EQ(kuu::prune(n, {kuu::pruning_method::kMagnitude, 0.75}), 2);
+  auto conv_weight = *n.conv->parameter("conv2d weight");
+  auto fc_weight = *n.fc->parameter("linear-weight");
+  // conv: {Cols, C_out} = {27, 32} has 27 * 2 blocks, 40 of them pruned
+  ASSERT_NE(conv_weight.mask(), nullptr);
+  ASSERT_EQ(xt::sum(*conv_weight.mask())(), 14 * 16);
+  // fc: {800, 20} has 800 * 2 blocks of 16 and 4 outputs, 1200 pruned
+  ASSERT_NE(fc_weight.mask(), nullptr);
+  ASSERT_EQ(xt::count_nonzero(fc_weight.data())(),
+            xt::count_nonzero(*fc_weight.mask())());
+
+  // masked weights stay zero through momentum and weight decay
+  kuu::sgd optim{n.parameters(), kuu::sgd::options{0.1, 0.01, 0.9, 0, false}};
+  kuu::tensor input{xt::random::randn<kuu::value_type>({2, 3, 5, 5}), false};
+  for (int step = 0; step < 2; step++) {
+    auto y = n.forward(input);
+    y.backward();
+    optim.update();
+    optim.clear_grad();
+  }
+  for (auto *weight : {&conv_weight, &fc_weight}) {
+    ASSERT_EQ(xt::sum(xt::abs(weight->data() * (1 - *weight->mask())))(), 0);
+  }
+
+  // N:M keeps 2 of every 4 input positions per output block
+  kuu::prune(n, {kuu::pruning_method::kNM, 0, 2, 4});
+  ASSERT_EQ(xt::sum(*fc_weight.mask())(), 800 / 2 * 20);
+}
+
+TEST(BatchNormTest, TestInference) {
+  kuu::batchnorm bn{3};
+  xt::xarray<kuu::value_type> x =
+      xt::random::randn<kuu::value_type>({4, 3, 5, 5});
+  kuu::tensor input{x, false};
+  bn->forward(input); // updates the running statistics
+
+  xt::xarray<kuu::value_type> running_mean = 0.9f * xt::mean(x, {0, 2, 3});
+  xt::xarray<kuu::value_type> running_var =
+      0.1f + 0.9f * xt::variance(x, {0, 2, 3});
+  running_mean.reshape({1, 3, 1, 1});
+  running_var.reshape({1, 3, 1, 1});
+  xt::xarray<kuu::value_type> expected =
+      (x - running_mean) / xt::sqrt(running_var + 1e-5f);
+
+  bn->train(false);
+  auto y = bn->forward(input);
+  ASSERT_FALSE(y.requires_grad());
+  CLOSE_ALL(y.data(), expected, 1e-4);
+
+  // the folded scale follows changes of gamma
+  auto gamma = *bn->parameter("weight");
+  gamma = xt::xarray<kuu::value_type>{2, 2, 2};
+  auto y2 = bn->forward(input);
+  CLOSE_ALL(y2.data(), 2.f * expected, 1e-4);
+}
+
+TEST(BatchNormTest, TestUntracked) {
+  // without running statistics, evaluation uses the batch ones
+  kuu::batchnorm bn{3, 1e-5, false, false};
+  xt::xarray<kuu::value_type> x =
+      xt::random::randn<kuu::value_type>({4, 3, 5, 5});
+  kuu::tensor input{x, false};
+  bn->train(false);
+  auto y = bn->forward(input);
+
+  xt::xarray<kuu::value_type> mean = xt::mean(x, {0, 2, 3});
+  xt::xarray<kuu::value_type> var = xt::variance(x, {0, 2, 3});
+  mean.reshape({1, 3, 1, 1});
+  var.reshape({1, 3, 1, 1});
+  CLOSE_ALL(y.data(), (x - mean) / xt::sqrt(var + 1e-5f), 1e-4);
+}
+
+TEST(BatchNormTest, TestFold) {
+  struct net : public kuu::module {
+    net()
+        : conv{kuu::conv_options<2>{3, 4, 3, 1, 1}},
+          shared{kuu::conv_options<2>{4, 4, 1}},
+          fc{kuu::linear_options{4 * 5 * 5, 6, true}}, bn_conv{4},
+          bn_shared{4}, bn_other{4}, bn_fc{6} {
+      register_module("conv", conv);
+      register_module("shared", shared);
+      register_module("fc", fc);
+      register_module("bn_conv", bn_conv);
+      register_module("bn_shared", bn_shared);
+      register_module("bn_other", bn_other);
+      register_module("bn_fc", bn_fc);
+    }
+    kuu::tensor forward(const kuu::tensor &input) {
+      auto out = conv->forward(input);
+      out = bn_conv->forward(out);
+      out = kuu::function::relu::forward(out);
+      out = shared->forward(out);
+      // the output of shared also feeds bn_other, so it is not folded
+      other = bn_other->forward(out);
+      out = bn_shared->forward(out);
+      out = fc->forward(out);
+      return bn_fc->forward(out);
+    }
+    kuu::tensor other;
+    kuu::conv2d conv, shared;
+    kuu::linear fc;
+    kuu::batchnorm bn_conv, bn_shared, bn_other, bn_fc;
+  };
+  net n;
+  n.initialize(kuu::initializer::normal, 0, 0.3);
+  kuu::tensor input{xt::random::randn<kuu::value_type>({2, 3, 5, 5}), false};
+  n.forward(input); // running statistics
+  for (auto *bn : {&n.bn_conv, &n.bn_fc}) {
+    auto gamma = *(*bn)->parameter("weight");
+    auto beta = *(*bn)->parameter("bias");
+    gamma = xt::random::rand<kuu::value_type>(gamma.shape()) + 0.5f;
+    beta = xt::random::randn<kuu::value_type>(beta.shape());
+  }
+
+  n.train(false);
+  const kuu::tensor_type expected = n.forward(input).data();
+  ASSERT_EQ(kuu::fold_batchnorm(n, [&] { n.forward(input); }), 2);
+  ASSERT_TRUE(n.bn_conv->is_folded());
+  ASSERT_TRUE(n.bn_fc->is_folded());
+  ASSERT_FALSE(n.bn_shared->is_folded());
+  ASSERT_TRUE(n.conv->parameter("conv2d bias").has_value());
+
+  CLOSE_ALL(n.forward(input).data(), expected, 1e-4);
+}
+
+TEST(BatchNormTest, TestFoldBranching) {
+  // the output of conv also goes to a function outside of any module, like
+  // a skip connection, so folding bn into conv would change that branch
+  struct net : public kuu::module {
+    net() : conv{kuu::conv_options<2>{3, 4, 3, 1, 1}}, bn{4} {
+      register_module("conv", conv);
+      register_module("bn", bn);
+    }
+    kuu::tensor forward(const kuu::tensor &input) {
+      auto out = conv->forward(input);
+      skip = kuu::function::relu::forward(out);
+      return bn->forward(out);
+    }
+    kuu::tensor skip;
+    kuu::conv2d conv;
+    kuu::batchnorm bn;
+  };
+  net n;
+  n.initialize(kuu::initializer::normal, 0, 0.3);
+  kuu::tensor input{xt::random::randn<kuu::value_type>({2, 3, 5, 5}), false};
+  n.forward(input); // running statistics
+
+  n.train(false);
+  n.forward(input);
+  const kuu::tensor_type skip = n.skip.data();
+  ASSERT_EQ(kuu::fold_batchnorm(n, [&] { n.forward(input); }), 0);
+  ASSERT_FALSE(n.bn->is_folded());
+  n.forward(input);
+  ASSERT_EQ(n.skip.data(), skip);
+}
+
+TEST(PoolingTest, TestModules) {
+  // overlapping windows with padding, which counts as zeros in the average
+  kuu::tensor data{kuu::tensor_type{{{{1, 2, 3, 4},
+                                      {5, 6, 7, 8},
+                                      {9, 10, 11, 12},
+                                      {13, 14, 15, 16}}}},
+                   true};
+  kuu::maxpool2d max_pool{kuu::pool_options<2>{3, 2, 1}};
+  kuu::avgpool2d avg_pool{kuu::pool_options<2>{3, 2, 1}};
+  auto max = max_pool->forward(data);
+  ASSERT_EQ(max.data(), (kuu::tensor_type{{{{6, 8}, {14, 16}}}}));
+  max.backward();
+  ASSERT_EQ(data.grad(), (kuu::tensor_type{{{{0, 0, 0, 0},
+                                             {0, 1, 0, 1},
+                                             {0, 0, 0, 0},
+                                             {0, 1, 0, 1}}}}));
+  auto avg = avg_pool->forward(data);
+  CLOSE_ALL(avg.data(),
+            (kuu::tensor_type{{{{14.f / 9, 30.f / 9}, {57.f / 9, 99.f / 9}}}}),
+            1e-6);
+}
+
+TEST(LinearTest, TestSparseActivations) {
+  // the activation fused into the dense GEMM is applied to sparse inputs too
+  kuu::tensor_type x = {{0, -2, 0, 1}, {3, 0, 0, 0}, {0, 0, 0, 0}};
+  const auto sparse = kuu::sparse_tensor::from_dense(x);
+  for (const auto act : {kuu::activation::kReLU, kuu::activation::kSigmoid,
+                         kuu::activation::kGELU}) {
+    kuu::linear fc{kuu::linear_options{4, 5, true, act}};
+    fc->initialize(kuu::initializer::normal, 0, 0.3);
+    auto weight = *fc->parameter("linear-weight");
+    auto dense = fc->forward(kuu::tensor{x, false});
+    dense.backward();
+    const kuu::tensor_type gW = weight.grad();
+    fc->clear_grad();
+
+    auto y = fc->forward(sparse);
+    CLOSE_ALL(y.data(), dense.data(), 1e-5);
+    y.backward();
+    CLOSE_ALL(weight.grad(), gW, 1e-5);
+  }
+}
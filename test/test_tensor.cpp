@@ -98,4 +98,57 @@ TEST(TensorTest, TensorStride) {
   xt::xarray<kuu::value_type> val1 = {5, 6};
   ASSERT_EQ(stride.cgrad(), val1);
   ASSERT_EQ(stride.grad(), val1);
-}
\ No newline at end of file
+}
+
+TEST(TensorTest, TensorVersion) {
+  kuu::tensor t{xt::ones<kuu::value_type>({2, 3}), true};
+  ASSERT_EQ(t.version(), 0);
+
+  int packs = 0;
+  auto pack = [&packs](const kuu::tensor_type &data) {
+    packs++;
+    return kuu::kernel::pack_matrix(false, data.shape()[0], data.shape()[1],
+                                    data.data(), data.shape()[1]);
+  };
+  t.packed(1, pack);
+  t.packed(1, pack);
+  ASSERT_EQ(packs, 1);
+
+  // another way of packing, then back
+  t.packed(2, pack);
+  ASSERT_EQ(packs, 2);
+  t.packed(1, pack);
+  ASSERT_EQ(packs, 3);
+
+  t = xt::zeros<kuu::value_type>({2, 3});
+  ASSERT_EQ(t.version(), 1);
+  t.packed(1, pack);
+  ASSERT_EQ(packs, 4);
+
+  t.data() += 1;
+  t.bump_version();
+  ASSERT_EQ(t.version(), 2);
+  ASSERT_EQ(t.packed(1, pack).data[0], 1);
+  ASSERT_EQ(packs, 5);
+}
+
+TEST(TensorTest, TensorCompress) {
+  kuu::tensor t{xt::random::randn<kuu::value_type>({4, 5}), false};
+  const auto original = t.cdata();
+  t.compress(kuu::kernel::half_format::kBFloat16);
+  ASSERT_TRUE(t.is_compressed());
+  ASSERT_EQ(t.shape(), (std::vector<std::size_t>{4, 5}));
+  ASSERT_EQ(t.size(), 20);
+
+  // grad comes back as zeros without touching data
+  ASSERT_EQ(t.grad(), xt::zeros<kuu::value_type>({4, 5}));
+  ASSERT_TRUE(t.is_compressed());
+
+  const auto restored = t.cdata();
+  ASSERT_FALSE(t.is_compressed());
+  ASSERT_TRUE(xt::allclose(restored, original, 1.f / 256, 0));
+  kuu::tensor_type rounded = original;
+  kuu::kernel::round_to_half(kuu::kernel::half_format::kBFloat16,
+                             rounded.data(), rounded.size());
+  ASSERT_EQ(restored, rounded);
+}